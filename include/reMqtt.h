@@ -35,6 +35,175 @@
 extern "C" {
 #endif
 
+typedef struct {
+  uint32_t pool_allocs;
+  uint32_t pool_frees;
+  uint32_t heap_fallbacks;
+  uint32_t in_use;
+  uint32_t in_use_max;
+} re_mqtt_pool_stats_t;
+
+typedef struct {
+  uint32_t refs;
+  char*    topic;
+  size_t   topic_len;
+  char*    data;
+  size_t   data_len;
+} re_mqtt_message_t;
+
+typedef struct {
+  uint32_t created;
+  uint32_t released;
+  uint32_t live;
+  uint32_t live_max;
+  uint32_t retains;
+  uint32_t deliveries;
+} re_mqtt_message_stats_t;
+
+typedef void (*mqtt_message_handler_t)(re_mqtt_message_t* message, void* arg);
+
+typedef struct {
+  char*       topic;
+  size_t      topic_len;
+  const char* data;
+  size_t      data_len;
+  size_t      offset;
+  size_t      total_len;
+} re_mqtt_fragment_t;
+
+typedef void (*mqtt_stream_handler_t)(const re_mqtt_fragment_t* fragment, void* arg);
+
+typedef struct {
+  uint32_t count;
+  uint32_t bytes;
+  uint32_t coalesced;
+  uint32_t evicted;
+  uint32_t expired;
+  uint32_t rejected;
+} re_mqtt_outbox_stats_t;
+
+typedef struct {
+  uint32_t stored;
+  uint32_t replayed;
+  uint32_t pending;
+  uint32_t dropped;
+  uint32_t erases;
+  uint32_t crc_errors;
+} re_mqtt_persist_stats_t;
+
+typedef struct {
+  uint32_t sent;
+  uint32_t throttled;
+  uint32_t overflows;
+  uint32_t queue_max;
+  uint32_t delay_max_ms;
+  uint64_t delay_total_ms;
+} re_mqtt_pacer_stats_t;
+
+typedef struct {
+  uint32_t reported;
+  uint32_t merged;
+  uint32_t dropped;
+  uint32_t posted;
+} re_mqtt_error_stats_t;
+
+typedef struct {
+  uint32_t hits;
+  uint32_t misses;
+  uint32_t stale;
+  uint32_t failures;
+} re_mqtt_addr_stats_t;
+
+typedef struct {
+  uint32_t attempts;
+  uint32_t successes;
+  uint32_t failures;
+  uint32_t handshake_last_ms;
+  uint32_t interval_max_s;
+  uint32_t interval_s;
+} re_mqtt_probe_stats_t;
+
+typedef struct {
+  uint32_t connects;
+  uint32_t disconnects;
+  uint32_t failovers;
+  uint64_t connected_ms;
+  uint32_t handshakes;
+  uint32_t handshake_last_ms;
+  uint32_t handshake_max_ms;
+  uint32_t standby_switches;
+} re_mqtt_broker_stats_t;
+
+typedef struct {
+  uint32_t publish_ok;
+  uint32_t publish_failed;
+  uint64_t bytes_out;
+  uint64_t bytes_in;
+  uint32_t received;
+  uint32_t outbox_max;
+  uint32_t incoming_bytes;
+  uint32_t incoming_max;
+  uint32_t outages;
+  uint32_t outage_last_ms;
+  uint32_t outage_max_ms;
+  uint32_t outage_lost;
+  uint32_t failover_last_ms;
+  uint32_t return_last_ms;
+  re_mqtt_broker_stats_t brokers[2];  // 0 - primary, 1 - reserved
+} re_mqtt_stats_t;
+
+#define MQTT_LATENCY_BUCKETS 16
+
+// Bucket 0: less than 1 ms, bucket N: from 2^(N-1) to 2^N ms, the last bucket also includes everything above
+typedef struct {
+  uint32_t count;
+  uint32_t max_ms;
+  uint64_t total_ms;
+  uint32_t buckets[MQTT_LATENCY_BUCKETS];
+} re_mqtt_latency_hist_t;
+
+typedef struct {
+  bool     refuse_connect;
+  uint8_t  drop_percent;
+  uint32_t latency_ms;
+} re_mqtt_faults_t;
+
+typedef struct {
+  char        host[64];
+  uint16_t    port;
+  uint8_t     type;           // 0 - internet, 1 - local, 2 - gateway
+  bool        primary;        // Role: primary or reserved broker
+  bool        tls;
+  uint8_t     tls_storage;    // TLS_CERT_BUFFER, TLS_CERT_GLOBAL or TLS_CERT_BUNDLE
+  const char* cert_pem;
+  size_t      cert_len;
+  char        username[64];
+  char        password[64];
+  char        client_id[64];
+  uint32_t    timeout_ms;
+  uint32_t    reconnect_ms;
+  bool        auto_reconnect;
+  bool        clean_session;
+  uint16_t    keepalive;
+} re_mqtt_broker_t;
+
+typedef struct {
+  uint32_t attempts;
+  uint32_t successes;
+  uint32_t failures;
+  uint32_t success_pm;        // Moving average of the connection success rate, per mille
+  uint32_t handshake_ms;      // Moving average of the connection time
+  uint32_t rtt_ms;            // Moving average of the publication acknowledgment time
+} re_mqtt_broker_score_t;
+
+typedef struct re_mqtt_topic_t* mqtt_topic_handle_t;
+
+typedef struct {
+  const void* data;
+  size_t      len;
+  bool        free_data;
+} mqtt_iovec_t;
+
 #if CONFIG_MQTT_STATUS_LWT || CONFIG_MQTT_STATUS_ONLINE
 char* mqttTopicStatusCreate(const bool primary);
 char* mqttTopicStatusGet();
@@ -51,9 +220,58 @@ void mqttEventHandlerUnregister();
 bool mqttIsConnected();
 bool mqttIsPrimary();
 int  mqttGetOutboxSize();
+void mqttGetStats(re_mqtt_stats_t* stats);
+int  mqttLatencyClassAdd(const char* filter);
+bool mqttLatencyGetHistogram(uint8_t topic_class, bool primary, re_mqtt_latency_hist_t* hist);
+size_t mqttLatencyExport(void* buffer, size_t size);
+char* mqttLatencyExportJson();
+#if CONFIG_MQTT_FAULT_INJECTION
+void mqttFaultSet(bool primary, const re_mqtt_faults_t* faults);
+bool mqttFaultReset();
+#endif // CONFIG_MQTT_FAULT_INJECTION
+#if CONFIG_MQTT_BROKER_TABLE
+int  mqttBrokerAdd(const re_mqtt_broker_t* broker);
+bool mqttBrokerRemove(uint8_t index);
+uint8_t mqttBrokerCount();
+bool mqttBrokerGet(uint8_t index, re_mqtt_broker_t* broker, re_mqtt_broker_score_t* score);
+bool mqttBrokersLoad();
+bool mqttBrokersSave();
+#endif // CONFIG_MQTT_BROKER_TABLE
+void mqttOutboxGetStats(re_mqtt_outbox_stats_t* stats);
+void mqttPersistGetStats(re_mqtt_persist_stats_t* stats);
+void mqttPacerGetStats(re_mqtt_pacer_stats_t* stats);
+void mqttProbeGetStats(re_mqtt_probe_stats_t* stats);
+void mqttAddrGetStats(re_mqtt_addr_stats_t* stats);
+void mqttErrorGetStats(re_mqtt_error_stats_t* stats);
 bool mqttSubscribe(const char *topic, int qos);
 bool mqttUnsubscribe(const char *topic);
+void* mqttBufferAlloc(size_t size);
+void  mqttBufferFree(void* buffer);
+void  mqttPoolGetStats(re_mqtt_pool_stats_t* stats);
+
+bool mqttMessageHandlerRegister(mqtt_message_handler_t handler, void* arg);
+void mqttMessageHandlerUnregister(mqtt_message_handler_t handler, void* arg);
+re_mqtt_message_t* mqttMessageRetain(re_mqtt_message_t* message);
+void mqttMessageRelease(re_mqtt_message_t* message);
+void mqttMessageGetStats(re_mqtt_message_stats_t* stats);
+
+bool mqttRouteAdd(const char* filter, mqtt_message_handler_t handler, void* arg);
+void mqttRouteRemove(const char* filter, mqtt_message_handler_t handler, void* arg);
+
+bool mqttTopicMatch(const char* filter, const char* topic, size_t topic_len);
+bool mqttStreamHandlerRegister(const char* filter, mqtt_stream_handler_t handler, void* arg);
+void mqttStreamHandlerUnregister(const char* filter, mqtt_stream_handler_t handler);
+
+bool mqttLogSetTopicSampling(const char* filter, uint32_t every);
+
 esp_err_t mqttPublish(char *topic, char *payload, int qos, bool retained, bool free_topic, bool free_payload);
+esp_err_t mqttPublishEx(char *topic, const void *payload, size_t payload_len, int qos, bool retained, bool free_topic, bool free_payload);
+esp_err_t mqttPublishV(char *topic, const mqtt_iovec_t *iov, size_t iovcnt, int qos, bool retained, bool free_topic);
+
+mqtt_topic_handle_t mqttTopicRegister(const char* topic);
+void mqttTopicUnregister(mqtt_topic_handle_t handle);
+const char* mqttTopicGetName(mqtt_topic_handle_t handle);
+esp_err_t mqttPublishTopic(mqtt_topic_handle_t handle, char *payload, int qos, bool retained, bool free_payload);
 
 #ifdef __cplusplus
 }
@@ -2,8 +2,11 @@
 #include "freertos/FreeRTOS.h"
 #include "freertos/event_groups.h"
 #include "freertos/task.h"
+#include "freertos/semphr.h"
+#include "esp_timer.h"
 #include "mbedtls/ssl.h"
 #include <time.h>
+#include <inttypes.h>
 #include "reTgSend.h"
 
 static const char* logTAG = "MQTT";
@@ -36,6 +39,181 @@ esp_err_t mqttClientCreate();
 esp_err_t mqttClientRestart();
 esp_err_t mqttClientStop();
 esp_err_t mqttClientDestroy();
+static esp_err_t mqttPublishClient(const char *topic, const char *payload, size_t payload_len, int qos, bool retained, int64_t started, int* msg_id);
+static esp_err_t mqttPublishInternal(const char *topic, const char *payload, size_t payload_len, int qos, bool retained);
+static esp_err_t mqttPublishOffline(const char *topic, const char *payload, size_t payload_len, int qos, bool retained, int64_t started);
+static bool mqttSideEventHandler(esp_mqtt_event_handle_t data);
+static bool mqttRaceMainConnected(esp_mqtt_client_handle_t client);
+static void mqttRaceStart();
+static void mqttSideStop();
+static void mqttStandbyStart();
+static bool mqttStandbyTakeover();
+#if defined(CONFIG_MQTT2_TYPE) && defined(CONFIG_MQTT_PRIMARY_PROBE) && CONFIG_MQTT_PRIMARY_PROBE
+static bool mqttProbeConnect();
+static void mqttProbeCancel();
+#endif // CONFIG_MQTT_PRIMARY_PROBE
+static void mqttAddrInvalidate();
+static void mqttAddrRecheck();
+static void mqttHandoverPut(esp_mqtt_client_handle_t client, int msg_id, const char *topic, const char *payload, size_t payload_len, int qos, bool retained);
+static void mqttHandoverAck(esp_mqtt_client_handle_t client, int msg_id);
+static void mqttHandoverDrop(esp_mqtt_client_handle_t client);
+
+// -----------------------------------------------------------------------------------------------------------------------
+// ---------------------------------------------------- Client handle ----------------------------------------------------
+// -----------------------------------------------------------------------------------------------------------------------
+
+// Tasks outside the client take the handle with a ticket; when the handle is replaced (connection race, hot standby)
+// or deleted, the previous client is destroyed only after all tickets taken before the replacement have been returned.
+// Each handle has its own generation with a separate counter: new tickets are always taken for the current generation,
+// and a retired generation is not reused until its drain is finished, so a drain never waits for newer users
+#ifndef CONFIG_MQTT_CLIENT_GENERATIONS
+  #define CONFIG_MQTT_CLIENT_GENERATIONS 4
+#endif // CONFIG_MQTT_CLIENT_GENERATIONS
+
+typedef struct {
+  uint32_t users;
+  bool     draining;   // The handle has been retired and is waiting for mqttClientDrain()
+} re_mqtt_client_gen_t;
+
+static portMUX_TYPE _mqttClientLock = portMUX_INITIALIZER_UNLOCKED;
+static uint32_t _mqttClientCurrent = 0;
+static re_mqtt_client_gen_t _mqttClientGens[CONFIG_MQTT_CLIENT_GENERATIONS];
+
+static esp_mqtt_client_handle_t mqttClientAcquire(uint32_t* ticket)
+{
+  taskENTER_CRITICAL(&_mqttClientLock);
+  esp_mqtt_client_handle_t client = _mqttClient;
+  *ticket = _mqttClientCurrent;
+  _mqttClientGens[*ticket].users++;
+  taskEXIT_CRITICAL(&_mqttClientLock);
+  return client;
+}
+
+static void mqttClientRelease(uint32_t ticket)
+{
+  taskENTER_CRITICAL(&_mqttClientLock);
+  _mqttClientGens[ticket].users--;
+  taskEXIT_CRITICAL(&_mqttClientLock);
+}
+
+// Returns false without changes if all generations are still in use, otherwise the previous handle and its ticket,
+// which must be passed to mqttClientDrain() if the previous handle is not empty. May be called inside a critical section
+static bool mqttClientReplace(esp_mqtt_client_handle_t client, esp_mqtt_client_handle_t* previous, uint32_t* ticket)
+{
+  bool ret = false;
+  taskENTER_CRITICAL(&_mqttClientLock);
+  for (uint32_t i = 1; i < CONFIG_MQTT_CLIENT_GENERATIONS; i++) {
+    uint32_t next = (_mqttClientCurrent + i) % CONFIG_MQTT_CLIENT_GENERATIONS;
+    if ((_mqttClientGens[next].users == 0) && !_mqttClientGens[next].draining) {
+      *previous = _mqttClient;
+      *ticket = _mqttClientCurrent;
+      // Users of an empty handle have nothing to wait for, the generation is released with the last of them
+      _mqttClientGens[_mqttClientCurrent].draining = _mqttClient != nullptr;
+      _mqttClient = client;
+      _mqttClientCurrent = next;
+      ret = true;
+      break;
+    };
+  };
+  taskEXIT_CRITICAL(&_mqttClientLock);
+  return ret;
+}
+
+// Replacement outside of critical sections: waits until a generation is released by a running drain
+static esp_mqtt_client_handle_t mqttClientReplaceWait(esp_mqtt_client_handle_t client, uint32_t* ticket)
+{
+  esp_mqtt_client_handle_t previous = nullptr;
+  while (!mqttClientReplace(client, &previous, ticket)) {
+    vTaskDelay(1);
+  };
+  return previous;
+}
+
+// Waiting for the tickets of the previous handle; must not be called from the task of that client,
+// since a ticket holder may be waiting for the client's lock
+static void mqttClientDrain(uint32_t ticket)
+{
+  while (1) {
+    taskENTER_CRITICAL(&_mqttClientLock);
+    bool drained = _mqttClientGens[ticket].users == 0;
+    if (drained) _mqttClientGens[ticket].draining = false;
+    taskEXIT_CRITICAL(&_mqttClientLock);
+    if (drained) break;
+    vTaskDelay(1);
+  };
+}
+
+// -----------------------------------------------------------------------------------------------------------------------
+// ----------------------------------------------------- Zero heap -------------------------------------------------------
+// -----------------------------------------------------------------------------------------------------------------------
+
+#if CONFIG_MQTT_ZERO_HEAP
+
+#if !CONFIG_MQTT_STATIC_ALLOCATION || !(defined(CONFIG_MQTT_INCOMING_POOL) && CONFIG_MQTT_INCOMING_POOL)
+  #error "CONFIG_MQTT_ZERO_HEAP requires CONFIG_MQTT_STATIC_ALLOCATION and CONFIG_MQTT_INCOMING_POOL"
+#endif // CONFIG_MQTT_STATIC_ALLOCATION && CONFIG_MQTT_INCOMING_POOL
+#ifndef CONFIG_MQTT_ERROR_MSG_SIZE
+  #define CONFIG_MQTT_ERROR_MSG_SIZE 192
+#endif // CONFIG_MQTT_ERROR_MSG_SIZE
+#ifndef CONFIG_MQTT_TOPIC_MAX_LEN
+  #define CONFIG_MQTT_TOPIC_MAX_LEN 96
+#endif // CONFIG_MQTT_TOPIC_MAX_LEN
+#ifndef CONFIG_MQTT_ZERO_HEAP_BUDGET
+  #define CONFIG_MQTT_ZERO_HEAP_BUDGET 65536
+#endif // CONFIG_MQTT_ZERO_HEAP_BUDGET
+
+// Strings are formatted into a buffer of fixed size (truncated if necessary) instead of the heap
+#define MQTT_STRING_BUFFER(name) char name[CONFIG_MQTT_ERROR_MSG_SIZE]
+#define mqttStringf(name, ...) (snprintf(name, sizeof(name), __VA_ARGS__), name)
+#define mqttStringFree(str)
+#define MQTT_STRING_OWNED false
+// Runtime objects are placed in the buffer pool; pool slots are reused, so they are zeroed like esp_calloc() does
+static void* mqttRuntimeAlloc(size_t size)
+{
+  void* ptr = mqttBufferAlloc(size);
+  if (ptr) memset(ptr, 0, size);
+  return ptr;
+}
+#define mqttRuntimeFree(ptr) mqttBufferFree(ptr)
+
+// Device topics are generated once during initialization for both brokers: mqttGetTopicDevice1() returns a heap string
+static bool mqttTopicStaticCreate(char buffer[2][CONFIG_MQTT_TOPIC_MAX_LEN], bool local, const char* topic)
+{
+  for (uint8_t i = 0; i < 2; i++) {
+    char* generated = mqttGetTopicDevice1(i == 0, local, topic);
+    if (generated == nullptr) return false;
+    bool fits = strlen(generated) < CONFIG_MQTT_TOPIC_MAX_LEN;
+    if (fits) {
+      strcpy(buffer[i], generated);
+    } else {
+      rlog_e(logTAG, "Topic [ %s ] is longer than CONFIG_MQTT_TOPIC_MAX_LEN", generated);
+    };
+    free(generated);
+    if (!fits) return false;
+  };
+  return true;
+}
+
+#else
+
+#define MQTT_STRING_BUFFER(name)
+#define mqttStringf(name, ...) malloc_stringf(__VA_ARGS__)
+#define mqttStringFree(str) do { if (str) free(str); } while (0)
+#define MQTT_STRING_OWNED true
+#define mqttRuntimeAlloc(size) esp_calloc(1, size)
+#define mqttRuntimeFree(ptr) free(ptr)
+
+#endif // CONFIG_MQTT_ZERO_HEAP
+static void mqttBrokerConnecting();
+static void mqttBrokerConnected(int32_t handshake_ms);
+static void mqttBrokerFailed();
+#if defined(CONFIG_MQTT_LATENCY_STATS) && CONFIG_MQTT_LATENCY_STATS
+  static void mqttBrokerRtt(uint32_t rtt_ms);
+#endif // CONFIG_MQTT_LATENCY_STATS
+static bool mqttBrokerRotate();
+#if defined(CONFIG_MQTT2_TYPE) && ((defined(CONFIG_MQTT_CONNECT_RACE) && CONFIG_MQTT_CONNECT_RACE) || (defined(CONFIG_MQTT_HOT_STANDBY) && CONFIG_MQTT_HOT_STANDBY) || (defined(CONFIG_MQTT_PRIMARY_PROBE) && CONFIG_MQTT_PRIMARY_PROBE))
+  static void mqttBrokerTakeover();
+#endif // CONFIG_MQTT_CONNECT_RACE || CONFIG_MQTT_HOT_STANDBY || CONFIG_MQTT_PRIMARY_PROBE
 
 // -----------------------------------------------------------------------------------------------------------------------
 // ----------------------------------------------------- Status bits -----------------------------------------------------
@@ -167,9 +345,126 @@ EventBits_t mqttStatesWaitMs(EventBits_t bits, BaseType_t clearOnExit, BaseType_
 // --------------------------------------------- Return to main server timer ---------------------------------------------
 // -----------------------------------------------------------------------------------------------------------------------
 
-#if defined(CONFIG_MQTT2_TYPE) && defined(CONFIG_MQTT_BACK_TO_PRIMARY_TIME_MINUTES) && (CONFIG_MQTT_BACK_TO_PRIMARY_TIME_MINUTES > 0)
+#if defined(CONFIG_MQTT2_TYPE) && defined(CONFIG_MQTT_PRIMARY_PROBE) && CONFIG_MQTT_PRIMARY_PROBE
 
-#include "esp_timer.h"
+#ifndef CONFIG_MQTT_PROBE_INTERVAL_MIN
+  #define CONFIG_MQTT_PROBE_INTERVAL_MIN 30
+#endif // CONFIG_MQTT_PROBE_INTERVAL_MIN
+#ifndef CONFIG_MQTT_PROBE_INTERVAL_MAX
+  #if defined(CONFIG_MQTT_BACK_TO_PRIMARY_TIME_MINUTES) && (CONFIG_MQTT_BACK_TO_PRIMARY_TIME_MINUTES > 0)
+    #define CONFIG_MQTT_PROBE_INTERVAL_MAX (CONFIG_MQTT_BACK_TO_PRIMARY_TIME_MINUTES * 60)
+  #else
+    #define CONFIG_MQTT_PROBE_INTERVAL_MAX 900
+  #endif // CONFIG_MQTT_BACK_TO_PRIMARY_TIME_MINUTES
+#endif // CONFIG_MQTT_PROBE_INTERVAL_MAX
+
+esp_timer_handle_t _mqttBackToPrimaryTimer = nullptr;
+static uint32_t _mqttProbeInterval = CONFIG_MQTT_PROBE_INTERVAL_MIN;
+static re_mqtt_probe_stats_t _mqttProbeStats = { 0, 0, 0, 0, 0, CONFIG_MQTT_PROBE_INTERVAL_MIN };
+
+bool mqttServer1SetAvailable(bool newAvailable);
+bool mqttServer1Activate();
+
+static bool mqttBackToPrimaryTimerSchedule()
+{
+  _mqttProbeStats.interval_s = _mqttProbeInterval;
+  RE_OK_CHECK(esp_timer_start_once(_mqttBackToPrimaryTimer, 1000000ULL * _mqttProbeInterval), return false);
+  rlog_d(logTAG, "Next probe of the primary MQTT broker in %d s", _mqttProbeInterval);
+  return true;
+}
+
+void mqttBackToPrimaryTimerEnd(void* arg)
+{
+  // The main connection is not touched until the probe proves that the primary broker is healthy
+  if (mqttProbeConnect()) {
+    _mqttProbeStats.attempts++;
+  } else {
+    mqttBackToPrimaryTimerSchedule();
+  };
+}
+
+// Called by the probe connection: on success, switch to the primary broker, otherwise try again later
+static void mqttBackToPrimaryProbeResult(bool healthy, uint32_t handshake_ms)
+{
+  if (healthy) {
+    _mqttProbeStats.successes++;
+    _mqttProbeStats.handshake_last_ms = handshake_ms;
+    _mqttProbeInterval = CONFIG_MQTT_PROBE_INTERVAL_MIN;
+    rlog_i(logTAG, "Primary MQTT broker responded in %d ms, returning to it", handshake_ms);
+    if (mqttStatesCheck(MQTTCLI_SERVER1_AVAILABLED, false)) {
+      // The reserved broker was selected by the connection race or hot standby, the primary one is still marked as available
+      mqttServer1Activate();
+    } else {
+      mqttServer1SetAvailable(true);
+    };
+  } else {
+    _mqttProbeStats.failures++;
+    _mqttProbeInterval = _mqttProbeInterval * 2 < CONFIG_MQTT_PROBE_INTERVAL_MAX ? _mqttProbeInterval * 2 : CONFIG_MQTT_PROBE_INTERVAL_MAX;
+    if (_mqttProbeInterval > _mqttProbeStats.interval_max_s) {
+      _mqttProbeStats.interval_max_s = _mqttProbeInterval;
+    };
+    rlog_w(logTAG, "Primary MQTT broker is still unavailable");
+    if ((_mqttBackToPrimaryTimer != nullptr) && mqttStatesCheck(MQTTCLI_SERVER2_ACTIVE, false)) {
+      mqttBackToPrimaryTimerSchedule();
+    };
+  };
+}
+
+bool mqttBackToPrimaryTimerInit()
+{
+  if (_mqttBackToPrimaryTimer == nullptr) {
+    esp_timer_create_args_t cfg;
+    memset(&cfg, 0, sizeof(cfg));
+    cfg.name = "mqtt_probe";
+    cfg.skip_unhandled_events = true;
+    cfg.callback = mqttBackToPrimaryTimerEnd;
+    RE_OK_CHECK(esp_timer_create(&cfg, &_mqttBackToPrimaryTimer), return false);
+    rlog_i(logTAG, "The probe timer of the main MQTT server is created");
+  };
+  return true;
+}
+
+bool mqttBackToPrimaryTimerStop()
+{
+  if ((_mqttBackToPrimaryTimer != nullptr) && esp_timer_is_active(_mqttBackToPrimaryTimer)) {
+    RE_OK_CHECK(esp_timer_stop(_mqttBackToPrimaryTimer), return false);
+    rlog_i(logTAG, "The probe timer of the main MQTT server was stopped");
+  };
+  mqttProbeCancel();
+  return true;
+}
+
+bool mqttBackToPrimaryTimerFree()
+{
+  if (_mqttBackToPrimaryTimer != nullptr) {
+    mqttBackToPrimaryTimerStop();
+    RE_OK_CHECK(esp_timer_delete(_mqttBackToPrimaryTimer), return false);
+    _mqttBackToPrimaryTimer = nullptr;
+    rlog_i(logTAG, "The probe timer of the main MQTT server is deleted");
+  };
+  return true;
+}
+
+bool mqttBackToPrimaryTimerStart()
+{
+  if (_mqttBackToPrimaryTimer == nullptr) {
+    if (!mqttBackToPrimaryTimerInit()) {
+      return false;
+    };
+  };
+  mqttBackToPrimaryTimerStop();
+  _mqttProbeInterval = CONFIG_MQTT_PROBE_INTERVAL_MIN;
+  if (!mqttBackToPrimaryTimerSchedule()) return false;
+  rlog_i(logTAG, "The probe timer of the main MQTT server was started");
+  return true;
+}
+
+void mqttProbeGetStats(re_mqtt_probe_stats_t* stats)
+{
+  if (stats) memcpy(stats, &_mqttProbeStats, sizeof(re_mqtt_probe_stats_t));
+}
+
+#elif defined(CONFIG_MQTT2_TYPE) && defined(CONFIG_MQTT_BACK_TO_PRIMARY_TIME_MINUTES) && (CONFIG_MQTT_BACK_TO_PRIMARY_TIME_MINUTES > 0)
 
 esp_timer_handle_t _mqttBackToPrimaryTimer = nullptr;
 
@@ -225,6 +520,11 @@ bool mqttBackToPrimaryTimerStart()
   return true;
 }
 
+void mqttProbeGetStats(re_mqtt_probe_stats_t* stats)
+{
+  if (stats) memset(stats, 0, sizeof(re_mqtt_probe_stats_t));
+}
+
 #else
 
 bool mqttBackToPrimaryTimerInit()
@@ -247,354 +547,3578 @@ bool mqttBackToPrimaryTimerStop()
   return true;
 }
 
-#endif // CONFIG_MQTT_BACK_TO_PRIMARY_TIME_MINUTES
+void mqttProbeGetStats(re_mqtt_probe_stats_t* stats)
+{
+  if (stats) memset(stats, 0, sizeof(re_mqtt_probe_stats_t));
+}
+
+#endif // CONFIG_MQTT_PRIMARY_PROBE || CONFIG_MQTT_BACK_TO_PRIMARY_TIME_MINUTES
 
 // -----------------------------------------------------------------------------------------------------------------------
-// ----------------------------------------------------- Routines --------------------------------------------------------
+// ----------------------------------------------------- Buffer pool -----------------------------------------------------
 // -----------------------------------------------------------------------------------------------------------------------
 
-bool mqttIsConnected() 
-{
-  return statesNetworkIsConnected() && (_mqttClient) && mqttStatesCheck(MQTTCLI_STARTED | MQTTCLI_CONNECTED, false);
-}
+#if defined(CONFIG_MQTT_INCOMING_POOL) && CONFIG_MQTT_INCOMING_POOL
+
+#ifndef CONFIG_MQTT_POOL_SLOTS_64
+  #define CONFIG_MQTT_POOL_SLOTS_64 8
+#endif // CONFIG_MQTT_POOL_SLOTS_64
+#ifndef CONFIG_MQTT_POOL_SLOTS_256
+  #define CONFIG_MQTT_POOL_SLOTS_256 4
+#endif // CONFIG_MQTT_POOL_SLOTS_256
+#ifndef CONFIG_MQTT_POOL_SLOTS_1K
+  #define CONFIG_MQTT_POOL_SLOTS_1K 2
+#endif // CONFIG_MQTT_POOL_SLOTS_1K
+#ifndef CONFIG_MQTT_POOL_SLOTS_4K
+  #define CONFIG_MQTT_POOL_SLOTS_4K 1
+#endif // CONFIG_MQTT_POOL_SLOTS_4K
+
+#define MQTT_POOL_CLASSES 4
+
+static_assert((CONFIG_MQTT_POOL_SLOTS_64 <= 32) && (CONFIG_MQTT_POOL_SLOTS_256 <= 32)
+           && (CONFIG_MQTT_POOL_SLOTS_1K <= 32) && (CONFIG_MQTT_POOL_SLOTS_4K <= 32),
+  "No more than 32 slots per size class are allowed");
+
+#define MQTT_POOL_BYTES (64*CONFIG_MQTT_POOL_SLOTS_64 + 256*CONFIG_MQTT_POOL_SLOTS_256 + 1024*CONFIG_MQTT_POOL_SLOTS_1K + 4096*CONFIG_MQTT_POOL_SLOTS_4K)
+
+typedef struct {
+  size_t   slot_size;
+  uint32_t slot_count;
+  uint32_t busy;         // Bitmap of occupied slots
+  uint8_t* slots;
+} re_mqtt_pool_class_t;
+
+static re_mqtt_pool_class_t _mqttPool[MQTT_POOL_CLASSES] = {
+  { 64,   CONFIG_MQTT_POOL_SLOTS_64,  0, nullptr },
+  { 256,  CONFIG_MQTT_POOL_SLOTS_256, 0, nullptr },
+  { 1024, CONFIG_MQTT_POOL_SLOTS_1K,  0, nullptr },
+  { 4096, CONFIG_MQTT_POOL_SLOTS_4K,  0, nullptr }
+};
+static uint8_t* _mqttPoolArea = nullptr;
+static re_mqtt_pool_stats_t _mqttPoolStats;
+static portMUX_TYPE _mqttPoolLock = portMUX_INITIALIZER_UNLOCKED;
+#if CONFIG_MQTT_STATIC_ALLOCATION
+  static uint8_t _mqttPoolBuffer[MQTT_POOL_BYTES];
+#endif // CONFIG_MQTT_STATIC_ALLOCATION
 
-bool mqttIsPrimary()
+bool mqttPoolInit()
 {
-  return !mqttStatesCheck(MQTTCLI_SERVER2_ACTIVE, false);
+  if (_mqttPoolArea == nullptr) {
+    #if CONFIG_MQTT_STATIC_ALLOCATION
+      _mqttPoolArea = _mqttPoolBuffer;
+    #else
+      _mqttPoolArea = (uint8_t*)esp_calloc(1, MQTT_POOL_BYTES);
+      if (_mqttPoolArea == nullptr) {
+        rlog_e(logTAG, "Failed to allocate buffer pool: %d bytes", MQTT_POOL_BYTES);
+        return false;
+      };
+    #endif // CONFIG_MQTT_STATIC_ALLOCATION
+    uint8_t* next = _mqttPoolArea;
+    for (uint8_t i = 0; i < MQTT_POOL_CLASSES; i++) {
+      _mqttPool[i].busy = 0;
+      _mqttPool[i].slots = next;
+      next += _mqttPool[i].slot_size * _mqttPool[i].slot_count;
+    };
+    memset(&_mqttPoolStats, 0, sizeof(_mqttPoolStats));
+    rlog_i(logTAG, "Buffer pool created: %d bytes", MQTT_POOL_BYTES);
+  };
+  return true;
 }
 
-int mqttGetOutboxSize()
+static bool mqttPoolContains(void* buffer)
 {
-  return esp_mqtt_client_get_outbox_size(_mqttClient);
+  return (_mqttPoolArea != nullptr) && ((uint8_t*)buffer >= _mqttPoolArea) && ((uint8_t*)buffer < _mqttPoolArea + MQTT_POOL_BYTES);
 }
 
-void mqttErrorEventSend(const char* message, const char* object)
+void* mqttBufferAlloc(size_t size)
 {
-  mqttStatesSet(MQTTCLI_ERROR);
-  if (message) {
-    if (object) {
-      char* err_msg = malloc_stringf(message, object);
-      if (err_msg) {
-        eventLoopPost(RE_MQTT_EVENTS, RE_MQTT_ERROR, (void*)err_msg, strlen(err_msg)+1, portMAX_DELAY);
-        free(err_msg);
+  if (_mqttPoolArea) {
+    taskENTER_CRITICAL(&_mqttPoolLock);
+    for (uint8_t i = 0; i < MQTT_POOL_CLASSES; i++) {
+      if (size <= _mqttPool[i].slot_size) {
+        for (uint32_t j = 0; j < _mqttPool[i].slot_count; j++) {
+          if ((_mqttPool[i].busy & (1UL << j)) == 0) {
+            _mqttPool[i].busy |= (1UL << j);
+            _mqttPoolStats.pool_allocs++;
+            _mqttPoolStats.in_use++;
+            if (_mqttPoolStats.in_use > _mqttPoolStats.in_use_max) {
+              _mqttPoolStats.in_use_max = _mqttPoolStats.in_use;
+            };
+            taskEXIT_CRITICAL(&_mqttPoolLock);
+            return _mqttPool[i].slots + j * _mqttPool[i].slot_size;
+          };
+        };
+        // If this class is exhausted, the next (larger) one is tried
       };
-    } else {
-      eventLoopPost(RE_MQTT_EVENTS, RE_MQTT_ERROR, (void*)message, strlen(message)+1, portMAX_DELAY);
     };
-  } else {
-    eventLoopPost(RE_MQTT_EVENTS, RE_MQTT_ERROR, nullptr, 0, portMAX_DELAY);
+    _mqttPoolStats.heap_fallbacks++;
+    taskEXIT_CRITICAL(&_mqttPoolLock);
   };
+  #if CONFIG_MQTT_ZERO_HEAP
+    // No heap fallback: the pool is exhausted or the buffer is too large
+    return nullptr;
+  #else
+    return esp_calloc(1, size);
+  #endif // CONFIG_MQTT_ZERO_HEAP
 }
 
-void mqttErrorEventSendCode(const char* message, const char* object, esp_err_t error_code)
+void mqttBufferFree(void* buffer)
 {
-  mqttStatesSet(MQTTCLI_ERROR);
-  if (message) {
-    char* err_msg = nullptr;
-    if (object) {
-      err_msg = malloc_stringf(message, object, error_code, esp_err_to_name(error_code));
+  if (buffer) {
+    if (mqttPoolContains(buffer)) {
+      size_t offset = (uint8_t*)buffer - _mqttPoolArea;
+      taskENTER_CRITICAL(&_mqttPoolLock);
+      for (uint8_t i = 0; i < MQTT_POOL_CLASSES; i++) {
+        size_t class_bytes = _mqttPool[i].slot_size * _mqttPool[i].slot_count;
+        if (offset < class_bytes) {
+          _mqttPool[i].busy &= ~(1UL << (offset / _mqttPool[i].slot_size));
+          break;
+        };
+        offset -= class_bytes;
+      };
+      _mqttPoolStats.pool_frees++;
+      _mqttPoolStats.in_use--;
+      taskEXIT_CRITICAL(&_mqttPoolLock);
     } else {
-      err_msg = malloc_stringf(message, error_code, esp_err_to_name(error_code));
-    };
-    if (err_msg) {
-      eventLoopPost(RE_MQTT_EVENTS, RE_MQTT_ERROR, (void*)err_msg, strlen(err_msg)+1, portMAX_DELAY);
-      free(err_msg);
+      free(buffer);
     };
   };
 }
 
-void mqttErrorEventClear()
+void mqttPoolGetStats(re_mqtt_pool_stats_t* stats)
 {
-  if (mqttStatesCheck(MQTTCLI_ERROR, true)) {
-    eventLoopPost(RE_MQTT_EVENTS, RE_MQTT_ERROR_CLEAR, nullptr, 0, portMAX_DELAY);
+  if (stats) {
+    taskENTER_CRITICAL(&_mqttPoolLock);
+    memcpy(stats, &_mqttPoolStats, sizeof(re_mqtt_pool_stats_t));
+    taskEXIT_CRITICAL(&_mqttPoolLock);
   };
 }
 
-// -----------------------------------------------------------------------------------------------------------------------
-// ------------------------------------------------ Publish system status ------------------------------------------------
-// -----------------------------------------------------------------------------------------------------------------------
+void mqttPoolFree()
+{
+  #if !CONFIG_MQTT_STATIC_ALLOCATION
+    if (_mqttPoolArea) free(_mqttPoolArea);
+  #endif // CONFIG_MQTT_STATIC_ALLOCATION
+  _mqttPoolArea = nullptr;
+}
 
-#if CONFIG_MQTT_STATUS_LWT || CONFIG_MQTT_STATUS_ONLINE || CONFIG_MQTT_STATUS_ONLINE_SYSINFO
+#else
 
-static char* _mqttTopicStatus = nullptr;
+bool mqttPoolInit()
+{
+  return true;
+}
 
-char* mqttTopicStatusCreate(const bool primary)
+void* mqttBufferAlloc(size_t size)
 {
-  if (_mqttTopicStatus) free(_mqttTopicStatus);
-  _mqttTopicStatus = mqttGetTopicDevice1(primary, CONFIG_MQTT_STATUS_LOCAL, CONFIG_MQTT_STATUS_TOPIC);
-  if (_mqttTopicStatus) {
-    rlog_i(logTAG, "Generated topic for publishing system status: [ %s ]", _mqttTopicStatus);
-  } else {
-    rlog_i(logTAG, "Failed to denerate topic for publishing system status");
-  };
-  return _mqttTopicStatus;
+  return esp_calloc(1, size);
 }
 
-char* mqttTopicStatusGet()
+void mqttBufferFree(void* buffer)
 {
-  if (!_mqttTopicStatus) {
-    if (mqttStatesCheck(MQTTCLI_CONNECTED, false)) {
-      mqttTopicStatusCreate(_mqttData.primary);
-    };
-  };
-  return _mqttTopicStatus;
+  if (buffer) free(buffer);
 }
 
-void mqttTopicStatusFree()
+void mqttPoolGetStats(re_mqtt_pool_stats_t* stats)
 {
-  if (_mqttTopicStatus) free(_mqttTopicStatus);
-  _mqttTopicStatus = nullptr;
-  rlog_d(logTAG, "Topic for publishing system status has been scrapped");
+  if (stats) memset(stats, 0, sizeof(re_mqtt_pool_stats_t));
 }
 
-#endif // CONFIG_MQTT_STATUS_LWT || CONFIG_MQTT_STATUS_ONLINE || CONFIG_MQTT_STATUS_ONLINE_SYSINFO
+void mqttPoolFree()
+{
+}
+
+#endif // CONFIG_MQTT_INCOMING_POOL
 
 // -----------------------------------------------------------------------------------------------------------------------
-// -------------------------------------------------- Server selection ---------------------------------------------------
+// --------------------------------------------------- Error reporting ---------------------------------------------------
 // -----------------------------------------------------------------------------------------------------------------------
 
-// Connect to server with new parameters
-bool mqttServer1isLocal()
+#if defined(CONFIG_MQTT_ERROR_QUEUE) && CONFIG_MQTT_ERROR_QUEUE
+
+#ifndef CONFIG_MQTT_ERROR_QUEUE_SIZE
+  #define CONFIG_MQTT_ERROR_QUEUE_SIZE 16
+#endif // CONFIG_MQTT_ERROR_QUEUE_SIZE
+#ifndef CONFIG_MQTT_ERROR_RECORD_SIZE
+  #define CONFIG_MQTT_ERROR_RECORD_SIZE 160
+#endif // CONFIG_MQTT_ERROR_RECORD_SIZE
+#ifndef CONFIG_MQTT_ERROR_COALESCE_MS
+  #define CONFIG_MQTT_ERROR_COALESCE_MS 5000
+#endif // CONFIG_MQTT_ERROR_COALESCE_MS
+#ifndef CONFIG_MQTT_ERROR_TASK_STACK_SIZE
+  #define CONFIG_MQTT_ERROR_TASK_STACK_SIZE 3072
+#endif // CONFIG_MQTT_ERROR_TASK_STACK_SIZE
+#ifndef CONFIG_MQTT_ERROR_TASK_PRIORITY
+  #define CONFIG_MQTT_ERROR_TASK_PRIORITY 1
+#endif // CONFIG_MQTT_ERROR_TASK_PRIORITY
+
+static_assert((CONFIG_MQTT_ERROR_QUEUE_SIZE & (CONFIG_MQTT_ERROR_QUEUE_SIZE - 1)) == 0, "CONFIG_MQTT_ERROR_QUEUE_SIZE must be a power of two");
+
+typedef enum {
+  MQTT_ERROR_RECORD = 0,
+  MQTT_ERROR_CLEAR
+} re_mqtt_error_kind_t;
+
+typedef struct {
+  uint8_t kind;
+  int64_t time;
+  char    message[CONFIG_MQTT_ERROR_RECORD_SIZE];
+} re_mqtt_error_record_t;
+
+typedef struct {
+  uint32_t sequence;
+  re_mqtt_error_record_t record;
+} re_mqtt_error_cell_t;
+
+static re_mqtt_error_cell_t _mqttErrorRing[CONFIG_MQTT_ERROR_QUEUE_SIZE];
+static uint32_t _mqttErrorHead = 0;   // Next cell for producers
+static uint32_t _mqttErrorTail = 0;   // Next cell for the drainer task
+static TaskHandle_t _mqttErrorTask = nullptr;
+static re_mqtt_error_stats_t _mqttErrorStats;
+// RE_MQTT_ERROR_CLEAR that did not fit into the ring: it is posted when the drainer reaches the position where it was due
+static bool _mqttErrorClearPending = false;
+static uint32_t _mqttErrorClearAt = 0;
+
+static void mqttErrorPost(const char* message);
+
+// Records are formatted directly into the ring cell; never waits, if the ring is full the record is dropped.
+// Until the drainer task is created (and after it is deleted) records are posted directly from the caller
+static bool mqttErrorPush(re_mqtt_error_kind_t kind, const char* format, ...) __attribute__((format(printf, 2, 3)));
+static bool mqttErrorPush(re_mqtt_error_kind_t kind, const char* format, ...)
 {
-  return CONFIG_MQTT1_TYPE > 0;
+  if (_mqttErrorTask == nullptr) {
+    if (kind == MQTT_ERROR_CLEAR) {
+      eventLoopPost(RE_MQTT_EVENTS, RE_MQTT_ERROR_CLEAR, nullptr, 0, portMAX_DELAY);
+    } else {
+      char message[CONFIG_MQTT_ERROR_RECORD_SIZE];
+      va_list args;
+      va_start(args, format);
+      vsnprintf(message, sizeof(message), format, args);
+      va_end(args);
+      mqttErrorPost(message);
+    };
+    __atomic_add_fetch(&_mqttErrorStats.reported, 1, __ATOMIC_RELAXED);
+    return true;
+  };
+  uint32_t pos = __atomic_load_n(&_mqttErrorHead, __ATOMIC_RELAXED);
+  re_mqtt_error_cell_t* cell;
+  while (1) {
+    cell = &_mqttErrorRing[pos & (CONFIG_MQTT_ERROR_QUEUE_SIZE - 1)];
+    int32_t diff = (int32_t)(__atomic_load_n(&cell->sequence, __ATOMIC_ACQUIRE) - pos);
+    if (diff == 0) {
+      if (__atomic_compare_exchange_n(&_mqttErrorHead, &pos, pos + 1, true, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) break;
+    } else if (diff < 0) {
+      __atomic_add_fetch(&_mqttErrorStats.dropped, 1, __ATOMIC_RELAXED);
+      return false;
+    } else {
+      pos = __atomic_load_n(&_mqttErrorHead, __ATOMIC_RELAXED);
+    };
+  };
+  cell->record.kind = kind;
+  cell->record.time = esp_timer_get_time();
+  va_list args;
+  va_start(args, format);
+  vsnprintf(cell->record.message, sizeof(cell->record.message), format, args);
+  va_end(args);
+  __atomic_store_n(&cell->sequence, pos + 1, __ATOMIC_RELEASE);
+  __atomic_add_fetch(&_mqttErrorStats.reported, 1, __ATOMIC_RELAXED);
+  xTaskNotifyGive(_mqttErrorTask);
+  return true;
 }
 
-bool mqttServer1Enabled()
+// Unlike error records, CLEAR is never lost: if the ring is full, it is remembered with its position in the ring
+static void mqttErrorPushClear()
 {
-  return mqttStatesCheck(MQTTCLI_SERVER1_AVAILABLED, false) && (mqttServer1isLocal() || mqttStatesCheck(MQTTCLI_INET_AVAILABLED, false));
+  uint32_t pos = __atomic_load_n(&_mqttErrorHead, __ATOMIC_RELAXED);
+  if (!mqttErrorPush(MQTT_ERROR_CLEAR, "%s", "")) {
+    __atomic_store_n(&_mqttErrorClearAt, pos, __ATOMIC_RELAXED);
+    __atomic_store_n(&_mqttErrorClearPending, true, __ATOMIC_RELEASE);
+    xTaskNotifyGive(_mqttErrorTask);
+  };
 }
 
-#ifdef CONFIG_MQTT2_TYPE
-
-bool mqttServer2isLocal()
+// A pending CLEAR is returned as a record once all records queued before it have been taken
+static bool mqttErrorPop(re_mqtt_error_record_t* record)
 {
-  return CONFIG_MQTT2_TYPE > 0;
+  if (__atomic_load_n(&_mqttErrorClearPending, __ATOMIC_ACQUIRE)
+   && ((int32_t)(_mqttErrorTail - __atomic_load_n(&_mqttErrorClearAt, __ATOMIC_RELAXED)) >= 0)
+   && __atomic_exchange_n(&_mqttErrorClearPending, false, __ATOMIC_ACQ_REL)) {
+    record->kind = MQTT_ERROR_CLEAR;
+    record->time = esp_timer_get_time();
+    record->message[0] = 0;
+    return true;
+  };
+  re_mqtt_error_cell_t* cell = &_mqttErrorRing[_mqttErrorTail & (CONFIG_MQTT_ERROR_QUEUE_SIZE - 1)];
+  if (__atomic_load_n(&cell->sequence, __ATOMIC_ACQUIRE) != _mqttErrorTail + 1) return false;
+  memcpy(record, &cell->record, sizeof(re_mqtt_error_record_t));
+  __atomic_store_n(&cell->sequence, _mqttErrorTail + CONFIG_MQTT_ERROR_QUEUE_SIZE, __ATOMIC_RELEASE);
+  _mqttErrorTail++;
+  return true;
 }
 
-bool mqttServer2Enabled()
+static void mqttErrorPost(const char* message)
 {
-  return mqttStatesCheck(MQTTCLI_SERVER2_AVAILABLED, false) && (mqttServer2isLocal() || mqttStatesCheck(MQTTCLI_INET_AVAILABLED, false));
+  if (message[0]) {
+    eventLoopPost(RE_MQTT_EVENTS, RE_MQTT_ERROR, (void*)message, strlen(message)+1, portMAX_DELAY);
+  } else {
+    eventLoopPost(RE_MQTT_EVENTS, RE_MQTT_ERROR, nullptr, 0, portMAX_DELAY);
+  };
+  __atomic_add_fetch(&_mqttErrorStats.posted, 1, __ATOMIC_RELAXED);
 }
 
-bool mqttServer1Activate()
+// The first error is posted immediately; identical errors within CONFIG_MQTT_ERROR_COALESCE_MS are merged into one summary
+static void mqttErrorTaskExec(void *arg)
 {
-  if (mqttStatesCheck(MQTTCLI_SERVER2_ACTIVE, false) || (_mqttClient == nullptr) || !mqttStatesCheck(MQTTCLI_STARTED, false)) {
-    rlog_i(logTAG, "Primary MQTT broker selected");
-    mqttBackToPrimaryTimerStop();
-    mqttStatesClear(MQTTCLI_SERVER2_ACTIVE);
-    if (_mqttClient) {
-      if (mqttStatesCheck(MQTTCLI_STARTED, false)) {
-        // The client is already running - can only be restarted through the event loop (from another task)
-        return eventLoopPost(RE_MQTT_EVENTS, RE_MQTT_SERVER_PRIMARY, nullptr, 0, portMAX_DELAY);
-      } else {
-        // The client is not running yet - you can just run it from this task
-        return mqttClientRestart() == ESP_OK;
+  static re_mqtt_error_record_t record;
+  static re_mqtt_error_record_t held;
+  static char summary[CONFIG_MQTT_ERROR_RECORD_SIZE + 64];
+  bool holding = false;
+  uint32_t repeats = 0;
+  int64_t first = 0;
+
+  while (1) {
+    ulTaskNotifyTake(pdTRUE, pdMS_TO_TICKS(CONFIG_MQTT_ERROR_COALESCE_MS));
+    bool popped;
+    do {
+      popped = mqttErrorPop(&record);
+      bool merge = popped && holding && (record.kind == MQTT_ERROR_RECORD)
+        && (record.time - first < (int64_t)CONFIG_MQTT_ERROR_COALESCE_MS * 1000)
+        && (strcmp(record.message, held.message) == 0);
+      if (merge) {
+        repeats++;
+        held.time = record.time;
+        _mqttErrorStats.merged++;
+      } else if (holding && ((popped) || (esp_timer_get_time() - first >= (int64_t)CONFIG_MQTT_ERROR_COALESCE_MS * 1000))) {
+        // The series is over: a summary with the number of repeats and the time between the first and last of them
+        if (repeats > 0) {
+          snprintf(summary, sizeof(summary), "%s [repeated %" PRIu32 " times in %" PRIu32 " ms]",
+            held.message, repeats, (uint32_t)((held.time - first) / 1000));
+          mqttErrorPost(summary);
+        };
+        holding = false;
+        repeats = 0;
       };
-    } else {
-      // The client has not yet been created
-      return mqttClientCreate() == ESP_OK;
-    };
+      if (popped && !merge) {
+        if (record.kind == MQTT_ERROR_CLEAR) {
+          eventLoopPost(RE_MQTT_EVENTS, RE_MQTT_ERROR_CLEAR, nullptr, 0, portMAX_DELAY);
+        } else {
+          mqttErrorPost(record.message);
+          memcpy(&held, &record, sizeof(re_mqtt_error_record_t));
+          first = record.time;
+          holding = true;
+        };
+      };
+    } while (popped);
   };
-  return true;
+  vTaskDelete(nullptr);
 }
 
-bool mqttServer2Activate()
+bool mqttErrorInit()
 {
-  if (!mqttStatesCheck(MQTTCLI_SERVER2_ACTIVE, false) || (_mqttClient == nullptr) || !mqttStatesCheck(MQTTCLI_STARTED, false)) {
-    rlog_i(logTAG, "Reserved MQTT broker selected");
-    mqttBackToPrimaryTimerStart();
-    mqttStatesSet(MQTTCLI_SERVER2_ACTIVE);
-    if (_mqttClient) {
-      if (mqttStatesCheck(MQTTCLI_STARTED, false)) {
-        // The client is already running - can only be restarted through the event loop (from another task)
-        return eventLoopPost(RE_MQTT_EVENTS, RE_MQTT_SERVER_RESERVED, nullptr, 0, portMAX_DELAY);
-      } else {
-        // The client is not running yet - you can just run it from this task
-        return mqttClientRestart() == ESP_OK;
-      };
-    } else {
-      // The client has not yet been created
-      return mqttClientCreate() == ESP_OK;
+  if (_mqttErrorTask == nullptr) {
+    for (uint32_t i = 0; i < CONFIG_MQTT_ERROR_QUEUE_SIZE; i++) {
+      _mqttErrorRing[i].sequence = i;
+    };
+    _mqttErrorHead = 0;
+    _mqttErrorTail = 0;
+    _mqttErrorClearPending = false;
+    if (xTaskCreate(mqttErrorTaskExec, "mqtt_error", CONFIG_MQTT_ERROR_TASK_STACK_SIZE, nullptr, CONFIG_MQTT_ERROR_TASK_PRIORITY, &_mqttErrorTask) != pdPASS) {
+      _mqttErrorTask = nullptr;
+      rlog_e(logTAG, "Failed to create task [ MQTT_ERROR ]!");
+      return false;
     };
   };
   return true;
 }
 
-// Setting network availability and starting the client, depending on which server is currently available
-bool mqttServerSelectAuto()
+void mqttErrorFree()
 {
-  if (mqttServer1Enabled()) {
+  if (_mqttErrorTask) {
+    vTaskDelete(_mqttErrorTask);
+    _mqttErrorTask = nullptr;
+  };
+}
+
+void mqttErrorGetStats(re_mqtt_error_stats_t* stats)
+{
+  if (stats) memcpy(stats, &_mqttErrorStats, sizeof(re_mqtt_error_stats_t));
+}
+
+#else
+
+bool mqttErrorInit()
+{
+  return true;
+}
+
+void mqttErrorFree()
+{
+}
+
+void mqttErrorGetStats(re_mqtt_error_stats_t* stats)
+{
+  if (stats) memset(stats, 0, sizeof(re_mqtt_error_stats_t));
+}
+
+#endif // CONFIG_MQTT_ERROR_QUEUE
+
+// -----------------------------------------------------------------------------------------------------------------------
+// ----------------------------------------------------- Routines --------------------------------------------------------
+// -----------------------------------------------------------------------------------------------------------------------
+
+bool mqttIsConnected() 
+{
+  return statesNetworkIsConnected() && (_mqttClient) && mqttStatesCheck(MQTTCLI_STARTED | MQTTCLI_CONNECTED, false);
+}
+
+bool mqttIsPrimary()
+{
+  return !mqttStatesCheck(MQTTCLI_SERVER2_ACTIVE, false);
+}
+
+int mqttGetOutboxSize()
+{
+  uint32_t ticket;
+  esp_mqtt_client_handle_t client = mqttClientAcquire(&ticket);
+  int size = client ? esp_mqtt_client_get_outbox_size(client) : 0;
+  mqttClientRelease(ticket);
+  return size;
+}
+
+void mqttErrorEventSend(const char* message, const char* object)
+{
+  mqttStatesSet(MQTTCLI_ERROR);
+  #if defined(CONFIG_MQTT_ERROR_QUEUE) && CONFIG_MQTT_ERROR_QUEUE
+    if (message && object) {
+      mqttErrorPush(MQTT_ERROR_RECORD, message, object);
+    } else {
+      mqttErrorPush(MQTT_ERROR_RECORD, "%s", message ? message : "");
+    };
+  #else
+    if (message) {
+      if (object) {
+        MQTT_STRING_BUFFER(err_buf);
+        char* err_msg = mqttStringf(err_buf, message, object);
+        if (err_msg) {
+          eventLoopPost(RE_MQTT_EVENTS, RE_MQTT_ERROR, (void*)err_msg, strlen(err_msg)+1, portMAX_DELAY);
+          mqttStringFree(err_msg);
+        };
+      } else {
+        eventLoopPost(RE_MQTT_EVENTS, RE_MQTT_ERROR, (void*)message, strlen(message)+1, portMAX_DELAY);
+      };
+    } else {
+      eventLoopPost(RE_MQTT_EVENTS, RE_MQTT_ERROR, nullptr, 0, portMAX_DELAY);
+    };
+  #endif // CONFIG_MQTT_ERROR_QUEUE
+}
+
+void mqttErrorEventSendCode(const char* message, const char* object, esp_err_t error_code)
+{
+  mqttStatesSet(MQTTCLI_ERROR);
+  if (message) {
+    #if defined(CONFIG_MQTT_ERROR_QUEUE) && CONFIG_MQTT_ERROR_QUEUE
+      if (object) {
+        mqttErrorPush(MQTT_ERROR_RECORD, message, object, error_code, esp_err_to_name(error_code));
+      } else {
+        mqttErrorPush(MQTT_ERROR_RECORD, message, error_code, esp_err_to_name(error_code));
+      };
+    #else
+      MQTT_STRING_BUFFER(err_buf);
+      char* err_msg = nullptr;
+      if (object) {
+        err_msg = mqttStringf(err_buf, message, object, error_code, esp_err_to_name(error_code));
+      } else {
+        err_msg = mqttStringf(err_buf, message, error_code, esp_err_to_name(error_code));
+      };
+      if (err_msg) {
+        eventLoopPost(RE_MQTT_EVENTS, RE_MQTT_ERROR, (void*)err_msg, strlen(err_msg)+1, portMAX_DELAY);
+        mqttStringFree(err_msg);
+      };
+    #endif // CONFIG_MQTT_ERROR_QUEUE
+  };
+}
+
+void mqttErrorEventClear()
+{
+  if (mqttStatesCheck(MQTTCLI_ERROR, true)) {
+    #if defined(CONFIG_MQTT_ERROR_QUEUE) && CONFIG_MQTT_ERROR_QUEUE
+      mqttErrorPushClear();
+    #else
+      eventLoopPost(RE_MQTT_EVENTS, RE_MQTT_ERROR_CLEAR, nullptr, 0, portMAX_DELAY);
+    #endif // CONFIG_MQTT_ERROR_QUEUE
+  };
+}
+
+// -----------------------------------------------------------------------------------------------------------------------
+// ----------------------------------------------------- Statistics ------------------------------------------------------
+// -----------------------------------------------------------------------------------------------------------------------
+
+// Counters are updated without locks; the snapshot may be slightly inconsistent between fields
+static re_mqtt_stats_t _mqttStats;
+static int64_t _mqttConnectedSince = 0;
+
+#define mqttStatsAdd(field, value) __atomic_add_fetch(&_mqttStats.field, value, __ATOMIC_RELAXED)
+#define mqttStatsSet(field, value) __atomic_store_n(&_mqttStats.field, value, __ATOMIC_RELAXED)
+
+static void mqttStatsMax(uint32_t* field, uint32_t value)
+{
+  uint32_t current = __atomic_load_n(field, __ATOMIC_RELAXED);
+  while ((value > current) && !__atomic_compare_exchange_n(field, &current, value, true, __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+}
+
+// Outage: from the loss of connection to the next established connection to any broker
+static int64_t _mqttOutageSince = 0;
+static bool _mqttOutagePrimary = true;
+static uint32_t _mqttOutageFailed = 0;
+static int64_t _mqttReservedSince = 0;
+// Handshake: from the start of the connection attempt (TCP, TLS if enabled, MQTT CONNECT) to CONNACK
+static int64_t _mqttHandshakeSince = 0;
+
+static void mqttStatsConnecting()
+{
+  _mqttHandshakeSince = esp_timer_get_time();
+}
+
+// Switch to the hot standby session: it is already established, there was no handshake at the moment of switching
+static void mqttStatsStandbySwitch()
+{
+  _mqttHandshakeSince = 0;
+  mqttStatsAdd(brokers[_mqttData.primary ? 0 : 1].standby_switches, 1);
+}
+
+// Returns the handshake time in ms, or -1 if the session was established without a handshake
+static int32_t mqttStatsConnected()
+{
+  int64_t now = esp_timer_get_time();
+  uint8_t role = _mqttData.primary ? 0 : 1;
+  int32_t handshake = -1;
+  mqttStatsAdd(brokers[role].connects, 1);
+  __atomic_store_n(&_mqttConnectedSince, now, __ATOMIC_RELAXED);
+  if (_mqttHandshakeSince > 0) {
+    handshake = (now - _mqttHandshakeSince) / 1000;
+    mqttStatsAdd(brokers[role].handshakes, 1);
+    mqttStatsSet(brokers[role].handshake_last_ms, (uint32_t)handshake);
+    mqttStatsMax(&_mqttStats.brokers[role].handshake_max_ms, (uint32_t)handshake);
+    _mqttHandshakeSince = 0;
+  };
+  if (_mqttOutageSince > 0) {
+    uint32_t duration = (now - _mqttOutageSince) / 1000;
+    mqttStatsAdd(outages, 1);
+    mqttStatsSet(outage_last_ms, duration);
+    mqttStatsMax(&_mqttStats.outage_max_ms, duration);
+    mqttStatsSet(outage_lost, __atomic_load_n(&_mqttStats.publish_failed, __ATOMIC_RELAXED) - _mqttOutageFailed);
+    if (_mqttOutagePrimary != _mqttData.primary) {
+      mqttStatsSet(failover_last_ms, duration);
+    };
+    _mqttOutageSince = 0;
+  };
+  if (_mqttData.primary) {
+    if (_mqttReservedSince > 0) {
+      mqttStatsSet(return_last_ms, (uint32_t)((now - _mqttReservedSince) / 1000));
+      _mqttReservedSince = 0;
+    };
+  } else if (_mqttReservedSince == 0) {
+    _mqttReservedSince = now;
+  };
+  return handshake;
+}
+
+static void mqttStatsDisconnected()
+{
+  int64_t since = __atomic_load_n(&_mqttConnectedSince, __ATOMIC_RELAXED);
+  if (since > 0) {
+    int64_t now = esp_timer_get_time();
+    uint8_t role = _mqttData.primary ? 0 : 1;
+    mqttStatsAdd(brokers[role].disconnects, 1);
+    mqttStatsAdd(brokers[role].connected_ms, (uint64_t)((now - since) / 1000));
+    __atomic_store_n(&_mqttConnectedSince, 0, __ATOMIC_RELAXED);
+    _mqttOutageSince = now;
+    _mqttOutagePrimary = _mqttData.primary;
+    _mqttOutageFailed = __atomic_load_n(&_mqttStats.publish_failed, __ATOMIC_RELAXED);
+  };
+}
+
+void mqttGetStats(re_mqtt_stats_t* stats)
+{
+  if (stats) {
+    memcpy(stats, &_mqttStats, sizeof(re_mqtt_stats_t));
+    // 64-bit counters may be torn by memcpy on a 32-bit core
+    for (uint8_t i = 0; i < 2; i++) {
+      stats->brokers[i].connected_ms = __atomic_load_n(&_mqttStats.brokers[i].connected_ms, __ATOMIC_RELAXED);
+    };
+    // Add the current session
+    int64_t since = __atomic_load_n(&_mqttConnectedSince, __ATOMIC_RELAXED);
+    if (since > 0) {
+      stats->brokers[_mqttData.primary ? 0 : 1].connected_ms += (esp_timer_get_time() - since) / 1000;
+    };
+  };
+}
+
+#if defined(CONFIG_MQTT_STATS_INTERVAL) && (CONFIG_MQTT_STATS_INTERVAL > 0)
+
+#ifndef CONFIG_MQTT_STATS_TOPIC
+  #define CONFIG_MQTT_STATS_TOPIC "mqtt"
+#endif // CONFIG_MQTT_STATS_TOPIC
+#ifndef CONFIG_MQTT_STATS_LOCAL
+  #define CONFIG_MQTT_STATS_LOCAL 0
+#endif // CONFIG_MQTT_STATS_LOCAL
+#ifndef CONFIG_MQTT_STATS_QOS
+  #define CONFIG_MQTT_STATS_QOS 0
+#endif // CONFIG_MQTT_STATS_QOS
+#ifndef CONFIG_MQTT_STATS_RETAINED
+  #define CONFIG_MQTT_STATS_RETAINED 0
+#endif // CONFIG_MQTT_STATS_RETAINED
+
+static esp_timer_handle_t _mqttStatsTimer = nullptr;
+#if CONFIG_MQTT_ZERO_HEAP
+  static char _mqttStatsTopic[2][CONFIG_MQTT_TOPIC_MAX_LEN];
+  static char _mqttStatsJson[1024];
+#endif // CONFIG_MQTT_ZERO_HEAP
+
+static void mqttStatsTimerExec(void* arg)
+{
+  if (mqttStatesCheck(MQTTCLI_CONNECTED, false)) {
+    re_mqtt_stats_t stats;
+    mqttGetStats(&stats);
+    #if CONFIG_MQTT_ZERO_HEAP
+      char* topic = _mqttStatsTopic[_mqttData.primary ? 0 : 1];
+    #else
+      char* topic = mqttGetTopicDevice1(_mqttData.primary, CONFIG_MQTT_STATS_LOCAL, CONFIG_MQTT_STATS_TOPIC);
+    #endif // CONFIG_MQTT_ZERO_HEAP
+    char* payload = mqttStringf(_mqttStatsJson,
+      "{\"publish_ok\":%" PRIu32 ",\"publish_failed\":%" PRIu32 ",\"bytes_out\":%" PRIu64 ",\"bytes_in\":%" PRIu64 ",\"received\":%" PRIu32 ","
+      "\"outbox_max\":%" PRIu32 ",\"incoming_bytes\":%" PRIu32 ",\"incoming_max\":%" PRIu32 ","
+      "\"outages\":%" PRIu32 ",\"outage_last\":%" PRIu32 ",\"outage_max\":%" PRIu32 ",\"outage_lost\":%" PRIu32 ","
+      "\"failover_last\":%" PRIu32 ",\"return_last\":%" PRIu32 ","
+      "\"primary\":{\"connects\":%" PRIu32 ",\"disconnects\":%" PRIu32 ",\"failovers\":%" PRIu32 ",\"connected\":%" PRIu64 ","
+      "\"handshakes\":%" PRIu32 ",\"handshake_last\":%" PRIu32 ",\"handshake_max\":%" PRIu32 ",\"standby_switches\":%" PRIu32 "},"
+      "\"reserved\":{\"connects\":%" PRIu32 ",\"disconnects\":%" PRIu32 ",\"failovers\":%" PRIu32 ",\"connected\":%" PRIu64 ","
+      "\"handshakes\":%" PRIu32 ",\"handshake_last\":%" PRIu32 ",\"handshake_max\":%" PRIu32 ",\"standby_switches\":%" PRIu32 "}}",
+      stats.publish_ok, stats.publish_failed, stats.bytes_out, stats.bytes_in, stats.received,
+      stats.outbox_max, stats.incoming_bytes, stats.incoming_max,
+      stats.outages, stats.outage_last_ms, stats.outage_max_ms, stats.outage_lost,
+      stats.failover_last_ms, stats.return_last_ms,
+      stats.brokers[0].connects, stats.brokers[0].disconnects, stats.brokers[0].failovers, stats.brokers[0].connected_ms / 1000,
+      stats.brokers[0].handshakes, stats.brokers[0].handshake_last_ms, stats.brokers[0].handshake_max_ms, stats.brokers[0].standby_switches,
+      stats.brokers[1].connects, stats.brokers[1].disconnects, stats.brokers[1].failovers, stats.brokers[1].connected_ms / 1000,
+      stats.brokers[1].handshakes, stats.brokers[1].handshake_last_ms, stats.brokers[1].handshake_max_ms, stats.brokers[1].standby_switches);
+    if (topic && topic[0] && payload) {
+      mqttPublish(topic, payload, CONFIG_MQTT_STATS_QOS, CONFIG_MQTT_STATS_RETAINED, MQTT_STRING_OWNED, MQTT_STRING_OWNED);
+    } else {
+      mqttStringFree(topic);
+      mqttStringFree(payload);
+    };
+  };
+}
+
+bool mqttStatsInit()
+{
+  if (_mqttStatsTimer == nullptr) {
+    #if CONFIG_MQTT_ZERO_HEAP
+      if (!mqttTopicStaticCreate(_mqttStatsTopic, CONFIG_MQTT_STATS_LOCAL, CONFIG_MQTT_STATS_TOPIC)) return false;
+    #endif // CONFIG_MQTT_ZERO_HEAP
+    esp_timer_create_args_t cfg;
+    memset(&cfg, 0, sizeof(cfg));
+    cfg.name = "mqtt_stats";
+    cfg.skip_unhandled_events = true;
+    cfg.callback = mqttStatsTimerExec;
+    RE_OK_CHECK(esp_timer_create(&cfg, &_mqttStatsTimer), return false);
+    RE_OK_CHECK(esp_timer_start_periodic(_mqttStatsTimer, (uint64_t)CONFIG_MQTT_STATS_INTERVAL * 1000000ULL), return false);
+  };
+  return true;
+}
+
+void mqttStatsFree()
+{
+  if (_mqttStatsTimer) {
+    if (esp_timer_is_active(_mqttStatsTimer)) {
+      esp_timer_stop(_mqttStatsTimer);
+    };
+    esp_timer_delete(_mqttStatsTimer);
+    _mqttStatsTimer = nullptr;
+  };
+}
+
+#else
+
+bool mqttStatsInit()
+{
+  return true;
+}
+
+void mqttStatsFree()
+{
+}
+
+#endif // CONFIG_MQTT_STATS_INTERVAL
+
+// -----------------------------------------------------------------------------------------------------------------------
+// -------------------------------------------------- Publish latency ----------------------------------------------------
+// -----------------------------------------------------------------------------------------------------------------------
+
+#if defined(CONFIG_MQTT_LATENCY_STATS) && CONFIG_MQTT_LATENCY_STATS
+
+#ifndef CONFIG_MQTT_LATENCY_PENDING
+  #define CONFIG_MQTT_LATENCY_PENDING 32
+#endif // CONFIG_MQTT_LATENCY_PENDING
+#ifndef CONFIG_MQTT_LATENCY_CLASSES
+  #define CONFIG_MQTT_LATENCY_CLASSES 4
+#endif // CONFIG_MQTT_LATENCY_CLASSES
+
+#define MQTT_LATENCY_HISTS (CONFIG_MQTT_LATENCY_CLASSES + 1)
+
+// Message waiting for acknowledgment. The acknowledgment may be processed by the client task
+// before the publishing task records the identifier, then the entry stores the time of the acknowledgment
+typedef struct {
+  int64_t  time;
+  int      msg_id;
+  uint8_t  hist;
+  bool     acked;
+  bool     used;
+} re_mqtt_latency_pending_t;
+
+static portMUX_TYPE _mqttLatencyLock = portMUX_INITIALIZER_UNLOCKED;
+static re_mqtt_latency_pending_t _mqttLatencyPending[CONFIG_MQTT_LATENCY_PENDING];
+static re_mqtt_latency_hist_t _mqttLatencyHists[2][MQTT_LATENCY_HISTS];
+static char* _mqttLatencyClasses[CONFIG_MQTT_LATENCY_CLASSES];
+static uint32_t _mqttLatencyClassReserved = 0;  // Slots taken by mqttLatencyClassAdd()
+static uint32_t _mqttLatencyClassCount = 0;     // Slots that are filled and visible to readers
+
+int mqttLatencyClassAdd(const char* filter)
+{
+  if (filter == nullptr) return -1;
+  // Each caller gets its own slot, so concurrent calls never write the same one
+  uint32_t index = __atomic_fetch_add(&_mqttLatencyClassReserved, 1, __ATOMIC_RELAXED);
+  if (index >= CONFIG_MQTT_LATENCY_CLASSES) return -1;
+  _mqttLatencyClasses[index] = malloc_string(filter);
+  if (_mqttLatencyClasses[index] == nullptr) {
+    rlog_e(logTAG, "Failed to allocate latency class filter \"%s\"", filter);
+  };
+  // Slots become visible in order: a caller waits until the previous slots are filled by other callers
+  uint32_t expected = index;
+  while (!__atomic_compare_exchange_n(&_mqttLatencyClassCount, &expected, index + 1, false, __ATOMIC_RELEASE, __ATOMIC_RELAXED)) {
+    expected = index;
+    vTaskDelay(1);
+  };
+  return _mqttLatencyClasses[index] ? index + 1 : -1;
+}
+
+static uint8_t mqttLatencyClassFind(const char* topic)
+{
+  uint32_t count = __atomic_load_n(&_mqttLatencyClassCount, __ATOMIC_ACQUIRE);
+  size_t topic_len = strlen(topic);
+  for (uint32_t i = 0; i < count; i++) {
+    if (_mqttLatencyClasses[i] && mqttTopicMatch(_mqttLatencyClasses[i], topic, topic_len)) return i + 1;
+  };
+  return 0;
+}
+
+// Must be called inside the critical section
+static void mqttLatencyRecord(uint8_t hist, int64_t latency_us)
+{
+  uint32_t ms = latency_us > 0 ? latency_us / 1000 : 0;
+  uint8_t bucket = ms > 0 ? 32 - __builtin_clz(ms) : 0;
+  if (bucket >= MQTT_LATENCY_BUCKETS) bucket = MQTT_LATENCY_BUCKETS - 1;
+  re_mqtt_latency_hist_t* h = &_mqttLatencyHists[_mqttData.primary ? 0 : 1][hist];
+  h->count++;
+  h->total_ms += ms;
+  if (ms > h->max_ms) h->max_ms = ms;
+  h->buckets[bucket]++;
+}
+
+// Must be called inside the critical section; an unused entry or else the oldest one
+static re_mqtt_latency_pending_t* mqttLatencySlot()
+{
+  re_mqtt_latency_pending_t* slot = &_mqttLatencyPending[0];
+  for (uint8_t i = 0; i < CONFIG_MQTT_LATENCY_PENDING; i++) {
+    if (!_mqttLatencyPending[i].used) return &_mqttLatencyPending[i];
+    if (_mqttLatencyPending[i].time < slot->time) slot = &_mqttLatencyPending[i];
+  };
+  return slot;
+}
+
+static void mqttLatencyStart(int msg_id, const char* topic, int64_t started)
+{
+  uint8_t hist = mqttLatencyClassFind(topic);
+  taskENTER_CRITICAL(&_mqttLatencyLock);
+  re_mqtt_latency_pending_t* slot = nullptr;
+  for (uint8_t i = 0; i < CONFIG_MQTT_LATENCY_PENDING; i++) {
+    if (_mqttLatencyPending[i].used && (_mqttLatencyPending[i].msg_id == msg_id)) {
+      slot = &_mqttLatencyPending[i];
+      break;
+    };
+  };
+  if (slot && slot->acked) {
+    mqttLatencyRecord(hist, slot->time - started);
+    slot->used = false;
+  } else {
+    if (slot == nullptr) slot = mqttLatencySlot();
+    slot->time = started;
+    slot->msg_id = msg_id;
+    slot->hist = hist;
+    slot->acked = false;
+    slot->used = true;
+  };
+  taskEXIT_CRITICAL(&_mqttLatencyLock);
+}
+
+static void mqttLatencyAck(int msg_id)
+{
+  int64_t now = esp_timer_get_time();
+  int64_t rtt_us = -1;
+  taskENTER_CRITICAL(&_mqttLatencyLock);
+  re_mqtt_latency_pending_t* slot = nullptr;
+  for (uint8_t i = 0; i < CONFIG_MQTT_LATENCY_PENDING; i++) {
+    if (_mqttLatencyPending[i].used && !_mqttLatencyPending[i].acked && (_mqttLatencyPending[i].msg_id == msg_id)) {
+      slot = &_mqttLatencyPending[i];
+      break;
+    };
+  };
+  if (slot) {
+    rtt_us = now - slot->time;
+    mqttLatencyRecord(slot->hist, rtt_us);
+    slot->used = false;
+  } else {
+    slot = mqttLatencySlot();
+    slot->time = now;
+    slot->msg_id = msg_id;
+    slot->hist = 0;
+    slot->acked = true;
+    slot->used = true;
+  };
+  taskEXIT_CRITICAL(&_mqttLatencyLock);
+  if (rtt_us >= 0) {
+    mqttBrokerRtt(rtt_us / 1000);
+  };
+}
+
+bool mqttLatencyGetHistogram(uint8_t topic_class, bool primary, re_mqtt_latency_hist_t* hist)
+{
+  if ((hist == nullptr) || (topic_class >= MQTT_LATENCY_HISTS)) return false;
+  taskENTER_CRITICAL(&_mqttLatencyLock);
+  memcpy(hist, &_mqttLatencyHists[primary ? 0 : 1][topic_class], sizeof(re_mqtt_latency_hist_t));
+  taskEXIT_CRITICAL(&_mqttLatencyLock);
+  return true;
+}
+
+size_t mqttLatencyExport(void* buffer, size_t size)
+{
+  size_t required = sizeof(_mqttLatencyHists);
+  if (buffer && (size >= required)) {
+    taskENTER_CRITICAL(&_mqttLatencyLock);
+    memcpy(buffer, _mqttLatencyHists, required);
+    taskEXIT_CRITICAL(&_mqttLatencyLock);
+  };
+  return required;
+}
+
+char* mqttLatencyExportJson()
+{
+  static re_mqtt_latency_hist_t hists[2][MQTT_LATENCY_HISTS];
+  mqttLatencyExport(hists, sizeof(hists));
+  // Each histogram takes no more than 96 characters for the fields and 11 characters per bucket
+  size_t size = 32 + 2 * MQTT_LATENCY_HISTS * (96 + 11 * MQTT_LATENCY_BUCKETS);
+  char* json = (char*)esp_calloc(1, size);
+  if (json == nullptr) return nullptr;
+  size_t len = 0;
+  for (uint8_t broker = 0; broker < 2; broker++) {
+    len += snprintf(json + len, size - len, broker ? ",\"reserved\":[" : "{\"primary\":[");
+    for (uint8_t i = 0; i < MQTT_LATENCY_HISTS; i++) {
+      re_mqtt_latency_hist_t* h = &hists[broker][i];
+      len += snprintf(json + len, size - len, "%s{\"count\":%" PRIu32 ",\"max\":%" PRIu32 ",\"total\":%" PRIu64 ",\"buckets\":[",
+        i ? "," : "", h->count, h->max_ms, h->total_ms);
+      for (uint8_t b = 0; b < MQTT_LATENCY_BUCKETS; b++) {
+        len += snprintf(json + len, size - len, b ? ",%" PRIu32 : "%" PRIu32, h->buckets[b]);
+      };
+      len += snprintf(json + len, size - len, "]}");
+    };
+    len += snprintf(json + len, size - len, "]");
+  };
+  snprintf(json + len, size - len, "}");
+  return json;
+}
+
+#else
+
+int mqttLatencyClassAdd(const char* filter)
+{
+  return -1;
+}
+
+static void mqttLatencyStart(int msg_id, const char* topic, int64_t started)
+{
+}
+
+static void mqttLatencyAck(int msg_id)
+{
+}
+
+bool mqttLatencyGetHistogram(uint8_t topic_class, bool primary, re_mqtt_latency_hist_t* hist)
+{
+  return false;
+}
+
+size_t mqttLatencyExport(void* buffer, size_t size)
+{
+  return 0;
+}
+
+char* mqttLatencyExportJson()
+{
+  return nullptr;
+}
+
+#endif // CONFIG_MQTT_LATENCY_STATS
+
+// -----------------------------------------------------------------------------------------------------------------------
+// -------------------------------------------------- Fault injection ----------------------------------------------------
+// -----------------------------------------------------------------------------------------------------------------------
+
+#if defined(CONFIG_MQTT_FAULT_INJECTION) && CONFIG_MQTT_FAULT_INJECTION
+
+#if ESP_IDF_VERSION_MAJOR < 5
+  #include "esp_system.h"
+#else
+  #include "esp_random.h"
+#endif // ESP_IDF_VERSION_MAJOR
+
+static re_mqtt_faults_t _mqttFaults[2];
+
+static re_mqtt_faults_t* mqttFaultsCurrent()
+{
+  return &_mqttFaults[_mqttData.primary ? 0 : 1];
+}
+
+void mqttFaultSet(bool primary, const re_mqtt_faults_t* faults)
+{
+  if (faults) {
+    memcpy(&_mqttFaults[primary ? 0 : 1], faults, sizeof(re_mqtt_faults_t));
+    #if !CONFIG_MQTT_PUBLISH_QUEUE
+      // The delay is applied by the sender task, without it the caller would be blocked instead of the delivery
+      if (faults->latency_ms > 0) {
+        _mqttFaults[primary ? 0 : 1].latency_ms = 0;
+        rlog_e(logTAG, "Fault injection: latency requires CONFIG_MQTT_PUBLISH_QUEUE and is ignored");
+      };
+    #endif // CONFIG_MQTT_PUBLISH_QUEUE
+  } else {
+    memset(&_mqttFaults[primary ? 0 : 1], 0, sizeof(re_mqtt_faults_t));
+  };
+  rlog_w(logTAG, "Fault injection for %s broker: refuse=%d, drop=%d%%, latency=%d ms", 
+    primary ? "primary" : "reserved", _mqttFaults[primary ? 0 : 1].refuse_connect, 
+    _mqttFaults[primary ? 0 : 1].drop_percent, _mqttFaults[primary ? 0 : 1].latency_ms);
+}
+
+bool mqttFaultReset()
+{
+  bool ret = false;
+  uint32_t ticket;
+  esp_mqtt_client_handle_t client = mqttClientAcquire(&ticket);
+  if (client && mqttStatesCheck(MQTTCLI_CONNECTED, false)) {
+    rlog_w(logTAG, "Fault injection: connection reset");
+    ret = esp_mqtt_client_disconnect(client) == ESP_OK;
+  };
+  mqttClientRelease(ticket);
+  return ret;
+}
+
+// The broker "refuses" the connection: the session is closed as soon as it is established
+static bool mqttFaultRefuse()
+{
+  if (mqttFaultsCurrent()->refuse_connect) {
+    rlog_w(logTAG, "Fault injection: connection to [ %s : %d ] refused", _mqttData.host, _mqttData.port);
+    uint32_t ticket;
+    esp_mqtt_client_handle_t client = mqttClientAcquire(&ticket);
+    if (client) esp_mqtt_client_disconnect(client);
+    mqttClientRelease(ticket);
+    return true;
+  };
+  return false;
+}
+
+#if (defined(CONFIG_MQTT_RATE_LIMIT) && CONFIG_MQTT_RATE_LIMIT) || (defined(CONFIG_MQTT_PUBLISH_QUEUE) && CONFIG_MQTT_PUBLISH_QUEUE)
+// Called by the sender task: the message is delivered no earlier than latency_ms after it was queued
+static void mqttFaultDelay(int64_t queued)
+{
+  uint32_t latency_ms = mqttFaultsCurrent()->latency_ms;
+  if (latency_ms > 0) {
+    int64_t wait = queued + (int64_t)latency_ms * 1000 - esp_timer_get_time();
+    if (wait > 0) vTaskDelay(pdMS_TO_TICKS(wait / 1000) + 1);
+  };
+}
+#endif // CONFIG_MQTT_RATE_LIMIT || CONFIG_MQTT_PUBLISH_QUEUE
+
+static esp_err_t mqttFaultPublish()
+{
+  re_mqtt_faults_t* faults = mqttFaultsCurrent();
+  if ((faults->drop_percent > 0) && ((esp_random() % 100) < faults->drop_percent)) {
+    return ESP_FAIL;
+  };
+  return ESP_OK;
+}
+
+#else
+
+static bool mqttFaultRefuse()
+{
+  return false;
+}
+
+#if (defined(CONFIG_MQTT_RATE_LIMIT) && CONFIG_MQTT_RATE_LIMIT) || (defined(CONFIG_MQTT_PUBLISH_QUEUE) && CONFIG_MQTT_PUBLISH_QUEUE)
+static void mqttFaultDelay(int64_t queued)
+{
+}
+#endif // CONFIG_MQTT_RATE_LIMIT || CONFIG_MQTT_PUBLISH_QUEUE
+
+static esp_err_t mqttFaultPublish()
+{
+  return ESP_OK;
+}
+
+#endif // CONFIG_MQTT_FAULT_INJECTION
+
+// -----------------------------------------------------------------------------------------------------------------------
+// ------------------------------------------------ Publish system status ------------------------------------------------
+// -----------------------------------------------------------------------------------------------------------------------
+
+#if CONFIG_MQTT_STATUS_LWT || CONFIG_MQTT_STATUS_ONLINE || CONFIG_MQTT_STATUS_ONLINE_SYSINFO
+
+static char* _mqttTopicStatus = nullptr;
+#if CONFIG_MQTT_ZERO_HEAP
+  static char _mqttTopicStatusStatic[2][CONFIG_MQTT_TOPIC_MAX_LEN];
+#endif // CONFIG_MQTT_ZERO_HEAP
+
+bool mqttTopicStatusInit()
+{
+  #if CONFIG_MQTT_ZERO_HEAP
+    return mqttTopicStaticCreate(_mqttTopicStatusStatic, CONFIG_MQTT_STATUS_LOCAL, CONFIG_MQTT_STATUS_TOPIC);
+  #else
+    return true;
+  #endif // CONFIG_MQTT_ZERO_HEAP
+}
+
+// In zero heap mode, the topic is one of the strings generated during initialization
+static char* mqttTopicStatusMake(const bool primary)
+{
+  #if CONFIG_MQTT_ZERO_HEAP
+    return _mqttTopicStatusStatic[primary ? 0 : 1];
+  #else
+    return mqttGetTopicDevice1(primary, CONFIG_MQTT_STATUS_LOCAL, CONFIG_MQTT_STATUS_TOPIC);
+  #endif // CONFIG_MQTT_ZERO_HEAP
+}
+
+char* mqttTopicStatusCreate(const bool primary)
+{
+  mqttStringFree(_mqttTopicStatus);
+  _mqttTopicStatus = mqttTopicStatusMake(primary);
+  if (_mqttTopicStatus) {
+    rlog_i(logTAG, "Generated topic for publishing system status: [ %s ]", _mqttTopicStatus);
+  } else {
+    rlog_i(logTAG, "Failed to denerate topic for publishing system status");
+  };
+  return _mqttTopicStatus;
+}
+
+char* mqttTopicStatusGet()
+{
+  if (!_mqttTopicStatus) {
+    if (mqttStatesCheck(MQTTCLI_CONNECTED, false)) {
+      mqttTopicStatusCreate(_mqttData.primary);
+    };
+  };
+  return _mqttTopicStatus;
+}
+
+void mqttTopicStatusFree()
+{
+  mqttStringFree(_mqttTopicStatus);
+  _mqttTopicStatus = nullptr;
+  rlog_d(logTAG, "Topic for publishing system status has been scrapped");
+}
+
+#else
+
+bool mqttTopicStatusInit()
+{
+  return true;
+}
+
+#endif // CONFIG_MQTT_STATUS_LWT || CONFIG_MQTT_STATUS_ONLINE || CONFIG_MQTT_STATUS_ONLINE_SYSINFO
+
+// -----------------------------------------------------------------------------------------------------------------------
+// -------------------------------------------------- Server selection ---------------------------------------------------
+// -----------------------------------------------------------------------------------------------------------------------
+
+// Connect to server with new parameters
+bool mqttServer1isLocal()
+{
+  return CONFIG_MQTT1_TYPE > 0;
+}
+
+bool mqttServer1Enabled()
+{
+  return mqttStatesCheck(MQTTCLI_SERVER1_AVAILABLED, false) && (mqttServer1isLocal() || mqttStatesCheck(MQTTCLI_INET_AVAILABLED, false));
+}
+
+#ifdef CONFIG_MQTT2_TYPE
+
+bool mqttServer2isLocal()
+{
+  return CONFIG_MQTT2_TYPE > 0;
+}
+
+bool mqttServer2Enabled()
+{
+  return mqttStatesCheck(MQTTCLI_SERVER2_AVAILABLED, false) && (mqttServer2isLocal() || mqttStatesCheck(MQTTCLI_INET_AVAILABLED, false));
+}
+
+bool mqttServer1Activate()
+{
+  if (mqttStatesCheck(MQTTCLI_SERVER2_ACTIVE, false) || (_mqttClient == nullptr) || !mqttStatesCheck(MQTTCLI_STARTED, false)) {
+    rlog_i(logTAG, "Primary MQTT broker selected");
+    if (mqttStatesCheck(MQTTCLI_SERVER2_ACTIVE, false)) {
+      mqttStatsAdd(brokers[0].failovers, 1);
+    };
+    mqttBackToPrimaryTimerStop();
+    mqttStatesClear(MQTTCLI_SERVER2_ACTIVE);
+    if (_mqttClient) {
+      if (mqttStatesCheck(MQTTCLI_STARTED, false)) {
+        // The client is already running - can only be restarted through the event loop (from another task)
+        return eventLoopPost(RE_MQTT_EVENTS, RE_MQTT_SERVER_PRIMARY, nullptr, 0, portMAX_DELAY);
+      } else {
+        // The client is not running yet - you can just run it from this task
+        return mqttClientRestart() == ESP_OK;
+      };
+    } else {
+      // The client has not yet been created
+      return mqttClientCreate() == ESP_OK;
+    };
+  };
+  return true;
+}
+
+bool mqttServer2Activate()
+{
+  if (!mqttStatesCheck(MQTTCLI_SERVER2_ACTIVE, false) || (_mqttClient == nullptr) || !mqttStatesCheck(MQTTCLI_STARTED, false)) {
+    rlog_i(logTAG, "Reserved MQTT broker selected");
+    if (!mqttStatesCheck(MQTTCLI_SERVER2_ACTIVE, false) && (_mqttClient != nullptr)) {
+      mqttStatsAdd(brokers[1].failovers, 1);
+    };
+    mqttBackToPrimaryTimerStart();
+    mqttStatesSet(MQTTCLI_SERVER2_ACTIVE);
+    if (_mqttClient) {
+      if (mqttStatesCheck(MQTTCLI_STARTED, false)) {
+        // The client is already running - can only be restarted through the event loop (from another task)
+        return eventLoopPost(RE_MQTT_EVENTS, RE_MQTT_SERVER_RESERVED, nullptr, 0, portMAX_DELAY);
+      } else {
+        // The client is not running yet - you can just run it from this task
+        return mqttClientRestart() == ESP_OK;
+      };
+    } else {
+      // The client has not yet been created
+      return mqttClientCreate() == ESP_OK;
+    };
+  };
+  return true;
+}
+
+// Setting network availability and starting the client, depending on which server is currently available
+bool mqttServerSelectAuto()
+{
+  if (mqttServer1Enabled()) {
     return mqttServer1Activate();
   } else {
-    if (mqttServer2Enabled()) {
-      return mqttServer2Activate();
+    if (mqttServer2Enabled()) {
+      return mqttServer2Activate();
+    } else {
+      if (_mqttClient && mqttStatesCheck(MQTTCLI_STARTED, false)) {
+        // Send event to suspend service
+        return eventLoopPost(RE_MQTT_EVENTS, RE_MQTT_SELF_STOP, nullptr, 0, portMAX_DELAY);
+      };
+    };
+  };
+  return false;
+}
+
+// Server status change (by ping)
+bool mqttServer2SetAvailable(bool newAvailable)
+{
+  if (mqttStatesCheck(MQTTCLI_SERVER2_AVAILABLED, false) != newAvailable) {
+    mqttStatesSetBit(MQTTCLI_SERVER2_AVAILABLED, newAvailable);
+    return mqttServerSelectAuto();
+  };
+  return false;
+}
+
+#else
+
+bool mqttServerSelectAuto()
+{
+  if (mqttServer1Enabled()) {
+    mqttStatesClear(MQTTCLI_SERVER2_ACTIVE);
+    if (_mqttClient) {
+      // The client is not running yet - you can just run it from this task
+      return mqttClientRestart() == ESP_OK;
+    } else {
+      // The client has not yet been created
+      return mqttClientCreate() == ESP_OK;
+    };
+  } else {
+    // Send event to suspend service
+    return eventLoopPost(RE_MQTT_EVENTS, RE_MQTT_SELF_STOP, nullptr, 0, portMAX_DELAY);
+  };
+}
+
+#endif // CONFIG_MQTT2_TYPE
+
+// Server status change (by ping)
+bool mqttServer1SetAvailable(bool newAvailable)
+{
+  if (mqttStatesCheck(MQTTCLI_SERVER1_AVAILABLED, false) != newAvailable) {
+    mqttStatesSetBit(MQTTCLI_SERVER1_AVAILABLED, newAvailable);
+    return mqttServerSelectAuto();
+  };
+  return false;
+}
+
+// Server status change (by internet)
+bool mqttServerSetInetAvailable(bool internetAvailable)
+{
+  mqttStatesSetBit(MQTTCLI_INET_AVAILABLED, internetAvailable);
+  return mqttServerSelectAuto();
+}
+
+// -----------------------------------------------------------------------------------------------------------------------
+// ----------------------------------------------------- Subscribe -------------------------------------------------------
+// -----------------------------------------------------------------------------------------------------------------------
+
+bool mqttSubscribe(const char *topic, int qos)
+{
+  if (mqttStatesCheck(MQTTCLI_CONNECTED, false) && (topic != nullptr)) {
+    uint32_t ticket;
+    esp_mqtt_client_handle_t client = mqttClientAcquire(&ticket);
+    int msg_id = client ? esp_mqtt_client_subscribe(client, topic, qos) : -1;
+    mqttClientRelease(ticket);
+    if (msg_id == -1) {
+      rlog_e(logTAG, "Failed to subscribe to topic \"%s\"", topic);
+      mqttErrorEventSend("Failed to subscribe to topic \"%s\"", topic);
+      return false;
+    };
+    rlog_i(logTAG, "Subscribed to: \"%s\"", topic);
+    return true;
+  };
+  return false;
+}
+
+bool mqttUnsubscribe(const char *topic)
+{
+  if (mqttStatesCheck(MQTTCLI_CONNECTED, false) && (topic != nullptr)) {
+    uint32_t ticket;
+    esp_mqtt_client_handle_t client = mqttClientAcquire(&ticket);
+    int msg_id = client ? esp_mqtt_client_unsubscribe(client, topic) : -1;
+    mqttClientRelease(ticket);
+    if (msg_id == -1) {
+      rlog_e(logTAG, "Failed to unsubscribe from topic \"%s\"", topic);
+      mqttErrorEventSend("Failed to unsubscribe from topic \"%s\"", topic);
+      return false;
+    };
+    rlog_i(logTAG, "Unsubscribed from: \"%s\"", topic);
+    return true;
+  };
+  return false;
+}
+
+// -----------------------------------------------------------------------------------------------------------------------
+// --------------------------------------------------- Message router ----------------------------------------------------
+// -----------------------------------------------------------------------------------------------------------------------
+
+#ifndef CONFIG_MQTT_ROUTE_MAX_MATCHES
+  #define CONFIG_MQTT_ROUTE_MAX_MATCHES 16
+#endif // CONFIG_MQTT_ROUTE_MAX_MATCHES
+
+typedef struct re_mqtt_route_entry_t {
+  re_mqtt_route_entry_t* next;
+  mqtt_message_handler_t handler;
+  void* arg;
+} re_mqtt_route_entry_t;
+
+// One node per filter level, "+" and "#" are stored as ordinary levels and checked during matching
+typedef struct re_mqtt_route_node_t {
+  re_mqtt_route_node_t* sibling;
+  re_mqtt_route_node_t* child;
+  re_mqtt_route_entry_t* entries;
+  size_t level_len;
+  char*  level;
+} re_mqtt_route_node_t;
+
+static re_mqtt_route_node_t _mqttRouteRoot = { nullptr, nullptr, nullptr, 0, nullptr };
+static uint32_t _mqttRouteCount = 0;
+static SemaphoreHandle_t _mqttRouteLock = nullptr;
+#if CONFIG_MQTT_STATIC_ALLOCATION
+  StaticSemaphore_t _mqttRouteLockBuffer;
+#endif // CONFIG_MQTT_STATIC_ALLOCATION
+
+// The mutex is created together with the other primitives in mqttTaskInit() and is kept with the routes until reboot
+static bool mqttRouterInit()
+{
+  if (_mqttRouteLock == nullptr) {
+    #if CONFIG_MQTT_STATIC_ALLOCATION
+      _mqttRouteLock = xSemaphoreCreateMutexStatic(&_mqttRouteLockBuffer);
+    #else
+      _mqttRouteLock = xSemaphoreCreateMutex();
+    #endif // CONFIG_MQTT_STATIC_ALLOCATION
+    if (_mqttRouteLock == nullptr) {
+      rlog_e(logTAG, "Failed to create router mutex!");
+    };
+  };
+  return _mqttRouteLock != nullptr;
+}
+
+static bool mqttRouterLock()
+{
+  if (_mqttRouteLock == nullptr) {
+    rlog_e(logTAG, "Router is not initialized, call mqttTaskStart() first!");
+    return false;
+  };
+  return xSemaphoreTake(_mqttRouteLock, portMAX_DELAY) == pdTRUE;
+}
+
+static void mqttRouterUnlock()
+{
+  xSemaphoreGive(_mqttRouteLock);
+}
+
+static bool mqttRouterExists()
+{
+  return _mqttRouteCount > 0;
+}
+
+static re_mqtt_route_node_t* mqttRouteNodeGet(re_mqtt_route_node_t* parent, const char* level, size_t level_len, bool create)
+{
+  re_mqtt_route_node_t* node = parent->child;
+  while (node) {
+    if ((node->level_len == level_len) && (memcmp(node->level, level, level_len) == 0)) {
+      return node;
+    };
+    node = node->sibling;
+  };
+  if (create) {
+    node = (re_mqtt_route_node_t*)esp_calloc(1, sizeof(re_mqtt_route_node_t) + level_len + 1);
+    if (node) {
+      node->level = (char*)node + sizeof(re_mqtt_route_node_t);
+      node->level_len = level_len;
+      memcpy(node->level, level, level_len);
+      node->sibling = parent->child;
+      parent->child = node;
+    };
+  };
+  return node;
+}
+
+bool mqttRouteAdd(const char* filter, mqtt_message_handler_t handler, void* arg)
+{
+  if ((filter == nullptr) || (handler == nullptr)) return false;
+  re_mqtt_route_entry_t* entry = (re_mqtt_route_entry_t*)esp_calloc(1, sizeof(re_mqtt_route_entry_t));
+  if (entry == nullptr) return false;
+  entry->handler = handler;
+  entry->arg = arg;
+  if (!mqttRouterLock()) {
+    free(entry);
+    return false;
+  };
+
+  re_mqtt_route_node_t* node = &_mqttRouteRoot;
+  const char* level = filter;
+  while (node) {
+    const char* delim = strchr(level, '/');
+    size_t level_len = delim ? (size_t)(delim - level) : strlen(level);
+    node = mqttRouteNodeGet(node, level, level_len, true);
+    if (delim == nullptr) break;
+    level = delim + 1;
+  };
+  if (node) {
+    entry->next = node->entries;
+    node->entries = entry;
+    _mqttRouteCount++;
+  };
+
+  mqttRouterUnlock();
+  if (node) {
+    rlog_d(logTAG, "Route added for \"%s\"", filter);
+    return true;
+  };
+  free(entry);
+  rlog_e(logTAG, "Failed to add route for \"%s\": out of memory", filter);
+  return false;
+}
+
+// Returns true if the node has become empty and can be deleted
+static bool mqttRouteRemoveLevel(re_mqtt_route_node_t* node, const char* level, mqtt_message_handler_t handler, void* arg)
+{
+  if (level == nullptr) {
+    re_mqtt_route_entry_t** prev = &node->entries;
+    while (*prev) {
+      if (((*prev)->handler == handler) && ((*prev)->arg == arg)) {
+        re_mqtt_route_entry_t* entry = *prev;
+        *prev = entry->next;
+        free(entry);
+        _mqttRouteCount--;
+        break;
+      };
+      prev = &(*prev)->next;
+    };
+  } else {
+    const char* delim = strchr(level, '/');
+    size_t level_len = delim ? (size_t)(delim - level) : strlen(level);
+    re_mqtt_route_node_t* child = mqttRouteNodeGet(node, level, level_len, false);
+    if (child && mqttRouteRemoveLevel(child, delim ? delim + 1 : nullptr, handler, arg)) {
+      re_mqtt_route_node_t** prev = &node->child;
+      while (*prev != child) prev = &(*prev)->sibling;
+      *prev = child->sibling;
+      free(child);
+    };
+  };
+  return (node != &_mqttRouteRoot) && (node->entries == nullptr) && (node->child == nullptr);
+}
+
+void mqttRouteRemove(const char* filter, mqtt_message_handler_t handler, void* arg)
+{
+  if ((filter != nullptr) && mqttRouterLock()) {
+    mqttRouteRemoveLevel(&_mqttRouteRoot, filter, handler, arg);
+    mqttRouterUnlock();
+  };
+}
+
+static void mqttRouteCollectEntries(re_mqtt_route_entry_t* entry, re_mqtt_route_entry_t* matches, uint8_t* count)
+{
+  while (entry && (*count < CONFIG_MQTT_ROUTE_MAX_MATCHES)) {
+    matches[(*count)++] = *entry;
+    entry = entry->next;
+  };
+}
+
+static void mqttRouteCollect(re_mqtt_route_node_t* node, const char* level, const char* end, bool has_level, bool system,
+  re_mqtt_route_entry_t* matches, uint8_t* count)
+{
+  const char* delim = nullptr;
+  size_t level_len = 0;
+  if (has_level) {
+    delim = (const char*)memchr(level, '/', end - level);
+    level_len = delim ? (size_t)(delim - level) : (size_t)(end - level);
+  } else {
+    // The whole topic has been matched
+    mqttRouteCollectEntries(node->entries, matches, count);
+  };
+
+  re_mqtt_route_node_t* child = node->child;
+  while (child) {
+    if ((child->level_len == 1) && (child->level[0] == '#')) {
+      // "a/#" matches "a" and any topic below it
+      if (!system) mqttRouteCollectEntries(child->entries, matches, count);
+    } else if ((child->level_len == 1) && (child->level[0] == '+')) {
+      if (has_level && !system) mqttRouteCollect(child, delim ? delim + 1 : end, end, delim != nullptr, false, matches, count);
+    } else if (has_level && (child->level_len == level_len) && (memcmp(child->level, level, level_len) == 0)) {
+      mqttRouteCollect(child, delim ? delim + 1 : end, end, delim != nullptr, false, matches, count);
+    };
+    child = child->sibling;
+  };
+}
+
+static uint8_t mqttRouterDispatch(re_mqtt_message_t* message)
+{
+  re_mqtt_route_entry_t matches[CONFIG_MQTT_ROUTE_MAX_MATCHES];
+  uint8_t count = 0;
+  if (mqttRouterExists() && mqttRouterLock()) {
+    // Topics starting with "$" are not matched by wildcards at the first level
+    mqttRouteCollect(&_mqttRouteRoot, message->topic, message->topic + message->topic_len, true, 
+      message->topic[0] == '$', matches, &count);
+    mqttRouterUnlock();
+  };
+  // Handlers are called outside the lock, so they can add or remove routes
+  for (uint8_t i = 0; i < count; i++) {
+    matches[i].handler(message, matches[i].arg);
+  };
+  return count;
+}
+
+// -----------------------------------------------------------------------------------------------------------------------
+// -------------------------------------------------- Incoming messages --------------------------------------------------
+// -----------------------------------------------------------------------------------------------------------------------
+
+#ifndef CONFIG_MQTT_MESSAGE_HANDLERS
+  #define CONFIG_MQTT_MESSAGE_HANDLERS 8
+#endif // CONFIG_MQTT_MESSAGE_HANDLERS
+
+// Repost incoming messages to the main event loop (RE_MQTT_INCOMING_DATA)
+#ifndef CONFIG_MQTT_INCOMING_EVENT_POST
+  #if CONFIG_MQTT_ZERO_HEAP
+    // Reposted buffers always come from the heap
+    #define CONFIG_MQTT_INCOMING_EVENT_POST 0
+  #else
+    #define CONFIG_MQTT_INCOMING_EVENT_POST 1
+  #endif // CONFIG_MQTT_ZERO_HEAP
+#endif // CONFIG_MQTT_INCOMING_EVENT_POST
+
+// Reposted buffers belong to the recipient, which releases them with free(); by default they remain owned by the library
+// and are released when the next message arrives
+#ifndef CONFIG_MQTT_INCOMING_EVENT_OWNED
+  #define CONFIG_MQTT_INCOMING_EVENT_OWNED 0
+#endif // CONFIG_MQTT_INCOMING_EVENT_OWNED
+
+// Also repost messages that have already been delivered to at least one handler (a copy is made for the event loop);
+// firmware in which all recipients have moved to handlers can disable it to avoid the copy
+#ifndef CONFIG_MQTT_INCOMING_EVENT_POST_HANDLED
+  #define CONFIG_MQTT_INCOMING_EVENT_POST_HANDLED 1
+#endif // CONFIG_MQTT_INCOMING_EVENT_POST_HANDLED
+
+typedef struct {
+  mqtt_message_handler_t handler;
+  void* arg;
+} re_mqtt_message_handler_t;
+
+static re_mqtt_message_handler_t _mqttMsgHandlers[CONFIG_MQTT_MESSAGE_HANDLERS];
+static uint8_t _mqttMsgHandlersCount = 0;
+static re_mqtt_message_stats_t _mqttMsgStats = { 0, 0, 0, 0, 0, 0 };
+static portMUX_TYPE _mqttMsgLock = portMUX_INITIALIZER_UNLOCKED;
+
+bool mqttMessageHandlerRegister(mqtt_message_handler_t handler, void* arg)
+{
+  bool ret = false;
+  if (handler) {
+    taskENTER_CRITICAL(&_mqttMsgLock);
+    if (_mqttMsgHandlersCount < CONFIG_MQTT_MESSAGE_HANDLERS) {
+      _mqttMsgHandlers[_mqttMsgHandlersCount].handler = handler;
+      _mqttMsgHandlers[_mqttMsgHandlersCount].arg = arg;
+      _mqttMsgHandlersCount++;
+      ret = true;
+    };
+    taskEXIT_CRITICAL(&_mqttMsgLock);
+    if (!ret) {
+      rlog_e(logTAG, "Failed to register message handler: limit of %d handlers reached", CONFIG_MQTT_MESSAGE_HANDLERS);
+    };
+  };
+  return ret;
+}
+
+void mqttMessageHandlerUnregister(mqtt_message_handler_t handler, void* arg)
+{
+  taskENTER_CRITICAL(&_mqttMsgLock);
+  for (uint8_t i = 0; i < _mqttMsgHandlersCount; i++) {
+    if ((_mqttMsgHandlers[i].handler == handler) && (_mqttMsgHandlers[i].arg == arg)) {
+      _mqttMsgHandlersCount--;
+      for (uint8_t j = i; j < _mqttMsgHandlersCount; j++) {
+        _mqttMsgHandlers[j] = _mqttMsgHandlers[j+1];
+      };
+      break;
+    };
+  };
+  taskEXIT_CRITICAL(&_mqttMsgLock);
+}
+
+static bool mqttMessageHandlersExists()
+{
+  return (_mqttMsgHandlersCount > 0) || mqttRouterExists();
+}
+
+// The message header, topic and payload are placed in one buffer
+static re_mqtt_message_t* mqttMessageCreate(const char* topic, size_t topic_len, size_t data_len)
+{
+  re_mqtt_message_t* message = (re_mqtt_message_t*)mqttBufferAlloc(sizeof(re_mqtt_message_t) + topic_len + data_len + 2);
+  if (message) {
+    message->refs = 1;
+    message->topic = (char*)message + sizeof(re_mqtt_message_t);
+    message->topic_len = topic_len;
+    memcpy(message->topic, topic, topic_len);
+    message->topic[topic_len] = 0;
+    message->data = message->topic + topic_len + 1;
+    message->data_len = data_len;
+    message->data[data_len] = 0;
+    taskENTER_CRITICAL(&_mqttMsgLock);
+    _mqttMsgStats.created++;
+    _mqttMsgStats.live++;
+    if (_mqttMsgStats.live > _mqttMsgStats.live_max) {
+      _mqttMsgStats.live_max = _mqttMsgStats.live;
+    };
+    taskEXIT_CRITICAL(&_mqttMsgLock);
+  };
+  return message;
+}
+
+re_mqtt_message_t* mqttMessageRetain(re_mqtt_message_t* message)
+{
+  if (message) {
+    __atomic_add_fetch(&message->refs, 1, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&_mqttMsgStats.retains, 1, __ATOMIC_RELAXED);
+  };
+  return message;
+}
+
+void mqttMessageRelease(re_mqtt_message_t* message)
+{
+  if (message && (__atomic_sub_fetch(&message->refs, 1, __ATOMIC_ACQ_REL) == 0)) {
+    mqttBufferFree(message);
+    taskENTER_CRITICAL(&_mqttMsgLock);
+    _mqttMsgStats.released++;
+    _mqttMsgStats.live--;
+    taskEXIT_CRITICAL(&_mqttMsgLock);
+  };
+}
+
+// Every handler receives the same message; a handler that needs it after returning must call mqttMessageRetain()
+static uint32_t mqttMessageDispatch(re_mqtt_message_t* message)
+{
+  re_mqtt_message_handler_t handlers[CONFIG_MQTT_MESSAGE_HANDLERS];
+  taskENTER_CRITICAL(&_mqttMsgLock);
+  uint8_t count = _mqttMsgHandlersCount;
+  memcpy(handlers, _mqttMsgHandlers, count * sizeof(re_mqtt_message_handler_t));
+  taskEXIT_CRITICAL(&_mqttMsgLock);
+
+  for (uint8_t i = 0; i < count; i++) {
+    handlers[i].handler(message, handlers[i].arg);
+  };
+  uint32_t delivered = count + mqttRouterDispatch(message);
+  __atomic_add_fetch(&_mqttMsgStats.deliveries, delivered, __ATOMIC_RELAXED);
+  return delivered;
+}
+
+void mqttMessageGetStats(re_mqtt_message_stats_t* stats)
+{
+  if (stats) {
+    taskENTER_CRITICAL(&_mqttMsgLock);
+    memcpy(stats, &_mqttMsgStats, sizeof(re_mqtt_message_stats_t));
+    taskEXIT_CRITICAL(&_mqttMsgLock);
+  };
+}
+
+// Buffers reposted to the main event loop are always allocated on the heap (not from the pool),
+// so that with CONFIG_MQTT_INCOMING_EVENT_OWNED the recipient can release them with free()
+static bool mqttIncomingAlloc(re_mqtt_incoming_data_t* buffer, const char* topic, int topic_len, int data_len)
+{
+  buffer->topic = malloc_stringl(topic, topic_len);
+  buffer->data = (char*)esp_calloc(1, data_len+1);
+  if (buffer->topic && buffer->data) {
+    buffer->topic_len = topic_len;
+    return true;
+  };
+  if (buffer->topic) free(buffer->topic);
+  if (buffer->data) free(buffer->data);
+  memset(buffer, 0, sizeof(re_mqtt_incoming_data_t));
+  return false;
+}
+
+// Without CONFIG_MQTT_INCOMING_EVENT_OWNED the buffers stay in place and are released when the next message starts
+static bool mqttIncomingPost(re_mqtt_incoming_data_t* buffer)
+{
+  bool ret = eventLoopPost(RE_MQTT_EVENTS, RE_MQTT_INCOMING_DATA, buffer, sizeof(re_mqtt_incoming_data_t), portMAX_DELAY);
+  if (!ret) {
+    rlog_e(logTAG, "Failed to repost incoming message \"%s\"", buffer->topic);
+  };
+  #if CONFIG_MQTT_INCOMING_EVENT_OWNED
+    if (!ret) {
+      // The message did not reach the recipient, so the buffers are still ours
+      free(buffer->topic);
+      free(buffer->data);
+    };
+    memset(buffer, 0, sizeof(re_mqtt_incoming_data_t));
+  #endif // CONFIG_MQTT_INCOMING_EVENT_OWNED
+  return ret;
+}
+
+// -----------------------------------------------------------------------------------------------------------------------
+// ------------------------------------------------- Streaming delivery --------------------------------------------------
+// -----------------------------------------------------------------------------------------------------------------------
+
+#ifndef CONFIG_MQTT_STREAM_HANDLERS
+  #define CONFIG_MQTT_STREAM_HANDLERS 4
+#endif // CONFIG_MQTT_STREAM_HANDLERS
+
+typedef struct {
+  char* filter;
+  mqtt_stream_handler_t handler;
+  void* arg;
+} re_mqtt_stream_handler_t;
+
+static re_mqtt_stream_handler_t _mqttStreamHandlers[CONFIG_MQTT_STREAM_HANDLERS];
+static uint8_t _mqttStreamHandlersCount = 0;
+static portMUX_TYPE _mqttStreamLock = portMUX_INITIALIZER_UNLOCKED;
+
+// Checking the topic against a subscription filter with wildcards "+" and "#"
+bool mqttTopicMatch(const char* filter, const char* topic, size_t topic_len)
+{
+  // Topics starting with "$" are not matched by wildcards at the first level
+  if ((topic_len > 0) && (topic[0] == '$') && ((filter[0] == '+') || (filter[0] == '#'))) return false;
+  size_t i = 0;
+  while (*filter) {
+    if (*filter == '#') {
+      return true;
+    } else if (*filter == '+') {
+      while ((i < topic_len) && (topic[i] != '/')) i++;
+      filter++;
+    } else {
+      if ((i >= topic_len) || (*filter != topic[i])) {
+        // "a/#" also matches the parent level "a"
+        return (i == topic_len) && (filter[0] == '/') && (filter[1] == '#') && (filter[2] == 0);
+      };
+      filter++;
+      i++;
+    };
+  };
+  return i == topic_len;
+}
+
+bool mqttStreamHandlerRegister(const char* filter, mqtt_stream_handler_t handler, void* arg)
+{
+  if ((filter == nullptr) || (handler == nullptr)) return false;
+  char* _filter = malloc_string(filter);
+  if (_filter == nullptr) return false;
+  bool ret = false;
+  taskENTER_CRITICAL(&_mqttStreamLock);
+  if (_mqttStreamHandlersCount < CONFIG_MQTT_STREAM_HANDLERS) {
+    _mqttStreamHandlers[_mqttStreamHandlersCount].filter = _filter;
+    _mqttStreamHandlers[_mqttStreamHandlersCount].handler = handler;
+    _mqttStreamHandlers[_mqttStreamHandlersCount].arg = arg;
+    _mqttStreamHandlersCount++;
+    ret = true;
+  };
+  taskEXIT_CRITICAL(&_mqttStreamLock);
+  if (ret) {
+    rlog_i(logTAG, "Streaming delivery enabled for \"%s\"", filter);
+  } else {
+    free(_filter);
+    rlog_e(logTAG, "Failed to register stream handler: limit of %d handlers reached", CONFIG_MQTT_STREAM_HANDLERS);
+  };
+  return ret;
+}
+
+void mqttStreamHandlerUnregister(const char* filter, mqtt_stream_handler_t handler)
+{
+  char* _filter = nullptr;
+  taskENTER_CRITICAL(&_mqttStreamLock);
+  for (uint8_t i = 0; i < _mqttStreamHandlersCount; i++) {
+    if ((_mqttStreamHandlers[i].handler == handler) && (strcmp(_mqttStreamHandlers[i].filter, filter) == 0)) {
+      _filter = _mqttStreamHandlers[i].filter;
+      _mqttStreamHandlersCount--;
+      for (uint8_t j = i; j < _mqttStreamHandlersCount; j++) {
+        _mqttStreamHandlers[j] = _mqttStreamHandlers[j+1];
+      };
+      break;
+    };
+  };
+  taskEXIT_CRITICAL(&_mqttStreamLock);
+  if (_filter) free(_filter);
+}
+
+static bool mqttStreamHandlerFind(const char* topic, size_t topic_len, re_mqtt_stream_handler_t* found)
+{
+  bool ret = false;
+  taskENTER_CRITICAL(&_mqttStreamLock);
+  for (uint8_t i = 0; i < _mqttStreamHandlersCount; i++) {
+    if (mqttTopicMatch(_mqttStreamHandlers[i].filter, topic, topic_len)) {
+      *found = _mqttStreamHandlers[i];
+      ret = true;
+      break;
+    };
+  };
+  taskEXIT_CRITICAL(&_mqttStreamLock);
+  return ret;
+}
+
+// -----------------------------------------------------------------------------------------------------------------------
+// ----------------------------------------------------- Publish log -----------------------------------------------------
+// -----------------------------------------------------------------------------------------------------------------------
+
+#if defined(CONFIG_MQTT_LOG_DEFERRED) && CONFIG_MQTT_LOG_DEFERRED
+
+#include "freertos/queue.h"
+
+#ifndef CONFIG_MQTT_LOG_QUEUE_SIZE
+  #define CONFIG_MQTT_LOG_QUEUE_SIZE 16
+#endif // CONFIG_MQTT_LOG_QUEUE_SIZE
+#ifndef CONFIG_MQTT_LOG_TOPIC_SIZE
+  #define CONFIG_MQTT_LOG_TOPIC_SIZE 64
+#endif // CONFIG_MQTT_LOG_TOPIC_SIZE
+#ifndef CONFIG_MQTT_LOG_PAYLOAD_SIZE
+  #define CONFIG_MQTT_LOG_PAYLOAD_SIZE 64
+#endif // CONFIG_MQTT_LOG_PAYLOAD_SIZE
+#ifndef CONFIG_MQTT_LOG_SAMPLING
+  #define CONFIG_MQTT_LOG_SAMPLING 1
+#endif // CONFIG_MQTT_LOG_SAMPLING
+#ifndef CONFIG_MQTT_LOG_TOPIC_RULES
+  #define CONFIG_MQTT_LOG_TOPIC_RULES 4
+#endif // CONFIG_MQTT_LOG_TOPIC_RULES
+#ifndef CONFIG_MQTT_LOG_TASK_STACK_SIZE
+  #define CONFIG_MQTT_LOG_TASK_STACK_SIZE 3072
+#endif // CONFIG_MQTT_LOG_TASK_STACK_SIZE
+#ifndef CONFIG_MQTT_LOG_TASK_PRIORITY
+  #define CONFIG_MQTT_LOG_TASK_PRIORITY (tskIDLE_PRIORITY + 1)
+#endif // CONFIG_MQTT_LOG_TASK_PRIORITY
+
+typedef struct {
+  char     topic[CONFIG_MQTT_LOG_TOPIC_SIZE];
+  char     payload[CONFIG_MQTT_LOG_PAYLOAD_SIZE];
+  uint32_t payload_len;
+  uint32_t skipped;
+  uint8_t  qos;
+  bool     retained;
+  bool     is_null;
+} re_mqtt_log_record_t;
+
+typedef struct {
+  char*    filter;
+  uint32_t every;
+  uint32_t counter;
+} re_mqtt_log_rule_t;
+
+static QueueHandle_t _mqttLogQueue = nullptr;
+static TaskHandle_t _mqttLogTask = nullptr;
+static re_mqtt_log_rule_t _mqttLogRules[CONFIG_MQTT_LOG_TOPIC_RULES];
+static uint8_t _mqttLogRulesCount = 0;
+static uint32_t _mqttLogCounter = 0;
+static uint32_t _mqttLogSkipped = 0;
+static uint32_t _mqttLogDropped = 0;
+static portMUX_TYPE _mqttLogLock = portMUX_INITIALIZER_UNLOCKED;
+#if CONFIG_MQTT_STATIC_ALLOCATION
+  static StaticQueue_t _mqttLogQueueBuffer;
+  static uint8_t _mqttLogQueueStorage[CONFIG_MQTT_LOG_QUEUE_SIZE * sizeof(re_mqtt_log_record_t)];
+#endif // CONFIG_MQTT_STATIC_ALLOCATION
+
+static void mqttLogTaskExec(void *arg)
+{
+  static re_mqtt_log_record_t record;
+  while (1) {
+    if (xQueueReceive(_mqttLogQueue, &record, portMAX_DELAY) == pdPASS) {
+      if (record.skipped > 0) {
+        rlog_i(logTAG, "... %" PRIu32 " publications are not shown", record.skipped);
+      };
+      if (record.is_null) {
+        rlog_i(logTAG, "Publish to topic \"%s\": NULL [ 0 bytes ]", record.topic);
+      } else if (record.payload_len >= CONFIG_MQTT_LOG_PAYLOAD_SIZE) {
+        rlog_i(logTAG, "Publish to topic \"%s\": %.*s... [ %" PRIu32 " bytes ]", record.topic, CONFIG_MQTT_LOG_PAYLOAD_SIZE-1, record.payload, record.payload_len);
+      } else {
+        rlog_i(logTAG, "Publish to topic \"%s\": %s", record.topic, record.payload);
+      };
+    };
+  };
+  vTaskDelete(nullptr);
+}
+
+bool mqttLogInit()
+{
+  if (_mqttLogQueue == nullptr) {
+    #if CONFIG_MQTT_STATIC_ALLOCATION
+      _mqttLogQueue = xQueueCreateStatic(CONFIG_MQTT_LOG_QUEUE_SIZE, sizeof(re_mqtt_log_record_t), _mqttLogQueueStorage, &_mqttLogQueueBuffer);
+    #else
+      _mqttLogQueue = xQueueCreate(CONFIG_MQTT_LOG_QUEUE_SIZE, sizeof(re_mqtt_log_record_t));
+    #endif // CONFIG_MQTT_STATIC_ALLOCATION
+    if (_mqttLogQueue == nullptr) {
+      rlog_e(logTAG, "Failed to create publish log queue!");
+      return false;
+    };
+  };
+  if (_mqttLogTask == nullptr) {
+    if (xTaskCreate(mqttLogTaskExec, "mqtt_log", CONFIG_MQTT_LOG_TASK_STACK_SIZE, nullptr, CONFIG_MQTT_LOG_TASK_PRIORITY, &_mqttLogTask) != pdPASS) {
+      _mqttLogTask = nullptr;
+      rlog_e(logTAG, "Failed to create task [ MQTT_LOG ]!");
+      return false;
+    };
+  };
+  return true;
+}
+
+void mqttLogFree()
+{
+  if (_mqttLogTask) {
+    vTaskDelete(_mqttLogTask);
+    _mqttLogTask = nullptr;
+  };
+  if (_mqttLogQueue) {
+    vQueueDelete(_mqttLogQueue);
+    _mqttLogQueue = nullptr;
+  };
+}
+
+// Only every N-th publication to topics matching the filter is logged
+bool mqttLogSetTopicSampling(const char* filter, uint32_t every)
+{
+  if ((filter == nullptr) || (every == 0)) return false;
+  char* _filter = malloc_string(filter);
+  if (_filter == nullptr) return false;
+  bool ret = false;
+  taskENTER_CRITICAL(&_mqttLogLock);
+  for (uint8_t i = 0; i < _mqttLogRulesCount; i++) {
+    if (strcmp(_mqttLogRules[i].filter, filter) == 0) {
+      _mqttLogRules[i].every = every;
+      _mqttLogRules[i].counter = 0;
+      ret = true;
+      break;
+    };
+  };
+  if (!ret && (_mqttLogRulesCount < CONFIG_MQTT_LOG_TOPIC_RULES)) {
+    _mqttLogRules[_mqttLogRulesCount].filter = _filter;
+    _mqttLogRules[_mqttLogRulesCount].every = every;
+    _mqttLogRules[_mqttLogRulesCount].counter = 0;
+    _mqttLogRulesCount++;
+    _filter = nullptr;
+    ret = true;
+  };
+  taskEXIT_CRITICAL(&_mqttLogLock);
+  if (_filter) free(_filter);
+  return ret;
+}
+
+static void mqttLogPublish(const char *topic, const char *payload, size_t payload_len, int qos, bool retained)
+{
+  // Sampling
+  bool skip = false;
+  uint32_t skipped = 0;
+  size_t topic_len = strlen(topic);
+  taskENTER_CRITICAL(&_mqttLogLock);
+  re_mqtt_log_rule_t* rule = nullptr;
+  for (uint8_t i = 0; i < _mqttLogRulesCount; i++) {
+    if (mqttTopicMatch(_mqttLogRules[i].filter, topic, topic_len)) {
+      rule = &_mqttLogRules[i];
+      break;
+    };
+  };
+  if (rule) {
+    skip = (rule->counter++ % rule->every) != 0;
+  } else {
+    skip = (_mqttLogCounter++ % CONFIG_MQTT_LOG_SAMPLING) != 0;
+  };
+  if (skip) {
+    _mqttLogSkipped++;
+  } else {
+    skipped = _mqttLogSkipped;
+    _mqttLogSkipped = 0;
+  };
+  taskEXIT_CRITICAL(&_mqttLogLock);
+  if (skip || (_mqttLogQueue == nullptr)) return;
+
+  // Only a truncated copy of the data gets into the queue
+  re_mqtt_log_record_t record;
+  size_t len = topic_len < CONFIG_MQTT_LOG_TOPIC_SIZE ? topic_len : CONFIG_MQTT_LOG_TOPIC_SIZE-1;
+  memcpy(record.topic, topic, len);
+  record.topic[len] = 0;
+  record.is_null = payload == nullptr;
+  record.payload_len = payload_len;
+  len = payload_len < CONFIG_MQTT_LOG_PAYLOAD_SIZE ? payload_len : CONFIG_MQTT_LOG_PAYLOAD_SIZE-1;
+  if (len > 0) memcpy(record.payload, payload, len);
+  record.payload[len] = 0;
+  record.skipped = skipped;
+  record.qos = qos;
+  record.retained = retained;
+  if (xQueueSend(_mqttLogQueue, &record, 0) != pdPASS) {
+    __atomic_add_fetch(&_mqttLogDropped, 1, __ATOMIC_RELAXED);
+  };
+}
+
+#else
+
+bool mqttLogInit()
+{
+  return true;
+}
+
+void mqttLogFree()
+{
+}
+
+bool mqttLogSetTopicSampling(const char* filter, uint32_t every)
+{
+  return false;
+}
+
+static void mqttLogPublish(const char *topic, const char *payload, size_t payload_len, int qos, bool retained)
+{
+  if (payload == nullptr) {
+    rlog_i(logTAG, "Publish to topic \"%s\": NULL [ 0 bytes ]", topic);
+  } else if (payload_len > MQTT_LOG_PAYLOAD_LIMIT) {
+    rlog_i(logTAG, "Publish to topic \"%s\": [ %d bytes ]", topic, (int)payload_len);
+  } else {
+    rlog_i(logTAG, "Publish to topic \"%s\": %.*s", topic, (int)payload_len, payload);
+  };
+}
+
+#endif // CONFIG_MQTT_LOG_DEFERRED
+
+// -----------------------------------------------------------------------------------------------------------------------
+// --------------------------------------------------- Managed outbox ----------------------------------------------------
+// -----------------------------------------------------------------------------------------------------------------------
+
+#define MQTT_COALESCE_NONE     0
+#define MQTT_COALESCE_VOLATILE 1  // Only retained messages and messages with QoS 0
+#define MQTT_COALESCE_ALL      2
+
+#define MQTT_EVICT_REJECT      0  // New messages are rejected when the outbox is full
+#define MQTT_EVICT_OLDEST      1  // The oldest messages are evicted
+#define MQTT_EVICT_QOS0_FIRST  2  // The oldest messages with QoS 0 are evicted first, then the oldest ones
+
+#if (defined(CONFIG_MQTT_COALESCE_PENDING) && (CONFIG_MQTT_COALESCE_PENDING > MQTT_COALESCE_NONE)) \
+ || (defined(CONFIG_MQTT_OUTBOX_MANAGED) && CONFIG_MQTT_OUTBOX_MANAGED)
+
+#include "esp_timer.h"
+
+#ifndef CONFIG_MQTT_COALESCE_PENDING
+  #define CONFIG_MQTT_COALESCE_PENDING MQTT_COALESCE_NONE
+#endif // CONFIG_MQTT_COALESCE_PENDING
+#ifndef CONFIG_MQTT_OUTBOX_MANAGED
+  #define CONFIG_MQTT_OUTBOX_MANAGED 0
+#endif // CONFIG_MQTT_OUTBOX_MANAGED
+#ifndef CONFIG_MQTT_COALESCE_MAX_TOPICS
+  #define CONFIG_MQTT_COALESCE_MAX_TOPICS 32
+#endif // CONFIG_MQTT_COALESCE_MAX_TOPICS
+#ifndef CONFIG_MQTT_OUTBOX_MAX_MESSAGES
+  #define CONFIG_MQTT_OUTBOX_MAX_MESSAGES CONFIG_MQTT_COALESCE_MAX_TOPICS
+#endif // CONFIG_MQTT_OUTBOX_MAX_MESSAGES
+#ifndef CONFIG_MQTT_OUTBOX_MAX_BYTES
+  #define CONFIG_MQTT_OUTBOX_MAX_BYTES 16384
+#endif // CONFIG_MQTT_OUTBOX_MAX_BYTES
+#ifndef CONFIG_MQTT_OUTBOX_EVICTION
+  #define CONFIG_MQTT_OUTBOX_EVICTION MQTT_EVICT_REJECT
+#endif // CONFIG_MQTT_OUTBOX_EVICTION
+#ifndef CONFIG_MQTT_OUTBOX_TOPIC_QUOTA
+  #define CONFIG_MQTT_OUTBOX_TOPIC_QUOTA 0
+#endif // CONFIG_MQTT_OUTBOX_TOPIC_QUOTA
+#ifndef CONFIG_MQTT_OUTBOX_TTL_SECONDS
+  #define CONFIG_MQTT_OUTBOX_TTL_SECONDS 0
+#endif // CONFIG_MQTT_OUTBOX_TTL_SECONDS
+
+// Messages published while there is no connection, in order of arrival
+typedef struct re_mqtt_outbox_item_t {
+  re_mqtt_outbox_item_t* next;
+  int64_t  created;
+  char*    topic;
+  size_t   topic_len;
+  char*    payload;
+  size_t   payload_len;
+  int      qos;
+  bool     retained;
+} re_mqtt_outbox_item_t;
+
+static re_mqtt_outbox_item_t* _mqttOutbox = nullptr;
+static re_mqtt_outbox_stats_t _mqttOutboxStats;
+static portMUX_TYPE _mqttOutboxLock = portMUX_INITIALIZER_UNLOCKED;
+
+static bool mqttOutboxAccepted(int qos, bool retained)
+{
+  #if CONFIG_MQTT_OUTBOX_MANAGED || (CONFIG_MQTT_COALESCE_PENDING == MQTT_COALESCE_ALL)
+    return true;
+  #else
+    return retained || (qos == 0);
+  #endif // CONFIG_MQTT_COALESCE_PENDING
+}
+
+static bool mqttOutboxCoalesced(int qos, bool retained)
+{
+  #if CONFIG_MQTT_COALESCE_PENDING == MQTT_COALESCE_ALL
+    return true;
+  #elif CONFIG_MQTT_COALESCE_PENDING == MQTT_COALESCE_VOLATILE
+    return retained || (qos == 0);
+  #else
+    return false;
+  #endif // CONFIG_MQTT_COALESCE_PENDING
+}
+
+// Removing an item from the list; the caller frees it after leaving the critical section
+static re_mqtt_outbox_item_t* mqttOutboxUnlink(re_mqtt_outbox_item_t** prev)
+{
+  re_mqtt_outbox_item_t* item = *prev;
+  *prev = item->next;
+  item->next = nullptr;
+  _mqttOutboxStats.count--;
+  _mqttOutboxStats.bytes -= item->topic_len + item->payload_len;
+  return item;
+}
+
+static void mqttOutboxGarbage(re_mqtt_outbox_item_t** garbage, re_mqtt_outbox_item_t* item)
+{
+  item->next = *garbage;
+  *garbage = item;
+}
+
+static void mqttOutboxExpire(re_mqtt_outbox_item_t** garbage, int64_t now)
+{
+  #if CONFIG_MQTT_OUTBOX_TTL_SECONDS > 0
+    re_mqtt_outbox_item_t** prev = &_mqttOutbox;
+    while (*prev) {
+      if (now - (*prev)->created > 1000000LL * CONFIG_MQTT_OUTBOX_TTL_SECONDS) {
+        mqttOutboxGarbage(garbage, mqttOutboxUnlink(prev));
+        _mqttOutboxStats.expired++;
+      } else {
+        prev = &(*prev)->next;
+      };
+    };
+  #endif // CONFIG_MQTT_OUTBOX_TTL_SECONDS
+}
+
+static bool mqttOutboxEvict(re_mqtt_outbox_item_t** garbage)
+{
+  #if CONFIG_MQTT_OUTBOX_EVICTION == MQTT_EVICT_REJECT
+    return false;
+  #else
+    re_mqtt_outbox_item_t** victim = nullptr;
+    #if CONFIG_MQTT_OUTBOX_EVICTION == MQTT_EVICT_QOS0_FIRST
+      re_mqtt_outbox_item_t** prev = &_mqttOutbox;
+      while (*prev) {
+        if ((*prev)->qos == 0) {
+          victim = prev;
+          break;
+        };
+        prev = &(*prev)->next;
+      };
+    #endif // MQTT_EVICT_QOS0_FIRST
+    if ((victim == nullptr) && (_mqttOutbox != nullptr)) {
+      victim = &_mqttOutbox;
+    };
+    if (victim) {
+      mqttOutboxGarbage(garbage, mqttOutboxUnlink(victim));
+      _mqttOutboxStats.evicted++;
+      return true;
+    };
+    return false;
+  #endif // CONFIG_MQTT_OUTBOX_EVICTION
+}
+
+static void mqttOutboxFreeList(re_mqtt_outbox_item_t* item)
+{
+  while (item) {
+    re_mqtt_outbox_item_t* next = item->next;
+    mqttRuntimeFree(item);
+    item = next;
+  };
+}
+
+static esp_err_t mqttOutboxPut(const char *topic, const char *payload, size_t payload_len, int qos, bool retained)
+{
+  size_t topic_len = strlen(topic);
+  if (topic_len + payload_len > CONFIG_MQTT_OUTBOX_MAX_BYTES) return ESP_ERR_INVALID_SIZE;
+
+  re_mqtt_outbox_item_t* item = (re_mqtt_outbox_item_t*)mqttRuntimeAlloc(sizeof(re_mqtt_outbox_item_t) + topic_len + payload_len + 2);
+  if (item == nullptr) return ESP_ERR_NO_MEM;
+  item->created = esp_timer_get_time();
+  item->topic = (char*)item + sizeof(re_mqtt_outbox_item_t);
+  item->topic_len = topic_len;
+  memcpy(item->topic, topic, topic_len);
+  item->payload = item->topic + topic_len + 1;
+  item->payload_len = payload_len;
+  if (payload_len > 0) memcpy(item->payload, payload, payload_len);
+  item->qos = qos;
+  item->retained = retained;
+
+  re_mqtt_outbox_item_t* garbage = nullptr;
+  esp_err_t err = ESP_OK;
+  taskENTER_CRITICAL(&_mqttOutboxLock);
+  mqttOutboxExpire(&garbage, item->created);
+  
+  // Last value wins: the newest queued message for the same topic is dropped and the new one is added to the end,
+  // but only if both of them may be coalesced (a queued message with QoS 1 is never replaced by a message with QoS 0)
+  re_mqtt_outbox_item_t** prev = nullptr;
+  if (mqttOutboxCoalesced(qos, retained)) {
+    re_mqtt_outbox_item_t** newest_same = nullptr;
+    prev = &_mqttOutbox;
+    while (*prev) {
+      if (((*prev)->topic_len == topic_len) && (memcmp((*prev)->topic, topic, topic_len) == 0)
+       && mqttOutboxCoalesced((*prev)->qos, (*prev)->retained)) {
+        newest_same = prev;
+      };
+      prev = &(*prev)->next;
+    };
+    if (newest_same) {
+      mqttOutboxGarbage(&garbage, mqttOutboxUnlink(newest_same));
+      _mqttOutboxStats.coalesced++;
+    };
+  };
+  // Per-topic quota
+  #if CONFIG_MQTT_OUTBOX_TOPIC_QUOTA > 0
+    re_mqtt_outbox_item_t** oldest_same = nullptr;
+    uint32_t same_count = 0;
+    prev = &_mqttOutbox;
+    while (*prev) {
+      if (((*prev)->topic_len == topic_len) && (memcmp((*prev)->topic, topic, topic_len) == 0)) {
+        if (oldest_same == nullptr) oldest_same = prev;
+        same_count++;
+      };
+      prev = &(*prev)->next;
+    };
+    if (oldest_same && (same_count >= CONFIG_MQTT_OUTBOX_TOPIC_QUOTA)) {
+      mqttOutboxGarbage(&garbage, mqttOutboxUnlink(oldest_same));
+      _mqttOutboxStats.evicted++;
+    };
+  #endif // CONFIG_MQTT_OUTBOX_TOPIC_QUOTA
+  // Capacity
+  while ((_mqttOutboxStats.count >= CONFIG_MQTT_OUTBOX_MAX_MESSAGES) 
+      || (_mqttOutboxStats.bytes + topic_len + payload_len > CONFIG_MQTT_OUTBOX_MAX_BYTES)) {
+    if (!mqttOutboxEvict(&garbage)) {
+      err = ESP_ERR_NO_MEM;
+      _mqttOutboxStats.rejected++;
+      break;
+    };
+  };
+  if (err == ESP_OK) {
+    // The tail may have changed after eviction
+    prev = &_mqttOutbox;
+    while (*prev) prev = &(*prev)->next;
+    *prev = item;
+  };
+  if (err == ESP_OK) {
+    _mqttOutboxStats.count++;
+    _mqttOutboxStats.bytes += topic_len + payload_len;
+  };
+  taskEXIT_CRITICAL(&_mqttOutboxLock);
+
+  mqttOutboxFreeList(garbage);
+  if (err != ESP_OK) mqttRuntimeFree(item);
+  return err;
+}
+
+static void mqttOutboxFlush()
+{
+  re_mqtt_outbox_item_t* garbage = nullptr;
+  taskENTER_CRITICAL(&_mqttOutboxLock);
+  mqttOutboxExpire(&garbage, esp_timer_get_time());
+  re_mqtt_outbox_item_t* item = _mqttOutbox;
+  _mqttOutbox = nullptr;
+  _mqttOutboxStats.count = 0;
+  _mqttOutboxStats.bytes = 0;
+  taskEXIT_CRITICAL(&_mqttOutboxLock);
+  mqttOutboxFreeList(garbage);
+
+  if (item) {
+    rlog_i(logTAG, "Sending pending messages...");
+  };
+  while (item) {
+    re_mqtt_outbox_item_t* next = item->next;
+    mqttPublishInternal(item->topic, item->payload, item->payload_len, item->qos, item->retained);
+    mqttRuntimeFree(item);
+    item = next;
+  };
+}
+
+static void mqttOutboxClear()
+{
+  taskENTER_CRITICAL(&_mqttOutboxLock);
+  re_mqtt_outbox_item_t* item = _mqttOutbox;
+  _mqttOutbox = nullptr;
+  _mqttOutboxStats.count = 0;
+  _mqttOutboxStats.bytes = 0;
+  taskEXIT_CRITICAL(&_mqttOutboxLock);
+  mqttOutboxFreeList(item);
+}
+
+void mqttOutboxGetStats(re_mqtt_outbox_stats_t* stats)
+{
+  if (stats) {
+    taskENTER_CRITICAL(&_mqttOutboxLock);
+    memcpy(stats, &_mqttOutboxStats, sizeof(re_mqtt_outbox_stats_t));
+    taskEXIT_CRITICAL(&_mqttOutboxLock);
+  };
+}
+
+#else
+
+static bool mqttOutboxAccepted(int qos, bool retained)
+{
+  return false;
+}
+
+static esp_err_t mqttOutboxPut(const char *topic, const char *payload, size_t payload_len, int qos, bool retained)
+{
+  return ESP_ERR_NOT_SUPPORTED;
+}
+
+static void mqttOutboxFlush()
+{
+}
+
+static void mqttOutboxClear()
+{
+}
+
+void mqttOutboxGetStats(re_mqtt_outbox_stats_t* stats)
+{
+  if (stats) memset(stats, 0, sizeof(re_mqtt_outbox_stats_t));
+}
+
+#endif // CONFIG_MQTT_COALESCE_PENDING || CONFIG_MQTT_OUTBOX_MANAGED
+
+// -----------------------------------------------------------------------------------------------------------------------
+// ------------------------------------------------- Persistent outbox ---------------------------------------------------
+// -----------------------------------------------------------------------------------------------------------------------
+
+#if defined(CONFIG_MQTT_OUTBOX_PERSISTENT) && CONFIG_MQTT_OUTBOX_PERSISTENT
+
+#include "esp_partition.h"
+#include "esp_rom_crc.h"
+
+#ifndef CONFIG_MQTT_OUTBOX_PARTITION
+  #define CONFIG_MQTT_OUTBOX_PARTITION "mqtt_outbox"
+#endif // CONFIG_MQTT_OUTBOX_PARTITION
+#ifndef CONFIG_MQTT_OUTBOX_PERSIST_MIN_QOS
+  #define CONFIG_MQTT_OUTBOX_PERSIST_MIN_QOS 1
+#endif // CONFIG_MQTT_OUTBOX_PERSIST_MIN_QOS
+#ifndef CONFIG_MQTT_OUTBOX_PERSIST_THRESHOLD
+  #define CONFIG_MQTT_OUTBOX_PERSIST_THRESHOLD 0
+#endif // CONFIG_MQTT_OUTBOX_PERSIST_THRESHOLD
+// Messages from flash that may wait for acknowledgement at the same time
+#ifndef CONFIG_MQTT_OUTBOX_REPLAY_BATCH
+  #define CONFIG_MQTT_OUTBOX_REPLAY_BATCH 8
+#endif // CONFIG_MQTT_OUTBOX_REPLAY_BATCH
+// The next message is read from flash only while the client outbox is smaller than this (bytes)
+#ifndef CONFIG_MQTT_OUTBOX_REPLAY_WATERMARK
+  #if CONFIG_MQTT_OUTBOX_PERSIST_THRESHOLD > 0
+    #define CONFIG_MQTT_OUTBOX_REPLAY_WATERMARK (CONFIG_MQTT_OUTBOX_PERSIST_THRESHOLD / 2)
+  #else
+    #define CONFIG_MQTT_OUTBOX_REPLAY_WATERMARK 4096
+  #endif // CONFIG_MQTT_OUTBOX_PERSIST_THRESHOLD
+#endif // CONFIG_MQTT_OUTBOX_REPLAY_WATERMARK
+#ifndef CONFIG_MQTT_OUTBOX_REPLAY_INTERVAL
+  #define CONFIG_MQTT_OUTBOX_REPLAY_INTERVAL 100
+#endif // CONFIG_MQTT_OUTBOX_REPLAY_INTERVAL
+#ifndef CONFIG_MQTT_OUTBOX_REPLAY_STACK_SIZE
+  #define CONFIG_MQTT_OUTBOX_REPLAY_STACK_SIZE 3072
+#endif // CONFIG_MQTT_OUTBOX_REPLAY_STACK_SIZE
+#ifndef CONFIG_MQTT_OUTBOX_REPLAY_PRIORITY
+  #define CONFIG_MQTT_OUTBOX_REPLAY_PRIORITY 1
+#endif // CONFIG_MQTT_OUTBOX_REPLAY_PRIORITY
+
+#define MQTT_PERSIST_SECTOR_SIZE  4096
+#define MQTT_PERSIST_MAGIC        0x514D
+#define MQTT_PERSIST_STATE_BLANK  0xFF  // Record is being written (power loss during writing)
+#define MQTT_PERSIST_STATE_VALID  0x7F  // Record is written and waiting to be sent
+#define MQTT_PERSIST_STATE_SENT   0x00  // Record is sent; states only clear bits, so no erase is needed
+#define MQTT_PERSIST_ALIGN(x)     (((x) + 3) & ~3)
+
+// Records are appended to a ring of flash sectors and never cross a sector boundary;
+// a sector is erased only when the write position enters it
+typedef struct {
+  uint16_t magic;
+  uint8_t  state;
+  uint8_t  flags;        // bits 0-1: QoS, bit 2: retained
+  uint16_t topic_len;
+  uint16_t payload_len;
+  uint32_t seq;
+  uint32_t crc;          // CRC32 of topic and payload
+} re_mqtt_persist_header_t;
+
+static const esp_partition_t* _mqttPersistPart = nullptr;
+static uint32_t _mqttPersistSectors = 0;
+static uint32_t _mqttPersistWrite = 0;
+static uint32_t _mqttPersistSeq = 0;
+static re_mqtt_persist_stats_t _mqttPersistStats;
+static SemaphoreHandle_t _mqttPersistLock = nullptr;
+#if CONFIG_MQTT_STATIC_ALLOCATION
+  StaticSemaphore_t _mqttPersistLockBuffer;
+#endif // CONFIG_MQTT_STATIC_ALLOCATION
+
+// Replayed records waiting for PUBACK; a record is marked as sent only after acknowledgement
+typedef struct {
+  int      msg_id;       // 0 - the slot is free
+  bool     acked;
+  uint32_t offset;
+  uint32_t seq;
+} re_mqtt_persist_flight_t;
+
+static re_mqtt_persist_flight_t _mqttPersistFlight[CONFIG_MQTT_OUTBOX_REPLAY_BATCH];
+static portMUX_TYPE _mqttPersistFlightLock = portMUX_INITIALIZER_UNLOCKED;
+static uint32_t _mqttReplayCursor = 0;
+static bool _mqttReplayRewind = false;
+static TaskHandle_t _mqttPersistTask = nullptr;
+
+static size_t mqttPersistRecordSize(const re_mqtt_persist_header_t* hdr)
+{
+  return MQTT_PERSIST_ALIGN(sizeof(re_mqtt_persist_header_t) + hdr->topic_len + hdr->payload_len);
+}
+
+static bool mqttPersistHeaderRead(uint32_t offset, re_mqtt_persist_header_t* hdr)
+{
+  if ((offset % MQTT_PERSIST_SECTOR_SIZE) + sizeof(re_mqtt_persist_header_t) > MQTT_PERSIST_SECTOR_SIZE) return false;
+  if (esp_partition_read(_mqttPersistPart, offset, hdr, sizeof(re_mqtt_persist_header_t)) != ESP_OK) return false;
+  return (hdr->magic == MQTT_PERSIST_MAGIC) 
+      && ((offset % MQTT_PERSIST_SECTOR_SIZE) + mqttPersistRecordSize(hdr) <= MQTT_PERSIST_SECTOR_SIZE);
+}
+
+static esp_err_t mqttPersistStateWrite(uint32_t offset, uint8_t state)
+{
+  return esp_partition_write(_mqttPersistPart, offset + offsetof(re_mqtt_persist_header_t, state), &state, sizeof(state));
+}
+
+static bool mqttPersistTaskStart();
+
+// Recovery after reboot: counting unsent records and searching for the position after the newest record
+bool mqttPersistInit()
+{
+  if (_mqttPersistPart) return mqttPersistTaskStart();
+
+  const esp_partition_t* part = esp_partition_find_first(ESP_PARTITION_TYPE_DATA, ESP_PARTITION_SUBTYPE_ANY, CONFIG_MQTT_OUTBOX_PARTITION);
+  if ((part == nullptr) || (part->size < 2 * MQTT_PERSIST_SECTOR_SIZE)) {
+    rlog_e(logTAG, "Partition \"%s\" for persistent outbox not found or too small", CONFIG_MQTT_OUTBOX_PARTITION);
+    return false;
+  };
+  // Recursive, so that the helpers that write records may be called with the lock already taken
+  if (_mqttPersistLock == nullptr) {
+    #if CONFIG_MQTT_STATIC_ALLOCATION
+      _mqttPersistLock = xSemaphoreCreateRecursiveMutexStatic(&_mqttPersistLockBuffer);
+    #else
+      _mqttPersistLock = xSemaphoreCreateRecursiveMutex();
+    #endif // CONFIG_MQTT_STATIC_ALLOCATION
+    if (_mqttPersistLock == nullptr) return false;
+  };
+
+  _mqttPersistPart = part;
+  _mqttPersistSectors = part->size / MQTT_PERSIST_SECTOR_SIZE;
+  memset(&_mqttPersistStats, 0, sizeof(_mqttPersistStats));
+  _mqttPersistWrite = 0;
+  _mqttPersistSeq = 0;
+  bool found = false;
+  re_mqtt_persist_header_t hdr;
+  for (uint32_t sector = 0; sector < _mqttPersistSectors; sector++) {
+    uint32_t offset = sector * MQTT_PERSIST_SECTOR_SIZE;
+    while (mqttPersistHeaderRead(offset, &hdr)) {
+      if (hdr.state == MQTT_PERSIST_STATE_VALID) {
+        _mqttPersistStats.pending++;
+      };
+      if (!found || ((int32_t)(hdr.seq - _mqttPersistSeq) >= 0)) {
+        found = true;
+        _mqttPersistSeq = hdr.seq + 1;
+        _mqttPersistWrite = offset + mqttPersistRecordSize(&hdr);
+      };
+      offset += mqttPersistRecordSize(&hdr);
+    };
+  };
+  rlog_i(logTAG, "Persistent outbox: %d sectors, %d messages recovered", _mqttPersistSectors, _mqttPersistStats.pending);
+  return mqttPersistTaskStart();
+}
+
+static void mqttPersistSectorErase(uint32_t sector)
+{
+  // Unsent messages in the reused sector are lost, these are the oldest ones
+  uint32_t offset = sector * MQTT_PERSIST_SECTOR_SIZE;
+  re_mqtt_persist_header_t hdr;
+  while (mqttPersistHeaderRead(offset, &hdr)) {
+    if (hdr.state == MQTT_PERSIST_STATE_VALID) {
+      _mqttPersistStats.dropped++;
+      _mqttPersistStats.pending--;
+    };
+    offset += mqttPersistRecordSize(&hdr);
+  };
+  if (esp_partition_erase_range(_mqttPersistPart, sector * MQTT_PERSIST_SECTOR_SIZE, MQTT_PERSIST_SECTOR_SIZE) == ESP_OK) {
+    _mqttPersistStats.erases++;
+  };
+}
+
+// Messages are written to flash without connection, and while connected when the client outbox has reached the threshold;
+// while there are unsent records in flash, new messages are appended after them to keep the order
+static bool mqttPersistAccepted(int qos)
+{
+  if ((_mqttPersistPart == nullptr) || (qos < CONFIG_MQTT_OUTBOX_PERSIST_MIN_QOS)) return false;
+  if (_mqttPersistStats.pending > 0) return true;
+  if (mqttStatesCheck(MQTTCLI_CONNECTED, false)) {
+    return (CONFIG_MQTT_OUTBOX_PERSIST_THRESHOLD > 0) 
+        && (mqttGetOutboxSize() >= CONFIG_MQTT_OUTBOX_PERSIST_THRESHOLD);
+  };
+  return mqttGetOutboxSize() >= CONFIG_MQTT_OUTBOX_PERSIST_THRESHOLD;
+}
+
+static esp_err_t mqttPersistPut(const char *topic, const char *payload, size_t payload_len, int qos, bool retained)
+{
+  re_mqtt_persist_header_t hdr;
+  hdr.magic = MQTT_PERSIST_MAGIC;
+  hdr.state = MQTT_PERSIST_STATE_BLANK;
+  hdr.flags = (qos & 0x03) | (retained ? 0x04 : 0x00);
+  hdr.topic_len = strlen(topic);
+  hdr.payload_len = payload_len;
+  size_t size = mqttPersistRecordSize(&hdr);
+  if ((size > MQTT_PERSIST_SECTOR_SIZE) || (payload_len > UINT16_MAX)) return ESP_ERR_INVALID_SIZE;
+  hdr.crc = esp_rom_crc32_le(0, (const uint8_t*)topic, hdr.topic_len);
+  if (payload_len > 0) hdr.crc = esp_rom_crc32_le(hdr.crc, (const uint8_t*)payload, payload_len);
+
+  xSemaphoreTakeRecursive(_mqttPersistLock, portMAX_DELAY);
+  if ((_mqttPersistWrite % MQTT_PERSIST_SECTOR_SIZE) + size > MQTT_PERSIST_SECTOR_SIZE) {
+    _mqttPersistWrite = (_mqttPersistWrite / MQTT_PERSIST_SECTOR_SIZE + 1) * MQTT_PERSIST_SECTOR_SIZE;
+  };
+  if (_mqttPersistWrite >= _mqttPersistSectors * MQTT_PERSIST_SECTOR_SIZE) {
+    _mqttPersistWrite = 0;
+  };
+  if ((_mqttPersistWrite % MQTT_PERSIST_SECTOR_SIZE) == 0) {
+    mqttPersistSectorErase(_mqttPersistWrite / MQTT_PERSIST_SECTOR_SIZE);
+  };
+  hdr.seq = _mqttPersistSeq;
+  uint32_t offset = _mqttPersistWrite;
+  esp_err_t err = esp_partition_write(_mqttPersistPart, offset, &hdr, sizeof(hdr));
+  if (err == ESP_OK) err = esp_partition_write(_mqttPersistPart, offset + sizeof(hdr), topic, hdr.topic_len);
+  if ((err == ESP_OK) && (payload_len > 0)) err = esp_partition_write(_mqttPersistPart, offset + sizeof(hdr) + hdr.topic_len, payload, payload_len);
+  if (err == ESP_OK) err = mqttPersistStateWrite(offset, MQTT_PERSIST_STATE_VALID);
+  // Even a failed record occupies its place, the area after it may no longer be blank
+  _mqttPersistWrite += size;
+  _mqttPersistSeq++;
+  if (err == ESP_OK) {
+    _mqttPersistStats.stored++;
+    _mqttPersistStats.pending++;
+  };
+  xSemaphoreGiveRecursive(_mqttPersistLock);
+
+  // While connected, the record is sent as soon as the client outbox has room for it
+  if ((err == ESP_OK) && _mqttPersistTask && mqttStatesCheck(MQTTCLI_CONNECTED, false)) {
+    xTaskNotifyGive(_mqttPersistTask);
+  };
+  return err;
+}
+
+// Marking the record as sent, if it has not been overwritten since it was read
+static void mqttPersistSent(uint32_t offset, uint32_t seq)
+{
+  re_mqtt_persist_header_t hdr;
+  xSemaphoreTakeRecursive(_mqttPersistLock, portMAX_DELAY);
+  if (mqttPersistHeaderRead(offset, &hdr) && (hdr.seq == seq) && (hdr.state == MQTT_PERSIST_STATE_VALID)) {
+    mqttPersistStateWrite(offset, MQTT_PERSIST_STATE_SENT);
+    _mqttPersistStats.pending--;
+  };
+  xSemaphoreGiveRecursive(_mqttPersistLock);
+}
+
+// Called by the client task on MQTT_EVENT_PUBLISHED; flash is written by the replay task, 
+// so the client task never waits for the persistent outbox lock
+static void mqttPersistAck(int msg_id)
+{
+  bool found = false;
+  taskENTER_CRITICAL(&_mqttPersistFlightLock);
+  for (uint8_t i = 0; i < CONFIG_MQTT_OUTBOX_REPLAY_BATCH; i++) {
+    if (_mqttPersistFlight[i].msg_id == msg_id) {
+      _mqttPersistFlight[i].acked = true;
+      found = true;
+      break;
+    };
+  };
+  taskEXIT_CRITICAL(&_mqttPersistFlightLock);
+  if (found && _mqttPersistTask) xTaskNotifyGive(_mqttPersistTask);
+}
+
+// Writing acknowledged records as sent, returns the number of free slots
+static uint8_t mqttPersistCommit()
+{
+  uint8_t free_slots = 0;
+  for (uint8_t i = 0; i < CONFIG_MQTT_OUTBOX_REPLAY_BATCH; i++) {
+    taskENTER_CRITICAL(&_mqttPersistFlightLock);
+    re_mqtt_persist_flight_t flight = _mqttPersistFlight[i];
+    if (flight.acked) {
+      _mqttPersistFlight[i].msg_id = 0;
+      _mqttPersistFlight[i].acked = false;
+    };
+    taskEXIT_CRITICAL(&_mqttPersistFlightLock);
+    if (flight.acked) {
+      mqttPersistSent(flight.offset, flight.seq);
+      free_slots++;
+    } else if (flight.msg_id == 0) {
+      free_slots++;
+    };
+  };
+  return free_slots;
+}
+
+// Searching for the next unsent record in write order, from the sector following the write position
+static bool mqttPersistNext(uint32_t* offset, re_mqtt_persist_header_t* hdr)
+{
+  while (1) {
+    if (_mqttReplayCursor >= _mqttPersistSectors * MQTT_PERSIST_SECTOR_SIZE) {
+      _mqttReplayCursor = 0;
+    };
+    if (mqttPersistHeaderRead(_mqttReplayCursor, hdr)) {
+      *offset = _mqttReplayCursor;
+      _mqttReplayCursor += mqttPersistRecordSize(hdr);
+      if (hdr->state == MQTT_PERSIST_STATE_VALID) return true;
     } else {
-      if (_mqttClient && mqttStatesCheck(MQTTCLI_STARTED, false)) {
-        // Send event to suspend service
-        return eventLoopPost(RE_MQTT_EVENTS, RE_MQTT_SELF_STOP, nullptr, 0, portMAX_DELAY);
+      // The rest of the sector is blank: wait for new records in the write sector, otherwise go to the next sector
+      uint32_t sector = _mqttReplayCursor / MQTT_PERSIST_SECTOR_SIZE;
+      if (sector == _mqttPersistWrite / MQTT_PERSIST_SECTOR_SIZE) return false;
+      _mqttReplayCursor = ((sector + 1) % _mqttPersistSectors) * MQTT_PERSIST_SECTOR_SIZE;
+    };
+  };
+}
+
+// Sending the next portion of records, returns true if the client outbox is too full and the replay should be retried later
+static bool mqttPersistReplayBatch()
+{
+  uint8_t free_slots = mqttPersistCommit();
+  if (__atomic_exchange_n(&_mqttReplayRewind, false, __ATOMIC_ACQ_REL)) {
+    // New session: unacknowledged records are sent again (QoS 1 allows duplicates)
+    taskENTER_CRITICAL(&_mqttPersistFlightLock);
+    memset(_mqttPersistFlight, 0, sizeof(_mqttPersistFlight));
+    taskEXIT_CRITICAL(&_mqttPersistFlightLock);
+    free_slots = CONFIG_MQTT_OUTBOX_REPLAY_BATCH;
+    xSemaphoreTakeRecursive(_mqttPersistLock, portMAX_DELAY);
+    _mqttReplayCursor = ((_mqttPersistWrite / MQTT_PERSIST_SECTOR_SIZE + 1) % _mqttPersistSectors) * MQTT_PERSIST_SECTOR_SIZE;
+    xSemaphoreGiveRecursive(_mqttPersistLock);
+    if (_mqttPersistStats.pending > 0) {
+      rlog_i(logTAG, "Sending %d messages from persistent outbox...", _mqttPersistStats.pending);
+    };
+  };
+
+  while ((free_slots > 0) && (_mqttPersistStats.pending > 0) && mqttStatesCheck(MQTTCLI_CONNECTED, false)) {
+    if (mqttGetOutboxSize() >= CONFIG_MQTT_OUTBOX_REPLAY_WATERMARK) return true;
+
+    // The record is copied under the lock, but sent without it: the client may be waiting for it in its own task
+    uint32_t offset = 0;
+    re_mqtt_persist_header_t hdr;
+    char* buffer = nullptr;
+    bool crc_ok = false;
+    xSemaphoreTakeRecursive(_mqttPersistLock, portMAX_DELAY);
+    bool found = mqttPersistNext(&offset, &hdr);
+    if (found) {
+      // The topic must be a zero-terminated string, so the buffer has room for a terminator between topic and payload
+      buffer = (char*)mqttBufferAlloc(hdr.topic_len + hdr.payload_len + 2);
+      if (buffer) {
+        if ((esp_partition_read(_mqttPersistPart, offset + sizeof(hdr), buffer, hdr.topic_len) == ESP_OK)
+         && (esp_partition_read(_mqttPersistPart, offset + sizeof(hdr) + hdr.topic_len, buffer + hdr.topic_len + 1, hdr.payload_len) == ESP_OK)) {
+          uint32_t crc = esp_rom_crc32_le(0, (const uint8_t*)buffer, hdr.topic_len);
+          crc = esp_rom_crc32_le(crc, (const uint8_t*)buffer + hdr.topic_len + 1, hdr.payload_len);
+          crc_ok = crc == hdr.crc;
+        };
+      } else {
+        _mqttReplayCursor = offset;
       };
     };
+    xSemaphoreGiveRecursive(_mqttPersistLock);
+    if (!found || (buffer == nullptr)) break;
+
+    if (!crc_ok) {
+      _mqttPersistStats.crc_errors++;
+      mqttPersistSent(offset, hdr.seq);
+      mqttBufferFree(buffer);
+      continue;
+    };
+    buffer[hdr.topic_len] = 0;
+    int qos = hdr.flags & 0x03;
+    int msg_id = -1;
+    esp_err_t err = mqttPublishClient(buffer, buffer + hdr.topic_len + 1, hdr.payload_len, qos, (hdr.flags & 0x04) != 0, esp_timer_get_time(), &msg_id);
+    mqttBufferFree(buffer);
+    if (err != ESP_OK) {
+      // The record will be read again at the next attempt
+      xSemaphoreTakeRecursive(_mqttPersistLock, portMAX_DELAY);
+      _mqttReplayCursor = offset;
+      xSemaphoreGiveRecursive(_mqttPersistLock);
+      return true;
+    };
+    _mqttPersistStats.replayed++;
+    if ((qos > 0) && (msg_id > 0)) {
+      taskENTER_CRITICAL(&_mqttPersistFlightLock);
+      for (uint8_t i = 0; i < CONFIG_MQTT_OUTBOX_REPLAY_BATCH; i++) {
+        if (_mqttPersistFlight[i].msg_id == 0) {
+          _mqttPersistFlight[i].msg_id = msg_id;
+          _mqttPersistFlight[i].acked = false;
+          _mqttPersistFlight[i].offset = offset;
+          _mqttPersistFlight[i].seq = hdr.seq;
+          break;
+        };
+      };
+      taskEXIT_CRITICAL(&_mqttPersistFlightLock);
+      free_slots--;
+    } else {
+      // QoS 0 is never acknowledged
+      mqttPersistSent(offset, hdr.seq);
+    };
+  };
+  return false;
+}
+
+static void mqttPersistTaskExec(void *arg)
+{
+  TickType_t wait = portMAX_DELAY;
+  while (1) {
+    ulTaskNotifyTake(pdTRUE, wait);
+    wait = mqttPersistReplayBatch() ? pdMS_TO_TICKS(CONFIG_MQTT_OUTBOX_REPLAY_INTERVAL) : portMAX_DELAY;
+  };
+  vTaskDelete(nullptr);
+}
+
+static bool mqttPersistTaskStart()
+{
+  if (_mqttPersistTask == nullptr) {
+    if (xTaskCreate(mqttPersistTaskExec, "mqtt_replay", CONFIG_MQTT_OUTBOX_REPLAY_STACK_SIZE, nullptr, CONFIG_MQTT_OUTBOX_REPLAY_PRIORITY, &_mqttPersistTask) != pdPASS) {
+      _mqttPersistTask = nullptr;
+      rlog_e(logTAG, "Failed to create task [ MQTT_REPLAY ]!");
+      return false;
+    };
+  };
+  return true;
+}
+
+void mqttPersistFree()
+{
+  if (_mqttPersistTask) {
+    TaskHandle_t task = _mqttPersistTask;
+    _mqttPersistTask = nullptr;
+    vTaskDelete(task);
+  };
+}
+
+// Called after connection: saved messages are sent in write order by the replay task, in portions, 
+// as the client outbox is emptied
+static void mqttPersistReplay()
+{
+  if ((_mqttPersistPart == nullptr) || (_mqttPersistTask == nullptr)) return;
+  __atomic_store_n(&_mqttReplayRewind, true, __ATOMIC_RELEASE);
+  xTaskNotifyGive(_mqttPersistTask);
+}
+
+void mqttPersistGetStats(re_mqtt_persist_stats_t* stats)
+{
+  if (stats) memcpy(stats, &_mqttPersistStats, sizeof(re_mqtt_persist_stats_t));
+}
+
+#else
+
+bool mqttPersistInit()
+{
+  return true;
+}
+
+static bool mqttPersistAccepted(int qos)
+{
+  return false;
+}
+
+static esp_err_t mqttPersistPut(const char *topic, const char *payload, size_t payload_len, int qos, bool retained)
+{
+  return ESP_ERR_NOT_SUPPORTED;
+}
+
+void mqttPersistFree()
+{
+}
+
+static void mqttPersistAck(int msg_id)
+{
+}
+
+static void mqttPersistReplay()
+{
+}
+
+void mqttPersistGetStats(re_mqtt_persist_stats_t* stats)
+{
+  if (stats) memset(stats, 0, sizeof(re_mqtt_persist_stats_t));
+}
+
+#endif // CONFIG_MQTT_OUTBOX_PERSISTENT
+
+// -----------------------------------------------------------------------------------------------------------------------
+// ---------------------------------------------------- Paced sender -----------------------------------------------------
+// -----------------------------------------------------------------------------------------------------------------------
+
+#if (defined(CONFIG_MQTT_RATE_LIMIT) && CONFIG_MQTT_RATE_LIMIT) || (defined(CONFIG_MQTT_PUBLISH_QUEUE) && CONFIG_MQTT_PUBLISH_QUEUE)
+
+#include "esp_timer.h"
+
+#ifndef CONFIG_MQTT_RATE_LIMIT
+  #define CONFIG_MQTT_RATE_LIMIT 0
+#endif // CONFIG_MQTT_RATE_LIMIT
+#ifndef CONFIG_MQTT_PUBLISH_QUEUE
+  #define CONFIG_MQTT_PUBLISH_QUEUE 0
+#endif // CONFIG_MQTT_PUBLISH_QUEUE
+
+// Token bucket parameters for each broker: messages per second, bytes per second (0 - unlimited) and burst size
+#if !CONFIG_MQTT_RATE_LIMIT
+  #undef CONFIG_MQTT1_RATE_MESSAGES
+  #undef CONFIG_MQTT1_RATE_BYTES
+  #undef CONFIG_MQTT2_RATE_MESSAGES
+  #undef CONFIG_MQTT2_RATE_BYTES
+#endif // CONFIG_MQTT_RATE_LIMIT
+#ifndef CONFIG_MQTT1_RATE_MESSAGES
+  #define CONFIG_MQTT1_RATE_MESSAGES 0
+#endif // CONFIG_MQTT1_RATE_MESSAGES
+#ifndef CONFIG_MQTT1_RATE_BYTES
+  #define CONFIG_MQTT1_RATE_BYTES 0
+#endif // CONFIG_MQTT1_RATE_BYTES
+#ifndef CONFIG_MQTT1_RATE_BURST
+  #define CONFIG_MQTT1_RATE_BURST 1
+#endif // CONFIG_MQTT1_RATE_BURST
+#ifndef CONFIG_MQTT2_RATE_MESSAGES
+  #define CONFIG_MQTT2_RATE_MESSAGES 0
+#endif // CONFIG_MQTT2_RATE_MESSAGES
+#ifndef CONFIG_MQTT2_RATE_BYTES
+  #define CONFIG_MQTT2_RATE_BYTES 0
+#endif // CONFIG_MQTT2_RATE_BYTES
+#ifndef CONFIG_MQTT2_RATE_BURST
+  #define CONFIG_MQTT2_RATE_BURST 1
+#endif // CONFIG_MQTT2_RATE_BURST
+#ifndef CONFIG_MQTT_SENDER_QUEUE_SIZE
+  #ifdef CONFIG_MQTT_RATE_QUEUE_SIZE
+    #define CONFIG_MQTT_SENDER_QUEUE_SIZE CONFIG_MQTT_RATE_QUEUE_SIZE
+  #else
+    #define CONFIG_MQTT_SENDER_QUEUE_SIZE 32
+  #endif // CONFIG_MQTT_RATE_QUEUE_SIZE
+#endif // CONFIG_MQTT_SENDER_QUEUE_SIZE
+// Topic and payload up to this size are copied directly into the ring cell, longer messages take a buffer from the pool
+#ifndef CONFIG_MQTT_SENDER_ITEM_SIZE
+  #define CONFIG_MQTT_SENDER_ITEM_SIZE 256
+#endif // CONFIG_MQTT_SENDER_ITEM_SIZE
+#ifndef CONFIG_MQTT_SENDER_STACK_SIZE
+  #define CONFIG_MQTT_SENDER_STACK_SIZE 3072
+#endif // CONFIG_MQTT_SENDER_STACK_SIZE
+#ifndef CONFIG_MQTT_SENDER_PRIORITY
+  #define CONFIG_MQTT_SENDER_PRIORITY CONFIG_TASK_PRIORITY_MQTT_CLIENT
+#endif // CONFIG_MQTT_SENDER_PRIORITY
+
+static_assert((CONFIG_MQTT_SENDER_QUEUE_SIZE & (CONFIG_MQTT_SENDER_QUEUE_SIZE - 1)) == 0, "CONFIG_MQTT_SENDER_QUEUE_SIZE must be a power of two");
+
+#define MQTT_TOKEN_UNIT 1000000LL  // Tokens are counted in millionths to refill them every microsecond
+
+typedef struct {
+  uint32_t msg_rate;
+  uint32_t byte_rate;
+  uint32_t burst;
+  int64_t  msg_tokens;
+  int64_t  byte_tokens;
+  int64_t  updated;
+} re_mqtt_bucket_t;
+
+typedef struct {
+  int64_t  queued;
+  char*    topic;
+  char*    payload;
+  size_t   payload_len;
+  int      qos;
+  bool     retained;
+  char*    buffer;       // Buffer of a message that does not fit into the cell, otherwise nullptr
+} re_mqtt_paced_t;
+
+// Cell of a bounded multi-producer ring: the sequence number tells whose turn it is to use the cell;
+// the message is stored in the cell itself, so producers do not allocate memory
+typedef struct {
+  uint32_t sequence;
+  re_mqtt_paced_t item;
+  char     data[CONFIG_MQTT_SENDER_ITEM_SIZE];
+} re_mqtt_ring_cell_t;
+
+static re_mqtt_bucket_t _mqttBuckets[2] = {
+  { CONFIG_MQTT1_RATE_MESSAGES, CONFIG_MQTT1_RATE_BYTES, CONFIG_MQTT1_RATE_BURST, 0, 0, 0 },
+  { CONFIG_MQTT2_RATE_MESSAGES, CONFIG_MQTT2_RATE_BYTES, CONFIG_MQTT2_RATE_BURST, 0, 0, 0 }
+};
+static re_mqtt_ring_cell_t _mqttRing[CONFIG_MQTT_SENDER_QUEUE_SIZE];
+static uint32_t _mqttRingHead = 0;   // Next cell for producers
+static uint32_t _mqttRingTail = 0;   // Next cell for the sender task
+static bool _mqttRingReady = false;
+static TaskHandle_t _mqttPacerTask = nullptr;
+static re_mqtt_pacer_stats_t _mqttPacerStats;
+
+static re_mqtt_bucket_t* mqttPacerBucket()
+{
+  return &_mqttBuckets[_mqttData.primary ? 0 : 1];
+}
+
+static bool mqttPacerActive()
+{
+  if (_mqttPacerTask == nullptr) return false;
+  #if CONFIG_MQTT_PUBLISH_QUEUE
+    return true;
+  #else
+    re_mqtt_bucket_t* bucket = mqttPacerBucket();
+    return (bucket->msg_rate > 0) || (bucket->byte_rate > 0);
+  #endif // CONFIG_MQTT_PUBLISH_QUEUE
+}
+
+// Reserving a cell for a new message, never waits for other producers or for the sender task
+static re_mqtt_ring_cell_t* mqttRingClaim(uint32_t* pos)
+{
+  *pos = __atomic_load_n(&_mqttRingHead, __ATOMIC_RELAXED);
+  while (1) {
+    re_mqtt_ring_cell_t* cell = &_mqttRing[*pos & (CONFIG_MQTT_SENDER_QUEUE_SIZE - 1)];
+    int32_t diff = (int32_t)(__atomic_load_n(&cell->sequence, __ATOMIC_ACQUIRE) - *pos);
+    if (diff == 0) {
+      if (__atomic_compare_exchange_n(&_mqttRingHead, pos, *pos + 1, true, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) return cell;
+    } else if (diff < 0) {
+      // The ring is full
+      return nullptr;
+    } else {
+      *pos = __atomic_load_n(&_mqttRingHead, __ATOMIC_RELAXED);
+    };
+  };
+}
+
+// Passing the filled cell to the sender task
+static void mqttRingCommit(re_mqtt_ring_cell_t* cell, uint32_t pos)
+{
+  __atomic_store_n(&cell->sequence, pos + 1, __ATOMIC_RELEASE);
+}
+
+// The next message for the sender task; it stays in the cell until mqttRingRelease(), only the sender task calls it
+static re_mqtt_paced_t* mqttRingPeek()
+{
+  re_mqtt_ring_cell_t* cell = &_mqttRing[_mqttRingTail & (CONFIG_MQTT_SENDER_QUEUE_SIZE - 1)];
+  if (__atomic_load_n(&cell->sequence, __ATOMIC_ACQUIRE) != _mqttRingTail + 1) return nullptr;
+  return &cell->item;
+}
+
+static void mqttRingRelease()
+{
+  re_mqtt_ring_cell_t* cell = &_mqttRing[_mqttRingTail & (CONFIG_MQTT_SENDER_QUEUE_SIZE - 1)];
+  if (cell->item.buffer) {
+    mqttBufferFree(cell->item.buffer);
+    cell->item.buffer = nullptr;
+  };
+  __atomic_store_n(&cell->sequence, _mqttRingTail + CONFIG_MQTT_SENDER_QUEUE_SIZE, __ATOMIC_RELEASE);
+  // Producers read the tail for queue_max
+  __atomic_store_n(&_mqttRingTail, _mqttRingTail + 1, __ATOMIC_RELAXED);
+}
+
+// Returns the time in microseconds until the bucket has enough tokens for the message
+static int64_t mqttPacerTake(re_mqtt_bucket_t* bucket, size_t size)
+{
+  int64_t now = esp_timer_get_time();
+  int64_t elapsed = bucket->updated > 0 ? now - bucket->updated : INT32_MAX;
+  bucket->updated = now;
+  int64_t wait = 0;
+
+  if (bucket->msg_rate > 0) {
+    int64_t limit = (int64_t)(bucket->burst > 0 ? bucket->burst : 1) * MQTT_TOKEN_UNIT;
+    bucket->msg_tokens += elapsed * bucket->msg_rate;
+    if (bucket->msg_tokens > limit) bucket->msg_tokens = limit;
+    if (bucket->msg_tokens < MQTT_TOKEN_UNIT) {
+      wait = (MQTT_TOKEN_UNIT - bucket->msg_tokens) / bucket->msg_rate + 1;
+    };
+  };
+  if (bucket->byte_rate > 0) {
+    // A message larger than the bucket is allowed when the bucket is full
+    int64_t limit = (int64_t)bucket->byte_rate * MQTT_TOKEN_UNIT;
+    int64_t need = (int64_t)size * MQTT_TOKEN_UNIT;
+    if (need > limit) need = limit;
+    bucket->byte_tokens += elapsed * bucket->byte_rate;
+    if (bucket->byte_tokens > limit) bucket->byte_tokens = limit;
+    if (bucket->byte_tokens < need) {
+      int64_t byte_wait = (need - bucket->byte_tokens) / bucket->byte_rate + 1;
+      if (byte_wait > wait) wait = byte_wait;
+    };
+  };
+  if (wait == 0) {
+    if (bucket->msg_rate > 0) bucket->msg_tokens -= MQTT_TOKEN_UNIT;
+    if (bucket->byte_rate > 0) bucket->byte_tokens -= (int64_t)size * MQTT_TOKEN_UNIT;
+  };
+  return wait;
+}
+
+static void mqttPacerSend(re_mqtt_paced_t* item)
+{
+  esp_err_t err = ESP_OK;
+  if (mqttStatesCheck(MQTTCLI_CONNECTED, false)) {
+    size_t size = strlen(item->topic) + item->payload_len;
+    bool throttled = false;
+    int64_t wait;
+    mqttFaultDelay(item->queued);
+    while ((wait = mqttPacerTake(mqttPacerBucket(), size)) > 0) {
+      throttled = true;
+      vTaskDelay(pdMS_TO_TICKS(wait / 1000) + 1);
+    };
+    uint32_t delay = (esp_timer_get_time() - item->queued) / 1000;
+    _mqttPacerStats.sent++;
+    if (throttled) _mqttPacerStats.throttled++;
+    _mqttPacerStats.delay_total_ms += delay;
+    if (delay > _mqttPacerStats.delay_max_ms) {
+      _mqttPacerStats.delay_max_ms = delay;
+    };
+    err = mqttPublishClient(item->topic, item->payload, item->payload_len, item->qos, item->retained, item->queued, nullptr);
+  } else {
+    // The connection was lost while the message was in the queue: it goes to the outboxes, like any message published offline
+    err = mqttPublishOffline(item->topic, item->payload, item->payload_len, item->qos, item->retained, item->queued);
+  };
+  if (err != ESP_OK) {
+    mqttStatsAdd(publish_failed, 1);
+    rlog_e(logTAG, "Failed to publish to topic \"%s\": %d, %s", item->topic, err, esp_err_to_name(err));
+    mqttErrorEventSendCode("Failed to publish to topic \"%s\": %d, %s", item->topic, err);
+  };
+}
+
+static void mqttPacerTaskExec(void *arg)
+{
+  re_mqtt_paced_t* item = nullptr;
+  while (1) {
+    ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+    // All messages accumulated since the last wake-up are transferred to the client in one pass
+    while ((item = mqttRingPeek()) != nullptr) {
+      mqttPacerSend(item);
+      mqttRingRelease();
+    };
+  };
+  vTaskDelete(nullptr);
+}
+
+bool mqttPacerInit()
+{
+  if (!_mqttRingReady) {
+    memset(&_mqttPacerStats, 0, sizeof(_mqttPacerStats));
+    for (uint32_t i = 0; i < CONFIG_MQTT_SENDER_QUEUE_SIZE; i++) {
+      _mqttRing[i].sequence = i;
+      _mqttRing[i].item.buffer = nullptr;
+    };
+    _mqttRingHead = 0;
+    _mqttRingTail = 0;
+    _mqttRingReady = true;
+  };
+  if (_mqttPacerTask == nullptr) {
+    if (xTaskCreate(mqttPacerTaskExec, "mqtt_send", CONFIG_MQTT_SENDER_STACK_SIZE, nullptr, CONFIG_MQTT_SENDER_PRIORITY, &_mqttPacerTask) != pdPASS) {
+      _mqttPacerTask = nullptr;
+      rlog_e(logTAG, "Failed to create task [ MQTT_SEND ]!");
+      return false;
+    };
+  };
+  return true;
+}
+
+void mqttPacerFree()
+{
+  if (_mqttPacerTask) {
+    TaskHandle_t task = _mqttPacerTask;
+    _mqttPacerTask = nullptr;
+    vTaskDelete(task);
+  };
+  if (_mqttRingReady) {
+    while (mqttRingPeek() != nullptr) {
+      mqttRingRelease();
+    };
+    _mqttRingReady = false;
+  };
+}
+
+static esp_err_t mqttPacerPut(const char *topic, const char *payload, size_t payload_len, int qos, bool retained)
+{
+  size_t topic_len = strlen(topic);
+  size_t size = topic_len + payload_len + 2;
+  // Only messages that do not fit into the cell need a buffer, it is taken before the cell so as not to hold the cell
+  char* buffer = nullptr;
+  if (size > CONFIG_MQTT_SENDER_ITEM_SIZE) {
+    buffer = (char*)mqttBufferAlloc(size);
+    if (buffer == nullptr) return ESP_ERR_NO_MEM;
+  };
+  uint32_t pos;
+  re_mqtt_ring_cell_t* cell = mqttRingClaim(&pos);
+  if (cell == nullptr) {
+    mqttBufferFree(buffer);
+    __atomic_add_fetch(&_mqttPacerStats.overflows, 1, __ATOMIC_RELAXED);
+    return ESP_ERR_NO_MEM;
+  };
+  re_mqtt_paced_t* item = &cell->item;
+  item->queued = esp_timer_get_time();
+  item->buffer = buffer;
+  item->topic = buffer ? buffer : cell->data;
+  memcpy(item->topic, topic, topic_len);
+  item->topic[topic_len] = 0;
+  item->payload = item->topic + topic_len + 1;
+  item->payload_len = payload_len;
+  if (payload_len > 0) memcpy(item->payload, payload, payload_len);
+  item->payload[payload_len] = 0;
+  item->qos = qos;
+  item->retained = retained;
+  mqttRingCommit(cell, pos);
+  uint32_t used = __atomic_load_n(&_mqttRingHead, __ATOMIC_RELAXED) - __atomic_load_n(&_mqttRingTail, __ATOMIC_RELAXED);
+  mqttStatsMax(&_mqttPacerStats.queue_max, used);
+  TaskHandle_t task = _mqttPacerTask;
+  if (task) xTaskNotifyGive(task);
+  return ESP_OK;
+}
+
+void mqttPacerGetStats(re_mqtt_pacer_stats_t* stats)
+{
+  if (stats) memcpy(stats, &_mqttPacerStats, sizeof(re_mqtt_pacer_stats_t));
+}
+
+#else
+
+bool mqttPacerInit()
+{
+  return true;
+}
+
+void mqttPacerFree()
+{
+}
+
+static bool mqttPacerActive()
+{
+  return false;
+}
+
+static esp_err_t mqttPacerPut(const char *topic, const char *payload, size_t payload_len, int qos, bool retained)
+{
+  return ESP_ERR_NOT_SUPPORTED;
+}
+
+void mqttPacerGetStats(re_mqtt_pacer_stats_t* stats)
+{
+  if (stats) memset(stats, 0, sizeof(re_mqtt_pacer_stats_t));
+}
+
+#endif // CONFIG_MQTT_RATE_LIMIT || CONFIG_MQTT_PUBLISH_QUEUE
+
+// -----------------------------------------------------------------------------------------------------------------------
+// ------------------------------------------------------ Publish --------------------------------------------------------
+// -----------------------------------------------------------------------------------------------------------------------
+
+// Transferring the message to the client outbox or directly to the broker
+static esp_err_t mqttPublishClient(const char *topic, const char *payload, size_t payload_len, int qos, bool retained, int64_t started, int* msg_id)
+{
+  esp_err_t err = mqttFaultPublish();
+  if (err != ESP_OK) return err;
+
+  uint32_t ticket;
+  esp_mqtt_client_handle_t client = mqttClientAcquire(&ticket);
+  if (client == nullptr) {
+    mqttClientRelease(ticket);
+    return ESP_ERR_INVALID_STATE;
+  };
+
+  #if defined(CONFIG_MQTT_MAX_OUTBOX_SIZE) && (CONFIG_MQTT_MAX_OUTBOX_SIZE > 0)
+    bool _enqueueOutbox = esp_mqtt_client_get_outbox_size(client) < CONFIG_MQTT_MAX_OUTBOX_SIZE;
+  #else
+    bool _enqueueOutbox = true;
+  #endif // CONFIG_MQTT_MAX_OUTBOX_SIZE
+
+  #if defined(CONFIG_MQTT_MAX_OUTBOX_MESSAGE_SIZE) && (CONFIG_MQTT_MAX_OUTBOX_MESSAGE_SIZE > 0)
+    bool _enqueueMessage = payload_len < CONFIG_MQTT_MAX_OUTBOX_MESSAGE_SIZE;
+  #else
+    bool _enqueueMessage = true;
+  #endif // CONFIG_MQTT_MAX_OUTBOX_MESSAGE_SIZE
+
+  int id = -1;
+  if (mqttStatesCheck(MQTTCLI_CONNECTED, false)) {
+    if (_enqueueOutbox && _enqueueMessage) {
+      id = esp_mqtt_client_enqueue(client, topic, payload, payload_len, qos, retained, true);
+    } else {
+      id = esp_mqtt_client_publish(client, topic, payload, payload_len, qos, retained);
+    };
+    id > -1 ? err = ESP_OK : err = ESP_FAIL;
+  } else {
+    if (_enqueueOutbox && _enqueueMessage) {
+      id = esp_mqtt_client_enqueue(client, topic, payload, payload_len, qos, retained, true);
+      id > -1 ? err = ESP_OK : err = ESP_FAIL;
+    } else {
+      err = ESP_ERR_INVALID_STATE;
+    };
+  };
+  // Only QoS 1 and 2 messages are acknowledged by the broker
+  if ((qos > 0) && (id > 0)) {
+    mqttLatencyStart(id, topic, started);
+    mqttHandoverPut(client, id, topic, payload, payload_len, qos, retained);
+  };
+  if (msg_id) *msg_id = id;
+  if ((err == ESP_OK) && _enqueueOutbox && _enqueueMessage) {
+    mqttStatsMax(&_mqttStats.outbox_max, esp_mqtt_client_get_outbox_size(client));
+  };
+  mqttClientRelease(ticket);
+  if (err == ESP_OK) {
+    // Messages are counted once, when they are handed over to the client, wherever they were queued before
+    mqttStatsAdd(publish_ok, 1);
+    mqttStatsAdd(bytes_out, strlen(topic) + payload_len);
+    mqttLogPublish(topic, payload, payload_len, qos, retained);
   };
-  return false;
+  return err;
 }
 
-// Server status change (by ping)
-bool mqttServer2SetAvailable(bool newAvailable)
+// The message is kept by the library until it can be sent: in flash or (without connection) in the managed outbox, 
+// otherwise in the client outbox
+static esp_err_t mqttPublishOffline(const char *topic, const char *payload, size_t payload_len, int qos, bool retained, int64_t started)
 {
-  if (mqttStatesCheck(MQTTCLI_SERVER2_AVAILABLED, false) != newAvailable) {
-    mqttStatesSetBit(MQTTCLI_SERVER2_AVAILABLED, newAvailable);
-    return mqttServerSelectAuto();
+  if (mqttPersistAccepted(qos) && (mqttPersistPut(topic, payload, payload_len, qos, retained) == ESP_OK)) {
+    // The message will be sent after connection (even after a reboot) or when the client outbox is emptied
+    rlog_d(logTAG, "Message for topic \"%s\" is saved to flash", topic);
+    return ESP_OK;
   };
-  return false;
+  if (!mqttStatesCheck(MQTTCLI_CONNECTED, false)
+   && mqttOutboxAccepted(qos, retained) && (mqttOutboxPut(topic, payload, payload_len, qos, retained) == ESP_OK)) {
+    // The message will be sent after connection
+    rlog_d(logTAG, "Message for topic \"%s\" is pending until connected", topic);
+    return ESP_OK;
+  };
+  return mqttPublishClient(topic, payload, payload_len, qos, retained, started, nullptr);
 }
 
-#else
-
-bool mqttServerSelectAuto()
+static esp_err_t mqttPublishInternal(const char *topic, const char *payload, size_t payload_len, int qos, bool retained)
 {
-  if (mqttServer1Enabled()) {
-    mqttStatesClear(MQTTCLI_SERVER2_ACTIVE);
-    if (_mqttClient) {
-      // The client is not running yet - you can just run it from this task
-      return mqttClientRestart() == ESP_OK;
+  esp_err_t err = ESP_ERR_INVALID_ARG;
+
+  if (mqttStatesCheck(MQTTCLI_CONNECTED, false) && !mqttPersistAccepted(qos)) {
+    if (mqttPacerActive()) {
+      // The message will be sent by the sender task at the rate allowed by the broker;
+      // if the queue is full, the message is rejected so as not to exceed the rate or overtake queued messages
+      err = mqttPacerPut(topic, payload, payload_len, qos, retained);
     } else {
-      // The client has not yet been created
-      return mqttClientCreate() == ESP_OK;
+      err = mqttPublishClient(topic, payload, payload_len, qos, retained, esp_timer_get_time(), nullptr);
     };
   } else {
-    // Send event to suspend service
-    return eventLoopPost(RE_MQTT_EVENTS, RE_MQTT_SELF_STOP, nullptr, 0, portMAX_DELAY);
+    err = mqttPublishOffline(topic, payload, payload_len, qos, retained, esp_timer_get_time());
+  };
+
+  if (err != ESP_OK) {
+    mqttStatsAdd(publish_failed, 1);
+    rlog_e(logTAG, "Failed to publish to topic \"%s\": %d, %s", topic, err, esp_err_to_name(err));
+    mqttErrorEventSendCode("Failed to publish to topic \"%s\": %d, %s", topic, err);
   };
+  return err;
 }
 
-#endif // CONFIG_MQTT2_TYPE
+esp_err_t mqttPublish(char *topic, char *payload, int qos, bool retained, bool free_topic, bool free_payload)
+{
+  esp_err_t err = ESP_ERR_INVALID_ARG;
+  if (topic != nullptr) {
+    err = mqttPublishInternal(topic, payload, payload ? strlen(payload) : 0, qos, retained);
+  };
+  if (free_topic && (topic != nullptr)) free(topic);
+  if (free_payload && (payload != nullptr)) free(payload);
+  return err;
+}
 
-// Server status change (by ping)
-bool mqttServer1SetAvailable(bool newAvailable)
+esp_err_t mqttPublishEx(char *topic, const void *payload, size_t payload_len, int qos, bool retained, bool free_topic, bool free_payload)
 {
-  if (mqttStatesCheck(MQTTCLI_SERVER1_AVAILABLED, false) != newAvailable) {
-    mqttStatesSetBit(MQTTCLI_SERVER1_AVAILABLED, newAvailable);
-    return mqttServerSelectAuto();
+  esp_err_t err = ESP_ERR_INVALID_ARG;
+  if (topic != nullptr) {
+    err = mqttPublishInternal(topic, (const char*)payload, payload ? payload_len : 0, qos, retained);
   };
-  return false;
+  if (free_topic && (topic != nullptr)) free(topic);
+  if (free_payload && (payload != nullptr)) free((void*)payload);
+  return err;
 }
 
-// Server status change (by internet)
-bool mqttServerSetInetAvailable(bool internetAvailable)
+#ifndef CONFIG_MQTT_PUBLISHV_STACK_SIZE
+  #define CONFIG_MQTT_PUBLISHV_STACK_SIZE 128
+#endif // CONFIG_MQTT_PUBLISHV_STACK_SIZE
+
+esp_err_t mqttPublishV(char *topic, const mqtt_iovec_t *iov, size_t iovcnt, int qos, bool retained, bool free_topic)
 {
-  mqttStatesSetBit(MQTTCLI_INET_AVAILABLED, internetAvailable);
-  return mqttServerSelectAuto();
+  esp_err_t err = ESP_ERR_INVALID_ARG;
+  if ((topic != nullptr) && ((iov != nullptr) || (iovcnt == 0))) {
+    size_t payload_len = 0;
+    for (size_t i = 0; i < iovcnt; i++) {
+      payload_len += iov[i].len;
+    };
+    // Fragments are assembled once: on the stack for short messages, otherwise in a pool buffer
+    char stack_buffer[CONFIG_MQTT_PUBLISHV_STACK_SIZE];
+    char* payload = payload_len <= sizeof(stack_buffer) ? stack_buffer : (char*)mqttBufferAlloc(payload_len);
+    if (payload_len == 0) {
+      // An empty message, nothing to assemble
+      err = mqttPublishInternal(topic, nullptr, 0, qos, retained);
+    } else if (payload) {
+      size_t offset = 0;
+      for (size_t i = 0; i < iovcnt; i++) {
+        if (iov[i].len > 0) {
+          memcpy(payload + offset, iov[i].data, iov[i].len);
+          offset += iov[i].len;
+        };
+      };
+      err = mqttPublishInternal(topic, payload, payload_len, qos, retained);
+      if (payload != stack_buffer) mqttBufferFree(payload);
+    } else {
+      err = ESP_ERR_NO_MEM;
+      mqttStatsAdd(publish_failed, 1);
+      rlog_e(logTAG, "Failed to publish to topic \"%s\": %d, %s", topic, err, esp_err_to_name(err));
+      mqttErrorEventSendCode("Failed to publish to topic \"%s\": %d, %s", topic, err);
+    };
+  };
+  if (iov != nullptr) {
+    for (size_t i = 0; i < iovcnt; i++) {
+      if (iov[i].free_data && (iov[i].data != nullptr)) free((void*)iov[i].data);
+    };
+  };
+  if (free_topic && (topic != nullptr)) free(topic);
+  return err;
 }
 
 // -----------------------------------------------------------------------------------------------------------------------
-// ----------------------------------------------------- Subscribe -------------------------------------------------------
+// ---------------------------------------------------- Topic handles ----------------------------------------------------
 // -----------------------------------------------------------------------------------------------------------------------
 
-bool mqttSubscribe(const char *topic, int qos)
+// The topic string is stored once in the same buffer as the handle
+struct re_mqtt_topic_t {
+  re_mqtt_topic_t* next;
+  uint32_t refs;
+  size_t   topic_len;
+  char*    topic;
+};
+
+static re_mqtt_topic_t* _mqttTopics = nullptr;
+static portMUX_TYPE _mqttTopicsLock = portMUX_INITIALIZER_UNLOCKED;
+
+static re_mqtt_topic_t* mqttTopicFind(const char* topic, size_t topic_len)
 {
-  if (mqttStatesCheck(MQTTCLI_CONNECTED, false) && (topic != nullptr)) {
-    if (esp_mqtt_client_subscribe(_mqttClient, topic, qos) == -1) {
-      rlog_e(logTAG, "Failed to subscribe to topic \"%s\"", topic);
-      mqttErrorEventSend("Failed to subscribe to topic \"%s\"", topic);
-      return false;
+  re_mqtt_topic_t* item = _mqttTopics;
+  while (item) {
+    if ((item->topic_len == topic_len) && (memcmp(item->topic, topic, topic_len) == 0)) {
+      return item;
     };
-    rlog_i(logTAG, "Subscribed to: \"%s\"", topic);
-    return true;
+    item = item->next;
   };
-  return false;
+  return nullptr;
 }
 
-bool mqttUnsubscribe(const char *topic)
+mqtt_topic_handle_t mqttTopicRegister(const char* topic)
 {
-  if (mqttStatesCheck(MQTTCLI_CONNECTED, false) && (topic != nullptr)) {
-    if (esp_mqtt_client_unsubscribe(_mqttClient, topic) == -1) {
-      rlog_e(logTAG, "Failed to unsubscribe from topic \"%s\"", topic);
-      mqttErrorEventSend("Failed to unsubscribe from topic \"%s\"", topic);
-      return false;
+  if (topic == nullptr) return nullptr;
+  size_t topic_len = strlen(topic);
+
+  // Repeated registration returns the same handle
+  taskENTER_CRITICAL(&_mqttTopicsLock);
+  re_mqtt_topic_t* item = mqttTopicFind(topic, topic_len);
+  if (item) item->refs++;
+  taskEXIT_CRITICAL(&_mqttTopicsLock);
+  if (item) return item;
+
+  re_mqtt_topic_t* created = (re_mqtt_topic_t*)esp_calloc(1, sizeof(re_mqtt_topic_t) + topic_len + 1);
+  if (created == nullptr) {
+    rlog_e(logTAG, "Failed to register topic \"%s\": out of memory", topic);
+    return nullptr;
+  };
+  created->refs = 1;
+  created->topic_len = topic_len;
+  created->topic = (char*)created + sizeof(re_mqtt_topic_t);
+  memcpy(created->topic, topic, topic_len + 1);
+
+  taskENTER_CRITICAL(&_mqttTopicsLock);
+  item = mqttTopicFind(topic, topic_len);
+  if (item) {
+    item->refs++;
+  } else {
+    created->next = _mqttTopics;
+    _mqttTopics = created;
+    item = created;
+    created = nullptr;
+  };
+  taskEXIT_CRITICAL(&_mqttTopicsLock);
+  if (created) free(created);
+  return item;
+}
+
+void mqttTopicUnregister(mqtt_topic_handle_t handle)
+{
+  if (handle == nullptr) return;
+  bool removed = false;
+  taskENTER_CRITICAL(&_mqttTopicsLock);
+  if (--handle->refs == 0) {
+    re_mqtt_topic_t** prev = &_mqttTopics;
+    while (*prev) {
+      if (*prev == handle) {
+        *prev = handle->next;
+        removed = true;
+        break;
+      };
+      prev = &(*prev)->next;
     };
-    rlog_i(logTAG, "Unsubscribed from: \"%s\"", topic);
-    return true;
   };
-  return false;
+  taskEXIT_CRITICAL(&_mqttTopicsLock);
+  if (removed) free(handle);
+}
+
+const char* mqttTopicGetName(mqtt_topic_handle_t handle)
+{
+  return handle ? handle->topic : nullptr;
+}
+
+esp_err_t mqttPublishTopic(mqtt_topic_handle_t handle, char *payload, int qos, bool retained, bool free_payload)
+{
+  esp_err_t err = ESP_ERR_INVALID_ARG;
+  if (handle != nullptr) {
+    err = mqttPublishInternal(handle->topic, payload, payload ? strlen(payload) : 0, qos, retained);
+  };
+  if (free_payload && (payload != nullptr)) free(payload);
+  return err;
 }
 
 // -----------------------------------------------------------------------------------------------------------------------
-// ------------------------------------------------------ Publish --------------------------------------------------------
+// -------------------------------------------------- Reconnect scheduler ------------------------------------------------
 // -----------------------------------------------------------------------------------------------------------------------
 
-esp_err_t mqttPublish(char *topic, char *payload, int qos, bool retained, bool free_topic, bool free_payload)
+#if defined(CONFIG_MQTT_RECONNECT_BACKOFF) && CONFIG_MQTT_RECONNECT_BACKOFF
+
+#if ESP_IDF_VERSION_MAJOR < 5
+  #include "esp_system.h"
+#else
+  #include "esp_mac.h"
+#endif // ESP_IDF_VERSION_MAJOR
+
+#ifndef CONFIG_MQTT_RECONNECT_FIRST
+  #define CONFIG_MQTT_RECONNECT_FIRST 1000
+#endif // CONFIG_MQTT_RECONNECT_FIRST
+#ifndef CONFIG_MQTT_RECONNECT_MAX
+  #define CONFIG_MQTT_RECONNECT_MAX 300000
+#endif // CONFIG_MQTT_RECONNECT_MAX
+
+static esp_timer_handle_t _mqttRetryTimer = nullptr;
+static uint32_t _mqttRetryBase = 0;
+static uint32_t _mqttRetryCount = 0;
+static uint32_t _mqttRetrySeed = 0;
+
+// xorshift32: the sequence is unique for each device, so that devices do not reconnect in lockstep
+static uint32_t mqttRetryRandom()
 {
-  esp_err_t err = ESP_ERR_INVALID_ARG;
+  _mqttRetrySeed ^= _mqttRetrySeed << 13;
+  _mqttRetrySeed ^= _mqttRetrySeed >> 17;
+  _mqttRetrySeed ^= _mqttRetrySeed << 5;
+  return _mqttRetrySeed;
+}
 
-  if (topic != nullptr) {
-    size_t payload_len;
-    if (payload == nullptr) {
-      payload_len = 0;
+static void mqttRetryTimerEnd(void* arg)
+{
+  uint32_t ticket;
+  esp_mqtt_client_handle_t client = mqttClientAcquire(&ticket);
+  if (client && mqttStatesCheck(MQTTCLI_STARTED, false) && !mqttStatesCheck(MQTTCLI_CONNECTED, false)) {
+    esp_mqtt_client_reconnect(client);
+  };
+  mqttClientRelease(ticket);
+}
+
+// The built-in reconnect interval of the client becomes a fallback above the cap, reconnects are initiated by the scheduler
+static void mqttRetryConfig(esp_mqtt_client_config_t * mqttCfg)
+{
+  #if ESP_IDF_VERSION_MAJOR < 5
+    if (!mqttCfg->disable_auto_reconnect) {
+      _mqttRetryBase = mqttCfg->reconnect_timeout_ms;
+      mqttCfg->reconnect_timeout_ms = CONFIG_MQTT_RECONNECT_MAX + CONFIG_MQTT_RECONNECT_MAX / 4;
+    } else {
+      _mqttRetryBase = 0;
+    };
+  #else
+    if (!mqttCfg->network.disable_auto_reconnect) {
+      _mqttRetryBase = mqttCfg->network.reconnect_timeout_ms;
+      mqttCfg->network.reconnect_timeout_ms = CONFIG_MQTT_RECONNECT_MAX + CONFIG_MQTT_RECONNECT_MAX / 4;
     } else {
-      payload_len = strlen(payload);
+      _mqttRetryBase = 0;
     };
+  #endif // ESP_IDF_VERSION_MAJOR
+}
 
-    #if defined(CONFIG_MQTT_MAX_OUTBOX_SIZE) && (CONFIG_MQTT_MAX_OUTBOX_SIZE > 0)
-      bool _enqueueOutbox = esp_mqtt_client_get_outbox_size(_mqttClient) < CONFIG_MQTT_MAX_OUTBOX_SIZE;
-    #else
-      bool _enqueueOutbox = true;
-    #endif // CONFIG_MQTT_MAX_OUTBOX_SIZE
+// The first retry is fast, then the interval doubles up to the cap; the actual delay is random in the upper half of the interval
+static void mqttRetrySchedule()
+{
+  if ((_mqttRetryTimer == nullptr) || (_mqttRetryBase == 0)) return;
+  uint64_t interval = CONFIG_MQTT_RECONNECT_FIRST;
+  if (_mqttRetryCount > 0) {
+    interval = (uint64_t)_mqttRetryBase << (_mqttRetryCount < 16 ? _mqttRetryCount - 1 : 15);
+    if (interval > CONFIG_MQTT_RECONNECT_MAX) interval = CONFIG_MQTT_RECONNECT_MAX;
+  };
+  uint32_t delay = interval / 2 + mqttRetryRandom() % (interval / 2 + 1);
+  _mqttRetryCount++;
+  if (esp_timer_is_active(_mqttRetryTimer)) {
+    esp_timer_stop(_mqttRetryTimer);
+  };
+  esp_timer_start_once(_mqttRetryTimer, (uint64_t)delay * 1000);
+  rlog_d(logTAG, "Reconnect to MQTT broker in %d ms", delay);
+}
 
-    #if defined(CONFIG_MQTT_MAX_OUTBOX_MESSAGE_SIZE) && (CONFIG_MQTT_MAX_OUTBOX_MESSAGE_SIZE > 0)
-      bool _enqueueMessage = payload_len < CONFIG_MQTT_MAX_OUTBOX_MESSAGE_SIZE;
-    #else
-      bool _enqueueMessage = true;
-    #endif // CONFIG_MQTT_MAX_OUTBOX_MESSAGE_SIZE
+static void mqttRetryCancel()
+{
+  if (_mqttRetryTimer && esp_timer_is_active(_mqttRetryTimer)) {
+    esp_timer_stop(_mqttRetryTimer);
+  };
+}
 
-    if (mqttStatesCheck(MQTTCLI_CONNECTED, false)) {
-      if (_enqueueOutbox && _enqueueMessage) {
-        esp_mqtt_client_enqueue(_mqttClient, topic, payload, payload_len, qos, retained, true) > -1 ? err = ESP_OK : err = ESP_FAIL;
-      } else {
-        esp_mqtt_client_publish(_mqttClient, topic, payload, payload_len, qos, retained) > -1 ? err = ESP_OK : err = ESP_FAIL;
-      };
-    } else {
-      if (_enqueueOutbox && _enqueueMessage) {
-        esp_mqtt_client_enqueue(_mqttClient, topic, payload, payload_len, qos, retained, true) > -1 ? err = ESP_OK : err = ESP_FAIL;
-      } else {
-        err = ESP_ERR_INVALID_STATE;
-      };
-    };
+static void mqttRetryReset()
+{
+  mqttRetryCancel();
+  _mqttRetryCount = 0;
+}
 
-    if (err == ESP_OK) {
-      if (payload == nullptr) {
-        rlog_i(logTAG, "Publish to topic \"%s\": NULL [ 0 bytes ]", topic);
-      } else if (strlen(payload) > MQTT_LOG_PAYLOAD_LIMIT) {
-        rlog_i(logTAG, "Publish to topic \"%s\": [ %d bytes ]", topic, strlen(payload));
-      } else {
-        rlog_i(logTAG, "Publish to topic \"%s\": %s", topic, payload);
-      };
-    } else {
-      rlog_e(logTAG, "Failed to publish to topic \"%s\": %d, %s", topic, err, esp_err_to_name(err));
-      mqttErrorEventSendCode("Failed to publish to topic \"%s\": %d, %s", topic, err);
+bool mqttRetryInit()
+{
+  if (_mqttRetryTimer == nullptr) {
+    uint8_t mac[6] = { 0 };
+    esp_read_mac(mac, ESP_MAC_WIFI_STA);
+    // FNV-1a
+    _mqttRetrySeed = 2166136261UL;
+    for (uint8_t i = 0; i < sizeof(mac); i++) {
+      _mqttRetrySeed = (_mqttRetrySeed ^ mac[i]) * 16777619UL;
     };
+    if (_mqttRetrySeed == 0) _mqttRetrySeed = 1;
+
+    esp_timer_create_args_t cfg;
+    memset(&cfg, 0, sizeof(cfg));
+    cfg.name = "mqtt_retry";
+    cfg.skip_unhandled_events = true;
+    cfg.callback = mqttRetryTimerEnd;
+    RE_OK_CHECK(esp_timer_create(&cfg, &_mqttRetryTimer), return false);
+  };
+  return true;
+}
+
+void mqttRetryFree()
+{
+  if (_mqttRetryTimer) {
+    mqttRetryCancel();
+    esp_timer_delete(_mqttRetryTimer);
+    _mqttRetryTimer = nullptr;
   };
+}
 
-  if (free_topic && (topic != nullptr)) free(topic);
-  if (free_payload && (payload != nullptr)) free(payload);
-  return err;
+#else
+
+static void mqttRetryConfig(esp_mqtt_client_config_t * mqttCfg)
+{
+}
+
+static void mqttRetrySchedule()
+{
+}
+
+static void mqttRetryCancel()
+{
+}
+
+static void mqttRetryReset()
+{
+}
+
+bool mqttRetryInit()
+{
+  return true;
+}
+
+void mqttRetryFree()
+{
 }
 
+#endif // CONFIG_MQTT_RECONNECT_BACKOFF
+
 // -----------------------------------------------------------------------------------------------------------------------
 // ---------------------------------------------------- Event callback ---------------------------------------------------
 // -----------------------------------------------------------------------------------------------------------------------
 
+static void mqttClientConnected()
+{
+  _mqttConnAttempt = 0;
+  mqttStatesSet(MQTTCLI_CONNECTED);
+  mqttBrokerConnected(mqttStatsConnected());
+  mqttRetryReset();
+  rlog_i(logTAG, "Connection to MQTT broker [ %s : %d ] established", _mqttData.host, _mqttData.port);
+  // Repost event to main event loop
+  eventLoopPost(RE_MQTT_EVENTS, RE_MQTT_CONNECTED, &_mqttData, sizeof(_mqttData), portMAX_DELAY);
+  mqttErrorEventClear();
+  // Send messages accumulated while there was no connection
+  mqttPersistReplay();
+  mqttOutboxFlush();
+  // Publish ONLINE static status
+  #if CONFIG_MQTT_STATUS_ONLINE || CONFIG_MQTT_STATUS_ONLINE_SYSINFO
+    mqttPublish(mqttTopicStatusGet(), (char*)CONFIG_MQTT_STATUS_ONLINE_PAYLOAD, 
+      CONFIG_MQTT_STATUS_QOS, CONFIG_MQTT_STATUS_RETAINED, false, false);
+  #endif // CONFIG_MQTT_STATUS_ONLINE || CONFIG_MQTT_STATUS_ONLINE_SYSINFO
+  mqttStandbyStart();
+}
+
 static void mqttEventHandler(void *handler_args, esp_event_base_t base, int32_t event_id, void *event_data)
 {
   // esp_mqtt_client_handle_t client = data->client;
   esp_mqtt_event_handle_t data = (esp_mqtt_event_handle_t)event_data;
   static char* str_value = nullptr;
-  static re_mqtt_incoming_data_t in_buffer;
-  memset(&in_buffer, 0, sizeof(re_mqtt_incoming_data_t));
+  static re_mqtt_incoming_data_t in_buffer = { nullptr, 0, nullptr, 0 };
+  static re_mqtt_message_t* in_message = nullptr;
+  static re_mqtt_fragment_t in_stream = { nullptr, 0, nullptr, 0, 0, 0 };
+  static mqtt_stream_handler_t in_stream_handler = nullptr;
+  static void* in_stream_arg = nullptr;
+
+  if (data->client != _mqttClient) {
+    // Events of the side connection; if it has become the main one, its connection is processed below
+    if (!mqttSideEventHandler(data)) return;
+  };
 
   switch (data->event_id) {
     case MQTT_EVENT_BEFORE_CONNECT:
       _mqttConnAttempt++;
       mqttStatesClear(MQTTCLI_CONNECTED);
+      mqttStatsConnecting();
+      mqttBrokerConnecting();
       if (_mqttConnAttempt > 1) {
         rlog_w(logTAG, "Attempt # %d to connect to MQTT broker [ %s : %d ]...", _mqttConnAttempt, _mqttData.host, _mqttData.port);
       } else {
@@ -606,33 +4130,45 @@ static void mqttEventHandler(void *handler_args, esp_event_base_t base, int32_t
     break;
 
     case MQTT_EVENT_CONNECTED:
-      _mqttConnAttempt = 0;
-      mqttStatesSet(MQTTCLI_CONNECTED);
-      rlog_i(logTAG, "Connection to MQTT broker [ %s : %d ] established", _mqttData.host, _mqttData.port);
-      // Repost event to main event loop
-      eventLoopPost(RE_MQTT_EVENTS, RE_MQTT_CONNECTED, &_mqttData, sizeof(_mqttData), portMAX_DELAY);
-      mqttErrorEventClear();
-      // Publish ONLINE static status
-      #if CONFIG_MQTT_STATUS_ONLINE || CONFIG_MQTT_STATUS_ONLINE_SYSINFO
-        mqttPublish(mqttTopicStatusGet(), (char*)CONFIG_MQTT_STATUS_ONLINE_PAYLOAD, 
-          CONFIG_MQTT_STATUS_QOS, CONFIG_MQTT_STATUS_RETAINED, false, false);
-      #endif // CONFIG_MQTT_STATUS_ONLINE || CONFIG_MQTT_STATUS_ONLINE_SYSINFO
+      if (mqttFaultRefuse()) break;
+      if (!mqttRaceMainConnected(data->client)) break;
+      mqttClientConnected();
       break;
 
     case MQTT_EVENT_DISCONNECTED:
       mqttErrorEventSend(nullptr, nullptr);
+      mqttStatsDisconnected();
       if (mqttStatesCheck(MQTTCLI_CONNECTED, false)) {
         // The connection has already been established before, the connection is lost
         mqttStatesClear(MQTTCLI_CONNECTED);
         rlog_w(logTAG, "Lost connection to MQTT broker [ %s : %d ]", _mqttData.host, _mqttData.port);
         // Repost event to main event loop
         eventLoopPost(RE_MQTT_EVENTS, RE_MQTT_CONN_LOST, &_mqttData, sizeof(_mqttData), portMAX_DELAY);
+        if (mqttStandbyTakeover()) {
+          // The standby connection to the reserved broker is already established
+          mqttStatsStandbySwitch();
+          mqttClientConnected();
+        } else {
+          mqttRaceStart();
+          mqttRetrySchedule();
+        };
       } else {
-        // Failed to establish connection
+        // Failed to establish connection; if the client is restarted on another broker, the scheduled retry is canceled
+        mqttBrokerFailed();
+        mqttRetrySchedule();
         if (_mqttConnAttempt == CONFIG_MQTT_CONNECT_ATTEMPTS) {
           // Repost event to main event loop
           eventLoopPost(RE_MQTT_EVENTS, RE_MQTT_CONN_FAILED, &_mqttData, sizeof(_mqttData), portMAX_DELAY);
           _mqttConnAttempt = 0;
+          // The cached address may be outdated, the next configuration will resolve it again
+          mqttAddrInvalidate();
+          if (mqttBrokerRotate()) {
+            // Another broker with the same role is in the table - restart the client without changing the role
+            eventLoopPost(RE_MQTT_EVENTS, _mqttData.primary ? RE_MQTT_SERVER_PRIMARY : RE_MQTT_SERVER_RESERVED, nullptr, 0, portMAX_DELAY);
+            break;
+          };
+          // The client keeps the address it was configured with, so without another broker it is restarted if the address has changed
+          mqttAddrRecheck();
           #ifdef CONFIG_MQTT2_TYPE
             // Switching to the another server - disable current server
             if (mqttStatesCheck(MQTTCLI_SERVER2_ACTIVE, false)) {
@@ -645,9 +4181,15 @@ static void mqttEventHandler(void *handler_args, esp_event_base_t base, int32_t
       };
       break;
 
+    case MQTT_EVENT_PUBLISHED:
+      if (event_data) {
+        mqttLatencyAck(data->msg_id);
+        mqttPersistAck(data->msg_id);
+        mqttHandoverAck(data->client, data->msg_id);
+      };
+      // fall through
     case MQTT_EVENT_SUBSCRIBED:
     case MQTT_EVENT_UNSUBSCRIBED:
-    case MQTT_EVENT_PUBLISHED:
       mqttErrorEventClear();
       #if CONFIG_SYSLED_MQTT_ACTIVITY
         ledSysActivity();
@@ -656,26 +4198,101 @@ static void mqttEventHandler(void *handler_args, esp_event_base_t base, int32_t
     
     case MQTT_EVENT_DATA:
       if (event_data) {
+        mqttStatsAdd(bytes_in, data->data_len);
         if (data->current_data_offset == 0) {
+          mqttStatsAdd(received, 1);
+          mqttStatsMax(&_mqttStats.incoming_max, data->total_data_len);
+        };
+        // Bytes of a message that is still being assembled
+        _mqttStats.incoming_bytes = data->current_data_offset + data->data_len < data->total_data_len ? data->total_data_len : 0;
+        if (data->current_data_offset == 0) {
+          // Streaming delivery: fragments are passed to the consumer as they arrive, without reassembly
+          mqttBufferFree(in_stream.topic);
+          in_stream.topic = nullptr;
+          re_mqtt_stream_handler_t stream_handler;
+          if (mqttStreamHandlerFind(data->topic, data->topic_len, &stream_handler)) {
+            in_stream.topic = (char*)mqttBufferAlloc(data->topic_len+1);
+            if (in_stream.topic) {
+              memcpy(in_stream.topic, data->topic, data->topic_len);
+              in_stream.topic[data->topic_len] = 0;
+              in_stream.topic_len = data->topic_len;
+              in_stream_handler = stream_handler.handler;
+              in_stream_arg = stream_handler.arg;
+            } else {
+              rlog_e(logTAG, "Failed to allocate buffer for incoming message \"%.*s\"", data->topic_len, data->topic);
+            };
+          };
+        };
+        if (in_stream.topic) {
+          in_stream.data = data->data;
+          in_stream.data_len = data->data_len;
+          in_stream.offset = data->current_data_offset;
+          in_stream.total_len = data->total_data_len;
+          in_stream_handler(&in_stream, in_stream_arg);
+          if (data->current_data_offset + data->data_len == data->total_data_len) {
+            mqttBufferFree(in_stream.topic);
+            in_stream.topic = nullptr;
+            #if CONFIG_SYSLED_MQTT_ACTIVITY
+              ledSysActivity();
+            #endif // CONFIG_SYSLED_MQTT_ACTIVITY
+          };
+          break;
+        };
+
+        if (data->current_data_offset == 0) {
+          // The previous message is released (with CONFIG_MQTT_INCOMING_EVENT_OWNED only an incomplete one is left here)
+          mqttMessageRelease(in_message);
+          in_message = nullptr;
           if (in_buffer.topic) free(in_buffer.topic);
-          in_buffer.topic = nullptr;
           if (in_buffer.data) free(in_buffer.data);
-          in_buffer.data = (char*)esp_calloc(1, data->total_data_len+1);
+          memset(&in_buffer, 0, sizeof(re_mqtt_incoming_data_t));
+          // The topic is only transmitted with the first fragment of the message
+          if (mqttMessageHandlersExists()) {
+            // Shared message for registered handlers, the event loop receives a copy of it only if it is not handled
+            in_message = mqttMessageCreate(data->topic, data->topic_len, data->total_data_len);
+            if (in_message == nullptr) {
+              rlog_e(logTAG, "Failed to allocate buffer for incoming message \"%.*s\"", data->topic_len, data->topic);
+            };
+          } else if (CONFIG_MQTT_INCOMING_EVENT_POST) {
+            if (!mqttIncomingAlloc(&in_buffer, data->topic, data->topic_len, data->total_data_len)) {
+              rlog_e(logTAG, "Failed to allocate buffer for incoming message \"%.*s\"", data->topic_len, data->topic);
+            };
+          };
         };
-        if (in_buffer.data) {
+        if (in_message) {
+          memcpy(in_message->data+data->current_data_offset, data->data, data->data_len);
+          if (data->current_data_offset + data->data_len == data->total_data_len) {
+            rlog_d(logTAG, "Incoming message \"%s\": [%s]", in_message->topic, in_message->data);
+            #if CONFIG_MQTT_INCOMING_EVENT_POST
+              // Copy for the main event loop; without CONFIG_MQTT_INCOMING_EVENT_POST_HANDLED only if no handler has received the message
+              if ((mqttMessageDispatch(in_message) == 0) || CONFIG_MQTT_INCOMING_EVENT_POST_HANDLED) {
+                if (mqttIncomingAlloc(&in_buffer, in_message->topic, in_message->topic_len, in_message->data_len)) {
+                  memcpy(in_buffer.data, in_message->data, in_message->data_len);
+                  in_buffer.data_len = in_message->data_len;
+                  mqttIncomingPost(&in_buffer);
+                } else {
+                  rlog_e(logTAG, "Failed to allocate buffer for incoming message \"%s\"", in_message->topic);
+                };
+              };
+            #else
+              mqttMessageDispatch(in_message);
+            #endif // CONFIG_MQTT_INCOMING_EVENT_POST
+            mqttMessageRelease(in_message);
+            in_message = nullptr;
+            #if CONFIG_SYSLED_MQTT_ACTIVITY
+              ledSysActivity();
+            #endif // CONFIG_SYSLED_MQTT_ACTIVITY
+          };
+        } else if (in_buffer.data) {
           memcpy(in_buffer.data+data->current_data_offset, data->data, data->data_len);
           if (data->current_data_offset + data->data_len == data->total_data_len) {
-            in_buffer.topic = malloc_stringl(data->topic, data->topic_len);
-            if (in_buffer.topic) {
-              in_buffer.topic_len = data->topic_len;
-              in_buffer.data_len = data->total_data_len;
-              rlog_d(logTAG, "Incoming message \"%.*s\": [%s]", data->topic_len, data->topic, in_buffer.data);
-              // Repost string to main event loop
-              eventLoopPost(RE_MQTT_EVENTS, RE_MQTT_INCOMING_DATA, &in_buffer, sizeof(in_buffer), portMAX_DELAY);
-              #if CONFIG_SYSLED_MQTT_ACTIVITY
-                ledSysActivity();
-              #endif // CONFIG_SYSLED_MQTT_ACTIVITY
-            };
+            in_buffer.data[data->total_data_len] = 0;
+            in_buffer.data_len = data->total_data_len;
+            rlog_d(logTAG, "Incoming message \"%s\": [%s]", in_buffer.topic, in_buffer.data);
+            mqttIncomingPost(&in_buffer);
+            #if CONFIG_SYSLED_MQTT_ACTIVITY
+              ledSysActivity();
+            #endif // CONFIG_SYSLED_MQTT_ACTIVITY
           };
         };
       };
@@ -685,113 +4302,472 @@ static void mqttEventHandler(void *handler_args, esp_event_base_t base, int32_t
       if (event_data) {
         rlog_e(logTAG, "MQTT client error!");
         // Generate error message
+        MQTT_STRING_BUFFER(err_buf);
         if (data->error_handle->error_type == MQTT_ERROR_TYPE_TCP_TRANSPORT) {
-          str_value = malloc_stringf("Transport error: %d\n  - %s\nESP_TLS error:   0x%X\nTLS stack error: 0x%X", 
+          str_value = mqttStringf(err_buf, "Transport error: %d\n  - %s\nESP_TLS error:   0x%X\nTLS stack error: 0x%X", 
             data->error_handle->esp_transport_sock_errno, strerror(data->error_handle->esp_transport_sock_errno),
             data->error_handle->esp_tls_last_esp_err, data->error_handle->esp_tls_stack_err);
         } else if (data->error_handle->error_type == MQTT_ERROR_TYPE_CONNECTION_REFUSED) {
-          str_value = malloc_stringf("Connection refused, error: 0x%x", 
+          str_value = mqttStringf(err_buf, "Connection refused, error: 0x%x", 
             data->error_handle->connect_return_code);
         } else {
-          str_value = malloc_stringf("Unknown error type: 0x%x", 
+          str_value = mqttStringf(err_buf, "Unknown error type: 0x%x", 
             data->error_handle->error_type);
         };
         // Repost event to main event loop
         mqttErrorEventSend(str_value, nullptr);
+        mqttStringFree(str_value);
+        str_value = nullptr;
       };
       #if CONFIG_SYSLED_MQTT_ACTIVITY
         ledSysActivity();
       #endif // CONFIG_SYSLED_MQTT_ACTIVITY
       break;
 
-    default:
-      rlog_w(logTAG, "Other event id: %d", data->event_id); 
-      break;
+    #if ESP_IDF_VERSION_MAJOR >= 5
+      case MQTT_EVENT_DELETED:
+        // The message has expired in the client outbox and will not be sent
+        if (event_data) {
+          mqttHandoverAck(data->client, data->msg_id);
+        };
+        break;
+    #endif // ESP_IDF_VERSION_MAJOR
+
+    default:
+      rlog_w(logTAG, "Other event id: %d", data->event_id);
+      break;
+  };
+  // Free resources
+  if (str_value) {
+    free(str_value);
+    str_value = nullptr;
+  };
+}
+
+// -----------------------------------------------------------------------------------------------------------------------
+// --------------------------------------------------- Address cache -----------------------------------------------------
+// -----------------------------------------------------------------------------------------------------------------------
+
+#if defined(CONFIG_MQTT_ADDR_CACHE) && CONFIG_MQTT_ADDR_CACHE
+
+#include "lwip/netdb.h"
+#include "lwip/sockets.h"
+
+#ifndef CONFIG_MQTT_ADDR_CACHE_SIZE
+  #define CONFIG_MQTT_ADDR_CACHE_SIZE 4
+#endif // CONFIG_MQTT_ADDR_CACHE_SIZE
+#ifndef CONFIG_MQTT_ADDR_CACHE_TTL
+  #define CONFIG_MQTT_ADDR_CACHE_TTL 600
+#endif // CONFIG_MQTT_ADDR_CACHE_TTL
+#ifndef CONFIG_MQTT_ADDR_STACK_SIZE
+  #define CONFIG_MQTT_ADDR_STACK_SIZE 3072
+#endif // CONFIG_MQTT_ADDR_STACK_SIZE
+
+#define MQTT_ADDR_LEN 46 // INET6_ADDRSTRLEN
+
+typedef struct {
+  char    host[64];
+  char    addr[MQTT_ADDR_LEN];
+  int64_t expires;
+  bool    used;
+} re_mqtt_addr_entry_t;
+
+static portMUX_TYPE _mqttAddrLock = portMUX_INITIALIZER_UNLOCKED;
+static re_mqtt_addr_entry_t _mqttAddrCache[CONFIG_MQTT_ADDR_CACHE_SIZE];
+static char _mqttAddrGateway[MQTT_ADDR_LEN] = { 0 };
+static re_mqtt_addr_stats_t _mqttAddrStats = { 0, 0, 0, 0 };
+// Resolved addresses of the main and side clients, they must remain valid while the client exists
+static char _mqttAddrClient[2][MQTT_ADDR_LEN];
+static char _mqttAddrMainHost[64] = { 0 };
+// Host being resolved by the lookup task
+static char _mqttAddrPending[64] = { 0 };
+static bool _mqttAddrBusy = false;
+
+// Must be called inside the critical section
+static re_mqtt_addr_entry_t* mqttAddrFind(const char* host)
+{
+  for (uint8_t i = 0; i < CONFIG_MQTT_ADDR_CACHE_SIZE; i++) {
+    if (_mqttAddrCache[i].used && (strncmp(_mqttAddrCache[i].host, host, sizeof(_mqttAddrCache[i].host)) == 0)) {
+      return &_mqttAddrCache[i];
+    };
+  };
+  return nullptr;
+}
+
+static bool mqttAddrLookup(const char* host, char* addr)
+{
+  struct addrinfo hints;
+  memset(&hints, 0, sizeof(hints));
+  hints.ai_family = AF_UNSPEC;
+  hints.ai_socktype = SOCK_STREAM;
+  struct addrinfo* res = nullptr;
+  if ((getaddrinfo(host, nullptr, &hints, &res) != 0) || (res == nullptr)) {
+    return false;
+  };
+  const char* ret = nullptr;
+  if (res->ai_family == AF_INET) {
+    ret = inet_ntop(AF_INET, &((struct sockaddr_in*)res->ai_addr)->sin_addr, addr, MQTT_ADDR_LEN);
+  #if LWIP_IPV6
+    } else if (res->ai_family == AF_INET6) {
+      ret = inet_ntop(AF_INET6, &((struct sockaddr_in6*)res->ai_addr)->sin6_addr, addr, MQTT_ADDR_LEN);
+  #endif // LWIP_IPV6
+  };
+  freeaddrinfo(res);
+  return ret != nullptr;
+}
+
+// Must be called inside the critical section
+static void mqttAddrStore(const char* host, const char* addr, int64_t now)
+{
+  re_mqtt_addr_entry_t* entry = mqttAddrFind(host);
+  if (entry == nullptr) {
+    // A free entry, or else the one that expires first
+    entry = &_mqttAddrCache[0];
+    for (uint8_t i = 0; i < CONFIG_MQTT_ADDR_CACHE_SIZE; i++) {
+      if (!_mqttAddrCache[i].used) { entry = &_mqttAddrCache[i]; break; };
+      if (_mqttAddrCache[i].expires < entry->expires) entry = &_mqttAddrCache[i];
+    };
+    snprintf(entry->host, sizeof(entry->host), "%s", host);
+    entry->used = true;
+  };
+  strcpy(entry->addr, addr);
+  entry->expires = now + (int64_t)CONFIG_MQTT_ADDR_CACHE_TTL * 1000000;
+}
+
+// getaddrinfo() blocks for up to several seconds, so lookups are performed in a separate short-lived task, one at a time.
+// If the main client is connected to the host by an address that has changed, it is restarted with the new address
+static void mqttAddrTaskExec(void *arg)
+{
+  char host[sizeof(_mqttAddrPending)];
+  taskENTER_CRITICAL(&_mqttAddrLock);
+  strcpy(host, _mqttAddrPending);
+  taskEXIT_CRITICAL(&_mqttAddrLock);
+
+  char resolved[MQTT_ADDR_LEN];
+  bool ok = mqttAddrLookup(host, resolved);
+  bool changed = false;
+  taskENTER_CRITICAL(&_mqttAddrLock);
+  if (ok) {
+    _mqttAddrStats.misses++;
+    mqttAddrStore(host, resolved, esp_timer_get_time());
+    changed = (strncmp(_mqttAddrMainHost, host, sizeof(_mqttAddrMainHost)) == 0) && (strcmp(_mqttAddrClient[0], resolved) != 0);
+  } else {
+    _mqttAddrStats.failures++;
+  };
+  _mqttAddrBusy = false;
+  taskEXIT_CRITICAL(&_mqttAddrLock);
+
+  if (ok) {
+    rlog_d(logTAG, "MQTT broker [ %s ] resolved to %s", host, resolved);
+    if (changed && mqttStatesCheck(MQTTCLI_STARTED, false)) {
+      rlog_i(logTAG, "Address of MQTT broker [ %s ] has changed to %s, restarting the client", host, resolved);
+      eventLoopPost(RE_MQTT_EVENTS, _mqttData.primary ? RE_MQTT_SERVER_PRIMARY : RE_MQTT_SERVER_RESERVED, nullptr, 0, portMAX_DELAY);
+    };
+  } else {
+    rlog_w(logTAG, "Failed to resolve MQTT broker [ %s ]", host);
+  };
+  vTaskDelete(nullptr);
+}
+
+static void mqttAddrRefresh(const char* host)
+{
+  bool start = false;
+  taskENTER_CRITICAL(&_mqttAddrLock);
+  if (!_mqttAddrBusy) {
+    snprintf(_mqttAddrPending, sizeof(_mqttAddrPending), "%s", host);
+    _mqttAddrBusy = true;
+    start = true;
+  };
+  taskEXIT_CRITICAL(&_mqttAddrLock);
+  // If a lookup is already running, the host will be requested again at the next connection
+  if (start && (xTaskCreate(mqttAddrTaskExec, "mqtt_addr", CONFIG_MQTT_ADDR_STACK_SIZE, nullptr, CONFIG_TASK_PRIORITY_MQTT_CLIENT, nullptr) != pdPASS)) {
+    taskENTER_CRITICAL(&_mqttAddrLock);
+    _mqttAddrBusy = false;
+    taskEXIT_CRITICAL(&_mqttAddrLock);
+    rlog_e(logTAG, "Failed to create task [ MQTT_ADDR ]!");
+  };
+}
+
+// Returns the address to connect to: a fresh cached entry, or else a stale one while the host is resolved again in the background.
+// Without any entry the client resolves the hostname itself. The client is configured from the event loop, so it never waits for DNS
+static const char* mqttAddrResolve(const char* host, bool main)
+{
+  struct in_addr literal;
+  if ((host == nullptr) || (host[0] == 0) || (inet_pton(AF_INET, host, &literal) == 1)) {
+    if (main) _mqttAddrMainHost[0] = 0;
+    return nullptr;
+  };
+
+  char* addr = _mqttAddrClient[main ? 0 : 1];
+  bool found = false;
+  bool fresh = false;
+  taskENTER_CRITICAL(&_mqttAddrLock);
+  re_mqtt_addr_entry_t* entry = mqttAddrFind(host);
+  if (entry) {
+    strcpy(addr, entry->addr);
+    fresh = entry->expires > esp_timer_get_time();
+    if (fresh) {
+      _mqttAddrStats.hits++;
+    } else {
+      _mqttAddrStats.stale++;
+    };
+    found = true;
   };
-  // Free resources
-  if (str_value) {
-    free(str_value);
-    str_value = nullptr;
+  if (main) {
+    // The host whose address the main client is using, see mqttAddrTaskExec()
+    snprintf(_mqttAddrMainHost, sizeof(_mqttAddrMainHost), "%s", found ? host : "");
+  };
+  taskEXIT_CRITICAL(&_mqttAddrLock);
+  if (!fresh) mqttAddrRefresh(host);
+  if (found) {
+    rlog_d(logTAG, "MQTT broker [ %s ] resolved to %s%s", host, addr, fresh ? "" : " (stale)");
+    return addr;
+  };
+  return nullptr;
+}
+
+// The gateway address is requested only once after the network is connected
+static void mqttAddrGateway(char* host, size_t size)
+{
+  if (_mqttAddrGateway[0] == 0) {
+    char *_host = wifiGetGatewayIP();
+    if (_host) {
+      taskENTER_CRITICAL(&_mqttAddrLock);
+      snprintf(_mqttAddrGateway, sizeof(_mqttAddrGateway), "%s", _host);
+      taskEXIT_CRITICAL(&_mqttAddrLock);
+      free(_host);
+    };
+  };
+  taskENTER_CRITICAL(&_mqttAddrLock);
+  snprintf(host, size, "%.*s", (int)size - 1, _mqttAddrGateway);
+  taskEXIT_CRITICAL(&_mqttAddrLock);
+}
+
+// Addresses are kept as stale entries in case DNS is unavailable after reconnecting, only the gateway is forgotten
+static void mqttAddrInvalidate()
+{
+  taskENTER_CRITICAL(&_mqttAddrLock);
+  for (uint8_t i = 0; i < CONFIG_MQTT_ADDR_CACHE_SIZE; i++) {
+    _mqttAddrCache[i].expires = 0;
+  };
+  _mqttAddrGateway[0] = 0;
+  taskEXIT_CRITICAL(&_mqttAddrLock);
+}
+
+// After a failed series the main client may keep retrying an outdated address: the host is resolved again,
+// and the client is restarted if the address has changed
+static void mqttAddrRecheck()
+{
+  char host[sizeof(_mqttAddrMainHost)];
+  taskENTER_CRITICAL(&_mqttAddrLock);
+  strcpy(host, _mqttAddrMainHost);
+  taskEXIT_CRITICAL(&_mqttAddrLock);
+  if (host[0]) mqttAddrRefresh(host);
+}
+
+void mqttAddrGetStats(re_mqtt_addr_stats_t* stats)
+{
+  if (stats) memcpy(stats, &_mqttAddrStats, sizeof(re_mqtt_addr_stats_t));
+}
+
+#else
+
+static const char* mqttAddrResolve(const char* host, bool main)
+{
+  return nullptr;
+}
+
+static void mqttAddrGateway(char* host, size_t size)
+{
+  char *_host = wifiGetGatewayIP();
+  if (_host) {
+    strncpy(host, _host, size - 1);
+    free(_host);
   };
 }
 
+static void mqttAddrInvalidate()
+{
+}
+
+static void mqttAddrRecheck()
+{
+}
+
+void mqttAddrGetStats(re_mqtt_addr_stats_t* stats)
+{
+  if (stats) memset(stats, 0, sizeof(re_mqtt_addr_stats_t));
+}
+
+#endif // CONFIG_MQTT_ADDR_CACHE
+
 // -----------------------------------------------------------------------------------------------------------------------
 // --------------------------------------------------- Configuration -----------------------------------------------------
 // -----------------------------------------------------------------------------------------------------------------------
 
-void mqttSetConfigPrimary(esp_mqtt_client_config_t * mqttCfg)
+#if CONFIG_MQTT_STATUS_LWT
+
+// The topic for the LWT of an additional connection does not replace the topic of the main connection
+static char* _mqttSideTopicStatus = nullptr;
+
+static char* mqttConfigTopicStatus(re_mqtt_event_data_t * mqttData)
 {
-  // Host
-  _mqttData.primary = true;
-  #if CONFIG_MQTT1_TYPE == 0
-    _mqttData.local = false;
-  #else
-    _mqttData.local = true;
-  #endif // CONFIG_MQTT1_TYPE == 0
+  if (mqttData == &_mqttData) {
+    return mqttTopicStatusCreate(mqttData->primary);
+  };
+  mqttStringFree(_mqttSideTopicStatus);
+  _mqttSideTopicStatus = mqttTopicStatusMake(mqttData->primary);
+  return _mqttSideTopicStatus;
+}
 
-  memset(_mqttData.host, 0, sizeof(_mqttData.host));
-  #if CONFIG_MQTT1_TYPE == 2
-    char *_host = wifiGetGatewayIP();
-    if (_host) {
-      strcpy(_mqttData.host, _host);
-      free(_host);
+#endif // CONFIG_MQTT_STATUS_LWT
+
+// Broker parameters from the project configuration
+static void mqttBrokerDefault(bool primary, re_mqtt_broker_t* broker)
+{
+  memset(broker, 0, sizeof(re_mqtt_broker_t));
+  broker->primary = primary;
+  if (primary) {
+    broker->type = CONFIG_MQTT1_TYPE;
+    #ifdef CONFIG_MQTT1_HOST
+      strncpy(broker->host, CONFIG_MQTT1_HOST, sizeof(broker->host) - 1);
+    #endif // CONFIG_MQTT1_HOST
+    #if CONFIG_MQTT1_TLS_ENABLED
+      broker->tls = true;
+      broker->tls_storage = CONFIG_MQTT1_TLS_STORAGE;
+      broker->port = CONFIG_MQTT1_PORT_TLS;
+      #if CONFIG_MQTT1_TLS_STORAGE == TLS_CERT_BUFFER
+        broker->cert_pem = (const char *)mqtt1_broker_pem_start;
+        broker->cert_len = mqtt1_broker_pem_end - mqtt1_broker_pem_start;
+      #endif // CONFIG_MQTT1_TLS_STORAGE
+    #else
+      broker->port = CONFIG_MQTT1_PORT_TCP;
+    #endif // CONFIG_MQTT1_TLS_ENABLED
+    #ifdef CONFIG_MQTT1_USERNAME
+      strncpy(broker->username, CONFIG_MQTT1_USERNAME, sizeof(broker->username) - 1);
+      #ifdef CONFIG_MQTT1_PASSWORD
+        strncpy(broker->password, CONFIG_MQTT1_PASSWORD, sizeof(broker->password) - 1);
+      #endif // CONFIG_MQTT1_PASSWORD
+    #endif // CONFIG_MQTT1_USERNAME
+    #ifdef CONFIG_MQTT1_CLIENTID
+      strncpy(broker->client_id, CONFIG_MQTT1_CLIENTID, sizeof(broker->client_id) - 1);
+    #endif // CONFIG_MQTT1_CLIENTID
+    broker->timeout_ms = CONFIG_MQTT1_TIMEOUT;
+    broker->reconnect_ms = CONFIG_MQTT1_RECONNECT;
+    broker->auto_reconnect = CONFIG_MQTT1_AUTO_RECONNECT;
+    broker->clean_session = CONFIG_MQTT1_CLEAN_SESSION;
+    broker->keepalive = CONFIG_MQTT1_KEEP_ALIVE;
+  };
+  #ifdef CONFIG_MQTT2_TYPE
+    if (!primary) {
+      broker->type = CONFIG_MQTT2_TYPE;
+      #ifdef CONFIG_MQTT2_HOST
+        strncpy(broker->host, CONFIG_MQTT2_HOST, sizeof(broker->host) - 1);
+      #endif // CONFIG_MQTT2_HOST
+      #if CONFIG_MQTT2_TLS_ENABLED
+        broker->tls = true;
+        broker->tls_storage = CONFIG_MQTT2_TLS_STORAGE;
+        broker->port = CONFIG_MQTT2_PORT_TLS;
+        #if CONFIG_MQTT2_TLS_STORAGE == TLS_CERT_BUFFER
+          broker->cert_pem = (const char *)mqtt2_broker_pem_start;
+          broker->cert_len = mqtt2_broker_pem_end - mqtt2_broker_pem_start;
+        #endif // CONFIG_MQTT2_TLS_STORAGE
+      #else
+        broker->port = CONFIG_MQTT2_PORT_TCP;
+      #endif // CONFIG_MQTT2_TLS_ENABLED
+      #ifdef CONFIG_MQTT2_USERNAME
+        strncpy(broker->username, CONFIG_MQTT2_USERNAME, sizeof(broker->username) - 1);
+        #ifdef CONFIG_MQTT2_PASSWORD
+          strncpy(broker->password, CONFIG_MQTT2_PASSWORD, sizeof(broker->password) - 1);
+        #endif // CONFIG_MQTT2_PASSWORD
+      #endif // CONFIG_MQTT2_USERNAME
+      #ifdef CONFIG_MQTT2_CLIENTID
+        strncpy(broker->client_id, CONFIG_MQTT2_CLIENTID, sizeof(broker->client_id) - 1);
+      #endif // CONFIG_MQTT2_CLIENTID
+      broker->timeout_ms = CONFIG_MQTT2_TIMEOUT;
+      broker->reconnect_ms = CONFIG_MQTT2_RECONNECT;
+      broker->auto_reconnect = CONFIG_MQTT2_AUTO_RECONNECT;
+      broker->clean_session = CONFIG_MQTT2_CLEAN_SESSION;
+      broker->keepalive = CONFIG_MQTT2_KEEP_ALIVE;
     };
-  #else
-    strcpy(_mqttData.host, CONFIG_MQTT1_HOST);
-  #endif // CONFIG_MQTT1_TYPE == 2
+  #endif // CONFIG_MQTT2_TYPE
+}
+
+// Client configuration for the broker; the strings of the broker must remain valid until the client is configured
+static void mqttSetConfigBroker(esp_mqtt_client_config_t * mqttCfg, re_mqtt_event_data_t * mqttData, const re_mqtt_broker_t * broker)
+{
+  // Host
+  mqttData->primary = broker->primary;
+  mqttData->local = broker->type > 0;
+  memset(mqttData->host, 0, sizeof(mqttData->host));
+  // The event data keeps a shortened copy of the name, the client is configured with the full one
+  const char* host = broker->host;
+  const char* address = nullptr;
+  if (broker->type == 2) {
+    mqttAddrGateway(mqttData->host, sizeof(mqttData->host));
+    host = mqttData->host;
+  } else {
+    snprintf(mqttData->host, sizeof(mqttData->host), "%.*s", (int)sizeof(mqttData->host) - 1, broker->host);
+    #if ESP_IDF_VERSION_MAJOR < 5
+      // Without common_name in the client configuration, TLS needs the hostname to verify the certificate
+      if (!broker->tls) address = mqttAddrResolve(broker->host, mqttData == &_mqttData);
+    #else
+      address = mqttAddrResolve(broker->host, mqttData == &_mqttData);
+    #endif // ESP_IDF_VERSION_MAJOR
+  };
+  mqttData->port = broker->port;
 
   #if ESP_IDF_VERSION_MAJOR < 5
-    // Hostname
-    mqttCfg->host = _mqttData.host;
+    // Hostname or the resolved address
+    mqttCfg->host = address ? address : host;
 
     // Port and transport
-    #if CONFIG_MQTT1_TLS_ENABLED
-      _mqttData.port = CONFIG_MQTT1_PORT_TLS;
-      mqttCfg->port = CONFIG_MQTT1_PORT_TLS;
+    mqttCfg->port = broker->port;
+    if (broker->tls) {
       mqttCfg->skip_cert_common_name_check = false;
       mqttCfg->transport = MQTT_TRANSPORT_OVER_SSL;
-      #if CONFIG_MQTT1_TLS_STORAGE == TLS_CERT_BUFFER
-        mqttCfg->cert_pem = (const char *)mqtt1_broker_pem_start;
-        mqttCfg->cert_len = mqtt1_broker_pem_end - mqtt1_broker_pem_start;
+      if (broker->cert_pem) {
+        mqttCfg->cert_pem = broker->cert_pem;
+        mqttCfg->cert_len = broker->cert_len;
         mqttCfg->use_global_ca_store = false;
-      #elif CONFIG_MQTT1_TLS_STORAGE == TLS_CERT_GLOBAL
+      #if defined(TLS_CERT_BUNDLE) && defined(CONFIG_MBEDTLS_CERTIFICATE_BUNDLE) && CONFIG_MBEDTLS_CERTIFICATE_BUNDLE
+        } else if (broker->tls_storage == TLS_CERT_BUNDLE) {
+          mqttCfg->crt_bundle_attach = esp_crt_bundle_attach;
+          mqttCfg->use_global_ca_store = false;
+      #endif // TLS_CERT_BUNDLE
+      } else {
         mqttCfg->use_global_ca_store = true;
-      #elif CONFIG_MQTT1_TLS_STORAGE == TLS_CERT_BUNDLE
-        mqttCfg->crt_bundle_attach = esp_crt_bundle_attach;
-        mqttCfg->use_global_ca_store = false;
-      #endif // CONFIG_MQTT2_TLS_STORAGE
-    #else
-      _mqttData.port = CONFIG_MQTT1_PORT_TCP;
+      };
+    } else {
       mqttCfg->transport = MQTT_TRANSPORT_OVER_TCP;
-      mqttCfg->port = CONFIG_MQTT1_PORT_TCP;
-    #endif // CONFIG_MQTT1_TLS_ENABLED
+    };
 
     // Credentials
-    #ifdef CONFIG_MQTT1_USERNAME
-      mqttCfg->username = CONFIG_MQTT1_USERNAME;
-      #ifdef CONFIG_MQTT1_PASSWORD
-        mqttCfg->password = CONFIG_MQTT1_PASSWORD;
-      #endif // CONFIG_MQTT1_PASSWORD
-    #endif // CONFIG_MQTT1_USERNAME
+    if (broker->username[0]) {
+      mqttCfg->username = broker->username;
+      if (broker->password[0]) {
+        mqttCfg->password = broker->password;
+      };
+    };
 
     // ClientId, if needed. Otherwise ClientId will be generated automatically
-    #ifdef CONFIG_MQTT1_CLIENTID
-      mqttCfg->client_id = CONFIG_MQTT1_CLIENTID;
-    #endif // CONFIG_MQTT_CLIENTID
+    if (broker->client_id[0]) {
+      mqttCfg->client_id = broker->client_id;
+    };
 
     // Network parameters
-    mqttCfg->network_timeout_ms = CONFIG_MQTT1_TIMEOUT;
-    mqttCfg->reconnect_timeout_ms = CONFIG_MQTT1_RECONNECT;
-    mqttCfg->disable_auto_reconnect = !CONFIG_MQTT1_AUTO_RECONNECT;
+    mqttCfg->network_timeout_ms = broker->timeout_ms;
+    mqttCfg->reconnect_timeout_ms = broker->reconnect_ms;
+    mqttCfg->disable_auto_reconnect = !broker->auto_reconnect;
 
     // Session parameters
-    mqttCfg->disable_clean_session = !CONFIG_MQTT1_CLEAN_SESSION;
-    mqttCfg->keepalive = CONFIG_MQTT1_KEEP_ALIVE;
+    mqttCfg->disable_clean_session = !broker->clean_session;
+    mqttCfg->keepalive = broker->keepalive;
     mqttCfg->disable_keepalive = false;
 
     // LWT
     #if CONFIG_MQTT_STATUS_LWT
-      mqttCfg->lwt_topic = mqttTopicStatusCreate(true);
+      mqttCfg->lwt_topic = mqttConfigTopicStatus(mqttData);
       mqttCfg->lwt_msg = CONFIG_MQTT_STATUS_LWT_PAYLOAD;
       mqttCfg->lwt_msg_len = strlen(CONFIG_MQTT_STATUS_LWT_PAYLOAD);
       mqttCfg->lwt_qos = CONFIG_MQTT_STATUS_QOS;
@@ -804,57 +4780,60 @@ void mqttSetConfigPrimary(esp_mqtt_client_config_t * mqttCfg)
     mqttCfg->task_prio = CONFIG_TASK_PRIORITY_MQTT_CLIENT;
     mqttCfg->task_stack = CONFIG_MQTT_CLIENT_STACK_SIZE;
   #else
-    // Hostname
-    mqttCfg->broker.address.hostname = _mqttData.host;
+    // Hostname or the resolved address
+    mqttCfg->broker.address.hostname = address ? address : host;
 
     // Port and transport
-    #if CONFIG_MQTT1_TLS_ENABLED
-      _mqttData.port = CONFIG_MQTT1_PORT_TLS;
-      mqttCfg->broker.address.port = CONFIG_MQTT1_PORT_TLS;
+    mqttCfg->broker.address.port = broker->port;
+    if (broker->tls) {
       mqttCfg->broker.address.transport = MQTT_TRANSPORT_OVER_SSL;
       mqttCfg->broker.verification.skip_cert_common_name_check = false;
-      #if CONFIG_MQTT1_TLS_STORAGE == TLS_CERT_BUFFER
-        mqttCfg->broker.verification.certificate = (const char *)mqtt1_broker_pem_start;
-        mqttCfg->broker.verification.certificate_len = mqtt1_broker_pem_end - mqtt1_broker_pem_start;
+      if (address) {
+        // The certificate is verified against the hostname (SNI too), not the resolved address
+        mqttCfg->broker.verification.common_name = host;
+      };
+      if (broker->cert_pem) {
+        mqttCfg->broker.verification.certificate = broker->cert_pem;
+        mqttCfg->broker.verification.certificate_len = broker->cert_len;
         mqttCfg->broker.verification.use_global_ca_store = false;
-      #elif CONFIG_MQTT1_TLS_STORAGE == TLS_CERT_GLOBAL
+      #if defined(TLS_CERT_BUNDLE) && defined(CONFIG_MBEDTLS_CERTIFICATE_BUNDLE) && CONFIG_MBEDTLS_CERTIFICATE_BUNDLE
+        } else if (broker->tls_storage == TLS_CERT_BUNDLE) {
+          mqttCfg->broker.verification.crt_bundle_attach = esp_crt_bundle_attach;
+          mqttCfg->broker.verification.use_global_ca_store = false;
+      #endif // TLS_CERT_BUNDLE
+      } else {
         mqttCfg->broker.verification.use_global_ca_store = true;
-      #elif CONFIG_MQTT1_TLS_STORAGE == TLS_CERT_BUNDLE
-        mqttCfg->broker.verification.crt_bundle_attach = esp_crt_bundle_attach;
-        mqttCfg->broker.verification.use_global_ca_store = false;
-      #endif // CONFIG_MQTT2_TLS_STORAGE
-    #else
-      _mqttData.port = CONFIG_MQTT1_PORT_TCP;
+      };
+    } else {
       mqttCfg->broker.address.transport = MQTT_TRANSPORT_OVER_TCP;
-      mqttCfg->broker.address.port = CONFIG_MQTT1_PORT_TCP;
-    #endif // CONFIG_MQTT1_TLS_ENABLED
+    };
 
     // Credentials
-    #ifdef CONFIG_MQTT1_USERNAME
-      mqttCfg->credentials.username = CONFIG_MQTT1_USERNAME;
-      #ifdef CONFIG_MQTT1_PASSWORD
-        mqttCfg->credentials.authentication.password = CONFIG_MQTT1_PASSWORD;
-      #endif // CONFIG_MQTT1_PASSWORD
-    #endif // CONFIG_MQTT1_USERNAME
+    if (broker->username[0]) {
+      mqttCfg->credentials.username = broker->username;
+      if (broker->password[0]) {
+        mqttCfg->credentials.authentication.password = broker->password;
+      };
+    };
 
     // ClientId, if needed. Otherwise ClientId will be generated automatically
-    #ifdef CONFIG_MQTT1_CLIENTID
-      mqttCfg->credentials.client_id = CONFIG_MQTT1_CLIENTID;
-    #endif // CONFIG_MQTT_CLIENTID
+    if (broker->client_id[0]) {
+      mqttCfg->credentials.client_id = broker->client_id;
+    };
 
     // Network parameters
-    mqttCfg->network.timeout_ms = CONFIG_MQTT1_TIMEOUT;
-    mqttCfg->network.reconnect_timeout_ms = CONFIG_MQTT1_RECONNECT;
-    mqttCfg->network.disable_auto_reconnect = !CONFIG_MQTT1_AUTO_RECONNECT;
+    mqttCfg->network.timeout_ms = broker->timeout_ms;
+    mqttCfg->network.reconnect_timeout_ms = broker->reconnect_ms;
+    mqttCfg->network.disable_auto_reconnect = !broker->auto_reconnect;
 
     // Session parameters
-    mqttCfg->session.disable_clean_session = !CONFIG_MQTT1_CLEAN_SESSION;
-    mqttCfg->session.keepalive = CONFIG_MQTT1_KEEP_ALIVE;
+    mqttCfg->session.disable_clean_session = !broker->clean_session;
+    mqttCfg->session.keepalive = broker->keepalive;
     mqttCfg->session.disable_keepalive = false;
 
     // LWT
     #if CONFIG_MQTT_STATUS_LWT
-      mqttCfg->session.last_will.topic = mqttTopicStatusCreate(true);
+      mqttCfg->session.last_will.topic = mqttConfigTopicStatus(mqttData);
       mqttCfg->session.last_will.msg = CONFIG_MQTT_STATUS_LWT_PAYLOAD;
       mqttCfg->session.last_will.msg_len = strlen(CONFIG_MQTT_STATUS_LWT_PAYLOAD);
       mqttCfg->session.last_will.qos = CONFIG_MQTT_STATUS_QOS;
@@ -869,156 +4848,409 @@ void mqttSetConfigPrimary(esp_mqtt_client_config_t * mqttCfg)
   #endif // #if ESP_IDF_VERSION_MAJOR
 }
 
+// -----------------------------------------------------------------------------------------------------------------------
+// ---------------------------------------------------- Broker table -----------------------------------------------------
+// -----------------------------------------------------------------------------------------------------------------------
+
 #ifdef CONFIG_MQTT2_TYPE
+  #define MQTT_BROKERS_BUILTIN 2
+#else
+  #define MQTT_BROKERS_BUILTIN 1
+#endif // CONFIG_MQTT2_TYPE
+
+#if defined(CONFIG_MQTT_BROKER_TABLE) && CONFIG_MQTT_BROKER_TABLE
+  #ifndef CONFIG_MQTT_BROKERS_MAX
+    #define CONFIG_MQTT_BROKERS_MAX 4
+  #endif // CONFIG_MQTT_BROKERS_MAX
+  #define MQTT_BROKERS_MAX CONFIG_MQTT_BROKERS_MAX
+#else
+  #define MQTT_BROKERS_MAX MQTT_BROKERS_BUILTIN
+#endif // CONFIG_MQTT_BROKER_TABLE
+
+static_assert(MQTT_BROKERS_MAX >= MQTT_BROKERS_BUILTIN, "CONFIG_MQTT_BROKERS_MAX is less than the number of configured brokers");
 
-void mqttSetConfigReserved(esp_mqtt_client_config_t * mqttCfg)
+static re_mqtt_broker_t _mqttBrokers[MQTT_BROKERS_MAX];
+static uint8_t _mqttBrokersCount = 0;
+
+#if defined(CONFIG_MQTT_BROKER_TABLE) && CONFIG_MQTT_BROKER_TABLE
+  // Brokers of the main and side clients
+  static uint8_t _mqttBrokerMain = 0;
+  static uint8_t _mqttBrokerSide = 0;
+  static void mqttBrokerStateReset(uint8_t index);
+#endif // CONFIG_MQTT_BROKER_TABLE
+
+bool mqttBrokersInit()
 {
-  // Host
-  _mqttData.primary = false;
-  #if CONFIG_MQTT2_TYPE == 0
-    _mqttData.local = false;
-  #else
-    _mqttData.local = true;
-  #endif // CONFIG_MQTT2_TYPE == 0
-  
-  memset(_mqttData.host, 0, sizeof(_mqttData.host));
-  #if CONFIG_MQTT2_TYPE == 2
-    char *_host = wifiGetGatewayIP();
-    if (_host) {
-      strcpy(_mqttData.host, _host);
-      free(_host);
+  if (_mqttBrokersCount == 0) {
+    for (uint8_t i = 0; i < MQTT_BROKERS_BUILTIN; i++) {
+      mqttBrokerDefault(i == 0, &_mqttBrokers[i]);
+      #if defined(CONFIG_MQTT_BROKER_TABLE) && CONFIG_MQTT_BROKER_TABLE
+        mqttBrokerStateReset(i);
+      #endif // CONFIG_MQTT_BROKER_TABLE
     };
-  #else
-    strcpy(_mqttData.host, CONFIG_MQTT2_HOST);
-  #endif // CONFIG_MQTT1_TYPE == 2
-  
-  #if ESP_IDF_VERSION_MAJOR < 5
-    // Hostname
-    mqttCfg->host = _mqttData.host;
-    
-    // Port and transport
-    #if CONFIG_MQTT2_TLS_ENABLED
-      _mqttData.port = CONFIG_MQTT2_PORT_TLS;
-      mqttCfg->port = CONFIG_MQTT2_PORT_TLS;
-      mqttCfg->skip_cert_common_name_check = false;
-      mqttCfg->transport = MQTT_TRANSPORT_OVER_SSL;
-      #if CONFIG_MQTT2_TLS_STORAGE == TLS_CERT_BUFFER
-        mqttCfg->cert_pem = (const char *)mqtt2_broker_pem_start;
-        mqttCfg->cert_len = mqtt2_broker_pem_end - mqtt2_broker_pem_start;
-        mqttCfg->use_global_ca_store = false;
-      #elif CONFIG_MQTT2_TLS_STORAGE == TLS_CERT_GLOBAL
-        mqttCfg->use_global_ca_store = true;
-      #elif CONFIG_MQTT2_TLS_STORAGE == TLS_CERT_BUNDLE
-        mqttCfg->crt_bundle_attach = esp_crt_bundle_attach;
-        mqttCfg->use_global_ca_store = false;
-      #endif // CONFIG_MQTT2_TLS_STORAGE
-    #else
-      _mqttData.port = CONFIG_MQTT2_PORT_TCP;
-      mqttCfg->transport = MQTT_TRANSPORT_OVER_TCP;
-      mqttCfg->port = CONFIG_MQTT2_PORT_TCP;
-    #endif // CONFIG_MQTT2_TLS_ENABLED
+    _mqttBrokersCount = MQTT_BROKERS_BUILTIN;
+  };
+  return true;
+}
 
-    // Credentials
-    #ifdef CONFIG_MQTT2_USERNAME
-      mqttCfg->username = CONFIG_MQTT2_USERNAME;
-      #ifdef CONFIG_MQTT2_PASSWORD
-        mqttCfg->password = CONFIG_MQTT2_PASSWORD;
-      #endif // CONFIG_MQTT2_PASSWORD
-    #endif // CONFIG_MQTT2_USERNAME
+#if defined(CONFIG_MQTT_BROKER_TABLE) && CONFIG_MQTT_BROKER_TABLE
 
-    // ClientId, if needed. Otherwise ClientId will be generated automatically
-    #ifdef CONFIG_MQTT2_CLIENTID
-      mqttCfg->client_id = CONFIG_MQTT2_CLIENTID;
-    #endif // CONFIG_MQTT_CLIENTID
+#ifndef CONFIG_MQTT_BROKERS_NVS_GROUP
+  #define CONFIG_MQTT_BROKERS_NVS_GROUP "mqtt"
+#endif // CONFIG_MQTT_BROKERS_NVS_GROUP
+#ifndef CONFIG_MQTT_BROKERS_NVS_KEY
+  #define CONFIG_MQTT_BROKERS_NVS_KEY "brokers"
+#endif // CONFIG_MQTT_BROKERS_NVS_KEY
 
-    // Network parameters
-    mqttCfg->network_timeout_ms = CONFIG_MQTT2_TIMEOUT;
-    mqttCfg->reconnect_timeout_ms = CONFIG_MQTT2_RECONNECT;
-    mqttCfg->disable_auto_reconnect = !CONFIG_MQTT2_AUTO_RECONNECT;
+// Moving averages with a weight of 1/8 for a new sample
+#define mqttBrokerAverage(value, sample) value = ((value) * 7 + (sample)) / 8
 
-    // Session parameters
-    mqttCfg->disable_clean_session = !CONFIG_MQTT2_CLEAN_SESSION;
-    mqttCfg->keepalive = CONFIG_MQTT2_KEEP_ALIVE;
-    mqttCfg->disable_keepalive = false;
+typedef struct {
+  re_mqtt_broker_score_t score;
+  bool    exhausted;    // All attempts of the last series have failed
+} re_mqtt_broker_state_t;
 
-    // LWT
-    #if CONFIG_MQTT_STATUS_LWT
-      mqttCfg->lwt_topic = mqttTopicStatusCreate(true);
-      mqttCfg->lwt_msg = CONFIG_MQTT_STATUS_LWT_PAYLOAD;
-      mqttCfg->lwt_msg_len = strlen(CONFIG_MQTT_STATUS_LWT_PAYLOAD);
-      mqttCfg->lwt_qos = CONFIG_MQTT_STATUS_QOS;
-      mqttCfg->lwt_retain = CONFIG_MQTT_STATUS_RETAINED;
-    #endif // CONFIG_MQTT_STATUS_LWT
+static portMUX_TYPE _mqttBrokersLock = portMUX_INITIALIZER_UNLOCKED;
+static re_mqtt_broker_state_t _mqttBrokerStates[MQTT_BROKERS_MAX];
+
+static void mqttBrokerStateReset(uint8_t index)
+{
+  memset(&_mqttBrokerStates[index], 0, sizeof(re_mqtt_broker_state_t));
+  // Brokers that have not yet been tried are considered reliable so that they get a chance
+  _mqttBrokerStates[index].score.success_pm = 1000;
+}
+
+// Higher is better: connection success rate minus penalties for slow handshakes and responses
+static int32_t mqttBrokerScore(uint8_t index)
+{
+  re_mqtt_broker_score_t* score = &_mqttBrokerStates[index].score;
+  return (int32_t)score->success_pm - (int32_t)(score->handshake_ms / 20) - (int32_t)(score->rtt_ms / 10);
+}
+
+// Must be called inside the critical section
+static int mqttBrokerBest(bool primary, bool skip_exhausted)
+{
+  int best = -1;
+  for (uint8_t i = 0; i < _mqttBrokersCount; i++) {
+    if ((_mqttBrokers[i].primary == primary) && !(skip_exhausted && _mqttBrokerStates[i].exhausted)) {
+      if ((best < 0) || (mqttBrokerScore(i) > mqttBrokerScore(best))) {
+        best = i;
+      };
+    };
+  };
+  return best;
+}
+
+static const re_mqtt_broker_t* mqttBrokerSelect(bool primary, bool main)
+{
+  mqttBrokersInit();
+  taskENTER_CRITICAL(&_mqttBrokersLock);
+  int index = mqttBrokerBest(primary, true);
+  if (index < 0) {
+    // All brokers have failed: start a new round
+    for (uint8_t i = 0; i < _mqttBrokersCount; i++) {
+      if (_mqttBrokers[i].primary == primary) _mqttBrokerStates[i].exhausted = false;
+    };
+    index = mqttBrokerBest(primary, false);
+  };
+  if (index < 0) index = primary ? 0 : MQTT_BROKERS_BUILTIN - 1;
+  if (main) {
+    _mqttBrokerMain = index;
+  } else {
+    _mqttBrokerSide = index;
+  };
+  taskEXIT_CRITICAL(&_mqttBrokersLock);
+  return &_mqttBrokers[index];
+}
+
+static void mqttBrokerConnecting()
+{
+  _mqttBrokerStates[_mqttBrokerMain].score.attempts++;
+}
+
+// The handshake time is measured by the statistics, -1 if the session was established without a handshake
+static void mqttBrokerConnected(int32_t handshake_ms)
+{
+  taskENTER_CRITICAL(&_mqttBrokersLock);
+  re_mqtt_broker_state_t* state = &_mqttBrokerStates[_mqttBrokerMain];
+  state->score.successes++;
+  mqttBrokerAverage(state->score.success_pm, 1000);
+  if (handshake_ms >= 0) {
+    if (state->score.successes == 1) {
+      state->score.handshake_ms = handshake_ms;
+    } else {
+      mqttBrokerAverage(state->score.handshake_ms, (uint32_t)handshake_ms);
+    };
+  };
+  // The next failure series starts from scratch for all brokers of the role
+  for (uint8_t i = 0; i < _mqttBrokersCount; i++) {
+    if (_mqttBrokers[i].primary == _mqttBrokers[_mqttBrokerMain].primary) _mqttBrokerStates[i].exhausted = false;
+  };
+  taskEXIT_CRITICAL(&_mqttBrokersLock);
+}
+
+static void mqttBrokerFailed()
+{
+  taskENTER_CRITICAL(&_mqttBrokersLock);
+  re_mqtt_broker_state_t* state = &_mqttBrokerStates[_mqttBrokerMain];
+  state->score.failures++;
+  mqttBrokerAverage(state->score.success_pm, 0);
+  taskEXIT_CRITICAL(&_mqttBrokersLock);
+}
+
+#if defined(CONFIG_MQTT_LATENCY_STATS) && CONFIG_MQTT_LATENCY_STATS
+static void mqttBrokerRtt(uint32_t rtt_ms)
+{
+  taskENTER_CRITICAL(&_mqttBrokersLock);
+  re_mqtt_broker_score_t* score = &_mqttBrokerStates[_mqttBrokerMain].score;
+  if (score->rtt_ms == 0) {
+    score->rtt_ms = rtt_ms;
+  } else {
+    mqttBrokerAverage(score->rtt_ms, rtt_ms);
+  };
+  taskEXIT_CRITICAL(&_mqttBrokersLock);
+}
+#endif // CONFIG_MQTT_LATENCY_STATS
+
+// After a failed series of attempts: returns true if another broker of the same role should be tried
+static bool mqttBrokerRotate()
+{
+  taskENTER_CRITICAL(&_mqttBrokersLock);
+  _mqttBrokerStates[_mqttBrokerMain].exhausted = true;
+  int next = mqttBrokerBest(_mqttBrokers[_mqttBrokerMain].primary, true);
+  taskEXIT_CRITICAL(&_mqttBrokersLock);
+  return next >= 0;
+}
+
+#if defined(CONFIG_MQTT2_TYPE) && ((defined(CONFIG_MQTT_CONNECT_RACE) && CONFIG_MQTT_CONNECT_RACE) || (defined(CONFIG_MQTT_HOT_STANDBY) && CONFIG_MQTT_HOT_STANDBY) || (defined(CONFIG_MQTT_PRIMARY_PROBE) && CONFIG_MQTT_PRIMARY_PROBE))
+static void mqttBrokerTakeover()
+{
+  _mqttBrokerMain = _mqttBrokerSide;
+}
+#endif // CONFIG_MQTT_CONNECT_RACE || CONFIG_MQTT_HOT_STANDBY || CONFIG_MQTT_PRIMARY_PROBE
+
+int mqttBrokerAdd(const re_mqtt_broker_t* broker)
+{
+  if (broker == nullptr) return -1;
+  #ifndef CONFIG_MQTT2_TYPE
+    // Without a reserved broker in the project configuration, there is nobody to switch to reserved brokers
+    if (!broker->primary) return -1;
+  #endif // CONFIG_MQTT2_TYPE
+  mqttBrokersInit();
+  int index = -1;
+  taskENTER_CRITICAL(&_mqttBrokersLock);
+  if (_mqttBrokersCount < MQTT_BROKERS_MAX) {
+    index = _mqttBrokersCount;
+    memcpy(&_mqttBrokers[index], broker, sizeof(re_mqtt_broker_t));
+    mqttBrokerStateReset(index);
+    _mqttBrokersCount++;
+  };
+  taskEXIT_CRITICAL(&_mqttBrokersLock);
+  if (index >= 0) {
+    rlog_i(logTAG, "MQTT broker [ %s : %d ] added to the table as #%d", broker->host, broker->port, index);
+  } else {
+    rlog_e(logTAG, "Failed to add MQTT broker [ %s : %d ]: the table is full", broker->host, broker->port);
+  };
+  return index;
+}
+
+bool mqttBrokerRemove(uint8_t index)
+{
+  bool removed = false;
+  taskENTER_CRITICAL(&_mqttBrokersLock);
+  // Brokers from the project configuration cannot be removed, as well as the one in use
+  if ((index >= MQTT_BROKERS_BUILTIN) && (index < _mqttBrokersCount) && (index != _mqttBrokerMain) && (index != _mqttBrokerSide)) {
+    for (uint8_t i = index; i + 1 < _mqttBrokersCount; i++) {
+      memcpy(&_mqttBrokers[i], &_mqttBrokers[i + 1], sizeof(re_mqtt_broker_t));
+      memcpy(&_mqttBrokerStates[i], &_mqttBrokerStates[i + 1], sizeof(re_mqtt_broker_state_t));
+    };
+    _mqttBrokersCount--;
+    if (_mqttBrokerMain > index) _mqttBrokerMain--;
+    if (_mqttBrokerSide > index) _mqttBrokerSide--;
+    removed = true;
+  };
+  taskEXIT_CRITICAL(&_mqttBrokersLock);
+  return removed;
+}
+
+uint8_t mqttBrokerCount()
+{
+  mqttBrokersInit();
+  return _mqttBrokersCount;
+}
+
+bool mqttBrokerGet(uint8_t index, re_mqtt_broker_t* broker, re_mqtt_broker_score_t* score)
+{
+  if (index >= _mqttBrokersCount) return false;
+  taskENTER_CRITICAL(&_mqttBrokersLock);
+  if (broker) memcpy(broker, &_mqttBrokers[index], sizeof(re_mqtt_broker_t));
+  if (score) memcpy(score, &_mqttBrokerStates[index].score, sizeof(re_mqtt_broker_score_t));
+  taskEXIT_CRITICAL(&_mqttBrokersLock);
+  return true;
+}
+
+static bool mqttBrokerSame(const re_mqtt_broker_t* a, const re_mqtt_broker_t* b)
+{
+  return (a->primary == b->primary) && (a->port == b->port) && (strncmp(a->host, b->host, sizeof(a->host)) == 0);
+}
+
+// Must be called inside the critical section: the runtime part of the table is replaced with the loaded brokers.
+// Brokers in use are kept even if they are not in the list, and brokers that remain in the table keep their scores
+static void mqttBrokersReplace(const re_mqtt_broker_t* loaded, size_t count, re_mqtt_broker_t* brokers, re_mqtt_broker_state_t* states)
+{
+  uint8_t total = MQTT_BROKERS_BUILTIN;
+  uint8_t main = _mqttBrokerMain;
+  uint8_t side = _mqttBrokerSide;
+  for (uint8_t i = MQTT_BROKERS_BUILTIN; i < _mqttBrokersCount; i++) {
+    if ((i == _mqttBrokerMain) || (i == _mqttBrokerSide)) {
+      memcpy(&brokers[total], &_mqttBrokers[i], sizeof(re_mqtt_broker_t));
+      memcpy(&states[total], &_mqttBrokerStates[i], sizeof(re_mqtt_broker_state_t));
+      if (i == _mqttBrokerMain) main = total;
+      if (i == _mqttBrokerSide) side = total;
+      total++;
+    };
+  };
+  for (size_t i = 0; (i < count) && (total < MQTT_BROKERS_MAX); i++) {
+    #ifndef CONFIG_MQTT2_TYPE
+      // Without a reserved broker in the project configuration, there is nobody to switch to reserved brokers
+      if (!loaded[i].primary) continue;
+    #endif // CONFIG_MQTT2_TYPE
+    bool kept = false;
+    for (uint8_t k = MQTT_BROKERS_BUILTIN; k < total; k++) {
+      if (mqttBrokerSame(&brokers[k], &loaded[i])) kept = true;
+    };
+    if (kept) continue;
+    memcpy(&brokers[total], &loaded[i], sizeof(re_mqtt_broker_t));
+    memset(&states[total], 0, sizeof(re_mqtt_broker_state_t));
+    states[total].score.success_pm = 1000;
+    for (uint8_t k = MQTT_BROKERS_BUILTIN; k < _mqttBrokersCount; k++) {
+      if (mqttBrokerSame(&_mqttBrokers[k], &loaded[i])) {
+        memcpy(&states[total], &_mqttBrokerStates[k], sizeof(re_mqtt_broker_state_t));
+      };
+    };
+    total++;
+  };
+  memcpy(&_mqttBrokers[MQTT_BROKERS_BUILTIN], &brokers[MQTT_BROKERS_BUILTIN], (total - MQTT_BROKERS_BUILTIN) * sizeof(re_mqtt_broker_t));
+  memcpy(&_mqttBrokerStates[MQTT_BROKERS_BUILTIN], &states[MQTT_BROKERS_BUILTIN], (total - MQTT_BROKERS_BUILTIN) * sizeof(re_mqtt_broker_state_t));
+  _mqttBrokersCount = total;
+  _mqttBrokerMain = main;
+  _mqttBrokerSide = side;
+}
+
+// Brokers added at runtime are stored in NVS as one blob, brokers from the project configuration are not stored
+bool mqttBrokersLoad()
+{
+  mqttBrokersInit();
+  nvs_handle_t nvs_handle;
+  esp_err_t err = nvs_open(CONFIG_MQTT_BROKERS_NVS_GROUP, NVS_READONLY, &nvs_handle);
+  if (err != ESP_OK) {
+    rlog_w(logTAG, "Failed to open NVS group \"%s\": %d %s", CONFIG_MQTT_BROKERS_NVS_GROUP, err, esp_err_to_name(err));
+    return false;
+  };
+  re_mqtt_broker_t* brokers = (re_mqtt_broker_t*)esp_calloc(MQTT_BROKERS_MAX - MQTT_BROKERS_BUILTIN, sizeof(re_mqtt_broker_t));
+  size_t size = (MQTT_BROKERS_MAX - MQTT_BROKERS_BUILTIN) * sizeof(re_mqtt_broker_t);
+  if (brokers) {
+    err = nvs_get_blob(nvs_handle, CONFIG_MQTT_BROKERS_NVS_KEY, brokers, &size);
+  } else {
+    err = ESP_ERR_NO_MEM;
+  };
+  nvs_close(nvs_handle);
+  // The new table is assembled in a temporary buffer, so as not to allocate memory in the critical section
+  re_mqtt_broker_t* table = nullptr;
+  re_mqtt_broker_state_t* states = nullptr;
+  if (err == ESP_OK) {
+    table = (re_mqtt_broker_t*)esp_calloc(MQTT_BROKERS_MAX, sizeof(re_mqtt_broker_t));
+    states = (re_mqtt_broker_state_t*)esp_calloc(MQTT_BROKERS_MAX, sizeof(re_mqtt_broker_state_t));
+    if ((table == nullptr) || (states == nullptr)) err = ESP_ERR_NO_MEM;
+  };
+  if (err == ESP_OK) {
+    size_t count = size / sizeof(re_mqtt_broker_t);
+    for (size_t i = 0; i < count; i++) {
+      // Certificate buffers are not stored in NVS, the global CA store is used instead
+      brokers[i].cert_pem = nullptr;
+      brokers[i].cert_len = 0;
+      if (brokers[i].tls_storage == TLS_CERT_BUFFER) brokers[i].tls_storage = TLS_CERT_GLOBAL;
+    };
+    taskENTER_CRITICAL(&_mqttBrokersLock);
+    mqttBrokersReplace(brokers, count, table, states);
+    taskEXIT_CRITICAL(&_mqttBrokersLock);
+    rlog_i(logTAG, "Loaded %d MQTT brokers from NVS", (int)count);
+  } else {
+    rlog_w(logTAG, "Failed to load MQTT brokers from NVS: %d %s", err, esp_err_to_name(err));
+  };
+  if (table) free(table);
+  if (states) free(states);
+  if (brokers) free(brokers);
+  return err == ESP_OK;
+}
+
+bool mqttBrokersSave()
+{
+  nvs_handle_t nvs_handle;
+  esp_err_t err = nvs_open(CONFIG_MQTT_BROKERS_NVS_GROUP, NVS_READWRITE, &nvs_handle);
+  if (err == ESP_OK) {
+    size_t count = _mqttBrokersCount > MQTT_BROKERS_BUILTIN ? _mqttBrokersCount - MQTT_BROKERS_BUILTIN : 0;
+    err = nvs_set_blob(nvs_handle, CONFIG_MQTT_BROKERS_NVS_KEY, &_mqttBrokers[MQTT_BROKERS_BUILTIN], count * sizeof(re_mqtt_broker_t));
+    if (err == ESP_OK) {
+      err = nvs_commit(nvs_handle);
+    };
+    nvs_close(nvs_handle);
+  };
+  if (err != ESP_OK) {
+    rlog_e(logTAG, "Failed to save MQTT brokers to NVS: %d %s", err, esp_err_to_name(err));
+  };
+  return err == ESP_OK;
+}
+
+#else
+
+static const re_mqtt_broker_t* mqttBrokerSelect(bool primary, bool main)
+{
+  mqttBrokersInit();
+  return &_mqttBrokers[primary ? 0 : MQTT_BROKERS_BUILTIN - 1];
+}
 
-    // Task & buffers
-    mqttCfg->buffer_size = CONFIG_MQTT_READ_BUFFER_SIZE;
-    mqttCfg->out_buffer_size = CONFIG_MQTT_WRITE_BUFFER_SIZE;
-    mqttCfg->task_prio = CONFIG_TASK_PRIORITY_MQTT_CLIENT;
-    mqttCfg->task_stack = CONFIG_MQTT_CLIENT_STACK_SIZE;
-  #else
-    // Hostname
-    mqttCfg->broker.address.hostname = _mqttData.host;
+static void mqttBrokerConnecting()
+{
+}
 
-    // Port and transport
-    #if CONFIG_MQTT2_TLS_ENABLED
-      _mqttData.port = CONFIG_MQTT2_PORT_TLS;
-      mqttCfg->broker.address.port = CONFIG_MQTT2_PORT_TLS;
-      mqttCfg->broker.address.transport = MQTT_TRANSPORT_OVER_SSL;
-      mqttCfg->broker.verification.skip_cert_common_name_check = false;
-      #if CONFIG_MQTT2_TLS_STORAGE == TLS_CERT_BUFFER
-        mqttCfg->broker.verification.certificate = (const char *)mqtt2_broker_pem_start;
-        mqttCfg->broker.verification.certificate_len = mqtt2_broker_pem_end - mqtt2_broker_pem_start;
-        mqttCfg->broker.verification.use_global_ca_store = false;
-      #elif CONFIG_MQTT2_TLS_STORAGE == TLS_CERT_GLOBAL
-        mqttCfg->broker.verification.use_global_ca_store = true;
-      #elif CONFIG_MQTT2_TLS_STORAGE == TLS_CERT_BUNDLE
-        mqttCfg->broker.verification.crt_bundle_attach = esp_crt_bundle_attach;
-        mqttCfg->broker.verification.use_global_ca_store = false;
-      #endif // CONFIG_MQTT2_TLS_STORAGE
-    #else
-      _mqttData.port = CONFIG_MQTT2_PORT_TCP;
-      mqttCfg->broker.address.transport = MQTT_TRANSPORT_OVER_TCP;
-      mqttCfg->broker.address.port = CONFIG_MQTT2_PORT_TCP;
-    #endif // CONFIG_MQTT2_TLS_ENABLED
+static void mqttBrokerConnected(int32_t handshake_ms)
+{
+}
 
-    // Credentials
-    #ifdef CONFIG_MQTT2_USERNAME
-      mqttCfg->credentials.username = CONFIG_MQTT2_USERNAME;
-      #ifdef CONFIG_MQTT2_PASSWORD
-        mqttCfg->credentials.authentication.password = CONFIG_MQTT2_PASSWORD;
-      #endif // CONFIG_MQTT2_PASSWORD
-    #endif // CONFIG_MQTT2_USERNAME
+static void mqttBrokerFailed()
+{
+}
 
-    // ClientId, if needed. Otherwise ClientId will be generated automatically
-    #ifdef CONFIG_MQTT2_CLIENTID
-      mqttCfg->credentials.client_id = CONFIG_MQTT2_CLIENTID;
-    #endif // CONFIG_MQTT_CLIENTID
+#if defined(CONFIG_MQTT_LATENCY_STATS) && CONFIG_MQTT_LATENCY_STATS
+static void mqttBrokerRtt(uint32_t rtt_ms)
+{
+}
+#endif // CONFIG_MQTT_LATENCY_STATS
 
-    // Network parameters
-    mqttCfg->network.timeout_ms = CONFIG_MQTT2_TIMEOUT;
-    mqttCfg->network.reconnect_timeout_ms = CONFIG_MQTT2_RECONNECT;
-    mqttCfg->network.disable_auto_reconnect = !CONFIG_MQTT2_AUTO_RECONNECT;
+static bool mqttBrokerRotate()
+{
+  return false;
+}
 
-    // Session parameters
-    mqttCfg->session.disable_clean_session = !CONFIG_MQTT2_CLEAN_SESSION;
-    mqttCfg->session.keepalive = CONFIG_MQTT2_KEEP_ALIVE;
-    mqttCfg->session.disable_keepalive = false;
+#if defined(CONFIG_MQTT2_TYPE) && ((defined(CONFIG_MQTT_CONNECT_RACE) && CONFIG_MQTT_CONNECT_RACE) || (defined(CONFIG_MQTT_HOT_STANDBY) && CONFIG_MQTT_HOT_STANDBY) || (defined(CONFIG_MQTT_PRIMARY_PROBE) && CONFIG_MQTT_PRIMARY_PROBE))
+static void mqttBrokerTakeover()
+{
+}
+#endif // CONFIG_MQTT_CONNECT_RACE || CONFIG_MQTT_HOT_STANDBY || CONFIG_MQTT_PRIMARY_PROBE
 
-    // LWT
-    #if CONFIG_MQTT_STATUS_LWT
-      mqttCfg->session.last_will.topic = mqttTopicStatusCreate(false);
-      mqttCfg->session.last_will.msg = CONFIG_MQTT_STATUS_LWT_PAYLOAD;
-      mqttCfg->session.last_will.msg_len = strlen(CONFIG_MQTT_STATUS_LWT_PAYLOAD);
-      mqttCfg->session.last_will.qos = CONFIG_MQTT_STATUS_QOS;
-      mqttCfg->session.last_will.retain = CONFIG_MQTT_STATUS_RETAINED;
-    #endif // CONFIG_MQTT_STATUS_LWT
+#endif // CONFIG_MQTT_BROKER_TABLE
 
-    // Task & buffers
-    mqttCfg->task.priority = CONFIG_TASK_PRIORITY_MQTT_CLIENT;
-    mqttCfg->task.stack_size = CONFIG_MQTT_CLIENT_STACK_SIZE;
-    mqttCfg->buffer.size = CONFIG_MQTT_READ_BUFFER_SIZE;
-    mqttCfg->buffer.out_size = CONFIG_MQTT_WRITE_BUFFER_SIZE;
-  #endif // #if ESP_IDF_VERSION_MAJOR
+void mqttSetConfigPrimary(esp_mqtt_client_config_t * mqttCfg, re_mqtt_event_data_t * mqttData)
+{
+  mqttSetConfigBroker(mqttCfg, mqttData, mqttBrokerSelect(true, mqttData == &_mqttData));
+}
+
+#ifdef CONFIG_MQTT2_TYPE
+
+void mqttSetConfigReserved(esp_mqtt_client_config_t * mqttCfg, re_mqtt_event_data_t * mqttData)
+{
+  mqttSetConfigBroker(mqttCfg, mqttData, mqttBrokerSelect(false, mqttData == &_mqttData));
 }
 
 #endif // CONFIG_MQTT2_TYPE
@@ -1033,10 +5265,11 @@ esp_err_t mqttInitConfig(esp_mqtt_client_config_t * mqttCfg)
   mqttStatesClear(MQTTCLI_STARTED | MQTTCLI_CONNECTED);
 
   #ifdef CONFIG_MQTT2_TYPE
-    mqttStatesCheck(MQTTCLI_SERVER2_ACTIVE, false) ? mqttSetConfigReserved(mqttCfg) : mqttSetConfigPrimary(mqttCfg);
+    mqttStatesCheck(MQTTCLI_SERVER2_ACTIVE, false) ? mqttSetConfigReserved(mqttCfg, &_mqttData) : mqttSetConfigPrimary(mqttCfg, &_mqttData);
   #else
-    mqttSetConfigPrimary(mqttCfg);
+    mqttSetConfigPrimary(mqttCfg, &_mqttData);
   #endif // CONFIG_MQTT2_TYPE
+  mqttRetryConfig(mqttCfg);
 
   #if ESP_IDF_VERSION_MAJOR < 5
     RE_MEM_CHECK_EVENT(mqttCfg->host, return ESP_ERR_INVALID_ARG);
@@ -1068,24 +5301,27 @@ esp_err_t mqttClientCreate()
     if (err != ESP_OK) return err;
 
     // Init client
-    _mqttClient = esp_mqtt_client_init(&_mqttCfg);
-    if (_mqttClient == nullptr) {
+    esp_mqtt_client_handle_t client = esp_mqtt_client_init(&_mqttCfg);
+    if (client == nullptr) {
       rlog_e(logTAG, "Failed to create task [ MQTT_CLIENT ]: out of memory");
       mqttErrorEventSendCode("Failed to create task [ MQTT_CLIENT ]: %d %s", nullptr, ESP_ERR_NO_MEM);
       return ESP_ERR_NO_MEM;
     };
     
-    err = esp_mqtt_client_register_event(_mqttClient, MQTT_EVENT_ANY, mqttEventHandler, _mqttClient);
+    err = esp_mqtt_client_register_event(client, MQTT_EVENT_ANY, mqttEventHandler, client);
     if (err != ESP_OK) {
       mqttErrorEventSendCode("Failed to create task (re) [ MQTT_CLIENT ]: %d %s", nullptr, err);
       rlog_e(logTAG, "Failed to create task (re) [ MQTT_CLIENT ]: %d %s", err, esp_err_to_name(err));
     };
+    uint32_t ticket;
+    mqttClientReplaceWait(client, &ticket);
 
     // Start client
-    err = esp_mqtt_client_start(_mqttClient);
+    err = esp_mqtt_client_start(client);
     if (err == ESP_OK) {
       mqttStatesSet(MQTTCLI_STARTED);
       rlog_i(logTAG, "Task [ MQTT_CLIENT ] was started");
+      mqttRaceStart();
     } else {
       mqttErrorEventSendCode("Failed to start task [ MQTT_CLIENT ]: %d %s", nullptr, err);
       rlog_e(logTAG, "Failed to start task [ MQTT_CLIENT ]: %d %s", err, esp_err_to_name(err));
@@ -1110,18 +5346,23 @@ esp_err_t mqttClientRestart()
   err = mqttInitConfig(&_mqttCfg);
   if (err != ESP_OK) return err;
 
-  err = esp_mqtt_set_config(_mqttClient, &_mqttCfg);
+  uint32_t ticket;
+  esp_mqtt_client_handle_t client = mqttClientAcquire(&ticket);
+  err = client ? esp_mqtt_set_config(client, &_mqttCfg) : ESP_ERR_INVALID_STATE;
   if (err != ESP_OK) {
+    mqttClientRelease(ticket);
     mqttErrorEventSendCode("Failed to configure MQTT client [ MQTT_CLIENT ]: %d %s", nullptr, err);
     rlog_e(logTAG, "Failed to configure MQTT client [ MQTT_CLIENT ]: %d %s", err, esp_err_to_name(err));
     return err;
   };
     
   // Start client
-  err = esp_mqtt_client_start(_mqttClient);
+  err = esp_mqtt_client_start(client);
+  mqttClientRelease(ticket);
   if (err == ESP_OK) {
     mqttStatesSet(MQTTCLI_STARTED);
     rlog_i(logTAG, "Task [ MQTT_CLIENT ] was started");
+    mqttRaceStart();
   } else {
     mqttErrorEventSendCode("Failed to start task [ MQTT_CLIENT ]: %d %s", nullptr, err);
     rlog_e(logTAG, "Failed to start task [ MQTT_CLIENT ]: %d %s", err, esp_err_to_name(err));
@@ -1131,10 +5372,16 @@ esp_err_t mqttClientRestart()
 
 esp_err_t mqttClientStop()
 {
-  if (_mqttClient) {
+  mqttSideStop();
+  mqttRetryCancel();
+  uint32_t ticket;
+  esp_mqtt_client_handle_t client = mqttClientAcquire(&ticket);
+  esp_err_t err = ESP_FAIL;
+  if (client) {
+    err = ESP_OK;
     if (mqttStatesCheck(MQTTCLI_STARTED, false)) {
       rlog_w(logTAG, "Stop MQTT client...");
-      esp_err_t err = esp_mqtt_client_stop(_mqttClient);
+      err = esp_mqtt_client_stop(client);
       if (err == ESP_OK) {
         if (mqttStatesCheck(MQTTCLI_CONNECTED, false)) {
           eventLoopPost(RE_MQTT_EVENTS, RE_MQTT_CONN_LOST, &_mqttData, sizeof(_mqttData), portMAX_DELAY);
@@ -1150,11 +5397,10 @@ esp_err_t mqttClientStop()
         mqttErrorEventSendCode("Failed to stop task [ MQTT_CLIENT ]: %d %s", nullptr, err);
         rlog_e(logTAG, "Failed to stop task [ MQTT_CLIENT ]: %d %s", err, esp_err_to_name(err));
       };
-      return err;
     };
-    return ESP_OK;
   };
-  return ESP_FAIL;
+  mqttClientRelease(ticket);
+  return err;
 }
 
 esp_err_t mqttClientDestroy()
@@ -1163,26 +5409,637 @@ esp_err_t mqttClientDestroy()
     rlog_w(logTAG, "Destroy MQTT client...");
     // Disсonnect from server and stop task
     mqttClientStop();
+    // Other tasks may still be using the handle: it is reset first, then the client is destroyed when they have finished
+    uint32_t ticket;
+    esp_mqtt_client_handle_t client = mqttClientReplaceWait(nullptr, &ticket);
+    mqttClientDrain(ticket);
     // Destoy client
-    esp_err_t err = esp_mqtt_client_destroy(_mqttClient);
+    esp_err_t err = esp_mqtt_client_destroy(client);
     if (err == ESP_OK) {
-      // Reset variables
-      _mqttClient = nullptr;
+      mqttHandoverDrop(client);
       rlog_i(logTAG, "Task [ MQTT_CLIENT ] was deleted");
     } else {
+      mqttClientReplaceWait(client, &ticket);
       rlog_e(logTAG, "Failed to destroy task [ MQTT_CLIENT ]: %d %s", err, esp_err_to_name(err));
+      return err;
     };
   };
   return ESP_OK;
 }
 
+// -----------------------------------------------------------------------------------------------------------------------
+// -------------------------------------------------- Side connection ----------------------------------------------------
+// -----------------------------------------------------------------------------------------------------------------------
+
+#if defined(CONFIG_MQTT2_TYPE) && ((defined(CONFIG_MQTT_CONNECT_RACE) && CONFIG_MQTT_CONNECT_RACE) || (defined(CONFIG_MQTT_HOT_STANDBY) && CONFIG_MQTT_HOT_STANDBY) || (defined(CONFIG_MQTT_PRIMARY_PROBE) && CONFIG_MQTT_PRIMARY_PROBE))
+
+#ifndef CONFIG_MQTT_CONNECT_RACE
+  #define CONFIG_MQTT_CONNECT_RACE 0
+#endif // CONFIG_MQTT_CONNECT_RACE
+#ifndef CONFIG_MQTT_HOT_STANDBY
+  #define CONFIG_MQTT_HOT_STANDBY 0
+#endif // CONFIG_MQTT_HOT_STANDBY
+#ifndef CONFIG_MQTT_PRIMARY_PROBE
+  #define CONFIG_MQTT_PRIMARY_PROBE 0
+#endif // CONFIG_MQTT_PRIMARY_PROBE
+#ifndef CONFIG_MQTT_STANDBY_KEEP_ALIVE
+  #define CONFIG_MQTT_STANDBY_KEEP_ALIVE 300
+#endif // CONFIG_MQTT_STANDBY_KEEP_ALIVE
+// Seconds after a standby takeover until the client is restarted with the full configuration (0 - never)
+#ifndef CONFIG_MQTT_STANDBY_RECONFIGURE
+  #define CONFIG_MQTT_STANDBY_RECONFIGURE 30
+#endif // CONFIG_MQTT_STANDBY_RECONFIGURE
+#ifndef CONFIG_MQTT_RACE_HEAD_START
+  #define CONFIG_MQTT_RACE_HEAD_START 2000
+#endif // CONFIG_MQTT_RACE_HEAD_START
+#ifndef CONFIG_MQTT_DROP_STACK_SIZE
+  #define CONFIG_MQTT_DROP_STACK_SIZE 3072
+#endif // CONFIG_MQTT_DROP_STACK_SIZE
+// Copies of unacknowledged QoS 1 and 2 messages, which are sent again if their client is replaced
+#ifndef CONFIG_MQTT_HANDOVER_MAX_BYTES
+  #define CONFIG_MQTT_HANDOVER_MAX_BYTES 8192
+#endif // CONFIG_MQTT_HANDOVER_MAX_BYTES
+
+typedef enum {
+  MQTT_SIDE_NONE = 0,
+  MQTT_SIDE_RACE,
+  MQTT_SIDE_STANDBY,
+  MQTT_SIDE_PROBE
+} re_mqtt_side_mode_t;
+
+static portMUX_TYPE _mqttSideLock = portMUX_INITIALIZER_UNLOCKED;
+static esp_mqtt_client_handle_t _mqttSideClient = nullptr;
+static re_mqtt_side_mode_t _mqttSideMode = MQTT_SIDE_NONE;
+static bool _mqttSideConnected = false;
+static re_mqtt_event_data_t _mqttSideData;
+static esp_timer_handle_t _mqttRaceTimer = nullptr;
+static esp_timer_handle_t _mqttStandbyTimer = nullptr;
+#if CONFIG_MQTT_PRIMARY_PROBE
+static int64_t _mqttProbeStarted = 0;
+#endif // CONFIG_MQTT_PRIMARY_PROBE
+
+typedef struct re_mqtt_handover_t {
+  re_mqtt_handover_t* next;
+  esp_mqtt_client_handle_t client;
+  int      msg_id;
+  char*    topic;
+  char*    payload;
+  size_t   payload_len;
+  int      qos;
+  bool     retained;
+} re_mqtt_handover_t;
+
+static re_mqtt_handover_t* _mqttHandover = nullptr;
+static size_t _mqttHandoverBytes = 0;
+static portMUX_TYPE _mqttHandoverLock = portMUX_INITIALIZER_UNLOCKED;
+
+typedef struct {
+  esp_mqtt_client_handle_t client;
+  bool     retired;  // The client was the main one: wait for tickets and resend its unacknowledged messages
+  uint32_t ticket;
+} re_mqtt_side_drop_t;
+
+static size_t mqttHandoverSize(re_mqtt_handover_t* item)
+{
+  return strlen(item->topic) + item->payload_len;
+}
+
+static void mqttHandoverFreeList(re_mqtt_handover_t* item)
+{
+  while (item) {
+    re_mqtt_handover_t* next = item->next;
+    free(item);
+    item = next;
+  };
+}
+
+static void mqttHandoverPut(esp_mqtt_client_handle_t client, int msg_id, const char *topic, const char *payload, size_t payload_len, int qos, bool retained)
+{
+  if (!(CONFIG_MQTT_CONNECT_RACE || CONFIG_MQTT_HOT_STANDBY)) return;
+  size_t topic_len = strlen(topic);
+  if (topic_len + payload_len > CONFIG_MQTT_HANDOVER_MAX_BYTES) return;
+  re_mqtt_handover_t* item = (re_mqtt_handover_t*)esp_calloc(1, sizeof(re_mqtt_handover_t) + topic_len + payload_len + 2);
+  if (item == nullptr) return;
+  item->client = client;
+  item->msg_id = msg_id;
+  item->topic = (char*)item + sizeof(re_mqtt_handover_t);
+  memcpy(item->topic, topic, topic_len);
+  item->payload = item->topic + topic_len + 1;
+  item->payload_len = payload_len;
+  if (payload_len > 0) memcpy(item->payload, payload, payload_len);
+  item->qos = qos;
+  item->retained = retained;
+
+  // The oldest copies are discarded when the limit is reached
+  re_mqtt_handover_t* garbage = nullptr;
+  taskENTER_CRITICAL(&_mqttHandoverLock);
+  while (_mqttHandover && (_mqttHandoverBytes + topic_len + payload_len > CONFIG_MQTT_HANDOVER_MAX_BYTES)) {
+    re_mqtt_handover_t* oldest = _mqttHandover;
+    _mqttHandover = oldest->next;
+    _mqttHandoverBytes -= mqttHandoverSize(oldest);
+    oldest->next = garbage;
+    garbage = oldest;
+  };
+  re_mqtt_handover_t** prev = &_mqttHandover;
+  while (*prev) prev = &(*prev)->next;
+  *prev = item;
+  _mqttHandoverBytes += topic_len + payload_len;
+  taskEXIT_CRITICAL(&_mqttHandoverLock);
+  mqttHandoverFreeList(garbage);
+}
+
+// Detaching the copies of the client (all of them, or only one message), in order of publication
+static re_mqtt_handover_t* mqttHandoverTake(esp_mqtt_client_handle_t client, int msg_id)
+{
+  re_mqtt_handover_t* taken = nullptr;
+  re_mqtt_handover_t** tail = &taken;
+  taskENTER_CRITICAL(&_mqttHandoverLock);
+  re_mqtt_handover_t** prev = &_mqttHandover;
+  while (*prev) {
+    re_mqtt_handover_t* item = *prev;
+    if ((item->client == client) && ((msg_id < 0) || (item->msg_id == msg_id))) {
+      *prev = item->next;
+      _mqttHandoverBytes -= mqttHandoverSize(item);
+      item->next = nullptr;
+      *tail = item;
+      tail = &item->next;
+      if (msg_id >= 0) break;
+    } else {
+      prev = &item->next;
+    };
+  };
+  taskEXIT_CRITICAL(&_mqttHandoverLock);
+  return taken;
+}
+
+static void mqttHandoverAck(esp_mqtt_client_handle_t client, int msg_id)
+{
+  if (msg_id > 0) mqttHandoverFreeList(mqttHandoverTake(client, msg_id));
+}
+
+static void mqttHandoverDrop(esp_mqtt_client_handle_t client)
+{
+  mqttHandoverFreeList(mqttHandoverTake(client, -1));
+}
+
+static void mqttSideDropTask(void* arg)
+{
+  re_mqtt_side_drop_t* drop = (re_mqtt_side_drop_t*)arg;
+  re_mqtt_handover_t* pending = nullptr;
+  if (drop->retired) {
+    mqttClientDrain(drop->ticket);
+    pending = mqttHandoverTake(drop->client, -1);
+  };
+  esp_mqtt_client_destroy(drop->client);
+  // The outbox of the destroyed client is lost: unacknowledged messages are sent again through the new main client
+  if (pending) {
+    rlog_i(logTAG, "Resending unacknowledged messages of the previous connection...");
+  };
+  while (pending) {
+    re_mqtt_handover_t* next = pending->next;
+    mqttPublishInternal(pending->topic, pending->payload, pending->payload_len, pending->qos, pending->retained);
+    free(pending);
+    pending = next;
+  };
+  free(drop);
+  vTaskDelete(nullptr);
+}
+
+// The retired handle will not be drained (it is abandoned), the generation is released with its last user
+static void mqttClientAbandon(uint32_t ticket)
+{
+  taskENTER_CRITICAL(&_mqttClientLock);
+  _mqttClientGens[ticket].draining = false;
+  taskEXIT_CRITICAL(&_mqttClientLock);
+}
+
+// Unnecessary clients are destroyed in a separate task: stopping a client waits for its task, which may be busy connecting
+static void mqttSideDropStart(esp_mqtt_client_handle_t client, bool retired, uint32_t ticket)
+{
+  if (client) {
+    re_mqtt_side_drop_t* drop = (re_mqtt_side_drop_t*)esp_calloc(1, sizeof(re_mqtt_side_drop_t));
+    if (drop) {
+      drop->client = client;
+      drop->retired = retired;
+      drop->ticket = ticket;
+      if (xTaskCreate(mqttSideDropTask, "mqtt_drop", CONFIG_MQTT_DROP_STACK_SIZE, drop, CONFIG_TASK_PRIORITY_MQTT_CLIENT, nullptr) == pdPASS) {
+        return;
+      };
+      free(drop);
+    };
+    if (retired) mqttClientAbandon(ticket);
+    rlog_e(logTAG, "Failed to create task [ MQTT_DROP ]!");
+  };
+}
+
+static void mqttSideDrop(esp_mqtt_client_handle_t client)
+{
+  mqttSideDropStart(client, false, 0);
+}
+
+static bool mqttSideStart(bool primary, re_mqtt_side_mode_t mode)
+{
+  if (_mqttSideClient) return false;
+
+  esp_mqtt_client_config_t cfg;
+  memset(&cfg, 0, sizeof(cfg));
+  memset(&_mqttSideData, 0, sizeof(_mqttSideData));
+  primary ? mqttSetConfigPrimary(&cfg, &_mqttSideData) : mqttSetConfigReserved(&cfg, &_mqttSideData);
+  if (mode != MQTT_SIDE_RACE) {
+    // No last will: the device is still online on the main broker
+    #if ESP_IDF_VERSION_MAJOR < 5
+      cfg.lwt_topic = nullptr;
+      cfg.lwt_msg = nullptr;
+      cfg.lwt_msg_len = 0;
+    #else
+      memset(&cfg.session.last_will, 0, sizeof(cfg.session.last_will));
+    #endif // ESP_IDF_VERSION_MAJOR
+  };
+  if (mode == MQTT_SIDE_STANDBY) {
+    // Idle session with a rare keepalive
+    #if ESP_IDF_VERSION_MAJOR < 5
+      cfg.keepalive = CONFIG_MQTT_STANDBY_KEEP_ALIVE;
+    #else
+      cfg.session.keepalive = CONFIG_MQTT_STANDBY_KEEP_ALIVE;
+    #endif // ESP_IDF_VERSION_MAJOR
+  } else if (mode == MQTT_SIDE_PROBE) {
+    // A single attempt, the result is reported by the first CONNECTED or DISCONNECTED event
+    #if ESP_IDF_VERSION_MAJOR < 5
+      cfg.disable_auto_reconnect = true;
+    #else
+      cfg.network.disable_auto_reconnect = true;
+    #endif // ESP_IDF_VERSION_MAJOR
+  };
+
+  esp_mqtt_client_handle_t client = esp_mqtt_client_init(&cfg);
+  if (client == nullptr) {
+    rlog_e(logTAG, "Failed to create side connection to MQTT broker [ %s : %d ]", _mqttSideData.host, _mqttSideData.port);
+    return false;
+  };
+  esp_mqtt_client_register_event(client, MQTT_EVENT_ANY, mqttEventHandler, client);
+
+  taskENTER_CRITICAL(&_mqttSideLock);
+  _mqttSideClient = client;
+  _mqttSideMode = mode;
+  _mqttSideConnected = false;
+  taskEXIT_CRITICAL(&_mqttSideLock);
+
+  esp_err_t err = esp_mqtt_client_start(client);
+  if (err != ESP_OK) {
+    rlog_e(logTAG, "Failed to start side connection to MQTT broker [ %s : %d ]: %d %s", _mqttSideData.host, _mqttSideData.port, err, esp_err_to_name(err));
+    taskENTER_CRITICAL(&_mqttSideLock);
+    if (_mqttSideClient == client) {
+      _mqttSideClient = nullptr;
+      _mqttSideMode = MQTT_SIDE_NONE;
+    } else {
+      client = nullptr;
+    };
+    taskEXIT_CRITICAL(&_mqttSideLock);
+    if (client) esp_mqtt_client_destroy(client);
+    return false;
+  };
+  rlog_i(logTAG, "Side connection to MQTT broker [ %s : %d ] started", _mqttSideData.host, _mqttSideData.port);
+  return true;
+}
+
+static void mqttSideStop()
+{
+  if (_mqttRaceTimer && esp_timer_is_active(_mqttRaceTimer)) {
+    esp_timer_stop(_mqttRaceTimer);
+  };
+  // The client is being restarted anyway, with the full configuration
+  if (_mqttStandbyTimer && esp_timer_is_active(_mqttStandbyTimer)) {
+    esp_timer_stop(_mqttStandbyTimer);
+  };
+  taskENTER_CRITICAL(&_mqttSideLock);
+  esp_mqtt_client_handle_t client = _mqttSideClient;
+  _mqttSideClient = nullptr;
+  _mqttSideMode = MQTT_SIDE_NONE;
+  _mqttSideConnected = false;
+  taskEXIT_CRITICAL(&_mqttSideLock);
+  mqttSideDrop(client);
+}
+
+// The side connection becomes the main one, the previous main client is destroyed
+static void mqttSideTakeover(esp_mqtt_client_handle_t previous, uint32_t ticket)
+{
+  memcpy(&_mqttData, &_mqttSideData, sizeof(_mqttData));
+  mqttBrokerTakeover();
+  _mqttConnAttempt = 0;
+  mqttStatesSet(MQTTCLI_STARTED);
+  mqttStatsAdd(brokers[_mqttData.primary ? 0 : 1].failovers, 1);
+  if (_mqttData.primary) {
+    mqttStatesClear(MQTTCLI_SERVER2_ACTIVE);
+    mqttBackToPrimaryTimerStop();
+  } else {
+    mqttStatesSet(MQTTCLI_SERVER2_ACTIVE);
+    mqttBackToPrimaryTimerStart();
+  };
+  #if CONFIG_MQTT_STATUS_LWT || CONFIG_MQTT_STATUS_ONLINE || CONFIG_MQTT_STATUS_ONLINE_SYSINFO
+    mqttTopicStatusCreate(_mqttData.primary);
+  #endif // CONFIG_MQTT_STATUS_LWT || CONFIG_MQTT_STATUS_ONLINE || CONFIG_MQTT_STATUS_ONLINE_SYSINFO
+  mqttSideDropStart(previous, true, ticket);
+}
+
+// The probe is finished after the first CONNECTED (the session is closed when the client is destroyed) or DISCONNECTED event
+static void mqttProbeEventHandler(esp_mqtt_event_handle_t data)
+{
+  #if CONFIG_MQTT_PRIMARY_PROBE
+    if ((data->event_id != MQTT_EVENT_CONNECTED) && (data->event_id != MQTT_EVENT_DISCONNECTED)) return;
+    bool finished = false;
+    taskENTER_CRITICAL(&_mqttSideLock);
+    if ((_mqttSideClient == data->client) && (_mqttSideMode == MQTT_SIDE_PROBE)) {
+      finished = true;
+      _mqttSideClient = nullptr;
+      _mqttSideMode = MQTT_SIDE_NONE;
+    };
+    taskEXIT_CRITICAL(&_mqttSideLock);
+    if (finished) {
+      mqttSideDrop(data->client);
+      mqttBackToPrimaryProbeResult(data->event_id == MQTT_EVENT_CONNECTED, (esp_timer_get_time() - _mqttProbeStarted) / 1000);
+    };
+  #endif // CONFIG_MQTT_PRIMARY_PROBE
+}
+
+// Returns true if the side connection has become the main one and the event should be processed as for the main client
+static bool mqttSideEventHandler(esp_mqtt_event_handle_t data)
+{
+  if ((data->client == _mqttSideClient) && (_mqttSideMode == MQTT_SIDE_PROBE)) {
+    mqttProbeEventHandler(data);
+    return false;
+  };
+  if ((data->event_id == MQTT_EVENT_DISCONNECTED) && (data->client == _mqttSideClient)) {
+    _mqttSideConnected = false;
+  };
+  if (data->event_id != MQTT_EVENT_CONNECTED) return false;
+
+  esp_mqtt_client_handle_t previous = nullptr;
+  uint32_t ticket = 0;
+  bool winner = false;
+  taskENTER_CRITICAL(&_mqttSideLock);
+  if ((_mqttSideClient == data->client) && (_mqttSideMode == MQTT_SIDE_STANDBY)) {
+    _mqttSideConnected = true;
+  } else if ((_mqttSideClient == data->client) && (_mqttSideMode == MQTT_SIDE_RACE)) {
+    // If the previous handles are still being drained, the race is left to the main client
+    winner = mqttClientReplace(_mqttSideClient, &previous, &ticket);
+    if (winner) {
+      _mqttSideClient = nullptr;
+      _mqttSideMode = MQTT_SIDE_NONE;
+    };
+  };
+  taskEXIT_CRITICAL(&_mqttSideLock);
+
+  if (winner) {
+    rlog_w(logTAG, "MQTT broker [ %s : %d ] won the connection race", _mqttSideData.host, _mqttSideData.port);
+    mqttSideTakeover(previous, ticket);
+  };
+  return winner;
+}
+
+static void mqttStandbyStart()
+{
+  #if CONFIG_MQTT_HOT_STANDBY
+    if (_mqttData.primary && (_mqttSideClient == nullptr) && mqttServer2Enabled()) {
+      mqttSideStart(false, MQTT_SIDE_STANDBY);
+    };
+  #endif // CONFIG_MQTT_HOT_STANDBY
+}
+
+// Instant failover: the idle session to the reserved broker becomes the main one
+static bool mqttStandbyTakeover()
+{
+  esp_mqtt_client_handle_t previous = nullptr;
+  uint32_t ticket = 0;
+  bool takeover = false;
+  taskENTER_CRITICAL(&_mqttSideLock);
+  // If the previous handles are still being drained, a regular reconnect is performed instead
+  if (_mqttSideClient && (_mqttSideMode == MQTT_SIDE_STANDBY) && _mqttSideConnected
+   && mqttClientReplace(_mqttSideClient, &previous, &ticket)) {
+    takeover = true;
+    _mqttSideClient = nullptr;
+    _mqttSideMode = MQTT_SIDE_NONE;
+    _mqttSideConnected = false;
+  };
+  taskEXIT_CRITICAL(&_mqttSideLock);
+
+  if (takeover) {
+    rlog_w(logTAG, "Switching to the standby connection to MQTT broker [ %s : %d ]", _mqttSideData.host, _mqttSideData.port);
+    mqttSideTakeover(previous, ticket);
+    // The standby session has no last will and a rare keepalive: it is replaced with a regular one a little later,
+    // when the messages accumulated during the failover have been sent
+    if (_mqttStandbyTimer) {
+      esp_timer_start_once(_mqttStandbyTimer, (uint64_t)CONFIG_MQTT_STANDBY_RECONFIGURE * 1000000);
+    };
+  };
+  return takeover;
+}
+
+static void mqttStandbyTimerEnd(void* arg)
+{
+  if (mqttStatesCheck(MQTTCLI_STARTED, false)) {
+    rlog_i(logTAG, "Restarting the standby connection with the full configuration");
+    eventLoopPost(RE_MQTT_EVENTS, _mqttData.primary ? RE_MQTT_SERVER_PRIMARY : RE_MQTT_SERVER_RESERVED, nullptr, 0, portMAX_DELAY);
+  };
+}
+
+// Returns false if the main client has already lost the race and is being destroyed
+static bool mqttRaceMainConnected(esp_mqtt_client_handle_t client)
+{
+  esp_mqtt_client_handle_t loser = nullptr;
+  taskENTER_CRITICAL(&_mqttSideLock);
+  bool keep = (client == _mqttClient);
+  if (keep && (_mqttSideMode == MQTT_SIDE_RACE)) {
+    loser = _mqttSideClient;
+    _mqttSideClient = nullptr;
+    _mqttSideMode = MQTT_SIDE_NONE;
+  };
+  taskEXIT_CRITICAL(&_mqttSideLock);
+  if (keep && _mqttRaceTimer && esp_timer_is_active(_mqttRaceTimer)) {
+    esp_timer_stop(_mqttRaceTimer);
+  };
+  mqttSideDrop(loser);
+  return keep;
+}
+
+static void mqttRaceTimerEnd(void* arg)
+{
+  if (mqttStatesCheck(MQTTCLI_STARTED, false) && !mqttStatesCheck(MQTTCLI_CONNECTED, false) && !mqttStatesCheck(MQTTCLI_SERVER2_ACTIVE, false)
+   && mqttServer2Enabled()) {
+    rlog_w(logTAG, "Primary MQTT broker did not respond within %d ms, starting connection to the reserved broker", CONFIG_MQTT_RACE_HEAD_START);
+    mqttSideStart(false, MQTT_SIDE_RACE);
+  };
+}
+
+// The primary broker gets a head start, then the reserved broker is connected in parallel
+static void mqttRaceStart()
+{
+  if (CONFIG_MQTT_CONNECT_RACE && _mqttRaceTimer && (_mqttSideClient == nullptr) && !mqttStatesCheck(MQTTCLI_SERVER2_ACTIVE, false) && mqttServer2Enabled()) {
+    if (esp_timer_is_active(_mqttRaceTimer)) {
+      esp_timer_stop(_mqttRaceTimer);
+    };
+    esp_timer_start_once(_mqttRaceTimer, (uint64_t)CONFIG_MQTT_RACE_HEAD_START * 1000);
+  };
+}
+
+#if CONFIG_MQTT_PRIMARY_PROBE
+
+// Connecting to the primary broker in parallel with the working connection to the reserved one
+static bool mqttProbeConnect()
+{
+  if (CONFIG_MQTT_PRIMARY_PROBE && (_mqttSideClient == nullptr) && mqttStatesCheck(MQTTCLI_STARTED | MQTTCLI_CONNECTED | MQTTCLI_SERVER2_ACTIVE, false)
+   && (mqttServer1isLocal() || mqttStatesCheck(MQTTCLI_INET_AVAILABLED, false))) {
+    _mqttProbeStarted = esp_timer_get_time();
+    return mqttSideStart(true, MQTT_SIDE_PROBE);
+  };
+  return false;
+}
+
+static void mqttProbeCancel()
+{
+  taskENTER_CRITICAL(&_mqttSideLock);
+  esp_mqtt_client_handle_t client = nullptr;
+  if (_mqttSideMode == MQTT_SIDE_PROBE) {
+    client = _mqttSideClient;
+    _mqttSideClient = nullptr;
+    _mqttSideMode = MQTT_SIDE_NONE;
+  };
+  taskEXIT_CRITICAL(&_mqttSideLock);
+  mqttSideDrop(client);
+}
+
+#endif // CONFIG_MQTT_PRIMARY_PROBE
+
+bool mqttSideInit()
+{
+  if (CONFIG_MQTT_CONNECT_RACE && (_mqttRaceTimer == nullptr)) {
+    esp_timer_create_args_t cfg;
+    memset(&cfg, 0, sizeof(cfg));
+    cfg.name = "mqtt_race";
+    cfg.skip_unhandled_events = true;
+    cfg.callback = mqttRaceTimerEnd;
+    RE_OK_CHECK(esp_timer_create(&cfg, &_mqttRaceTimer), return false);
+  };
+  if (CONFIG_MQTT_HOT_STANDBY && (CONFIG_MQTT_STANDBY_RECONFIGURE > 0) && (_mqttStandbyTimer == nullptr)) {
+    esp_timer_create_args_t cfg;
+    memset(&cfg, 0, sizeof(cfg));
+    cfg.name = "mqtt_standby";
+    cfg.skip_unhandled_events = true;
+    cfg.callback = mqttStandbyTimerEnd;
+    RE_OK_CHECK(esp_timer_create(&cfg, &_mqttStandbyTimer), return false);
+  };
+  return true;
+}
+
+void mqttSideFree()
+{
+  mqttSideStop();
+  if (_mqttRaceTimer) {
+    esp_timer_delete(_mqttRaceTimer);
+    _mqttRaceTimer = nullptr;
+  };
+  if (_mqttStandbyTimer) {
+    esp_timer_delete(_mqttStandbyTimer);
+    _mqttStandbyTimer = nullptr;
+  };
+}
+
+#else
+
+static void mqttHandoverPut(esp_mqtt_client_handle_t client, int msg_id, const char *topic, const char *payload, size_t payload_len, int qos, bool retained)
+{
+}
+
+static void mqttHandoverAck(esp_mqtt_client_handle_t client, int msg_id)
+{
+}
+
+static void mqttHandoverDrop(esp_mqtt_client_handle_t client)
+{
+}
+
+static bool mqttSideEventHandler(esp_mqtt_event_handle_t data)
+{
+  return false;
+}
+
+static bool mqttRaceMainConnected(esp_mqtt_client_handle_t client)
+{
+  return true;
+}
+
+static void mqttRaceStart()
+{
+}
+
+static void mqttSideStop()
+{
+}
+
+static void mqttStandbyStart()
+{
+}
+
+static bool mqttStandbyTakeover()
+{
+  return false;
+}
+
+bool mqttSideInit()
+{
+  return true;
+}
+
+void mqttSideFree()
+{
+}
+
+#endif // CONFIG_MQTT_CONNECT_RACE || CONFIG_MQTT_HOT_STANDBY || CONFIG_MQTT_PRIMARY_PROBE
+
 // -----------------------------------------------------------------------------------------------------------------------
 // ---------------------------------------------------- Task routines ----------------------------------------------------
 // -----------------------------------------------------------------------------------------------------------------------
 
+#if CONFIG_MQTT_ZERO_HEAP
+
+// All buffers used after initialization are allocated statically; their total size is checked at compile time
+static constexpr size_t MQTT_STATIC_BYTES = sizeof(_mqttPoolBuffer)
+  #if CONFIG_MQTT_STATUS_LWT || CONFIG_MQTT_STATUS_ONLINE || CONFIG_MQTT_STATUS_ONLINE_SYSINFO
+    + sizeof(_mqttTopicStatusStatic)
+  #endif // CONFIG_MQTT_STATUS_LWT || CONFIG_MQTT_STATUS_ONLINE || CONFIG_MQTT_STATUS_ONLINE_SYSINFO
+  #if defined(CONFIG_MQTT_STATS_INTERVAL) && (CONFIG_MQTT_STATS_INTERVAL > 0)
+    + sizeof(_mqttStatsTopic) + sizeof(_mqttStatsJson)
+  #endif // CONFIG_MQTT_STATS_INTERVAL
+  #if defined(CONFIG_MQTT_LOG_DEFERRED) && CONFIG_MQTT_LOG_DEFERRED
+    + sizeof(_mqttLogQueueStorage)
+  #endif // CONFIG_MQTT_LOG_DEFERRED
+  #if (defined(CONFIG_MQTT_RATE_LIMIT) && CONFIG_MQTT_RATE_LIMIT) || (defined(CONFIG_MQTT_PUBLISH_QUEUE) && CONFIG_MQTT_PUBLISH_QUEUE)
+    + sizeof(_mqttRing)
+  #endif // CONFIG_MQTT_RATE_LIMIT || CONFIG_MQTT_PUBLISH_QUEUE
+  #if defined(CONFIG_MQTT_ERROR_QUEUE) && CONFIG_MQTT_ERROR_QUEUE
+    + sizeof(_mqttErrorRing)
+  #endif // CONFIG_MQTT_ERROR_QUEUE
+  ;
+
+static_assert(MQTT_STATIC_BYTES <= CONFIG_MQTT_ZERO_HEAP_BUDGET, "Static buffers of reMqtt exceed CONFIG_MQTT_ZERO_HEAP_BUDGET");
+
+static bool mqttZeroHeapInit()
+{
+  rlog_i(logTAG, "Zero heap mode: %d bytes of static buffers, budget %d bytes", (int)MQTT_STATIC_BYTES, (int)CONFIG_MQTT_ZERO_HEAP_BUDGET);
+  return true;
+}
+
+#else
+
+static bool mqttZeroHeapInit()
+{
+  return true;
+}
+
+#endif // CONFIG_MQTT_ZERO_HEAP
+
 bool mqttTaskInit()
 {
-  return mqttStatesInit() && mqttBackToPrimaryTimerInit();
+  return mqttZeroHeapInit() && mqttStatesInit() && mqttErrorInit() && mqttBrokersInit() && mqttTopicStatusInit() && mqttPoolInit() && mqttRouterInit() && mqttLogInit() && mqttPersistInit() && mqttPacerInit() && mqttStatsInit() && mqttRetryInit() && mqttSideInit() && mqttBackToPrimaryTimerInit();
 }
 
 bool mqttTaskStart(bool createSuspended)
@@ -1201,9 +6058,18 @@ bool mqttTaskRestart()
 
 bool mqttTaskFree()
 {
-  if (mqttClientDestroy()) {
+  if (mqttClientDestroy() == ESP_OK) {
     mqttEventHandlerUnregister();
     mqttBackToPrimaryTimerFree();
+    mqttSideFree();
+    mqttRetryFree();
+    mqttStatsFree();
+    mqttPacerFree();
+    mqttPersistFree();
+    mqttOutboxClear();
+    mqttLogFree();
+    mqttPoolFree();
+    mqttErrorFree();
     mqttStatesFree();
     return true;
   };
@@ -1226,9 +6092,14 @@ static void mqttWiFiEventHandler(void* arg, esp_event_base_t event_base, int32_t
     rlog_d(logTAG, "Event received: RE_INET_PING_FAILED");
     mqttServerSetInetAvailable(false);
   }
+  // STA got IP: the network may have changed
+  else if (event_id == RE_WIFI_STA_GOT_IP) {
+    mqttAddrInvalidate();
+  }
   // STA disconnected
   else if ((event_id == RE_WIFI_STA_DISCONNECTED) || (event_id == RE_WIFI_STA_STOPPED)) {
     rlog_d(logTAG, "Event received: RE_WIFI_STA_DISCONNECTED");
+    mqttAddrInvalidate();
     if (!statesNetworkIsConnected() && mqttStatesCheck(MQTTCLI_STARTED, false)) {
       mqttClientStop();
     };
@@ -1271,7 +6142,6 @@ static void mqttSelfEventHandler(void* arg, esp_event_base_t event_base, int32_t
 static void mqttPing1EventHandler(void* arg, esp_event_base_t event_base, int32_t event_id, void* event_data)
 {
   // rlog_d("tgEVT", "Recieved PING event: %s %d", event_base, event_id);
-  ping_inet_data_t* data = (ping_inet_data_t*)event_data;
 
   // Broker 1 is available
   if (event_id == RE_PING_MQTT1_AVAILABLE) {
@@ -1290,7 +6160,6 @@ static void mqttPing1EventHandler(void* arg, esp_event_base_t event_base, int32_
 static void mqttPing2EventHandler(void* arg, esp_event_base_t event_base, int32_t event_id, void* event_data)
 {
   // rlog_d("tgEVT", "Recieved PING event: %s %d", event_base, event_id);
-  ping_inet_data_t* data = (ping_inet_data_t*)event_data;
 
   // Broker 2 is available
   if (event_id == RE_PING_MQTT2_AVAILABLE) {
@@ -0,0 +1,232 @@
+// Host benchmarks: topic matching, incoming dispatch through the router, publish throughput through the ring, memory
+// per message in the managed outbox, and publish and incoming rates over the loopback socket to the stand-in broker.
+// The numbers are only comparable between runs on the same machine.
+
+#include "../../src/reMqtt.cpp"
+
+#include <pthread.h>
+#include <stdio.h>
+#include <algorithm>
+#include <atomic>
+#include <string>
+#include <vector>
+#include "host_shims.h"
+
+static double benchSeconds(int64_t started)
+{
+  return (esp_timer_get_time() - started) / 1000000.0;
+}
+
+static volatile uint32_t _benchSink = 0;
+
+static void benchTopicMatch()
+{
+  const char* filters[] = { "home/+/temperature", "home/#", "home/kitchen/light/set", "+/+/+/+" };
+  const char* topic = "home/kitchen/temperature";
+  const uint32_t rounds = 5000000;
+  int64_t started = esp_timer_get_time();
+  for (uint32_t i = 0; i < rounds; i++) {
+    _benchSink += mqttTopicMatch(filters[i & 3], topic, 24);
+  };
+  printf("%-36s %10.2f M/s\n", "mqttTopicMatch", rounds / benchSeconds(started) / 1e6);
+}
+
+static void benchRouteHandler(re_mqtt_message_t* message, void* arg)
+{
+  _benchSink++;
+}
+
+static void benchRouterDispatch(uint32_t routes)
+{
+  mqttRouterInit();
+  std::vector<std::string> filters;
+  for (uint32_t i = 0; i < routes; i++) {
+    char filter[48];
+    snprintf(filter, sizeof(filter), (i % 8 == 0) ? "dev/%u/+/set" : "dev/%u/cmd/set", i);
+    filters.push_back(filter);
+    mqttRouteAdd(filter, benchRouteHandler, nullptr);
+  };
+  char topic[48];
+  int len = snprintf(topic, sizeof(topic), "dev/%u/cmd/set", routes / 2);
+  re_mqtt_message_t message = { 1, topic, (size_t)len, (char*)"1", 1 };
+  const uint32_t rounds = 1000000;
+  int64_t started = esp_timer_get_time();
+  for (uint32_t i = 0; i < rounds; i++) {
+    mqttRouterDispatch(&message);
+  };
+  char name[48];
+  snprintf(name, sizeof(name), "router dispatch, %u routes", routes);
+  printf("%-36s %10.2f M/s\n", name, rounds / benchSeconds(started) / 1e6);
+  for (uint32_t i = 0; i < routes; i++) {
+    mqttRouteRemove(filters[i].c_str(), benchRouteHandler, nullptr);
+  };
+}
+
+static std::atomic<bool> _benchRunning(false);
+static size_t _benchPayloadSize = 0;
+static const uint32_t _benchPerProducer = 200000;
+
+static void* benchRingProducer(void* arg)
+{
+  std::vector<int64_t>* latency = (std::vector<int64_t>*)arg;
+  std::vector<char> payload(_benchPayloadSize, 'x');
+  while (!_benchRunning) sched_yield();
+  for (uint32_t i = 0; i < _benchPerProducer; i++) {
+    int64_t started = esp_timer_get_time();
+    while (mqttPacerPut("bench/topic", payload.data(), payload.size(), 0, false) != ESP_OK) {
+      sched_yield();
+    };
+    latency->push_back(esp_timer_get_time() - started);
+  };
+  return nullptr;
+}
+
+static void benchRingPublish(uint32_t producers, size_t payload_size)
+{
+  _mqttPacerTask = hostTaskStub();
+  mqttPacerInit();
+  _benchPayloadSize = payload_size;
+  _benchRunning = false;
+  std::vector<std::vector<int64_t>> latency(producers);
+  std::vector<pthread_t> threads(producers);
+  for (uint32_t i = 0; i < producers; i++) {
+    latency[i].reserve(_benchPerProducer);
+    pthread_create(&threads[i], nullptr, benchRingProducer, &latency[i]);
+  };
+  int64_t started = esp_timer_get_time();
+  _benchRunning = true;
+  uint32_t received = 0;
+  while (received < producers * _benchPerProducer) {
+    if (mqttRingPeek() != nullptr) {
+      mqttRingRelease();
+      received++;
+    } else {
+      sched_yield();
+    };
+  };
+  double seconds = benchSeconds(started);
+  std::vector<int64_t> all;
+  for (uint32_t i = 0; i < producers; i++) {
+    pthread_join(threads[i], nullptr);
+    all.insert(all.end(), latency[i].begin(), latency[i].end());
+  };
+  std::sort(all.begin(), all.end());
+  char name[48];
+  snprintf(name, sizeof(name), "publish ring, %u thr, %u B", producers, (uint32_t)payload_size);
+  printf("%-36s %10.2f M/s   put p50 %lld us, p99 %lld us\n", name, received / seconds / 1e6,
+    (long long)all[all.size() / 2], (long long)all[all.size() * 99 / 100]);
+}
+
+static void benchOutboxMemory(size_t payload_size, int qos)
+{
+  mqttOutboxClear();
+  std::vector<char> payload(payload_size, 'x');
+  int64_t heap = hostHeapInUse();
+  // Different topics, so that nothing is coalesced
+  const uint32_t count = CONFIG_MQTT_OUTBOX_MAX_MESSAGES;
+  for (uint32_t i = 0; i < count; i++) {
+    char topic[32];
+    snprintf(topic, sizeof(topic), "bench/%u", i);
+    mqttOutboxPut(topic, payload.data(), payload.size(), qos, false);
+  };
+  char name[48];
+  snprintf(name, sizeof(name), "outbox memory, QoS %d, %u B", qos, (uint32_t)payload_size);
+  printf("%-36s %10lld B/msg\n", name, (long long)((hostHeapInUse() - heap) / count));
+  mqttOutboxClear();
+}
+
+// The whole path over the loopback socket: publish queue, sender task, client and the stand-in broker
+static void benchLoopbackPublish(size_t payload_size, int qos)
+{
+  std::vector<char> payload(payload_size + 1, 'x');
+  payload[payload_size] = 0;
+  const uint32_t count = 50000;
+  uint32_t received = hostBrokerReceived("broker1");
+  int64_t heap = hostHeapInUse();
+  int64_t started = esp_timer_get_time();
+  for (uint32_t i = 0; i < count; i++) {
+    while (mqttPublish((char*)"bench/out", payload.data(), qos, false, false, false) != ESP_OK) {
+      sched_yield();
+    };
+  };
+  while (hostBrokerReceived("broker1") - received < count) {
+    sched_yield();
+  };
+  char name[48];
+  snprintf(name, sizeof(name), "loopback publish, QoS %d, %u B", qos, (uint32_t)payload_size);
+  printf("%-36s %10.2f K/s   heap %lld B/msg\n", name, count / benchSeconds(started) / 1e3,
+    (long long)((hostHeapInUse() - heap) / count));
+}
+
+static std::atomic<uint32_t> _benchIncoming(0);
+
+static void benchIncomingHandler(re_mqtt_message_t* message, void* arg)
+{
+  _benchIncoming++;
+}
+
+static void benchLoopbackIncoming(size_t payload_size, int qos)
+{
+  std::vector<char> payload(payload_size, 'x');
+  const uint32_t count = 50000;
+  _benchIncoming = 0;
+  int64_t heap = hostHeapInUse();
+  int64_t started = esp_timer_get_time();
+  for (uint32_t i = 0; i < count; i++) {
+    hostBrokerPublish("broker1", "bench/in", payload.data(), payload.size(), qos, false);
+  };
+  while (_benchIncoming < count) {
+    sched_yield();
+  };
+  char name[48];
+  snprintf(name, sizeof(name), "loopback incoming, QoS %d, %u B", qos, (uint32_t)payload_size);
+  printf("%-36s %10.2f K/s   heap %lld B/msg\n", name, count / benchSeconds(started) / 1e3,
+    (long long)((hostHeapInUse() - heap) / count));
+}
+
+static void benchLoopback()
+{
+  // The sender task of the publish queue was replaced by the ring benchmark
+  _mqttPacerTask = nullptr;
+  hostBrokerStart("broker1");
+  mqttTaskInit();
+  mqttServerSelectAuto();
+  while (!mqttIsConnected()) vTaskDelay(1);
+  mqttRouteAdd("bench/in", benchIncomingHandler, nullptr);
+  mqttSubscribe("bench/in", 1);
+  // The subscription is active once a message sent after it has been received
+  while (_benchIncoming == 0) {
+    hostBrokerPublish("broker1", "bench/in", "1", 1, 0, false);
+    vTaskDelay(1);
+  };
+  for (size_t size : { 16, 200, 1024 }) {
+    benchLoopbackPublish(size, 0);
+    benchLoopbackPublish(size, 1);
+  };
+  for (size_t size : { 16, 200, 4096 }) {
+    benchLoopbackIncoming(size, 0);
+    benchLoopbackIncoming(size, 1);
+  };
+  mqttClientDestroy();
+  hostBrokerStop("broker1");
+}
+
+int main()
+{
+  mqttStatesInit();
+  mqttPoolInit();
+  benchTopicMatch();
+  benchRouterDispatch(8);
+  benchRouterDispatch(64);
+  benchRouterDispatch(512);
+  for (size_t size : { 16, 200, 1024 }) {
+    benchRingPublish(1, size);
+    benchRingPublish(4, size);
+  };
+  for (size_t size : { 16, 200, 1024 }) {
+    benchOutboxMemory(size, 0);
+    benchOutboxMemory(size, 1);
+  };
+  benchLoopback();
+  return 0;
+}
@@ -0,0 +1,61 @@
+#pragma once
+// Configuration of the host build: both brokers over plain TCP, the pure-logic modules are enabled
+#define CONFIG_MQTT1_TYPE 0
+#define CONFIG_MQTT1_HOST "broker1"
+#define CONFIG_MQTT1_TLS_ENABLED 0
+#define CONFIG_MQTT1_PORT_TLS 8883
+#define CONFIG_MQTT1_PORT_TCP 1883
+#define CONFIG_MQTT1_USERNAME "u"
+#define CONFIG_MQTT1_PASSWORD "p"
+#define CONFIG_MQTT1_TIMEOUT 10000
+#define CONFIG_MQTT1_RECONNECT 10000
+#define CONFIG_MQTT1_AUTO_RECONNECT 1
+#define CONFIG_MQTT1_CLEAN_SESSION 1
+#define CONFIG_MQTT1_KEEP_ALIVE 60
+#define CONFIG_MQTT1_PING_CHECK 1
+#define CONFIG_MQTT2_TYPE 2
+#define CONFIG_MQTT2_HOST "broker2"
+#define CONFIG_MQTT2_TLS_ENABLED 0
+#define CONFIG_MQTT2_PORT_TLS 8883
+#define CONFIG_MQTT2_PORT_TCP 1883
+#define CONFIG_MQTT2_TIMEOUT 10000
+#define CONFIG_MQTT2_RECONNECT 10000
+#define CONFIG_MQTT2_AUTO_RECONNECT 1
+#define CONFIG_MQTT2_CLEAN_SESSION 1
+#define CONFIG_MQTT2_KEEP_ALIVE 60
+#define CONFIG_MQTT2_PING_CHECK 1
+#define CONFIG_MQTT_BACK_TO_PRIMARY_TIME_MINUTES 60
+#define CONFIG_MQTT_CONNECT_ATTEMPTS 3
+#define CONFIG_MQTT_STATUS_LWT 1
+#define CONFIG_MQTT_STATUS_ONLINE 1
+#define CONFIG_MQTT_STATUS_LWT_PAYLOAD "offline"
+#define CONFIG_MQTT_STATUS_ONLINE_PAYLOAD "online"
+#define CONFIG_MQTT_STATUS_QOS 1
+#define CONFIG_MQTT_STATUS_RETAINED 1
+#define CONFIG_MQTT_STATUS_LOCAL 0
+#define CONFIG_MQTT_STATUS_TOPIC "status"
+#define CONFIG_MQTT_READ_BUFFER_SIZE 1024
+#define CONFIG_MQTT_WRITE_BUFFER_SIZE 1024
+#define CONFIG_TASK_PRIORITY_MQTT_CLIENT 5
+#define CONFIG_MQTT_CLIENT_STACK_SIZE 4096
+#define CONFIG_MQTT_MAX_OUTBOX_SIZE 4096
+#define CONFIG_MQTT_MAX_OUTBOX_MESSAGE_SIZE 1024
+#define CONFIG_SYSLED_MQTT_ACTIVITY 1
+#define CONFIG_MQTT_STATIC_ALLOCATION 1
+#define ESP_IDF_VERSION_MAJOR 5
+#define TLS_CERT_BUFFER 0
+#define TLS_CERT_GLOBAL 1
+#define TLS_CERT_BUNDLE 2
+
+#define CONFIG_MQTT_INCOMING_POOL 1
+#define CONFIG_MQTT_OUTBOX_MANAGED 1
+#define CONFIG_MQTT_COALESCE_PENDING 1
+#define CONFIG_MQTT_OUTBOX_EVICTION 2
+#define CONFIG_MQTT_OUTBOX_MAX_MESSAGES 4
+#define CONFIG_MQTT_PUBLISH_QUEUE 1
+#define CONFIG_MQTT_SENDER_QUEUE_SIZE 64
+#define CONFIG_MQTT_RECONNECT_BACKOFF 1
+#define CONFIG_MQTT_RECONNECT_FIRST 1000
+#define CONFIG_MQTT_RECONNECT_MAX 60000
+#define CONFIG_MQTT_ERROR_QUEUE 1
+#define CONFIG_MQTT_ERROR_QUEUE_SIZE 4
@@ -0,0 +1,3 @@
+#pragma once
+#include <stdint.h>
+typedef const char* esp_event_base_t;
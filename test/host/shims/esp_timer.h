@@ -0,0 +1,12 @@
+#pragma once
+#include <stdint.h>
+#include "rTypes.h"
+typedef void* esp_timer_handle_t;
+typedef struct { void (*callback)(void*); void* arg; int dispatch_method; const char* name; bool skip_unhandled_events; } esp_timer_create_args_t;
+esp_err_t esp_timer_create(const esp_timer_create_args_t*, esp_timer_handle_t*);
+esp_err_t esp_timer_start_once(esp_timer_handle_t, uint64_t);
+esp_err_t esp_timer_start_periodic(esp_timer_handle_t, uint64_t);
+esp_err_t esp_timer_stop(esp_timer_handle_t);
+esp_err_t esp_timer_delete(esp_timer_handle_t);
+bool esp_timer_is_active(esp_timer_handle_t);
+int64_t esp_timer_get_time();
@@ -0,0 +1,20 @@
+#pragma once
+// Host shim: just enough of FreeRTOS for reMqtt.cpp, implemented on pthreads in shims.cpp
+#include <stdint.h>
+typedef uint32_t TickType_t;
+typedef int BaseType_t;
+typedef unsigned UBaseType_t;
+#define pdMS_TO_TICKS(x) ((TickType_t)(x))
+#define pdTRUE 1
+#define pdFALSE 0
+#define pdPASS 1
+#define portTICK_PERIOD_MS 1
+#ifndef portMAX_DELAY
+  #define portMAX_DELAY 0xFFFFFFFF
+#endif
+// Recursive spinlock, like a portMUX taken twice on the same core
+typedef struct { void* owner; uint32_t count; } portMUX_TYPE;
+#define portMUX_INITIALIZER_UNLOCKED { nullptr, 0 }
+void taskENTER_CRITICAL(portMUX_TYPE* mux);
+void taskEXIT_CRITICAL(portMUX_TYPE* mux);
+TickType_t xTaskGetTickCount();
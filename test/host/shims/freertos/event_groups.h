@@ -0,0 +1,6 @@
+#pragma once
+typedef void* EventGroupHandle_t; typedef uint32_t EventBits_t; typedef struct {int x;} StaticEventGroup_t;
+EventGroupHandle_t xEventGroupCreate(); EventGroupHandle_t xEventGroupCreateStatic(StaticEventGroup_t*);
+void vEventGroupDelete(EventGroupHandle_t);
+EventBits_t xEventGroupGetBits(EventGroupHandle_t); EventBits_t xEventGroupSetBits(EventGroupHandle_t, EventBits_t); EventBits_t xEventGroupClearBits(EventGroupHandle_t, EventBits_t);
+EventBits_t xEventGroupWaitBits(EventGroupHandle_t, EventBits_t, BaseType_t, BaseType_t, TickType_t);
@@ -0,0 +1,9 @@
+#pragma once
+typedef void* TaskHandle_t; typedef void (*TaskFunction_t)(void*); typedef struct {int x;} StaticTask_t; typedef unsigned StackType_t;
+void vTaskDelay(TickType_t);
+BaseType_t xTaskCreate(TaskFunction_t, const char*, uint32_t, void*, UBaseType_t, TaskHandle_t*);
+TaskHandle_t xTaskCreateStatic(TaskFunction_t, const char*, uint32_t, void*, UBaseType_t, StackType_t*, StaticTask_t*);
+void vTaskDelete(TaskHandle_t);
+uint32_t ulTaskNotifyTake(BaseType_t, TickType_t);
+BaseType_t xTaskNotifyGive(TaskHandle_t);
+#define tskIDLE_PRIORITY 0
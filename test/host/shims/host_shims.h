@@ -0,0 +1,61 @@
+#pragma once
+// Hooks of the host shims that are available to the tests and benchmarks
+#include <stdint.h>
+#include <stddef.h>
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "esp_timer.h"
+#include "mqtt_client.h"
+
+// A task handle without a thread, notifications sent to it are only counted
+TaskHandle_t hostTaskStub();
+uint32_t hostTaskNotifications(TaskHandle_t task);
+
+// Timers never fire by themselves: the test reads the last timeout and calls the callback when it needs to
+uint64_t hostTimerTimeout(esp_timer_handle_t timer);
+void hostTimerFire(esp_timer_handle_t timer);
+
+// Shifts esp_timer_get_time() forward
+void hostTimeAdvance(int64_t us);
+
+// In-process stand-in broker (MQTT 3.1.1, QoS 0 and 1, retained messages) on a loopback port. Clients configured with
+// its hostname connect to it over a socket; a stopped broker stays registered and refuses connections until restarted
+bool hostBrokerStart(const char* host);
+void hostBrokerStop(const char* host);
+// Sends a message to the subscribers as if another client had published it
+void hostBrokerPublish(const char* host, const char* topic, const char* payload, size_t payload_len, int qos, bool retain);
+// Number of messages published to the broker, and the last payload published to the topic (length, or -1 if none)
+uint32_t hostBrokerReceived(const char* host);
+int hostBrokerLast(const char* host, const char* topic, char* payload, size_t size);
+uint32_t hostBrokerSessions(const char* host);
+// Number of messages published to the topic, duplicates included
+uint32_t hostBrokerCount(const char* host, const char* topic);
+
+// Faults of a running broker: CONNECT is answered with CONNACK "server unavailable", or the connection is reset without
+// CONNACK. Setting a fault also drops the established sessions
+typedef enum {
+  HOST_BROKER_NORMAL = 0,
+  HOST_BROKER_REFUSE,
+  HOST_BROKER_RESET
+} host_broker_fault_t;
+void hostBrokerFault(const char* host, host_broker_fault_t fault);
+
+// Loopback client: without a broker for its hostname it stays offline, publishes are only counted, msg_id grows from 1
+void hostClientSetOutbox(esp_mqtt_client_handle_t client, int size);
+uint32_t hostClientPublished(esp_mqtt_client_handle_t client);
+bool hostClientConnected(esp_mqtt_client_handle_t client);
+
+// Number of events posted to the event loop with this id
+uint32_t hostEventsPosted(int32_t event_id);
+// Events are delivered to the handlers registered with eventHandlerRegister() only when the test calls this function;
+// returns the number of events dispatched
+uint32_t hostEventsDispatch();
+
+// Host returned by wifiGetGatewayIP(): a stand-in broker for the reserved server of type 2 (gateway), nullptr if none
+void hostGatewaySet(const char* host);
+
+// MAC address returned by esp_read_mac(), a simulated device of a fleet
+void hostMacSet(const uint8_t* mac);
+
+// Bytes allocated through esp_calloc(), esp_malloc() and malloc_string*(), free() is not counted
+int64_t hostHeapInUse();
@@ -0,0 +1,9 @@
+#pragma once
+// Host shim: log output is discarded, arguments are still type-checked
+#include <stdio.h>
+#define rlog_host(t, ...) do { if (0) { (void)(t); printf(__VA_ARGS__); } } while (0)
+#define rlog_e(t, ...) rlog_host(t, __VA_ARGS__)
+#define rlog_w(t, ...) rlog_host(t, __VA_ARGS__)
+#define rlog_i(t, ...) rlog_host(t, __VA_ARGS__)
+#define rlog_d(t, ...) rlog_host(t, __VA_ARGS__)
+#define rlog_v(t, ...) rlog_host(t, __VA_ARGS__)
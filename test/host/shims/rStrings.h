@@ -0,0 +1,5 @@
+#pragma once
+#include <stddef.h>
+char* malloc_stringf(const char*, ...);
+char* malloc_stringl(const char*, size_t);
+char* malloc_string(const char*);
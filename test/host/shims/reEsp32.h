@@ -0,0 +1,7 @@
+#pragma once
+#include <stddef.h>
+void* esp_calloc(size_t, size_t);
+void* esp_malloc(size_t);
+#define RE_MEM_CHECK_EVENT(a, action) if (!(a)) { action; }
+#define RE_OK_CHECK(a, action) if ((a) != ESP_OK) { action; }
+void ledSysActivity();
@@ -0,0 +1,18 @@
+#pragma once
+#include "esp_event_base.h"
+#include <stddef.h>
+#include <stdint.h>
+typedef uint32_t TickType_t;
+#ifndef portMAX_DELAY
+  #define portMAX_DELAY 0xFFFFFFFF
+#endif
+extern esp_event_base_t RE_MQTT_EVENTS, RE_WIFI_EVENTS, RE_PING_EVENTS;
+enum { RE_MQTT_CONNECTED, RE_MQTT_CONN_LOST, RE_MQTT_CONN_FAILED, RE_MQTT_SERVER_PRIMARY, RE_MQTT_SERVER_RESERVED, RE_MQTT_SELF_STOP, RE_MQTT_COLD_RESTART, RE_MQTT_INCOMING_DATA, RE_MQTT_ERROR, RE_MQTT_ERROR_CLEAR,
+  RE_INET_PING_OK, RE_INET_PING_FAILED, RE_WIFI_STA_DISCONNECTED, RE_WIFI_STA_STOPPED, RE_WIFI_STA_GOT_IP, RE_WIFI_STA_PING_OK, RE_PING_MQTT1_AVAILABLE, RE_PING_MQTT1_UNAVAILABLE, RE_PING_MQTT2_AVAILABLE, RE_PING_MQTT2_UNAVAILABLE };
+#define ESP_EVENT_ANY_ID -1
+typedef struct { bool primary; bool local; char host[33]; uint32_t port; } re_mqtt_event_data_t;
+typedef struct { char* topic; size_t topic_len; char* data; size_t data_len; } re_mqtt_incoming_data_t;
+typedef struct { int x; } ping_inet_data_t;
+bool eventLoopPost(esp_event_base_t, int32_t, void*, size_t, TickType_t);
+bool eventHandlerRegister(esp_event_base_t, int32_t, void (*)(void*, esp_event_base_t, int32_t, void*), void*);
+void eventHandlerUnregister(esp_event_base_t, int32_t, void (*)(void*, esp_event_base_t, int32_t, void*));
@@ -0,0 +1,12 @@
+#pragma once
+#include <stdint.h>
+#include <stddef.h>
+#include "rTypes.h"
+typedef uint32_t nvs_handle_t;
+typedef enum { NVS_READONLY, NVS_READWRITE } nvs_open_mode_t;
+esp_err_t nvs_open(const char*, nvs_open_mode_t, nvs_handle_t*);
+void nvs_close(nvs_handle_t);
+esp_err_t nvs_get_blob(nvs_handle_t, const char*, void*, size_t*);
+esp_err_t nvs_set_blob(nvs_handle_t, const char*, const void*, size_t);
+esp_err_t nvs_commit(nvs_handle_t);
+bool nvsRead(const char* name, const char* key, int type, void* value);
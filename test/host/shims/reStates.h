@@ -0,0 +1,3 @@
+#pragma once
+bool statesNetworkIsConnected();
+char* mqttGetTopicDevice1(bool primary, bool local, const char* topic);
@@ -0,0 +1,1463 @@
+// Host implementations of the ESP-IDF and FreeRTOS functions used by reMqtt.cpp
+
+#include <arpa/inet.h>
+#include <errno.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <map>
+#include <mutex>
+#include <string>
+#include <vector>
+#include <malloc.h>
+#include "host_shims.h"
+#include "freertos/event_groups.h"
+#include "freertos/queue.h"
+#include "freertos/semphr.h"
+#include "rTypes.h"
+#include "rStrings.h"
+#include "reEsp32.h"
+#include "reEvents.h"
+#include "reNvs.h"
+#include "reStates.h"
+#include "reWiFi.h"
+#include "esp_mac.h"
+#include "esp_partition.h"
+#include "esp_random.h"
+#include "esp_rom_crc.h"
+
+// -------------------------------------------------------- Time ---------------------------------------------------------
+
+static std::atomic<int64_t> _hostTimeShift(0);
+
+int64_t esp_timer_get_time()
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (int64_t)ts.tv_sec * 1000000LL + ts.tv_nsec / 1000 + _hostTimeShift.load();
+}
+
+void hostTimeAdvance(int64_t us)
+{
+  _hostTimeShift += us;
+}
+
+TickType_t xTaskGetTickCount()
+{
+  return (TickType_t)(esp_timer_get_time() / 1000);
+}
+
+// ----------------------------------------------------- Critical sections -----------------------------------------------
+
+static thread_local char _hostThreadId;
+
+void taskENTER_CRITICAL(portMUX_TYPE* mux)
+{
+  void* self = &_hostThreadId;
+  if (__atomic_load_n(&mux->owner, __ATOMIC_ACQUIRE) == self) {
+    mux->count++;
+    return;
+  };
+  void* expected = nullptr;
+  while (!__atomic_compare_exchange_n(&mux->owner, &expected, self, false, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) {
+    expected = nullptr;
+    sched_yield();
+  };
+  mux->count = 1;
+}
+
+void taskEXIT_CRITICAL(portMUX_TYPE* mux)
+{
+  if (--mux->count == 0) {
+    __atomic_store_n(&mux->owner, nullptr, __ATOMIC_RELEASE);
+  };
+}
+
+// --------------------------------------------------------- Tasks -------------------------------------------------------
+
+struct HostTask {
+  pthread_t thread;
+  bool has_thread;
+  TaskFunction_t func;
+  void* arg;
+  std::mutex lock;
+  std::condition_variable cond;
+  uint32_t notify;
+  std::atomic<uint32_t> notifications;
+};
+
+static thread_local HostTask* _hostCurrentTask = nullptr;
+
+static bool hostWait(std::unique_lock<std::mutex>& lock, std::condition_variable& cond, TickType_t ticks, const std::function<bool()>& ready)
+{
+  if (ticks == portMAX_DELAY) {
+    while (!ready()) {
+      // Periodic wake-ups keep the thread cancellable by vTaskDelete()
+      cond.wait_for(lock, std::chrono::milliseconds(10));
+      pthread_testcancel();
+    };
+    return true;
+  };
+  return cond.wait_for(lock, std::chrono::milliseconds(ticks), ready);
+}
+
+static void* hostTaskEntry(void* arg)
+{
+  HostTask* task = (HostTask*)arg;
+  _hostCurrentTask = task;
+  pthread_setcanceltype(PTHREAD_CANCEL_DEFERRED, nullptr);
+  task->func(task->arg);
+  return nullptr;
+}
+
+BaseType_t xTaskCreate(TaskFunction_t func, const char* name, uint32_t stack, void* arg, UBaseType_t priority, TaskHandle_t* handle)
+{
+  HostTask* task = new HostTask();
+  task->func = func;
+  task->arg = arg;
+  task->notify = 0;
+  task->has_thread = true;
+  if (handle) *handle = task;
+  if (pthread_create(&task->thread, nullptr, hostTaskEntry, task) != 0) {
+    if (handle) *handle = nullptr;
+    delete task;
+    return pdFALSE;
+  };
+  pthread_detach(task->thread);
+  return pdPASS;
+}
+
+TaskHandle_t xTaskCreateStatic(TaskFunction_t func, const char* name, uint32_t stack, void* arg, UBaseType_t priority, StackType_t* stack_buffer, StaticTask_t* task_buffer)
+{
+  TaskHandle_t handle = nullptr;
+  xTaskCreate(func, name, stack, arg, priority, &handle);
+  return handle;
+}
+
+TaskHandle_t hostTaskStub()
+{
+  HostTask* task = new HostTask();
+  task->notify = 0;
+  task->has_thread = false;
+  return task;
+}
+
+uint32_t hostTaskNotifications(TaskHandle_t handle)
+{
+  return ((HostTask*)handle)->notifications.load();
+}
+
+void vTaskDelete(TaskHandle_t handle)
+{
+  HostTask* task = handle ? (HostTask*)handle : _hostCurrentTask;
+  if (task == nullptr) return;
+  if (task == _hostCurrentTask) {
+    pthread_exit(nullptr);
+  } else if (task->has_thread) {
+    // The task object is leaked on purpose: the thread may still be inside it until the cancellation point
+    pthread_cancel(task->thread);
+  };
+}
+
+void vTaskDelay(TickType_t ticks)
+{
+  if (ticks == 0) {
+    sched_yield();
+  } else {
+    struct timespec ts = { (time_t)(ticks / 1000), (long)(ticks % 1000) * 1000000L };
+    nanosleep(&ts, nullptr);
+  };
+}
+
+BaseType_t xTaskNotifyGive(TaskHandle_t handle)
+{
+  HostTask* task = (HostTask*)handle;
+  task->notifications++;
+  std::lock_guard<std::mutex> guard(task->lock);
+  task->notify++;
+  task->cond.notify_one();
+  return pdPASS;
+}
+
+uint32_t ulTaskNotifyTake(BaseType_t clear, TickType_t ticks)
+{
+  HostTask* task = _hostCurrentTask;
+  if (task == nullptr) return 0;
+  std::unique_lock<std::mutex> lock(task->lock);
+  hostWait(lock, task->cond, ticks, [task] { return task->notify > 0; });
+  uint32_t value = task->notify;
+  if (value > 0) task->notify = clear ? 0 : value - 1;
+  return value;
+}
+
+// ------------------------------------------------------- Semaphores ----------------------------------------------------
+
+SemaphoreHandle_t xSemaphoreCreateMutex()
+{
+  return new std::recursive_timed_mutex();
+}
+
+SemaphoreHandle_t xSemaphoreCreateMutexStatic(StaticSemaphore_t* buffer)
+{
+  return xSemaphoreCreateMutex();
+}
+
+SemaphoreHandle_t xSemaphoreCreateRecursiveMutex()
+{
+  return xSemaphoreCreateMutex();
+}
+
+SemaphoreHandle_t xSemaphoreCreateRecursiveMutexStatic(StaticSemaphore_t* buffer)
+{
+  return xSemaphoreCreateMutex();
+}
+
+BaseType_t xSemaphoreTake(SemaphoreHandle_t sem, TickType_t ticks)
+{
+  std::recursive_timed_mutex* mutex = (std::recursive_timed_mutex*)sem;
+  if (ticks == portMAX_DELAY) {
+    mutex->lock();
+    return pdTRUE;
+  };
+  return mutex->try_lock_for(std::chrono::milliseconds(ticks)) ? pdTRUE : pdFALSE;
+}
+
+BaseType_t xSemaphoreGive(SemaphoreHandle_t sem)
+{
+  ((std::recursive_timed_mutex*)sem)->unlock();
+  return pdTRUE;
+}
+
+BaseType_t xSemaphoreTakeRecursive(SemaphoreHandle_t sem, TickType_t ticks)
+{
+  return xSemaphoreTake(sem, ticks);
+}
+
+BaseType_t xSemaphoreGiveRecursive(SemaphoreHandle_t sem)
+{
+  return xSemaphoreGive(sem);
+}
+
+void vSemaphoreDelete(SemaphoreHandle_t sem)
+{
+  delete (std::recursive_timed_mutex*)sem;
+}
+
+// ------------------------------------------------------ Event groups ---------------------------------------------------
+
+struct HostEventGroup {
+  std::mutex lock;
+  std::condition_variable cond;
+  EventBits_t bits = 0;
+};
+
+EventGroupHandle_t xEventGroupCreate()
+{
+  return new HostEventGroup();
+}
+
+EventGroupHandle_t xEventGroupCreateStatic(StaticEventGroup_t* buffer)
+{
+  return xEventGroupCreate();
+}
+
+void vEventGroupDelete(EventGroupHandle_t group)
+{
+  delete (HostEventGroup*)group;
+}
+
+EventBits_t xEventGroupGetBits(EventGroupHandle_t handle)
+{
+  HostEventGroup* group = (HostEventGroup*)handle;
+  std::lock_guard<std::mutex> guard(group->lock);
+  return group->bits;
+}
+
+EventBits_t xEventGroupSetBits(EventGroupHandle_t handle, EventBits_t bits)
+{
+  HostEventGroup* group = (HostEventGroup*)handle;
+  std::lock_guard<std::mutex> guard(group->lock);
+  group->bits |= bits;
+  group->cond.notify_all();
+  return group->bits;
+}
+
+EventBits_t xEventGroupClearBits(EventGroupHandle_t handle, EventBits_t bits)
+{
+  HostEventGroup* group = (HostEventGroup*)handle;
+  std::lock_guard<std::mutex> guard(group->lock);
+  EventBits_t prev = group->bits;
+  group->bits &= ~bits;
+  return prev;
+}
+
+EventBits_t xEventGroupWaitBits(EventGroupHandle_t handle, EventBits_t bits, BaseType_t clear, BaseType_t all, TickType_t ticks)
+{
+  HostEventGroup* group = (HostEventGroup*)handle;
+  std::unique_lock<std::mutex> lock(group->lock);
+  auto ready = [group, bits, all] { return all ? (group->bits & bits) == bits : (group->bits & bits) != 0; };
+  bool ok = hostWait(lock, group->cond, ticks, ready);
+  EventBits_t value = group->bits;
+  if (ok && clear) group->bits &= ~bits;
+  return value;
+}
+
+// --------------------------------------------------------- Queues ------------------------------------------------------
+
+struct HostQueue {
+  std::mutex lock;
+  std::condition_variable cond;
+  std::deque<std::vector<uint8_t>> items;
+  size_t length;
+  size_t item_size;
+};
+
+QueueHandle_t xQueueCreate(UBaseType_t length, UBaseType_t item_size)
+{
+  HostQueue* queue = new HostQueue();
+  queue->length = length;
+  queue->item_size = item_size;
+  return queue;
+}
+
+QueueHandle_t xQueueCreateStatic(UBaseType_t length, UBaseType_t item_size, uint8_t* storage, StaticQueue_t* buffer)
+{
+  return xQueueCreate(length, item_size);
+}
+
+BaseType_t xQueueSend(QueueHandle_t handle, const void* item, TickType_t ticks)
+{
+  HostQueue* queue = (HostQueue*)handle;
+  std::unique_lock<std::mutex> lock(queue->lock);
+  if (!hostWait(lock, queue->cond, ticks, [queue] { return queue->items.size() < queue->length; })) return pdFALSE;
+  queue->items.emplace_back((const uint8_t*)item, (const uint8_t*)item + queue->item_size);
+  queue->cond.notify_all();
+  return pdTRUE;
+}
+
+BaseType_t xQueueReceive(QueueHandle_t handle, void* item, TickType_t ticks)
+{
+  HostQueue* queue = (HostQueue*)handle;
+  std::unique_lock<std::mutex> lock(queue->lock);
+  if (!hostWait(lock, queue->cond, ticks, [queue] { return !queue->items.empty(); })) return pdFALSE;
+  memcpy(item, queue->items.front().data(), queue->item_size);
+  queue->items.pop_front();
+  queue->cond.notify_all();
+  return pdTRUE;
+}
+
+UBaseType_t uxQueueMessagesWaiting(QueueHandle_t handle)
+{
+  HostQueue* queue = (HostQueue*)handle;
+  std::lock_guard<std::mutex> guard(queue->lock);
+  return queue->items.size();
+}
+
+void vQueueDelete(QueueHandle_t handle)
+{
+  delete (HostQueue*)handle;
+}
+
+// --------------------------------------------------------- Timers ------------------------------------------------------
+
+// Timers are started from the client threads as well, so the state is atomic
+struct HostTimer {
+  esp_timer_create_args_t args;
+  std::atomic<uint64_t> timeout;
+  std::atomic<bool> active;
+};
+
+esp_err_t esp_timer_create(const esp_timer_create_args_t* args, esp_timer_handle_t* handle)
+{
+  HostTimer* timer = new HostTimer();
+  timer->args = *args;
+  timer->timeout = 0;
+  timer->active = false;
+  *handle = timer;
+  return ESP_OK;
+}
+
+esp_err_t esp_timer_start_once(esp_timer_handle_t handle, uint64_t timeout)
+{
+  HostTimer* timer = (HostTimer*)handle;
+  bool expected = false;
+  if (!timer->active.compare_exchange_strong(expected, true)) return ESP_ERR_INVALID_STATE;
+  timer->timeout = timeout;
+  return ESP_OK;
+}
+
+esp_err_t esp_timer_start_periodic(esp_timer_handle_t handle, uint64_t period)
+{
+  return esp_timer_start_once(handle, period);
+}
+
+esp_err_t esp_timer_stop(esp_timer_handle_t handle)
+{
+  HostTimer* timer = (HostTimer*)handle;
+  bool expected = true;
+  if (!timer->active.compare_exchange_strong(expected, false)) return ESP_ERR_INVALID_STATE;
+  return ESP_OK;
+}
+
+esp_err_t esp_timer_delete(esp_timer_handle_t handle)
+{
+  delete (HostTimer*)handle;
+  return ESP_OK;
+}
+
+bool esp_timer_is_active(esp_timer_handle_t handle)
+{
+  return ((HostTimer*)handle)->active;
+}
+
+uint64_t hostTimerTimeout(esp_timer_handle_t handle)
+{
+  return ((HostTimer*)handle)->timeout;
+}
+
+void hostTimerFire(esp_timer_handle_t handle)
+{
+  HostTimer* timer = (HostTimer*)handle;
+  timer->active = false;
+  timer->args.callback(timer->args.arg);
+}
+
+// ---------------------------------------------------- MQTT wire format -------------------------------------------------
+
+// The subset of MQTT 3.1.1 spoken between the loopback client and the stand-in broker: CONNECT, PUBLISH with QoS 0 and 1,
+// SUBSCRIBE, UNSUBSCRIBE, PINGREQ and DISCONNECT
+
+static const uint8_t HOST_MQTT_CONNECT     = 0x10;
+static const uint8_t HOST_MQTT_CONNACK     = 0x20;
+static const uint8_t HOST_MQTT_PUBLISH     = 0x30;
+static const uint8_t HOST_MQTT_PUBACK      = 0x40;
+static const uint8_t HOST_MQTT_SUBSCRIBE   = 0x82;
+static const uint8_t HOST_MQTT_SUBACK      = 0x90;
+static const uint8_t HOST_MQTT_UNSUBSCRIBE = 0xA2;
+static const uint8_t HOST_MQTT_UNSUBACK    = 0xB0;
+static const uint8_t HOST_MQTT_PINGREQ     = 0xC0;
+static const uint8_t HOST_MQTT_PINGRESP    = 0xD0;
+static const uint8_t HOST_MQTT_DISCONNECT  = 0xE0;
+
+typedef struct {
+  uint8_t header;
+  std::vector<uint8_t> body;
+} host_mqtt_packet_t;
+
+static bool hostRecvAll(int fd, void* buffer, size_t size)
+{
+  uint8_t* ptr = (uint8_t*)buffer;
+  while (size > 0) {
+    ssize_t ret = recv(fd, ptr, size, 0);
+    if (ret <= 0) {
+      if ((ret < 0) && (errno == EINTR)) continue;
+      return false;
+    };
+    ptr += ret;
+    size -= ret;
+  };
+  return true;
+}
+
+static bool hostMqttRead(int fd, host_mqtt_packet_t* packet)
+{
+  if (!hostRecvAll(fd, &packet->header, 1)) return false;
+  uint32_t length = 0;
+  for (int shift = 0; shift < 28; shift += 7) {
+    uint8_t byte;
+    if (!hostRecvAll(fd, &byte, 1)) return false;
+    length |= (uint32_t)(byte & 0x7F) << shift;
+    if ((byte & 0x80) == 0) break;
+  };
+  packet->body.resize(length);
+  return (length == 0) || hostRecvAll(fd, packet->body.data(), length);
+}
+
+// Packets are written with one send() under the lock of the connection, so that writers from different threads do not interleave
+static bool hostMqttWrite(int fd, std::mutex& lock, uint8_t header, const std::vector<uint8_t>& body)
+{
+  std::vector<uint8_t> packet;
+  packet.reserve(body.size() + 5);
+  packet.push_back(header);
+  size_t length = body.size();
+  do {
+    uint8_t byte = length & 0x7F;
+    length >>= 7;
+    packet.push_back(length > 0 ? byte | 0x80 : byte);
+  } while (length > 0);
+  packet.insert(packet.end(), body.begin(), body.end());
+  std::lock_guard<std::mutex> guard(lock);
+  const uint8_t* ptr = packet.data();
+  size_t size = packet.size();
+  while (size > 0) {
+    ssize_t ret = send(fd, ptr, size, MSG_NOSIGNAL);
+    if (ret <= 0) {
+      if ((ret < 0) && (errno == EINTR)) continue;
+      return false;
+    };
+    ptr += ret;
+    size -= ret;
+  };
+  return true;
+}
+
+static void hostMqttPutU16(std::vector<uint8_t>& body, uint16_t value)
+{
+  body.push_back(value >> 8);
+  body.push_back(value & 0xFF);
+}
+
+static void hostMqttPutString(std::vector<uint8_t>& body, const char* value, size_t len)
+{
+  hostMqttPutU16(body, (uint16_t)len);
+  body.insert(body.end(), (const uint8_t*)value, (const uint8_t*)value + len);
+}
+
+static uint16_t hostMqttGetU16(const std::vector<uint8_t>& body, size_t& pos)
+{
+  if (pos + 2 > body.size()) { pos = body.size() + 1; return 0; };
+  uint16_t value = (body[pos] << 8) | body[pos + 1];
+  pos += 2;
+  return value;
+}
+
+static std::string hostMqttGetString(const std::vector<uint8_t>& body, size_t& pos)
+{
+  uint16_t len = hostMqttGetU16(body, pos);
+  if (pos + len > body.size()) { pos = body.size() + 1; return std::string(); };
+  std::string value((const char*)body.data() + pos, len);
+  pos += len;
+  return value;
+}
+
+static std::vector<uint8_t> hostMqttPublishBody(const std::string& topic, const char* data, size_t len, int qos, uint16_t msg_id)
+{
+  std::vector<uint8_t> body;
+  body.reserve(topic.size() + len + 4);
+  hostMqttPutString(body, topic.data(), topic.size());
+  if (qos > 0) hostMqttPutU16(body, msg_id);
+  body.insert(body.end(), (const uint8_t*)data, (const uint8_t*)data + len);
+  return body;
+}
+
+// MQTT 3.1.1 (4.7): '+' matches one level, '#' the rest of the topic, wildcards do not match topics starting with '$'
+static bool hostTopicMatch(const std::string& filter, const std::string& topic)
+{
+  if (!topic.empty() && (topic[0] == '$') && !filter.empty() && ((filter[0] == '+') || (filter[0] == '#'))) return false;
+  size_t f = 0, t = 0;
+  while (1) {
+    size_t fend = filter.find('/', f);
+    size_t tend = topic.find('/', t);
+    std::string flevel = filter.substr(f, fend == std::string::npos ? std::string::npos : fend - f);
+    if (flevel == "#") return true;
+    if (t == std::string::npos) return false;
+    std::string tlevel = topic.substr(t, tend == std::string::npos ? std::string::npos : tend - t);
+    if ((flevel != "+") && (flevel != tlevel)) return false;
+    if ((fend == std::string::npos) || (tend == std::string::npos)) {
+      // "a/#" also matches "a"
+      return (fend == std::string::npos) ? (tend == std::string::npos) : (filter.compare(fend, std::string::npos, "/#") == 0);
+    };
+    f = fend + 1;
+    t = tend + 1;
+  };
+}
+
+// ---------------------------------------------------- Stand-in broker --------------------------------------------------
+
+struct HostBrokerSession {
+  int fd;
+  pthread_t thread;
+  std::mutex send_lock;
+  std::vector<std::pair<std::string, int>> filters;  // Guarded by the broker lock
+  uint16_t msg_id;
+  struct HostBroker* broker;
+};
+
+struct HostBroker {
+  std::string host;
+  int listen_fd;
+  uint16_t port;
+  bool running;
+  pthread_t accept_thread;
+  std::mutex lock;
+  std::vector<HostBrokerSession*> sessions;
+  std::map<std::string, std::pair<std::string, int>> retained;
+  std::map<std::string, std::string> last;
+  std::map<std::string, uint32_t> counts;
+  std::atomic<uint32_t> received;
+  std::atomic<int> fault;
+};
+
+static std::mutex _hostBrokersLock;
+static std::vector<HostBroker*> _hostBrokers;
+
+static HostBroker* hostBrokerFind(const std::string& host)
+{
+  std::lock_guard<std::mutex> guard(_hostBrokersLock);
+  for (HostBroker* broker : _hostBrokers) {
+    if (broker->host == host) return broker;
+  };
+  return nullptr;
+}
+
+// Must be called under the broker lock
+static void hostBrokerDeliver(HostBroker* broker, HostBrokerSession* session, const std::string& topic, const std::string& payload, int qos, bool retain)
+{
+  if (session->fd < 0) return;
+  int granted = -1;
+  for (const auto& filter : session->filters) {
+    if (hostTopicMatch(filter.first, topic) && (filter.second > granted)) granted = filter.second;
+  };
+  if (granted < 0) return;
+  if (granted < qos) qos = granted;
+  if (++session->msg_id == 0) session->msg_id = 1;
+  hostMqttWrite(session->fd, session->send_lock, HOST_MQTT_PUBLISH | (qos << 1) | (retain ? 1 : 0),
+    hostMqttPublishBody(topic, payload.data(), payload.size(), qos, session->msg_id));
+}
+
+static void hostBrokerRoute(HostBroker* broker, const std::string& topic, const std::string& payload, int qos, bool retain)
+{
+  std::lock_guard<std::mutex> guard(broker->lock);
+  if (retain) {
+    if (payload.empty()) {
+      broker->retained.erase(topic);
+    } else {
+      broker->retained[topic] = std::make_pair(payload, qos);
+    };
+  };
+  // Retain is cleared for messages delivered to already existing subscriptions (3.3.1.3)
+  for (HostBrokerSession* session : broker->sessions) {
+    hostBrokerDeliver(broker, session, topic, payload, qos, false);
+  };
+}
+
+static void* hostBrokerSessionExec(void* arg)
+{
+  HostBrokerSession* session = (HostBrokerSession*)arg;
+  HostBroker* broker = session->broker;
+  host_mqtt_packet_t packet;
+  while (hostMqttRead(session->fd, &packet)) {
+    uint8_t type = packet.header & 0xF0;
+    size_t pos = 0;
+    if (type == HOST_MQTT_CONNECT) {
+      int fault = broker->fault;
+      if (fault == HOST_BROKER_RESET) {
+        // The connection is closed with RST instead of CONNACK
+        struct linger reset = { 1, 0 };
+        setsockopt(session->fd, SOL_SOCKET, SO_LINGER, &reset, sizeof(reset));
+        break;
+      };
+      // Return code 3: server unavailable
+      hostMqttWrite(session->fd, session->send_lock, HOST_MQTT_CONNACK, { 0x00, (uint8_t)(fault == HOST_BROKER_REFUSE ? 0x03 : 0x00) });
+      if (fault == HOST_BROKER_REFUSE) break;
+    } else if (type == HOST_MQTT_PUBLISH) {
+      int qos = (packet.header >> 1) & 0x03;
+      std::string topic = hostMqttGetString(packet.body, pos);
+      uint16_t msg_id = qos > 0 ? hostMqttGetU16(packet.body, pos) : 0;
+      if (pos > packet.body.size()) break;
+      std::string payload((const char*)packet.body.data() + pos, packet.body.size() - pos);
+      {
+        std::lock_guard<std::mutex> guard(broker->lock);
+        broker->last[topic] = payload;
+        broker->counts[topic]++;
+      };
+      broker->received++;
+      if (qos > 0) {
+        std::vector<uint8_t> ack;
+        hostMqttPutU16(ack, msg_id);
+        hostMqttWrite(session->fd, session->send_lock, HOST_MQTT_PUBACK, ack);
+      };
+      hostBrokerRoute(broker, topic, payload, qos, packet.header & 0x01);
+    } else if (type == (HOST_MQTT_SUBSCRIBE & 0xF0)) {
+      uint16_t msg_id = hostMqttGetU16(packet.body, pos);
+      std::vector<uint8_t> ack;
+      hostMqttPutU16(ack, msg_id);
+      std::lock_guard<std::mutex> guard(broker->lock);
+      std::vector<std::string> added;
+      while (pos < packet.body.size()) {
+        std::string filter = hostMqttGetString(packet.body, pos);
+        if (pos >= packet.body.size()) break;
+        int qos = packet.body[pos++] & 0x03;
+        if (qos > 1) qos = 1;
+        session->filters.push_back(std::make_pair(filter, qos));
+        added.push_back(filter);
+        ack.push_back(qos);
+      };
+      hostMqttWrite(session->fd, session->send_lock, HOST_MQTT_SUBACK, ack);
+      // Retained messages are sent to the new subscription with the retain flag
+      for (const auto& retained : broker->retained) {
+        for (const std::string& filter : added) {
+          if (hostTopicMatch(filter, retained.first)) {
+            hostBrokerDeliver(broker, session, retained.first, retained.second.first, retained.second.second, true);
+            break;
+          };
+        };
+      };
+    } else if (type == (HOST_MQTT_UNSUBSCRIBE & 0xF0)) {
+      uint16_t msg_id = hostMqttGetU16(packet.body, pos);
+      {
+        std::lock_guard<std::mutex> guard(broker->lock);
+        while (pos < packet.body.size()) {
+          std::string filter = hostMqttGetString(packet.body, pos);
+          for (size_t i = 0; i < session->filters.size(); i++) {
+            if (session->filters[i].first == filter) {
+              session->filters.erase(session->filters.begin() + i);
+              break;
+            };
+          };
+        };
+      };
+      std::vector<uint8_t> ack;
+      hostMqttPutU16(ack, msg_id);
+      hostMqttWrite(session->fd, session->send_lock, HOST_MQTT_UNSUBACK, ack);
+    } else if (type == HOST_MQTT_PINGREQ) {
+      hostMqttWrite(session->fd, session->send_lock, HOST_MQTT_PINGRESP, {});
+    } else if (type == HOST_MQTT_DISCONNECT) {
+      break;
+    };
+  };
+  std::lock_guard<std::mutex> guard(broker->lock);
+  close(session->fd);
+  session->fd = -1;
+  return nullptr;
+}
+
+static void* hostBrokerAcceptExec(void* arg)
+{
+  HostBroker* broker = (HostBroker*)arg;
+  while (1) {
+    int fd = accept(broker->listen_fd, nullptr, nullptr);
+    if (fd < 0) {
+      if (errno == EINTR) continue;
+      break;
+    };
+    int one = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    HostBrokerSession* session = new HostBrokerSession();
+    session->fd = fd;
+    session->msg_id = 0;
+    session->broker = broker;
+    std::lock_guard<std::mutex> guard(broker->lock);
+    broker->sessions.push_back(session);
+    pthread_create(&session->thread, nullptr, hostBrokerSessionExec, session);
+  };
+  return nullptr;
+}
+
+bool hostBrokerStart(const char* host)
+{
+  HostBroker* broker = hostBrokerFind(host);
+  if (broker && broker->running) return true;
+  int fd = socket(AF_INET, SOCK_STREAM, 0);
+  if (fd < 0) return false;
+  struct sockaddr_in addr;
+  memset(&addr, 0, sizeof(addr));
+  addr.sin_family = AF_INET;
+  addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  addr.sin_port = 0;
+  socklen_t len = sizeof(addr);
+  if ((bind(fd, (struct sockaddr*)&addr, sizeof(addr)) != 0) || (listen(fd, 16) != 0)
+   || (getsockname(fd, (struct sockaddr*)&addr, &len) != 0)) {
+    close(fd);
+    return false;
+  };
+  if (broker == nullptr) {
+    broker = new HostBroker();
+    broker->host = host;
+    broker->received = 0;
+    broker->fault = HOST_BROKER_NORMAL;
+    std::lock_guard<std::mutex> guard(_hostBrokersLock);
+    _hostBrokers.push_back(broker);
+  };
+  broker->listen_fd = fd;
+  broker->port = ntohs(addr.sin_port);
+  broker->running = true;
+  pthread_create(&broker->accept_thread, nullptr, hostBrokerAcceptExec, broker);
+  return true;
+}
+
+// The broker stays registered: clients of this host fail to connect until it is started again
+void hostBrokerStop(const char* host)
+{
+  HostBroker* broker = hostBrokerFind(host);
+  if ((broker == nullptr) || !broker->running) return;
+  broker->running = false;
+  shutdown(broker->listen_fd, SHUT_RDWR);
+  pthread_join(broker->accept_thread, nullptr);
+  close(broker->listen_fd);
+  std::vector<HostBrokerSession*> sessions;
+  {
+    std::lock_guard<std::mutex> guard(broker->lock);
+    sessions.swap(broker->sessions);
+    for (HostBrokerSession* session : sessions) {
+      if (session->fd >= 0) shutdown(session->fd, SHUT_RDWR);
+    };
+  };
+  for (HostBrokerSession* session : sessions) {
+    pthread_join(session->thread, nullptr);
+    delete session;
+  };
+}
+
+void hostBrokerPublish(const char* host, const char* topic, const char* payload, size_t payload_len, int qos, bool retain)
+{
+  HostBroker* broker = hostBrokerFind(host);
+  if (broker && broker->running) {
+    hostBrokerRoute(broker, topic, std::string(payload, payload_len), qos, retain);
+  };
+}
+
+uint32_t hostBrokerReceived(const char* host)
+{
+  HostBroker* broker = hostBrokerFind(host);
+  return broker ? broker->received.load() : 0;
+}
+
+int hostBrokerLast(const char* host, const char* topic, char* payload, size_t size)
+{
+  HostBroker* broker = hostBrokerFind(host);
+  if (broker == nullptr) return -1;
+  std::lock_guard<std::mutex> guard(broker->lock);
+  auto item = broker->last.find(topic);
+  if (item == broker->last.end()) return -1;
+  if (payload && size) snprintf(payload, size, "%s", item->second.c_str());
+  return (int)item->second.size();
+}
+
+uint32_t hostBrokerCount(const char* host, const char* topic)
+{
+  HostBroker* broker = hostBrokerFind(host);
+  if (broker == nullptr) return 0;
+  std::lock_guard<std::mutex> guard(broker->lock);
+  auto item = broker->counts.find(topic);
+  return item == broker->counts.end() ? 0 : item->second;
+}
+
+void hostBrokerFault(const char* host, host_broker_fault_t fault)
+{
+  HostBroker* broker = hostBrokerFind(host);
+  if (broker == nullptr) return;
+  broker->fault = fault;
+  if (fault != HOST_BROKER_NORMAL) {
+    std::lock_guard<std::mutex> guard(broker->lock);
+    for (HostBrokerSession* session : broker->sessions) {
+      if (session->fd >= 0) shutdown(session->fd, SHUT_RDWR);
+    };
+  };
+}
+
+uint32_t hostBrokerSessions(const char* host)
+{
+  HostBroker* broker = hostBrokerFind(host);
+  if (broker == nullptr) return 0;
+  std::lock_guard<std::mutex> guard(broker->lock);
+  uint32_t count = 0;
+  for (HostBrokerSession* session : broker->sessions) {
+    if (session->fd >= 0) count++;
+  };
+  return count;
+}
+
+// ------------------------------------------------------ MQTT client ----------------------------------------------------
+
+// A client whose hostname has a stand-in broker connects to it over a loopback socket and dispatches the events of
+// esp-mqtt from its own thread. Without a broker the client stays offline: publishes are only counted, msg_id grows from 1
+
+struct esp_mqtt_client {
+  std::atomic<int> msg_id;
+  std::atomic<int> outbox;
+  std::atomic<uint32_t> published;
+  std::string host;
+  std::string client_id;
+  int buffer_size;
+  esp_event_handler_t handler;
+  void* handler_arg;
+  std::mutex send_lock;
+  std::mutex state_lock;
+  int fd;
+  bool started;
+  bool thread_active;
+  bool thread_joinable;
+  bool stopping;
+  bool destroy_on_exit;
+  std::atomic<bool> connected;
+  pthread_t thread;
+  esp_mqtt_error_codes_t error;
+};
+
+static void hostClientDispatch(esp_mqtt_client_handle_t client, esp_mqtt_event_t* event)
+{
+  event->client = client;
+  if (client->handler) client->handler(client->handler_arg, "MQTT_EVENTS", event->event_id, event);
+}
+
+static void hostClientEvent(esp_mqtt_client_handle_t client, esp_mqtt_event_id_t event_id, int msg_id)
+{
+  esp_mqtt_event_t event;
+  memset(&event, 0, sizeof(event));
+  event.event_id = event_id;
+  event.msg_id = msg_id;
+  event.error_handle = &client->error;
+  hostClientDispatch(client, &event);
+}
+
+static int hostClientNextId(esp_mqtt_client_handle_t client)
+{
+  int id;
+  do {
+    id = ++client->msg_id & 0xFFFF;
+  } while (id == 0);
+  return id;
+}
+
+static int hostClientConnect(esp_mqtt_client_handle_t client)
+{
+  HostBroker* broker = hostBrokerFind(client->host);
+  if ((broker == nullptr) || !broker->running) return -1;
+  int fd = socket(AF_INET, SOCK_STREAM, 0);
+  if (fd < 0) return -1;
+  struct sockaddr_in addr;
+  memset(&addr, 0, sizeof(addr));
+  addr.sin_family = AF_INET;
+  addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  addr.sin_port = htons(broker->port);
+  if (connect(fd, (struct sockaddr*)&addr, sizeof(addr)) != 0) {
+    close(fd);
+    return -1;
+  };
+  int one = 1;
+  setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+  return fd;
+}
+
+static void* hostClientExec(void* arg)
+{
+  esp_mqtt_client_handle_t client = (esp_mqtt_client_handle_t)arg;
+  hostClientEvent(client, MQTT_EVENT_BEFORE_CONNECT, 0);
+  int fd = hostClientConnect(client);
+  host_mqtt_packet_t packet;
+  bool connected = false;
+  int connack = -1;
+  if (fd >= 0) {
+    {
+      std::lock_guard<std::mutex> guard(client->state_lock);
+      if (client->stopping) shutdown(fd, SHUT_RDWR);
+      client->fd = fd;
+    };
+    std::vector<uint8_t> body;
+    hostMqttPutString(body, "MQTT", 4);
+    body.push_back(4);     // Protocol level 3.1.1
+    body.push_back(0x02);  // Clean session
+    hostMqttPutU16(body, 60);
+    hostMqttPutString(body, client->client_id.data(), client->client_id.size());
+    connected = hostMqttWrite(fd, client->send_lock, HOST_MQTT_CONNECT, body) && hostMqttRead(fd, &packet)
+      && ((packet.header & 0xF0) == HOST_MQTT_CONNACK) && (packet.body.size() == 2);
+    connack = connected ? packet.body[1] : -1;
+    connected = connected && (connack == 0);
+  };
+  if (connected) {
+    client->connected = true;
+    hostClientEvent(client, MQTT_EVENT_CONNECTED, 0);
+    while (hostMqttRead(fd, &packet)) {
+      uint8_t type = packet.header & 0xF0;
+      size_t pos = 0;
+      if (type == HOST_MQTT_PUBLISH) {
+        int qos = (packet.header >> 1) & 0x03;
+        std::string topic = hostMqttGetString(packet.body, pos);
+        uint16_t msg_id = qos > 0 ? hostMqttGetU16(packet.body, pos) : 0;
+        if (pos > packet.body.size()) break;
+        int total = (int)(packet.body.size() - pos);
+        // Like esp-mqtt, messages longer than the input buffer are passed in fragments, the topic only with the first one
+        int chunk = client->buffer_size > 0 ? client->buffer_size : 1024;
+        int offset = 0;
+        do {
+          esp_mqtt_event_t event;
+          memset(&event, 0, sizeof(event));
+          event.event_id = MQTT_EVENT_DATA;
+          event.msg_id = msg_id;
+          event.qos = qos;
+          event.retain = packet.header & 0x01;
+          if (offset == 0) {
+            event.topic = (char*)topic.data();
+            event.topic_len = (int)topic.size();
+          };
+          event.data = (char*)packet.body.data() + pos + offset;
+          event.data_len = total - offset < chunk ? total - offset : chunk;
+          event.total_data_len = total;
+          event.current_data_offset = offset;
+          hostClientDispatch(client, &event);
+          offset += event.data_len;
+        } while (offset < total);
+        if (qos > 0) {
+          std::vector<uint8_t> ack;
+          hostMqttPutU16(ack, msg_id);
+          hostMqttWrite(fd, client->send_lock, HOST_MQTT_PUBACK, ack);
+        };
+      } else if ((type == HOST_MQTT_PUBACK) || (type == HOST_MQTT_SUBACK) || (type == HOST_MQTT_UNSUBACK)) {
+        uint16_t msg_id = hostMqttGetU16(packet.body, pos);
+        hostClientEvent(client, type == HOST_MQTT_PUBACK ? MQTT_EVENT_PUBLISHED : (type == HOST_MQTT_SUBACK ? MQTT_EVENT_SUBSCRIBED : MQTT_EVENT_UNSUBSCRIBED), msg_id);
+      };
+    };
+    client->connected = false;
+  } else if (!client->stopping) {
+    memset(&client->error, 0, sizeof(client->error));
+    if (connack > 0) {
+      client->error.error_type = MQTT_ERROR_TYPE_CONNECTION_REFUSED;
+      client->error.connect_return_code = connack;
+    } else {
+      client->error.error_type = MQTT_ERROR_TYPE_TCP_TRANSPORT;
+      client->error.esp_transport_sock_errno = fd >= 0 ? ECONNRESET : ECONNREFUSED;
+    };
+    hostClientEvent(client, MQTT_EVENT_ERROR, 0);
+  };
+  bool stopping;
+  {
+    std::lock_guard<std::mutex> guard(client->state_lock);
+    if (fd >= 0) close(fd);
+    client->fd = -1;
+    stopping = client->stopping;
+  };
+  // Stopping the client by the application does not produce an event, like in esp-mqtt
+  if (!stopping) {
+    hostClientEvent(client, MQTT_EVENT_DISCONNECTED, 0);
+  };
+  client->state_lock.lock();
+  client->thread_active = false;
+  bool destroy = client->destroy_on_exit;
+  client->state_lock.unlock();
+  if (destroy) delete client;
+  return nullptr;
+}
+
+// Joins the previous connection thread; from the thread itself (a call from an event handler) it is only detached
+static void hostClientJoin(esp_mqtt_client_handle_t client)
+{
+  pthread_t thread;
+  bool joinable;
+  {
+    std::lock_guard<std::mutex> guard(client->state_lock);
+    thread = client->thread;
+    joinable = client->thread_joinable;
+    client->thread_joinable = false;
+  };
+  if (joinable) {
+    if (pthread_equal(thread, pthread_self())) {
+      pthread_detach(thread);
+    } else {
+      pthread_join(thread, nullptr);
+    };
+  };
+}
+
+static esp_err_t hostClientSpawn(esp_mqtt_client_handle_t client)
+{
+  if (hostBrokerFind(client->host) == nullptr) return ESP_OK;
+  hostClientJoin(client);
+  std::lock_guard<std::mutex> guard(client->state_lock);
+  if (client->thread_active || !client->started) return ESP_OK;
+  client->thread_active = true;
+  client->thread_joinable = true;
+  if (pthread_create(&client->thread, nullptr, hostClientExec, client) != 0) {
+    client->thread_active = false;
+    client->thread_joinable = false;
+    return ESP_FAIL;
+  };
+  return ESP_OK;
+}
+
+static void hostClientConfig(esp_mqtt_client_handle_t client, const esp_mqtt_client_config_t* config)
+{
+  client->host = config->broker.address.hostname ? config->broker.address.hostname : "";
+  client->client_id = config->credentials.client_id ? config->credentials.client_id : "";
+  client->buffer_size = config->buffer.size;
+}
+
+esp_mqtt_client_handle_t esp_mqtt_client_init(const esp_mqtt_client_config_t* config)
+{
+  esp_mqtt_client_handle_t client = new esp_mqtt_client();
+  client->msg_id = 0;
+  client->outbox = 0;
+  client->published = 0;
+  client->handler = nullptr;
+  client->handler_arg = nullptr;
+  client->fd = -1;
+  client->started = false;
+  client->thread_active = false;
+  client->thread_joinable = false;
+  client->stopping = false;
+  client->destroy_on_exit = false;
+  client->connected = false;
+  memset(&client->error, 0, sizeof(client->error));
+  hostClientConfig(client, config);
+  return client;
+}
+
+esp_err_t esp_mqtt_set_config(esp_mqtt_client_handle_t client, const esp_mqtt_client_config_t* config)
+{
+  std::lock_guard<std::mutex> guard(client->state_lock);
+  hostClientConfig(client, config);
+  return ESP_OK;
+}
+
+esp_err_t esp_mqtt_client_start(esp_mqtt_client_handle_t client)
+{
+  {
+    std::lock_guard<std::mutex> guard(client->state_lock);
+    if (client->started) return ESP_FAIL;
+    client->started = true;
+    client->stopping = false;
+  };
+  return hostClientSpawn(client);
+}
+
+// The built-in reconnect timer is not simulated: a started client without a connection reconnects only on request
+esp_err_t esp_mqtt_client_reconnect(esp_mqtt_client_handle_t client)
+{
+  return hostClientSpawn(client);
+}
+
+esp_err_t esp_mqtt_client_disconnect(esp_mqtt_client_handle_t client)
+{
+  std::lock_guard<std::mutex> guard(client->state_lock);
+  if (client->fd >= 0) shutdown(client->fd, SHUT_RDWR);
+  return ESP_OK;
+}
+
+esp_err_t esp_mqtt_client_stop(esp_mqtt_client_handle_t client)
+{
+  {
+    std::lock_guard<std::mutex> guard(client->state_lock);
+    if (!client->started) return ESP_FAIL;
+    client->started = false;
+    client->stopping = true;
+    if (client->fd >= 0) shutdown(client->fd, SHUT_RDWR);
+  };
+  hostClientJoin(client);
+  return ESP_OK;
+}
+
+esp_err_t esp_mqtt_client_destroy(esp_mqtt_client_handle_t client)
+{
+  esp_mqtt_client_stop(client);
+  bool self;
+  {
+    std::lock_guard<std::mutex> guard(client->state_lock);
+    self = client->thread_active && pthread_equal(client->thread, pthread_self());
+    client->destroy_on_exit = self;
+  };
+  if (!self) delete client;
+  return ESP_OK;
+}
+
+static bool hostClientWrite(esp_mqtt_client_handle_t client, uint8_t header, const std::vector<uint8_t>& body)
+{
+  std::lock_guard<std::mutex> guard(client->state_lock);
+  return client->connected && (client->fd >= 0) && hostMqttWrite(client->fd, client->send_lock, header, body);
+}
+
+int esp_mqtt_client_subscribe(esp_mqtt_client_handle_t client, const char* topic, int qos)
+{
+  int msg_id = hostClientNextId(client);
+  std::vector<uint8_t> body;
+  hostMqttPutU16(body, msg_id);
+  hostMqttPutString(body, topic, strlen(topic));
+  body.push_back(qos);
+  if ((hostBrokerFind(client->host) != nullptr) && !hostClientWrite(client, HOST_MQTT_SUBSCRIBE, body)) return -1;
+  return msg_id;
+}
+
+int esp_mqtt_client_unsubscribe(esp_mqtt_client_handle_t client, const char* topic)
+{
+  int msg_id = hostClientNextId(client);
+  std::vector<uint8_t> body;
+  hostMqttPutU16(body, msg_id);
+  hostMqttPutString(body, topic, strlen(topic));
+  if ((hostBrokerFind(client->host) != nullptr) && !hostClientWrite(client, HOST_MQTT_UNSUBSCRIBE, body)) return -1;
+  return msg_id;
+}
+
+int esp_mqtt_client_publish(esp_mqtt_client_handle_t client, const char* topic, const char* data, int len, int qos, int retain)
+{
+  client->published++;
+  if (qos > 1) qos = 1;
+  int msg_id = qos > 0 ? hostClientNextId(client) : 0;
+  if (data && (len == 0)) len = strlen(data);
+  hostClientWrite(client, HOST_MQTT_PUBLISH | (qos << 1) | (retain ? 1 : 0),
+    hostMqttPublishBody(topic, data ? data : "", data ? len : 0, qos, msg_id));
+  return msg_id;
+}
+
+int esp_mqtt_client_enqueue(esp_mqtt_client_handle_t client, const char* topic, const char* data, int len, int qos, int retain, bool store)
+{
+  return esp_mqtt_client_publish(client, topic, data, len, qos, retain);
+}
+
+int esp_mqtt_client_get_outbox_size(esp_mqtt_client_handle_t client)
+{
+  return client->outbox;
+}
+
+esp_err_t esp_mqtt_client_register_event(esp_mqtt_client_handle_t client, esp_mqtt_event_id_t event, esp_event_handler_t handler, void* arg)
+{
+  client->handler = handler;
+  client->handler_arg = arg;
+  return ESP_OK;
+}
+
+esp_err_t esp_crt_bundle_attach(void* conf)
+{
+  return ESP_OK;
+}
+
+void hostClientSetOutbox(esp_mqtt_client_handle_t client, int size)
+{
+  client->outbox = size;
+}
+
+uint32_t hostClientPublished(esp_mqtt_client_handle_t client)
+{
+  return client->published;
+}
+
+bool hostClientConnected(esp_mqtt_client_handle_t client)
+{
+  return client->connected;
+}
+
+// ------------------------------------------------------ Event loop -----------------------------------------------------
+
+esp_event_base_t RE_MQTT_EVENTS = "RE_MQTT_EVENTS";
+esp_event_base_t RE_WIFI_EVENTS = "RE_WIFI_EVENTS";
+esp_event_base_t RE_PING_EVENTS = "RE_PING_EVENTS";
+
+static std::atomic<uint32_t> _hostEvents[64];
+
+// Events of registered handlers are queued with a copy of the data, like in esp_event; handlers run in hostEventsDispatch()
+
+typedef struct {
+  std::string base;
+  int32_t event_id;
+  void (*handler)(void*, esp_event_base_t, int32_t, void*);
+  void* arg;
+} host_event_handler_t;
+
+typedef struct {
+  esp_event_base_t base;
+  int32_t event_id;
+  std::vector<uint8_t> data;
+} host_event_t;
+
+static std::mutex _hostEventsLock;
+static std::vector<host_event_handler_t> _hostEventHandlers;
+static std::deque<host_event_t> _hostEventQueue;
+
+static bool hostEventMatch(const host_event_handler_t& handler, esp_event_base_t base, int32_t event_id)
+{
+  return (handler.base == base) && ((handler.event_id == ESP_EVENT_ANY_ID) || (handler.event_id == event_id));
+}
+
+bool eventLoopPost(esp_event_base_t base, int32_t event_id, void* data, size_t size, TickType_t ticks)
+{
+  if ((event_id >= 0) && (event_id < 64)) _hostEvents[event_id]++;
+  std::lock_guard<std::mutex> guard(_hostEventsLock);
+  for (const host_event_handler_t& handler : _hostEventHandlers) {
+    if (hostEventMatch(handler, base, event_id)) {
+      host_event_t event = { base, event_id, std::vector<uint8_t>((uint8_t*)data, (uint8_t*)data + (data ? size : 0)) };
+      _hostEventQueue.push_back(std::move(event));
+      break;
+    };
+  };
+  return true;
+}
+
+uint32_t hostEventsDispatch()
+{
+  uint32_t count = 0;
+  while (1) {
+    host_event_t event;
+    std::vector<host_event_handler_t> handlers;
+    {
+      std::lock_guard<std::mutex> guard(_hostEventsLock);
+      if (_hostEventQueue.empty()) break;
+      event = std::move(_hostEventQueue.front());
+      _hostEventQueue.pop_front();
+      for (const host_event_handler_t& handler : _hostEventHandlers) {
+        if (hostEventMatch(handler, event.base, event.event_id)) handlers.push_back(handler);
+      };
+    };
+    for (const host_event_handler_t& handler : handlers) {
+      handler.handler(handler.arg, event.base, event.event_id, event.data.empty() ? nullptr : event.data.data());
+    };
+    count++;
+  };
+  return count;
+}
+
+uint32_t hostEventsPosted(int32_t event_id)
+{
+  return _hostEvents[event_id];
+}
+
+bool eventHandlerRegister(esp_event_base_t base, int32_t event_id, void (*handler)(void*, esp_event_base_t, int32_t, void*), void* arg)
+{
+  std::lock_guard<std::mutex> guard(_hostEventsLock);
+  _hostEventHandlers.push_back({ base, event_id, handler, arg });
+  return true;
+}
+
+void eventHandlerUnregister(esp_event_base_t base, int32_t event_id, void (*handler)(void*, esp_event_base_t, int32_t, void*))
+{
+  std::lock_guard<std::mutex> guard(_hostEventsLock);
+  for (size_t i = 0; i < _hostEventHandlers.size(); i++) {
+    if ((_hostEventHandlers[i].base == base) && (_hostEventHandlers[i].event_id == event_id) && (_hostEventHandlers[i].handler == handler)) {
+      _hostEventHandlers.erase(_hostEventHandlers.begin() + i);
+      break;
+    };
+  };
+}
+
+// ------------------------------------------------------- Memory --------------------------------------------------------
+
+static std::atomic<int64_t> _hostHeap(0);
+
+void* esp_malloc(size_t size)
+{
+  void* ptr = malloc(size);
+  if (ptr) _hostHeap += malloc_usable_size(ptr);
+  return ptr;
+}
+
+void* esp_calloc(size_t count, size_t size)
+{
+  void* ptr = calloc(count, size);
+  if (ptr) _hostHeap += malloc_usable_size(ptr);
+  return ptr;
+}
+
+// free() is not wrapped, so the counter only grows: the benchmark measures the growth per message, and the zero heap
+// test checks that it does not grow at all after initialization
+int64_t hostHeapInUse()
+{
+  return _hostHeap;
+}
+
+// Strings of rStrings are allocated on the heap as well
+char* malloc_string(const char* source)
+{
+  return source ? malloc_stringl(source, strlen(source)) : nullptr;
+}
+
+char* malloc_stringl(const char* source, size_t len)
+{
+  char* ret = (char*)esp_malloc(len + 1);
+  if (ret) {
+    memcpy(ret, source, len);
+    ret[len] = 0;
+  };
+  return ret;
+}
+
+char* malloc_stringf(const char* format, ...)
+{
+  char* ret = nullptr;
+  va_list args;
+  va_start(args, format);
+  if (vasprintf(&ret, format, args) < 0) {
+    ret = nullptr;
+  } else {
+    _hostHeap += malloc_usable_size(ret);
+  };
+  va_end(args);
+  return ret;
+}
+
+// -------------------------------------------------------- System -------------------------------------------------------
+
+const char* esp_err_to_name(esp_err_t code)
+{
+  return code == ESP_OK ? "ESP_OK" : "ESP_ERR";
+}
+
+static uint8_t _hostMac[6] = { 0x24, 0x0a, 0xc4, 0x12, 0x34, 0x56 };
+
+void hostMacSet(const uint8_t* mac)
+{
+  memcpy(_hostMac, mac, sizeof(_hostMac));
+}
+
+esp_err_t esp_read_mac(uint8_t* mac, esp_mac_type_t type)
+{
+  memcpy(mac, _hostMac, sizeof(_hostMac));
+  return ESP_OK;
+}
+
+uint32_t esp_random()
+{
+  return (uint32_t)random();
+}
+
+uint32_t esp_rom_crc32_le(uint32_t crc, const uint8_t* buf, uint32_t len)
+{
+  crc = ~crc;
+  while (len--) {
+    crc ^= *buf++;
+    for (int i = 0; i < 8; i++) crc = (crc >> 1) ^ (0xEDB88320 & (0 - (crc & 1)));
+  };
+  return ~crc;
+}
+
+void ledSysActivity()
+{
+}
+
+bool statesNetworkIsConnected()
+{
+  return true;
+}
+
+char* mqttGetTopicDevice1(bool primary, bool local, const char* topic)
+{
+  return malloc_stringf("host/%s", topic);
+}
+
+static std::mutex _hostGatewayLock;
+static std::string _hostGateway;
+
+void hostGatewaySet(const char* host)
+{
+  std::lock_guard<std::mutex> guard(_hostGatewayLock);
+  _hostGateway = host ? host : "";
+}
+
+char* wifiGetGatewayIP()
+{
+  std::lock_guard<std::mutex> guard(_hostGatewayLock);
+  return _hostGateway.empty() ? nullptr : strdup(_hostGateway.c_str());
+}
+
+// No flash and no NVS on the host: the persistent outbox and the broker table stay in RAM
+
+const esp_partition_t* esp_partition_find_first(esp_partition_type_t type, esp_partition_subtype_t subtype, const char* label) { return nullptr; }
+esp_err_t esp_partition_read(const esp_partition_t* part, size_t offset, void* dst, size_t size) { return ESP_ERR_NOT_SUPPORTED; }
+esp_err_t esp_partition_write(const esp_partition_t* part, size_t offset, const void* src, size_t size) { return ESP_ERR_NOT_SUPPORTED; }
+esp_err_t esp_partition_erase_range(const esp_partition_t* part, size_t offset, size_t size) { return ESP_ERR_NOT_SUPPORTED; }
+
+esp_err_t nvs_open(const char* name, nvs_open_mode_t mode, nvs_handle_t* handle) { return ESP_ERR_NOT_FOUND; }
+void nvs_close(nvs_handle_t handle) {}
+esp_err_t nvs_get_blob(nvs_handle_t handle, const char* key, void* value, size_t* size) { return ESP_ERR_NOT_FOUND; }
+esp_err_t nvs_set_blob(nvs_handle_t handle, const char* key, const void* value, size_t size) { return ESP_ERR_NOT_SUPPORTED; }
+esp_err_t nvs_commit(nvs_handle_t handle) { return ESP_ERR_NOT_SUPPORTED; }
+bool nvsRead(const char* name, const char* key, int type, void* value) { return false; }
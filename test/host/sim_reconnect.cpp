@@ -0,0 +1,145 @@
+// Host simulation of a fleet reconnecting after a broker restart. Every device loses its connection at the same moment,
+// the stand-in broker stays down for a while and then accepts a limited number of connections per second, refusing
+// the rest. The fixed reconnect interval of the client is compared with the scheduler of CONFIG_MQTT_RECONNECT_BACKOFF,
+// where each simulated device has its own MAC address and therefore its own jitter sequence. The histogram shows the
+// connection attempts against the broker over time.
+
+#include "../../src/reMqtt.cpp"
+
+#include <stdio.h>
+#include <functional>
+#include <queue>
+#include <string>
+#include <vector>
+#include "host_shims.h"
+
+#define SIM_DEVICES           2000
+#define SIM_BROKER_DOWN       30000    // ms
+#define SIM_BROKER_CAPACITY   100      // connections per second
+#define SIM_HORIZON           900000   // ms
+#define SIM_BUCKET            5000     // ms
+
+typedef struct {
+  uint32_t attempts;
+  uint32_t refused;
+  uint32_t peak;                       // attempts per second after the broker is up again
+  uint64_t all_connected;              // ms, 0 if not reached
+  std::vector<uint32_t> histogram;     // attempts per bucket
+} sim_result_t;
+
+// Event-driven run: next(device, now) returns the time of the next attempt after a failed one
+static sim_result_t simRun(const std::function<uint64_t(uint32_t, uint64_t)>& next)
+{
+  sim_result_t result = { 0, 0, 0, 0, std::vector<uint32_t>(SIM_HORIZON / SIM_BUCKET, 0) };
+  std::vector<uint32_t> per_second(SIM_HORIZON / 1000, 0);
+  std::vector<uint32_t> accepted(SIM_HORIZON / 1000, 0);
+  typedef std::pair<uint64_t, uint32_t> sim_event_t;
+  std::priority_queue<sim_event_t, std::vector<sim_event_t>, std::greater<sim_event_t>> events;
+
+  // The connection is lost at 0, the first attempt follows the disconnection event
+  for (uint32_t device = 0; device < SIM_DEVICES; device++) {
+    events.push(sim_event_t(next(device, 0), device));
+  };
+  uint32_t connected = 0;
+  while (!events.empty()) {
+    sim_event_t event = events.top();
+    events.pop();
+    uint64_t now = event.first;
+    if (now >= SIM_HORIZON) break;
+    result.attempts++;
+    result.histogram[now / SIM_BUCKET]++;
+    per_second[now / 1000]++;
+    if ((now >= SIM_BROKER_DOWN) && (accepted[now / 1000] < SIM_BROKER_CAPACITY)) {
+      accepted[now / 1000]++;
+      if (++connected == SIM_DEVICES) result.all_connected = now;
+    } else {
+      if (now >= SIM_BROKER_DOWN) result.refused++;
+      events.push(sim_event_t(next(event.second, now), event.second));
+    };
+  };
+  for (size_t i = SIM_BROKER_DOWN / 1000; i < per_second.size(); i++) {
+    if (per_second[i] > result.peak) result.peak = per_second[i];
+  };
+  return result;
+}
+
+// The built-in reconnect of the client: the same interval after every failed attempt on every device
+static uint64_t simFixed(uint32_t device, uint64_t now)
+{
+  return now + CONFIG_MQTT1_RECONNECT;
+}
+
+// The scheduler of the library; the state of each device is swapped in before the next delay is taken from it
+static std::vector<uint32_t> _simSeed;
+static std::vector<uint32_t> _simCount;
+
+static uint64_t simBackoff(uint32_t device, uint64_t now)
+{
+  _mqttRetrySeed = _simSeed[device];
+  _mqttRetryCount = _simCount[device];
+  mqttRetrySchedule();
+  _simSeed[device] = _mqttRetrySeed;
+  _simCount[device] = _mqttRetryCount;
+  return now + hostTimerTimeout(_mqttRetryTimer) / 1000;
+}
+
+static void simBackoffInit()
+{
+  esp_mqtt_client_config_t cfg;
+  memset(&cfg, 0, sizeof(cfg));
+  cfg.network.reconnect_timeout_ms = CONFIG_MQTT1_RECONNECT;
+  for (uint32_t device = 0; device < SIM_DEVICES; device++) {
+    uint8_t mac[6] = { 0x24, 0x0a, 0xc4, (uint8_t)(device >> 16), (uint8_t)(device >> 8), (uint8_t)device };
+    hostMacSet(mac);
+    mqttRetryFree();
+    mqttRetryInit();
+    _simSeed.push_back(_mqttRetrySeed);
+    _simCount.push_back(0);
+  };
+  mqttRetryConfig(&cfg);
+}
+
+static void simPrint(const char* name, const sim_result_t& result)
+{
+  printf("%-24s attempts %6u, refused %6u, peak when up %5u/s, all connected ",
+    name, result.attempts, result.refused, result.peak);
+  if (result.all_connected) {
+    printf("at %llu s\n", (unsigned long long)(result.all_connected / 1000));
+  } else {
+    printf("not within %u s\n", SIM_HORIZON / 1000);
+  };
+}
+
+int main()
+{
+  sim_result_t fixed = simRun(simFixed);
+  simBackoffInit();
+  sim_result_t backoff = simRun(simBackoff);
+  mqttRetryFree();
+
+  printf("%u devices, broker down for %u s, then accepts %u connections/s\n\n",
+    SIM_DEVICES, SIM_BROKER_DOWN / 1000, SIM_BROKER_CAPACITY);
+  simPrint("fixed interval", fixed);
+  simPrint("backoff with jitter", backoff);
+
+  // Attempts per bucket until both runs are over; the bars are scaled to the largest bucket of both runs
+  uint64_t end = (fixed.all_connected > backoff.all_connected ? fixed.all_connected : backoff.all_connected);
+  if ((fixed.all_connected == 0) || (backoff.all_connected == 0)) end = SIM_HORIZON - 1;
+  uint32_t scale = 1;
+  for (size_t i = 0; i <= end / SIM_BUCKET; i++) {
+    if (fixed.histogram[i] > scale) scale = fixed.histogram[i];
+    if (backoff.histogram[i] > scale) scale = backoff.histogram[i];
+  };
+  printf("\n%9s  %-32s  %s\n", "time, s", "fixed interval", "backoff with jitter");
+  for (size_t i = 0; i <= end / SIM_BUCKET; i++) {
+    printf("%4u-%-4u  %5u %-26s  %5u %s\n", (uint32_t)(i * SIM_BUCKET / 1000), (uint32_t)((i + 1) * SIM_BUCKET / 1000),
+      fixed.histogram[i], std::string(fixed.histogram[i] * 26 / scale, '#').c_str(),
+      backoff.histogram[i], std::string(backoff.histogram[i] * 26 / scale, '#').c_str());
+  };
+
+  // The scheduler must bring the fleet back sooner and with a lower load on the broker once it is up again
+  bool ok = backoff.all_connected && (!fixed.all_connected || backoff.all_connected < fixed.all_connected)
+    && (backoff.refused < fixed.refused) && (backoff.peak < fixed.peak);
+  printf("\nreconnect spread         %s\n", ok ? "ok" : "FAILED");
+  return ok ? 0 : 1;
+}
@@ -0,0 +1,173 @@
+// Host regression harness of failover between the primary broker and the reserved one (type 2, on the gateway). Both
+// are stand-in brokers on loopback; the primary fails in several ways, and the harness reports the time to switch to the
+// reserved broker, the time to return to the primary, and the messages published during the outage that never reached
+// either broker. Time is virtual: before a timer of the library is fired, the clock is moved forward by its timeout, so
+// the results do not depend on the machine and are checked against the limits that follow from the configuration.
+
+#define CONFIG_MQTT_FAULT_INJECTION 1
+#include "../../src/reMqtt.cpp"
+
+#include <stdio.h>
+#include <chrono>
+#include <functional>
+#include <string>
+#include "host_shims.h"
+
+static uint32_t _testChecks = 0;
+static uint32_t _testFailed = 0;
+
+#define TEST_CHECK(cond) do { \
+  _testChecks++; \
+  if (!(cond)) { \
+    _testFailed++; \
+    printf("  FAILED %s:%d: %s\n", __FILE__, __LINE__, #cond); \
+  }; \
+} while (0)
+
+// Messages published during the outage: as many as the managed outbox keeps without eviction
+#define FAILOVER_MESSAGES     CONFIG_MQTT_OUTBOX_MAX_MESSAGES
+// Three failed attempts: the fast first retry, then the base interval and its double, each at most the full interval
+#define FAILOVER_LIMIT_MS     (CONFIG_MQTT_RECONNECT_FIRST + 3 * CONFIG_MQTT1_RECONNECT + 1000)
+#define RETURN_LIMIT_MS       (CONFIG_MQTT_BACK_TO_PRIMARY_TIME_MINUTES * 60000 + 1000)
+
+// Events of the library are dispatched by the harness; a timer is fired after the clock is moved forward by its timeout
+static bool testWaitFor(const std::function<bool()>& ready, esp_timer_handle_t timer = nullptr)
+{
+  int64_t deadline = std::chrono::duration_cast<std::chrono::microseconds>(
+    std::chrono::steady_clock::now().time_since_epoch()).count() + 10000000;
+  while (!ready()) {
+    if (std::chrono::duration_cast<std::chrono::microseconds>(
+      std::chrono::steady_clock::now().time_since_epoch()).count() > deadline) return false;
+    hostEventsDispatch();
+    if (timer && esp_timer_is_active(timer)) {
+      // The timeout is stored right after the timer is activated by another thread
+      vTaskDelay(1);
+      hostTimeAdvance(hostTimerTimeout(timer));
+      hostTimerFire(timer);
+    };
+    vTaskDelay(1);
+  };
+  return true;
+}
+
+static bool testOnPrimary()
+{
+  return mqttIsConnected() && mqttIsPrimary() && (hostBrokerSessions("broker1") > 0);
+}
+
+static bool testOnReserved()
+{
+  return mqttIsConnected() && !mqttIsPrimary() && (hostBrokerSessions("broker2") > 0);
+}
+
+static uint32_t testDelivered(const std::string& topic)
+{
+  return hostBrokerCount("broker1", topic.c_str()) + hostBrokerCount("broker2", topic.c_str());
+}
+
+typedef struct {
+  const char* name;
+  std::function<void()> fail;
+  std::function<void()> recover;
+} test_failover_t;
+
+static void testFailover(const test_failover_t& scenario)
+{
+  uint32_t lost_events = hostEventsPosted(RE_MQTT_CONN_LOST);
+  int64_t started = esp_timer_get_time();
+  scenario.fail();
+  TEST_CHECK(testWaitFor([lost_events] { return hostEventsPosted(RE_MQTT_CONN_LOST) > lost_events; }));
+
+  // Messages published without a connection wait in the managed outbox
+  std::string prefix = std::string("test/failover/") + scenario.name + "/";
+  for (uint32_t i = 0; i < FAILOVER_MESSAGES; i++) {
+    std::string topic = prefix + std::to_string(i);
+    mqttPublish((char*)topic.c_str(), (char*)"1", 1, false, false, false);
+  };
+
+  TEST_CHECK(testWaitFor(testOnReserved, _mqttRetryTimer));
+  int64_t switched = esp_timer_get_time();
+  scenario.recover();
+  TEST_CHECK(testWaitFor(testOnPrimary, _mqttBackToPrimaryTimer));
+
+  uint32_t lost = 0;
+  for (uint32_t i = 0; i < FAILOVER_MESSAGES; i++) {
+    std::string topic = prefix + std::to_string(i);
+    if (!testWaitFor([topic] { return testDelivered(topic) > 0; })) lost++;
+  };
+
+  re_mqtt_stats_t stats;
+  mqttGetStats(&stats);
+  printf("%-24s failover %6u ms, return %8u ms, lost %u of %u\n",
+    scenario.name, stats.failover_last_ms, stats.return_last_ms, lost, FAILOVER_MESSAGES);
+  // The statistics of the library agree with the clock of the harness
+  TEST_CHECK(stats.failover_last_ms <= (switched - started) / 1000);
+  TEST_CHECK(stats.failover_last_ms > 0);
+  TEST_CHECK(stats.failover_last_ms <= FAILOVER_LIMIT_MS);
+  TEST_CHECK(stats.return_last_ms >= CONFIG_MQTT_BACK_TO_PRIMARY_TIME_MINUTES * 60000);
+  TEST_CHECK(stats.return_last_ms <= RETURN_LIMIT_MS);
+  TEST_CHECK(lost == 0);
+}
+
+// Latency and dropped publications on the primary broker: the connection survives, there is no failover
+static void testLossy()
+{
+  re_mqtt_faults_t faults = { false, 20, 20 };
+  mqttFaultSet(true, &faults);
+  re_mqtt_stats_t before, after;
+  mqttGetStats(&before);
+  for (uint32_t i = 0; i < 50; i++) {
+    std::string topic = "test/lossy/" + std::to_string(i);
+    mqttPublish((char*)topic.c_str(), (char*)"1", 1, false, false, false);
+  };
+  // Each message is either delivered or counted as failed by the sender task
+  uint32_t delivered = 0;
+  TEST_CHECK(testWaitFor([&] {
+    delivered = 0;
+    for (uint32_t i = 0; i < 50; i++) {
+      if (testDelivered("test/lossy/" + std::to_string(i)) > 0) delivered++;
+    };
+    mqttGetStats(&after);
+    return delivered + (after.publish_failed - before.publish_failed) == 50;
+  }));
+  mqttFaultSet(true, nullptr);
+  printf("%-24s failover %6s, return %8s, lost %u of %u\n", "latency and drops", "-", "-", 50 - delivered, 50);
+  TEST_CHECK(testOnPrimary());
+  TEST_CHECK(after.brokers[1].failovers == before.brokers[1].failovers);
+  TEST_CHECK(after.publish_failed - before.publish_failed == 50 - delivered);
+}
+
+int main()
+{
+  hostGatewaySet("broker2");
+  TEST_CHECK(hostBrokerStart("broker1"));
+  TEST_CHECK(hostBrokerStart("broker2"));
+  TEST_CHECK(mqttTaskInit());
+  TEST_CHECK(mqttEventHandlerRegister());
+  TEST_CHECK(mqttServerSelectAuto());
+  TEST_CHECK(testWaitFor(testOnPrimary));
+
+  const test_failover_t scenarios[] = {
+    { "tcp refused",
+      [] { hostBrokerStop("broker1"); },
+      [] { TEST_CHECK(hostBrokerStart("broker1")); } },
+    { "connack refused",
+      [] { hostBrokerFault("broker1", HOST_BROKER_REFUSE); },
+      [] { hostBrokerFault("broker1", HOST_BROKER_NORMAL); } },
+    { "tcp reset",
+      [] { hostBrokerFault("broker1", HOST_BROKER_RESET); },
+      [] { hostBrokerFault("broker1", HOST_BROKER_NORMAL); } },
+  };
+  for (const test_failover_t& scenario : scenarios) {
+    testFailover(scenario);
+  };
+  testLossy();
+
+  mqttEventHandlerUnregister();
+  TEST_CHECK(mqttClientDestroy() == ESP_OK);
+  hostBrokerStop("broker1");
+  hostBrokerStop("broker2");
+  printf("%-24s %s\n", "failover", _testFailed == 0 ? "ok" : "FAILED");
+  printf("%u checks, %u failed\n", _testChecks, _testFailed);
+  return _testFailed == 0 ? 0 : 1;
+}
@@ -0,0 +1,618 @@
+// Host tests of reMqtt.cpp: topic matching, message router, client handle generations, publish ring, error queue,
+// managed outbox and reconnect backoff, and the whole client against the stand-in broker of the shims. The library is
+// included as a single translation unit, so that static functions and state are available to the tests.
+
+#include "../../src/reMqtt.cpp"
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <functional>
+#include <mutex>
+#include <set>
+#include <string>
+#include <vector>
+#include "host_shims.h"
+
+static uint32_t _testChecks = 0;
+static uint32_t _testFailed = 0;
+
+#define TEST_CHECK(cond) do { \
+  _testChecks++; \
+  if (!(cond)) { \
+    _testFailed++; \
+    printf("  FAILED %s:%d: %s\n", __FILE__, __LINE__, #cond); \
+  }; \
+} while (0)
+
+// -----------------------------------------------------------------------------------------------------------------------
+// ------------------------------------------------------ Reference ------------------------------------------------------
+// -----------------------------------------------------------------------------------------------------------------------
+
+static std::vector<std::string> testSplit(const std::string& value)
+{
+  std::vector<std::string> levels;
+  size_t start = 0;
+  while (1) {
+    size_t delim = value.find('/', start);
+    levels.push_back(value.substr(start, delim == std::string::npos ? std::string::npos : delim - start));
+    if (delim == std::string::npos) break;
+    start = delim + 1;
+  };
+  return levels;
+}
+
+// Straightforward level-by-level matching by the MQTT 3.1.1 rules (4.7)
+static bool testTopicMatch(const std::string& filter, const std::string& topic)
+{
+  std::vector<std::string> f = testSplit(filter);
+  std::vector<std::string> t = testSplit(topic);
+  if (!topic.empty() && (topic[0] == '$') && ((f[0] == "+") || (f[0] == "#"))) return false;
+  for (size_t i = 0; i < f.size(); i++) {
+    if (f[i] == "#") return true;
+    if (i >= t.size()) return false;
+    if ((f[i] != "+") && (f[i] != t[i])) return false;
+  };
+  return f.size() == t.size();
+}
+
+static const char* _testLevels[] = { "a", "b", "c", "ab", "", "$SYS" };
+
+static std::string testRandomTopic(bool filter)
+{
+  std::string value;
+  int count = 1 + rand() % 4;
+  for (int i = 0; i < count; i++) {
+    if (i > 0) value += '/';
+    int r = rand() % (filter ? 9 : 6);
+    if (r == 6 || r == 7) {
+      value += '+';
+    } else if (r == 8) {
+      value += '#';
+      break;
+    } else if ((r == 5) && (i > 0)) {
+      value += "a";
+    } else {
+      value += _testLevels[r];
+    };
+  };
+  return value;
+}
+
+// -----------------------------------------------------------------------------------------------------------------------
+// ---------------------------------------------------- Topic matching ---------------------------------------------------
+// -----------------------------------------------------------------------------------------------------------------------
+
+static bool testMatch(const char* filter, const char* topic)
+{
+  return mqttTopicMatch(filter, topic, strlen(topic));
+}
+
+static void testTopicMatchCases()
+{
+  TEST_CHECK(testMatch("a/b/c", "a/b/c"));
+  TEST_CHECK(!testMatch("a/b/c", "a/b"));
+  TEST_CHECK(!testMatch("a/b", "a/b/c"));
+  TEST_CHECK(testMatch("a/+/c", "a/b/c"));
+  TEST_CHECK(testMatch("a/+/c", "a//c"));
+  TEST_CHECK(!testMatch("a/+/c", "a/b/d"));
+  TEST_CHECK(testMatch("a/+", "a/"));
+  TEST_CHECK(!testMatch("a/+", "a"));
+  TEST_CHECK(testMatch("a/#", "a"));
+  TEST_CHECK(testMatch("a/#", "a/b/c"));
+  TEST_CHECK(!testMatch("a/#", "ab"));
+  TEST_CHECK(testMatch("#", "a/b"));
+  TEST_CHECK(testMatch("+/+", "a/b"));
+  TEST_CHECK(!testMatch("#", "$SYS/x"));
+  TEST_CHECK(!testMatch("+/x", "$SYS/x"));
+  TEST_CHECK(testMatch("$SYS/#", "$SYS/x"));
+}
+
+static void testTopicMatchFuzz()
+{
+  for (int i = 0; i < 200000; i++) {
+    std::string filter = testRandomTopic(true);
+    std::string topic = testRandomTopic(false);
+    bool expected = testTopicMatch(filter, topic);
+    bool actual = mqttTopicMatch(filter.c_str(), topic.c_str(), topic.size());
+    if (expected != actual) {
+      printf("  mismatch: filter \"%s\", topic \"%s\": expected %d\n", filter.c_str(), topic.c_str(), expected);
+    };
+    TEST_CHECK(expected == actual);
+    if (expected != actual) break;
+  };
+}
+
+// -----------------------------------------------------------------------------------------------------------------------
+// ---------------------------------------------------- Message router ---------------------------------------------------
+// -----------------------------------------------------------------------------------------------------------------------
+
+static std::set<intptr_t> _testRouted;
+
+static void testRouteHandler(re_mqtt_message_t* message, void* arg)
+{
+  _testRouted.insert((intptr_t)arg);
+}
+
+static uint8_t testDispatch(const std::string& topic)
+{
+  re_mqtt_message_t message = { 1, (char*)topic.c_str(), topic.size(), nullptr, 0 };
+  _testRouted.clear();
+  return mqttRouterDispatch(&message);
+}
+
+static void testRouterFuzz()
+{
+  TEST_CHECK(mqttRouterInit());
+  for (int round = 0; round < 50; round++) {
+    std::vector<std::string> filters;
+    for (int i = 0; i < CONFIG_MQTT_ROUTE_MAX_MATCHES; i++) {
+      filters.push_back(testRandomTopic(true));
+      TEST_CHECK(mqttRouteAdd(filters.back().c_str(), testRouteHandler, (void*)(intptr_t)i));
+    };
+    for (int i = 0; i < 2000; i++) {
+      std::string topic = testRandomTopic(false);
+      std::set<intptr_t> expected;
+      for (size_t f = 0; f < filters.size(); f++) {
+        if (testTopicMatch(filters[f], topic)) expected.insert(f);
+      };
+      uint8_t count = testDispatch(topic);
+      TEST_CHECK(count == expected.size());
+      TEST_CHECK(_testRouted == expected);
+      if (_testRouted != expected) {
+        printf("  mismatch: topic \"%s\"\n", topic.c_str());
+        round = 50;
+        break;
+      };
+    };
+    for (size_t f = 0; f < filters.size(); f++) {
+      mqttRouteRemove(filters[f].c_str(), testRouteHandler, (void*)(intptr_t)f);
+    };
+    TEST_CHECK(_mqttRouteCount == 0);
+    TEST_CHECK(_mqttRouteRoot.child == nullptr);
+  };
+}
+
+// -----------------------------------------------------------------------------------------------------------------------
+// ----------------------------------------------------- Publish ring ----------------------------------------------------
+// -----------------------------------------------------------------------------------------------------------------------
+
+#define TEST_PRODUCERS 4
+#define TEST_MESSAGES  20000
+
+static void* testRingProducer(void* arg)
+{
+  intptr_t producer = (intptr_t)arg;
+  char topic[32];
+  char payload[400];
+  snprintf(topic, sizeof(topic), "p/%d", (int)producer);
+  for (uint32_t i = 0; i < TEST_MESSAGES; i++) {
+    // Every 16th message does not fit into the cell and takes a buffer
+    size_t len = (i % 16 == 0) ? sizeof(payload) : snprintf(payload, sizeof(payload), "%u", i);
+    if (len == sizeof(payload)) {
+      memset(payload, 'x', sizeof(payload));
+      memcpy(payload, &i, sizeof(i));
+    };
+    while (mqttPacerPut(topic, payload, len, 0, false) != ESP_OK) {
+      sched_yield();
+    };
+  };
+  return nullptr;
+}
+
+static void testRingProducers()
+{
+  // The sender task is replaced by this thread, which drains the ring itself
+  _mqttPacerTask = hostTaskStub();
+  TEST_CHECK(mqttPacerInit());
+
+  pthread_t threads[TEST_PRODUCERS];
+  for (intptr_t i = 0; i < TEST_PRODUCERS; i++) {
+    pthread_create(&threads[i], nullptr, testRingProducer, (void*)i);
+  };
+
+  uint32_t next[TEST_PRODUCERS] = { 0 };
+  uint32_t received = 0;
+  bool ordered = true;
+  while (received < TEST_PRODUCERS * TEST_MESSAGES) {
+    re_mqtt_paced_t* item = mqttRingPeek();
+    if (item == nullptr) {
+      sched_yield();
+      continue;
+    };
+    int producer = atoi(item->topic + 2);
+    uint32_t index;
+    if (item->payload_len == 400) {
+      memcpy(&index, item->payload, sizeof(index));
+      ordered = ordered && (item->buffer != nullptr);
+    } else {
+      index = strtoul(item->payload, nullptr, 10);
+      ordered = ordered && (item->buffer == nullptr);
+    };
+    ordered = ordered && (producer >= 0) && (producer < TEST_PRODUCERS) && (index == next[producer]);
+    if (ordered) next[producer]++;
+    mqttRingRelease();
+    received++;
+  };
+  for (int i = 0; i < TEST_PRODUCERS; i++) {
+    pthread_join(threads[i], nullptr);
+  };
+
+  TEST_CHECK(ordered);
+  for (int i = 0; i < TEST_PRODUCERS; i++) {
+    TEST_CHECK(next[i] == TEST_MESSAGES);
+  };
+  TEST_CHECK(mqttRingPeek() == nullptr);
+  TEST_CHECK(_mqttPacerStats.queue_max <= CONFIG_MQTT_SENDER_QUEUE_SIZE);
+}
+
+static void testRingOverflow()
+{
+  for (uint32_t i = 0; i < CONFIG_MQTT_SENDER_QUEUE_SIZE; i++) {
+    TEST_CHECK(mqttPacerPut("t", "1", 1, 0, false) == ESP_OK);
+  };
+  uint32_t overflows = _mqttPacerStats.overflows;
+  TEST_CHECK(mqttPacerPut("t", "1", 1, 0, false) == ESP_ERR_NO_MEM);
+  TEST_CHECK(_mqttPacerStats.overflows == overflows + 1);
+  while (mqttRingPeek() != nullptr) mqttRingRelease();
+  TEST_CHECK(mqttPacerPut("t", "1", 1, 0, false) == ESP_OK);
+  while (mqttRingPeek() != nullptr) mqttRingRelease();
+}
+
+// -----------------------------------------------------------------------------------------------------------------------
+// ---------------------------------------------------- Client handle ----------------------------------------------------
+// -----------------------------------------------------------------------------------------------------------------------
+
+static void testClientGenerations()
+{
+  esp_mqtt_client_handle_t a = (esp_mqtt_client_handle_t)0x1000;
+  esp_mqtt_client_handle_t b = (esp_mqtt_client_handle_t)0x2000;
+  esp_mqtt_client_handle_t c = (esp_mqtt_client_handle_t)0x3000;
+  esp_mqtt_client_handle_t previous = nullptr;
+  uint32_t ticket, retired_a, retired_b;
+  TEST_CHECK(mqttClientReplace(a, &previous, &ticket) && (previous == nullptr));
+
+  // A user of the first client is still active when it is replaced twice in a row (takeover, then a cold restart)
+  uint32_t user_a;
+  TEST_CHECK(mqttClientAcquire(&user_a) == a);
+  TEST_CHECK(mqttClientReplace(b, &previous, &retired_a) && (previous == a));
+  TEST_CHECK(mqttClientReplace(c, &previous, &retired_b) && (previous == b));
+  TEST_CHECK(retired_a != retired_b);
+
+  // New users of the current client never share a counter with the retired ones
+  uint32_t user_c;
+  TEST_CHECK(mqttClientAcquire(&user_c) == c);
+  TEST_CHECK((user_c != retired_a) && (user_c != retired_b));
+  mqttClientDrain(retired_b);
+  mqttClientRelease(user_a);
+  mqttClientDrain(retired_a);
+  TEST_CHECK(_mqttClientGens[user_c].users == 1);
+
+  // While generations wait for their drain, replacement is refused instead of reusing them
+  uint32_t pending[CONFIG_MQTT_CLIENT_GENERATIONS];
+  uint32_t count = 0;
+  while (mqttClientReplace((esp_mqtt_client_handle_t)(uintptr_t)(0x4000 + count), &previous, &ticket)) {
+    pending[count++] = ticket;
+  };
+  TEST_CHECK(count == CONFIG_MQTT_CLIENT_GENERATIONS - 1);
+  mqttClientRelease(user_c);
+  for (uint32_t i = 0; i < count; i++) {
+    mqttClientDrain(pending[i]);
+  };
+  TEST_CHECK(mqttClientReplace(nullptr, &previous, &ticket));
+  mqttClientDrain(ticket);
+}
+
+// -----------------------------------------------------------------------------------------------------------------------
+// ----------------------------------------------------- Error queue -----------------------------------------------------
+// -----------------------------------------------------------------------------------------------------------------------
+
+// The drainer task is replaced by the test, which takes the records itself
+static std::string testErrorDrain()
+{
+  std::string value;
+  re_mqtt_error_record_t record;
+  while (mqttErrorPop(&record)) {
+    if (!value.empty()) value += ' ';
+    value += record.kind == MQTT_ERROR_CLEAR ? std::string("CLEAR") : std::string(record.message);
+  };
+  return value;
+}
+
+static void testErrorClear()
+{
+  for (uint32_t i = 0; i < CONFIG_MQTT_ERROR_QUEUE_SIZE; i++) {
+    _mqttErrorRing[i].sequence = i;
+  };
+  _mqttErrorHead = 0;
+  _mqttErrorTail = 0;
+  _mqttErrorClearPending = false;
+  _mqttErrorTask = hostTaskStub();
+
+  // CLEAR that fits into the ring keeps its place
+  mqttErrorEventSend("e%s", "1");
+  mqttErrorEventClear();
+  mqttErrorEventSend("e%s", "2");
+  TEST_CHECK(testErrorDrain() == "e1 CLEAR e2");
+
+  // CLEAR does not fit into the full ring: it is delivered after the records queued before it and before later ones
+  for (uint32_t i = 0; i < CONFIG_MQTT_ERROR_QUEUE_SIZE; i++) {
+    mqttErrorEventSend("f%s", std::to_string(i).c_str());
+  };
+  uint32_t dropped = _mqttErrorStats.dropped;
+  mqttErrorEventClear();
+  TEST_CHECK(_mqttErrorStats.dropped == dropped + 1);
+  TEST_CHECK(!mqttStatesCheck(MQTTCLI_ERROR, false));
+  re_mqtt_error_record_t record;
+  TEST_CHECK(mqttErrorPop(&record) && (strcmp(record.message, "f0") == 0));
+  mqttErrorEventSend("g%s", "0");
+  TEST_CHECK(testErrorDrain() == "f1 f2 f3 CLEAR g0");
+  TEST_CHECK(testErrorDrain() == "");
+
+  // Without an error there is nothing to clear
+  mqttErrorEventClear();
+  TEST_CHECK(testErrorDrain() == "CLEAR");
+  mqttErrorEventClear();
+  TEST_CHECK(testErrorDrain() == "");
+  _mqttErrorTask = nullptr;
+
+  // Without the drainer task nothing is queued or lost: errors and CLEAR are posted by the caller
+  uint32_t errors = hostEventsPosted(RE_MQTT_ERROR);
+  uint32_t clears = hostEventsPosted(RE_MQTT_ERROR_CLEAR);
+  dropped = _mqttErrorStats.dropped;
+  mqttErrorEventSend("h%s", "0");
+  mqttErrorEventClear();
+  TEST_CHECK(hostEventsPosted(RE_MQTT_ERROR) == errors + 1);
+  TEST_CHECK(hostEventsPosted(RE_MQTT_ERROR_CLEAR) == clears + 1);
+  TEST_CHECK(_mqttErrorStats.dropped == dropped);
+  TEST_CHECK(testErrorDrain() == "");
+}
+
+// -----------------------------------------------------------------------------------------------------------------------
+// ---------------------------------------------------- Managed outbox ---------------------------------------------------
+// -----------------------------------------------------------------------------------------------------------------------
+
+static std::string testOutboxDump()
+{
+  std::string value;
+  taskENTER_CRITICAL(&_mqttOutboxLock);
+  for (re_mqtt_outbox_item_t* item = _mqttOutbox; item; item = item->next) {
+    if (!value.empty()) value += ' ';
+    value += std::string(item->topic, item->topic_len) + '=' + std::string(item->payload, item->payload_len);
+    value += item->qos ? "/1" : "/0";
+  };
+  taskEXIT_CRITICAL(&_mqttOutboxLock);
+  return value;
+}
+
+static void testOutboxPut(const char* topic, const char* payload, int qos)
+{
+  TEST_CHECK(mqttOutboxPut(topic, payload, strlen(payload), qos, false) == ESP_OK);
+}
+
+static void testOutboxCoalescing()
+{
+  mqttOutboxClear();
+  memset(&_mqttOutboxStats, 0, sizeof(_mqttOutboxStats));
+
+  // A queued QoS 1 message is never replaced by a QoS 0 one
+  testOutboxPut("t", "1", 1);
+  testOutboxPut("t", "2", 0);
+  TEST_CHECK(testOutboxDump() == "t=1/1 t=2/0");
+  TEST_CHECK(_mqttOutboxStats.coalesced == 0);
+
+  // The newest QoS 0 value is replaced, and the new value goes to the end of the queue
+  testOutboxPut("u", "1", 0);
+  testOutboxPut("t", "3", 0);
+  TEST_CHECK(testOutboxDump() == "t=1/1 u=1/0 t=3/0");
+  TEST_CHECK(_mqttOutboxStats.coalesced == 1);
+
+  // A QoS 1 message is not coalesced and is added as is
+  testOutboxPut("t", "4", 1);
+  TEST_CHECK(testOutboxDump() == "t=1/1 u=1/0 t=3/0 t=4/1");
+  TEST_CHECK(_mqttOutboxStats.count == 4);
+  mqttOutboxClear();
+}
+
+static void testOutboxEviction()
+{
+  mqttOutboxClear();
+  memset(&_mqttOutboxStats, 0, sizeof(_mqttOutboxStats));
+
+  // CONFIG_MQTT_OUTBOX_MAX_MESSAGES is 4: QoS 0 messages are evicted first, the oldest one first
+  testOutboxPut("a", "1", 1);
+  testOutboxPut("b", "1", 0);
+  testOutboxPut("c", "1", 1);
+  testOutboxPut("d", "1", 0);
+  testOutboxPut("e", "1", 1);
+  TEST_CHECK(testOutboxDump() == "a=1/1 c=1/1 d=1/0 e=1/1");
+  testOutboxPut("f", "1", 1);
+  TEST_CHECK(testOutboxDump() == "a=1/1 c=1/1 e=1/1 f=1/1");
+  // Without QoS 0 messages, the oldest message is evicted
+  testOutboxPut("g", "1", 1);
+  TEST_CHECK(testOutboxDump() == "c=1/1 e=1/1 f=1/1 g=1/1");
+  TEST_CHECK(_mqttOutboxStats.evicted == 3);
+  TEST_CHECK(_mqttOutboxStats.rejected == 0);
+  TEST_CHECK(_mqttOutboxStats.count == CONFIG_MQTT_OUTBOX_MAX_MESSAGES);
+
+  // Too large messages are rejected before the queue is touched
+  std::string large(CONFIG_MQTT_OUTBOX_MAX_BYTES, 'x');
+  TEST_CHECK(mqttOutboxPut("h", large.c_str(), large.size(), 0, false) == ESP_ERR_INVALID_SIZE);
+  TEST_CHECK(testOutboxDump() == "c=1/1 e=1/1 f=1/1 g=1/1");
+  mqttOutboxClear();
+  TEST_CHECK(_mqttOutbox == nullptr);
+  TEST_CHECK(_mqttOutboxStats.bytes == 0);
+}
+
+// -----------------------------------------------------------------------------------------------------------------------
+// --------------------------------------------------- Reconnect backoff -------------------------------------------------
+// -----------------------------------------------------------------------------------------------------------------------
+
+static void testBackoff()
+{
+  TEST_CHECK(mqttRetryInit());
+  esp_mqtt_client_config_t cfg;
+  memset(&cfg, 0, sizeof(cfg));
+  cfg.network.reconnect_timeout_ms = 2000;
+  mqttRetryConfig(&cfg);
+  // The built-in reconnect of the client is moved above the cap
+  TEST_CHECK(cfg.network.reconnect_timeout_ms > CONFIG_MQTT_RECONNECT_MAX);
+  TEST_CHECK(_mqttRetryBase == 2000);
+
+  for (int series = 0; series < 100; series++) {
+    mqttRetryReset();
+    std::set<uint64_t> delays;
+    for (uint32_t attempt = 0; attempt < 40; attempt++) {
+      mqttRetrySchedule();
+      TEST_CHECK(esp_timer_is_active(_mqttRetryTimer));
+      uint64_t interval = CONFIG_MQTT_RECONNECT_FIRST;
+      if (attempt > 0) {
+        interval = 2000ULL << (attempt - 1 < 15 ? attempt - 1 : 15);
+        if (interval > CONFIG_MQTT_RECONNECT_MAX) interval = CONFIG_MQTT_RECONNECT_MAX;
+      };
+      uint64_t delay = hostTimerTimeout(_mqttRetryTimer) / 1000;
+      TEST_CHECK((delay >= interval / 2) && (delay <= interval));
+      if (interval == CONFIG_MQTT_RECONNECT_MAX) delays.insert(delay);
+    };
+    // Jitter: attempts at the cap are spread over the upper half of the interval
+    TEST_CHECK(delays.size() > 10);
+  };
+  mqttRetryFree();
+  TEST_CHECK(_mqttRetryTimer == nullptr);
+}
+
+// -----------------------------------------------------------------------------------------------------------------------
+// ---------------------------------------------------- Loopback broker --------------------------------------------------
+// -----------------------------------------------------------------------------------------------------------------------
+
+// The whole path over a socket: client task, publish queue, sender task, event handler, reassembly and the router
+
+static bool testWaitFor(const std::function<bool()>& ready)
+{
+  int64_t deadline = esp_timer_get_time() + 5000000;
+  while (!ready()) {
+    if (esp_timer_get_time() > deadline) return false;
+    vTaskDelay(1);
+  };
+  return true;
+}
+
+static std::mutex _testInLock;
+static std::vector<std::string> _testIn;
+
+static void testLoopbackRoute(re_mqtt_message_t* message, void* arg)
+{
+  std::lock_guard<std::mutex> guard(_testInLock);
+  _testIn.push_back(std::string(message->topic) + "=" + std::string(message->data, message->data_len));
+}
+
+static size_t testLoopbackCount()
+{
+  std::lock_guard<std::mutex> guard(_testInLock);
+  return _testIn.size();
+}
+
+static std::string testBrokerLast(const char* topic)
+{
+  char payload[64];
+  return hostBrokerLast("broker1", topic, payload, sizeof(payload)) < 0 ? std::string("-") : std::string(payload);
+}
+
+static void testLoopback()
+{
+  // The sender task of the publish queue was replaced by the ring tests
+  _mqttPacerTask = nullptr;
+  TEST_CHECK(hostBrokerStart("broker1"));
+  TEST_CHECK(mqttTaskInit());
+  TEST_CHECK(mqttServerSelectAuto());
+  TEST_CHECK(testWaitFor([] { return mqttIsConnected(); }));
+  TEST_CHECK(mqttIsPrimary());
+  TEST_CHECK(hostBrokerSessions("broker1") == 1);
+
+  // ONLINE status is published through the publish queue and the sender task after the connection
+  TEST_CHECK(testWaitFor([] { return testBrokerLast(mqttTopicStatusGet()) == CONFIG_MQTT_STATUS_ONLINE_PAYLOAD; }));
+
+  // A retained message is delivered when subscribing, so the subscription is known to be active after it
+  hostBrokerPublish("broker1", "test/in/retained", "r", 1, 1, true);
+  TEST_CHECK(mqttRouteAdd("test/in/#", testLoopbackRoute, nullptr));
+  TEST_CHECK(mqttSubscribe("test/in/#", 1));
+  TEST_CHECK(testWaitFor([] { return testLoopbackCount() == 1; }));
+
+  // Incoming QoS 0 and 1, and a message longer than the input buffer, which is passed in fragments
+  std::string large(CONFIG_MQTT_READ_BUFFER_SIZE * 3 + 17, 'x');
+  hostBrokerPublish("broker1", "test/in/a", "1", 1, 0, false);
+  hostBrokerPublish("broker1", "test/in/b", "2", 1, 1, false);
+  hostBrokerPublish("broker1", "test/in/large", large.data(), large.size(), 1, false);
+  hostBrokerPublish("broker1", "test/other", "3", 1, 0, false);
+
+  // Outgoing QoS 0 and 1, and a message published to a subscribed topic, which returns through the broker
+  uint32_t received = hostBrokerReceived("broker1");
+  TEST_CHECK(mqttPublish((char*)"test/out/0", (char*)"a", 0, false, false, false) == ESP_OK);
+  TEST_CHECK(mqttPublish((char*)"test/out/1", (char*)"b", 1, false, false, false) == ESP_OK);
+  TEST_CHECK(mqttPublish((char*)"test/in/echo", (char*)"c", 1, false, false, false) == ESP_OK);
+  TEST_CHECK(testWaitFor([received] { return hostBrokerReceived("broker1") == received + 3; }));
+  TEST_CHECK(testBrokerLast("test/out/0") == "a");
+  TEST_CHECK(testBrokerLast("test/out/1") == "b");
+  TEST_CHECK(testWaitFor([] { return testLoopbackCount() == 5; }));
+  {
+    std::lock_guard<std::mutex> guard(_testInLock);
+    std::set<std::string> in(_testIn.begin(), _testIn.end());
+    TEST_CHECK(_testIn[0] == "test/in/retained=r");
+    TEST_CHECK(in.count("test/in/a=1") && in.count("test/in/b=2") && in.count("test/in/echo=c"));
+    TEST_CHECK(in.count("test/in/large=" + large));
+  };
+  TEST_CHECK(__atomic_load_n(&_mqttStats.publish_failed, __ATOMIC_RELAXED) == 0);
+
+  // The broker goes down: the connection is lost, and the scheduled reconnect succeeds after it is back
+  uint32_t lost = hostEventsPosted(RE_MQTT_CONN_LOST);
+  uint32_t connected = hostEventsPosted(RE_MQTT_CONNECTED);
+  hostBrokerStop("broker1");
+  TEST_CHECK(testWaitFor([lost] { return hostEventsPosted(RE_MQTT_CONN_LOST) == lost + 1; }));
+  TEST_CHECK(!mqttIsConnected());
+  TEST_CHECK(esp_timer_is_active(_mqttRetryTimer));
+  TEST_CHECK(hostBrokerStart("broker1"));
+  hostTimerFire(_mqttRetryTimer);
+  TEST_CHECK(testWaitFor([connected] { return mqttIsConnected() && (hostEventsPosted(RE_MQTT_CONNECTED) == connected + 1); }));
+
+  mqttRouteRemove("test/in/#", testLoopbackRoute, nullptr);
+  TEST_CHECK(mqttClientDestroy() == ESP_OK);
+  TEST_CHECK(testWaitFor([] { return hostBrokerSessions("broker1") == 0; }));
+  hostBrokerStop("broker1");
+}
+
+// -----------------------------------------------------------------------------------------------------------------------
+// --------------------------------------------------------- Main --------------------------------------------------------
+// -----------------------------------------------------------------------------------------------------------------------
+
+typedef struct {
+  const char* name;
+  void (*exec)();
+} test_case_t;
+
+static const test_case_t _testCases[] = {
+  { "topic match",          testTopicMatchCases },
+  { "topic match fuzz",     testTopicMatchFuzz },
+  { "router fuzz",          testRouterFuzz },
+  { "ring producers",       testRingProducers },
+  { "ring overflow",        testRingOverflow },
+  { "client generations",   testClientGenerations },
+  { "error clear",          testErrorClear },
+  { "outbox coalescing",    testOutboxCoalescing },
+  { "outbox eviction",      testOutboxEviction },
+  { "reconnect backoff",    testBackoff },
+  { "loopback broker",      testLoopback },
+};
+
+int main()
+{
+  srand(12345);
+  TEST_CHECK(mqttStatesInit());
+  TEST_CHECK(mqttPoolInit());
+  for (size_t i = 0; i < sizeof(_testCases) / sizeof(_testCases[0]); i++) {
+    uint32_t failed = _testFailed;
+    _testCases[i].exec();
+    printf("%-24s %s\n", _testCases[i].name, failed == _testFailed ? "ok" : "FAILED");
+  };
+  printf("%u checks, %u failed\n", _testChecks, _testFailed);
+  return _testFailed == 0 ? 0 : 1;
+}
@@ -0,0 +1,123 @@
+// Host test of CONFIG_MQTT_ZERO_HEAP: after initialization the library must not take any memory from the heap while
+// publishing, receiving, reporting errors, buffering messages without a connection and reconnecting. The configuration
+// is the one of test_reMqtt.cpp with the zero heap mode on top of it.
+
+#define CONFIG_MQTT_ZERO_HEAP 1
+#include "../../src/reMqtt.cpp"
+
+#include <stdio.h>
+#include <atomic>
+#include <functional>
+#include <string>
+#include "host_shims.h"
+
+static uint32_t _testChecks = 0;
+static uint32_t _testFailed = 0;
+
+#define TEST_CHECK(cond) do { \
+  _testChecks++; \
+  if (!(cond)) { \
+    _testFailed++; \
+    printf("  FAILED %s:%d: %s\n", __FILE__, __LINE__, #cond); \
+  }; \
+} while (0)
+
+static bool testWaitFor(const std::function<bool()>& ready)
+{
+  int64_t deadline = esp_timer_get_time() + 5000000;
+  while (!ready()) {
+    if (esp_timer_get_time() > deadline) return false;
+    vTaskDelay(1);
+  };
+  return true;
+}
+
+static std::atomic<uint32_t> _testIn(0);
+static std::atomic<uint32_t> _testInBytes(0);
+
+static void testRoute(re_mqtt_message_t* message, void* arg)
+{
+  _testIn++;
+  _testInBytes += message->data_len;
+}
+
+// Publishes wait for the sender task when the pool has no free buffer, they are never taken from the heap
+static void testPublish(const char* topic, const std::string& payload, int qos)
+{
+  while (mqttPublish((char*)topic, (char*)payload.c_str(), qos, false, false, false) != ESP_OK) {
+    vTaskDelay(1);
+  };
+}
+
+static void testTraffic(uint32_t round)
+{
+  // Outgoing messages that fit into the cell of the publish queue, and longer ones that take a pool buffer
+  uint32_t received = hostBrokerReceived("broker1");
+  for (uint32_t i = 0; i < 100; i++) {
+    testPublish("test/out", std::string(i % 10 == 0 ? 900 : 16 + i, 'o'), i % 2);
+  };
+  TEST_CHECK(testWaitFor([received] { return hostBrokerReceived("broker1") == received + 100; }));
+
+  // Incoming messages for the route, including one longer than the input buffer; a message without a handler is dropped
+  uint32_t in = _testIn;
+  uint32_t posted = hostEventsPosted(RE_MQTT_INCOMING_DATA);
+  std::string large(CONFIG_MQTT_READ_BUFFER_SIZE * 2 + 100, 'i');
+  for (uint32_t i = 0; i < 50; i++) {
+    hostBrokerPublish("broker1", "test/in/a", "1234", 4, i % 2, false);
+  };
+  hostBrokerPublish("broker1", "test/unhandled", "x", 1, 0, false);
+  hostBrokerPublish("broker1", "test/in/large", large.data(), large.size(), 1, false);
+  TEST_CHECK(testWaitFor([in] { return _testIn == in + 51; }));
+  TEST_CHECK(hostEventsPosted(RE_MQTT_INCOMING_DATA) == posted);
+
+  // Errors are formatted on the stack and passed through the static ring
+  mqttErrorEventSend("Round %s failed", std::to_string(round).c_str());
+  mqttErrorEventSendCode("Round %s: %d %s", "x", ESP_FAIL);
+  mqttErrorEventClear();
+
+  // Without a connection messages are kept in the managed outbox, and sent after reconnecting
+  uint32_t lost = hostEventsPosted(RE_MQTT_CONN_LOST);
+  hostBrokerStop("broker1");
+  TEST_CHECK(testWaitFor([lost] { return hostEventsPosted(RE_MQTT_CONN_LOST) == lost + 1; }));
+  received = hostBrokerReceived("broker1");
+  testPublish("test/offline/a", "a", 1);
+  testPublish("test/offline/b", std::string(200, 'b'), 1);
+  TEST_CHECK(hostBrokerStart("broker1"));
+  hostTimerFire(_mqttRetryTimer);
+  TEST_CHECK(testWaitFor([] { return mqttIsConnected(); }));
+  // Both messages and the ONLINE status
+  TEST_CHECK(testWaitFor([received] { return hostBrokerReceived("broker1") == received + 3; }));
+  TEST_CHECK(mqttSubscribe("test/#", 1));
+}
+
+int main()
+{
+  TEST_CHECK(hostBrokerStart("broker1"));
+  TEST_CHECK(mqttTaskInit());
+  TEST_CHECK(mqttRouteAdd("test/in/#", testRoute, nullptr));
+  TEST_CHECK(mqttServerSelectAuto());
+  TEST_CHECK(testWaitFor([] { return mqttIsConnected(); }));
+  TEST_CHECK(mqttSubscribe("test/#", 1));
+  // The subscription is active once a message sent after it has been received
+  TEST_CHECK(testWaitFor([] {
+    hostBrokerPublish("broker1", "test/in/ready", "1", 1, 0, false);
+    return _testIn > 0;
+  }));
+  vTaskDelay(100);
+
+  int64_t heap = hostHeapInUse();
+  for (uint32_t round = 0; round < 5; round++) {
+    testTraffic(round);
+  };
+  int64_t grown = hostHeapInUse() - heap;
+  if (grown != 0) {
+    printf("  %lld bytes taken from the heap after initialization\n", (long long)grown);
+  };
+  TEST_CHECK(grown == 0);
+
+  TEST_CHECK(mqttClientDestroy() == ESP_OK);
+  hostBrokerStop("broker1");
+  printf("%-24s %s\n", "zero heap", _testFailed == 0 ? "ok" : "FAILED");
+  printf("%u checks, %u failed\n", _testChecks, _testFailed);
+  return _testFailed == 0 ? 0 : 1;
+}